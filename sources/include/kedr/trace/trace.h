@@ -1,6 +1,8 @@
 #ifndef KEDR_TRACE_H
 #define KEDR_TRACE_H
 
+#include <linux/llist.h>
+
 /*
  * Pretty print for data in the trace.
  * 
@@ -31,6 +33,9 @@ void kedr_trace(kedr_trace_pp_function pp,
  * 
  * If not NULL, 'params_pp' is used for print additional information
  * about call(e.g., function's parameters).
+ * 
+ * If the call is made by a target which has dedicated trace buffer,
+ * message is written into that buffer.
  */
 void kedr_trace_function_call(const char* function_name,
 	void* return_address, kedr_trace_pp_function params_pp,
@@ -49,6 +54,8 @@ void* kedr_trace_lock(kedr_trace_pp_function pp,
 /*
  * Reserve space for function call message in the trace.
  * 
+ * Message is always written into the global trace buffer.
+ * 
  * Return not NULL on success. Returning value should be passed to
  * the kedr_trace_unlock_commit() for complete trace operation.
  */
@@ -58,8 +65,116 @@ void* kedr_trace_function_call_lock(const char* function_name,
 
 
 /*
- * Complete trace operation, started with kedr_trace_lock() or
- * kedr_trace_function_call_lock().
+ * Format of the trace messages.
+ * 
+ * Unlike to the messages with pretty print function, messages written
+ * with registered format store only compact identificator of the format.
+ * The message is formatted only when it is read from the trace.
+ * 
+ * Also, unregistering of the format doesn't require to drop messages
+ * from the trace, unlike to kedr_trace_pp_unregister().
+ */
+struct kedr_trace_format
+{
+	/* 
+	 * Name of the format.
+	 * 
+	 * For function call messages, this is the name of the function.
+	 */
+	const char* name;
+	/* 
+	 * Pretty print function for data of the message.
+	 * 
+	 * May be NULL for formats which are used only for function call
+	 * messages without parameters.
+	 */
+	kedr_trace_pp_function pp;
+	
+	/* Identificator of the format. Set on registration. */
+	u16 id;
+	/* Sampling state of the format. Set on registration. */
+	struct kedr_trace_sampling* sampling;
+	/* Statistics of the messages with the format. Set on registration. */
+	struct kedr_trace_stats* stats;
+};
+
+/*
+ * Register format for the trace messages.
+ * 
+ * Return 0 on success, negative error code otherwise.
+ */
+int kedr_trace_format_register(struct kedr_trace_format* format);
+
+/*
+ * Unregister format for the trace messages.
+ * 
+ * After the call, pretty print function of the format won't be called.
+ * Messages already written with given format are output without data.
+ */
+void kedr_trace_format_unregister(struct kedr_trace_format* format);
+
+/*
+ * Register/unregister NULL-terminated array of formats.
+ * 
+ * If registration of some format fails, all formats registered before
+ * are unregistered.
+ */
+int kedr_trace_formats_register(struct kedr_trace_format** formats);
+void kedr_trace_formats_unregister(struct kedr_trace_format** formats);
+
+/*
+ * Reserve space for message with registered format in the trace.
+ * 
+ * Return not NULL on success. Returning value should be passed to
+ * the kedr_trace_unlock_commit() for complete trace operation.
+ */
+void* kedr_trace_format_lock(struct kedr_trace_format* format,
+	size_t size, void** data);
+
+/*
+ * Add message about function's call into the trace.
+ * 
+ * Name of the function is the name of the format, pretty print function
+ * of the format is used for 'params'.
+ * 
+ * As for kedr_trace_function_call(), message may be written into
+ * the dedicated buffer of the target.
+ */
+void kedr_trace_function_call_format(struct kedr_trace_format* format,
+	void* return_address, const void* params, size_t params_size);
+
+/*
+ * Maximum size of parameters for kedr_trace_function_call_fixed().
+ */
+#define KEDR_TRACE_FIXED_PARAMS_SIZE (3 * sizeof(unsigned long))
+
+/*
+ * Same as kedr_trace_function_call_format(), but intended for small
+ * parameters, not exceeding KEDR_TRACE_FIXED_PARAMS_SIZE.
+ * 
+ * With compact encoding, such message is written as a record of fixed
+ * size without packing of the parameters. Otherwise, or for larger
+ * parameters, message is written as by kedr_trace_function_call_format().
+ */
+void kedr_trace_function_call_fixed(struct kedr_trace_format* format,
+	void* return_address, const void* params, size_t params_size);
+
+/*
+ * Reserve space for function call message with registered format
+ * in the trace.
+ * 
+ * Message is always written into the global trace buffer.
+ * 
+ * Return not NULL on success. Returning value should be passed to
+ * the kedr_trace_unlock_commit() for complete trace operation.
+ */
+void* kedr_trace_function_call_format_lock(struct kedr_trace_format* format,
+	void* return_address, size_t params_size, void** params);
+
+/*
+ * Complete trace operation, started with kedr_trace_lock(),
+ * kedr_trace_function_call_lock() or their variants for registered
+ * formats.
  */
 void kedr_trace_unlock_commit(void* id);
 
@@ -70,7 +185,7 @@ typedef void (*kedr_trace_callback_func)(struct kedr_trace_callback_head*);
 
 struct kedr_trace_callback_head
 {
-	struct kedr_trace_callback_head* next;
+	struct llist_node node;
 	kedr_trace_callback_func func;
 	u64 ts;
 };
@@ -85,9 +200,25 @@ struct kedr_trace_callback_head
  * 
  * Callback function is executed in the atomic context.
  * 
- * Currently, kedr_trace_call_after_read may wait.
+ * kedr_trace_call_after_read never waits and may be called in any
+ * context where trace messages may be written, except NMI.
  */
 void kedr_trace_call_after_read(kedr_trace_callback_func func,
 	struct kedr_trace_callback_head* callback_head);
 
+/*
+ * Return number of messages lost in the global trace buffer
+ * due to its overflow.
+ * 
+ * May be called only in the process context.
+ */
+unsigned long kedr_trace_lost_messages(void);
+
+/*
+ * Return size of the global trace buffer in bytes (per CPU).
+ * 
+ * May be called only in the process context.
+ */
+unsigned long kedr_trace_buffer_size(void);
+
 #endif /* KEDR_TRACE_H */
@@ -0,0 +1,43 @@
+#ifndef KEDR_TRACE_BINARY_H
+#define KEDR_TRACE_BINARY_H
+
+/*
+ * Format of the records in the 'trace_binary' file of KEDR trace.
+ *
+ * This header is shared by the kernel module and by the userspace
+ * decoder, so only fixed-size types are used here.
+ *
+ * The file is a stream of records, each record begins with
+ * 'struct kedr_trace_binary_record' and is immediately followed by the
+ * next one. Fields are stored in the native byte order.
+ */
+
+#include <linux/types.h>
+
+/* Maximum length of the command name (same as TASK_COMM_LEN). */
+#define KEDR_TRACE_BINARY_COMM_LEN 16
+
+struct kedr_trace_binary_record
+{
+	/* Size of the whole record, including this header. */
+	__u32 size;
+	/* CPU on which message has been written. */
+	__u32 cpu;
+	/* Timestamp of the message, in nanoseconds since system starts. */
+	__u64 ts;
+	/* Process which wrote the message. */
+	__s32 pid;
+	char command[KEDR_TRACE_BINARY_COMM_LEN];
+	/*
+	 * Message-specific data.
+	 *
+	 * Currently this is a text produced by the pretty print function
+	 * of the message, without trailing '\0'.
+	 */
+	char data[0];
+} __attribute__((packed));
+
+#define kedr_trace_binary_record_data_size(record) \
+	((record)->size - offsetof(struct kedr_trace_binary_record, data))
+
+#endif /* KEDR_TRACE_BINARY_H */
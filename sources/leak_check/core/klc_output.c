@@ -29,6 +29,7 @@
 
 #include "leak_check_impl.h"
 #include "klc_output.h"
+#include "klc_pool.h"
 /* ====================================================================== */
 
 /* Main directory for LeakCheck in debugfs. */
@@ -119,6 +120,12 @@ struct kedr_lc_output
 	/* The file to force LeakCheck to clear the information about memory
 	 * allocations and deallocations collected so far. */
 	struct dentry *file_clear;
+
+	/* The file with the statistics of the resource info pools. */
+	struct dentry *file_pool;
+
+	/* The file with the statistics of the storage of allocations. */
+	struct dentry *file_table;
 	
 	/* Output buffers for each type of output resource. */
 	struct klc_output_buffer ob_leaks;
@@ -360,6 +367,74 @@ static const struct file_operations klc_clear_ops = {
 	.release = klc_clear_release,
 	.write = klc_clear_write,
 };
+
+/* Maximum length of the contents of "pool" file. */
+#define KLC_POOL_INFO_SIZE 128
+
+static ssize_t
+klc_pool_read(struct file *filp, char __user *buf, size_t count,
+	loff_t *f_pos)
+{
+	struct kedr_lc_pool_stats stats;
+	char info[KLC_POOL_INFO_SIZE];
+	int len;
+
+	kedr_lc_pool_get_stats(&stats);
+	len = snprintf(info, sizeof(info),
+		"Pool size: %u\n"
+		"Available: %lu\n"
+		"Hits: %lu\n"
+		"Misses: %lu\n",
+		stats.pool_size, stats.available, stats.hits, stats.misses);
+
+	return simple_read_from_buffer(buf, count, f_pos, info, len);
+}
+
+static const struct file_operations klc_pool_ops = {
+	.owner = THIS_MODULE,
+	.read = klc_pool_read,
+};
+
+/* Maximum length of the contents of "table" file. */
+#define KLC_TABLE_INFO_SIZE 128
+
+static int
+klc_table_open(struct inode *inode, struct file *filp)
+{
+	filp->private_data = inode->i_private;
+	return 0;
+}
+
+static ssize_t
+klc_table_read(struct file *filp, char __user *buf, size_t count,
+	loff_t *f_pos)
+{
+	struct kedr_lc_table_stats stats;
+	char info[KLC_TABLE_INFO_SIZE];
+	unsigned long load;
+	int len;
+
+	kedr_lc_get_table_stats(filp->private_data, &stats);
+	
+	/* Load factor (allocations per bucket) with 2 decimal places. */
+	load = (stats.nr_allocs * 100 + stats.nr_buckets / 2) / 
+		stats.nr_buckets;
+	len = snprintf(info, sizeof(info),
+		"Allocations: %lu\n"
+		"Buckets: %lu\n"
+		"Load factor: %lu.%02lu\n"
+		"Resizes: %lu\n",
+		stats.nr_allocs, stats.nr_buckets, load / 100, load % 100,
+		stats.nr_resizes);
+
+	return simple_read_from_buffer(buf, count, f_pos, info, len);
+}
+
+static const struct file_operations klc_table_ops = {
+	.owner = THIS_MODULE,
+	.open = klc_table_open,
+	.read = klc_table_read,
+};
 /* ====================================================================== */
 
 static void
@@ -386,6 +461,14 @@ klc_remove_debugfs_files(struct kedr_lc_output *output)
 		debugfs_remove(output->file_clear);
 		output->file_clear = NULL;
 	}
+	if (output->file_pool != NULL) {
+		debugfs_remove(output->file_pool);
+		output->file_pool = NULL;
+	}
+	if (output->file_table != NULL) {
+		debugfs_remove(output->file_table);
+		output->file_table = NULL;
+	}
 }
 
 /* [NB] We do not check here if debugfs is supported because this is done 
@@ -422,6 +505,16 @@ klc_create_debugfs_files(struct kedr_lc_output *output,
 	if (output->file_clear == NULL)
 		goto fail;
 
+	output->file_pool = debugfs_create_file("pool",
+		S_IRUGO, dir_klc_main, NULL, &klc_pool_ops);
+	if (output->file_pool == NULL)
+		goto fail;
+
+	output->file_table = debugfs_create_file("table",
+		S_IRUGO, dir_klc_main, lc, &klc_table_ops);
+	if (output->file_table == NULL)
+		goto fail;
+
 	return 0;
 
 fail:
@@ -729,7 +822,7 @@ kedr_lc_print_alloc_info(struct kedr_lc_output *output,
 	kfree(buf);
 	
 	klc_print_stack_trace(output, KLC_UNFREED_ALLOC, 
-		info->stack_entries, info->num_entries);
+		info->stack->entries, info->stack->num_entries);
 	
 	if (similar_allocs != 0) {
 		klc_print_u64(output, KLC_UNFREED_ALLOC, similar_allocs, 
@@ -766,7 +859,7 @@ kedr_lc_print_dealloc_info(struct kedr_lc_output *output,
 	kfree(buf);
 	
 	klc_print_stack_trace(output, KLC_BAD_FREE, 
-		info->stack_entries, info->num_entries);
+		info->stack->entries, info->stack->num_entries);
 	
 	if (similar_deallocs != 0) {
 		klc_print_u64(output, KLC_BAD_FREE, similar_deallocs, 
@@ -0,0 +1,235 @@
+/* klc_pool.c - allocation of the resource information structures. */
+
+/* ========================================================================
+ * Copyright (C) 2012, KEDR development team
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ ======================================================================== */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/workqueue.h>
+
+#include "leak_check_impl.h"
+#include "klc_pool.h"
+/* ====================================================================== */
+
+/* Maximum number of the preallocated resource information structures kept
+ * for each CPU. 0 disables the pools, the structures are then allocated
+ * from the slab cache directly. */
+unsigned int pool_size = 64;
+module_param(pool_size, uint, S_IRUGO);
+/* ====================================================================== */
+
+/* The pool of a CPU. The lock is almost always taken by that CPU only,
+ * except when the pool is refilled or its statistics is collected. */
+struct klc_pool
+{
+	spinlock_t lock;
+
+	/* The preallocated objects, 'nr_free' of 'pool_size' are
+	 * available. */
+	struct kedr_lc_resource_info **objects;
+	unsigned int nr_free;
+
+	unsigned long hits;
+	unsigned long misses;
+};
+
+static DEFINE_PER_CPU(struct klc_pool, klc_pools);
+
+static struct kmem_cache *klc_cache = NULL;
+
+/* Refills the pools in process context. */
+static void
+klc_pool_refill(struct work_struct *work);
+static DECLARE_WORK(klc_refill_work, klc_pool_refill);
+/* ====================================================================== */
+
+static void
+klc_pool_refill(struct work_struct *work)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct klc_pool *pool = &per_cpu(klc_pools, cpu);
+		unsigned long flags;
+
+		for (;;) {
+			struct kedr_lc_resource_info *info;
+
+			/* [NB] The pool may be filled concurrently by the
+			 * frees, so the check is repeated under the lock. */
+			if (ACCESS_ONCE(pool->nr_free) >= pool_size)
+				break;
+
+			info = kmem_cache_alloc(klc_cache, GFP_KERNEL);
+			if (info == NULL)
+				return;
+
+			spin_lock_irqsave(&pool->lock, flags);
+			if (pool->nr_free < pool_size) {
+				pool->objects[pool->nr_free++] = info;
+				info = NULL;
+			}
+			spin_unlock_irqrestore(&pool->lock, flags);
+
+			if (info != NULL) {
+				kmem_cache_free(klc_cache, info);
+				break;
+			}
+		}
+	}
+}
+
+struct kedr_lc_resource_info *
+kedr_lc_pool_alloc(void)
+{
+	struct kedr_lc_resource_info *info = NULL;
+	struct klc_pool *pool;
+	unsigned long flags;
+	int need_refill;
+
+	local_irq_save(flags);
+	pool = this_cpu_ptr(&klc_pools);
+
+	spin_lock(&pool->lock);
+	if (pool->nr_free != 0) {
+		info = pool->objects[--pool->nr_free];
+		pool->hits++;
+	}
+	else {
+		pool->misses++;
+	}
+	need_refill = (pool->nr_free < pool_size / 2);
+	spin_unlock(&pool->lock);
+
+	local_irq_restore(flags);
+
+	if (need_refill)
+		schedule_work(&klc_refill_work);
+
+	if (info == NULL)
+		info = kmem_cache_alloc(klc_cache, GFP_ATOMIC);
+	return info;
+}
+
+void
+kedr_lc_pool_free(struct kedr_lc_resource_info *info)
+{
+	struct klc_pool *pool;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	pool = this_cpu_ptr(&klc_pools);
+
+	spin_lock(&pool->lock);
+	if (pool->nr_free < pool_size) {
+		pool->objects[pool->nr_free++] = info;
+		info = NULL;
+	}
+	spin_unlock(&pool->lock);
+
+	local_irq_restore(flags);
+
+	if (info != NULL)
+		kmem_cache_free(klc_cache, info);
+}
+
+void
+kedr_lc_pool_get_stats(struct kedr_lc_pool_stats *stats)
+{
+	int cpu;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->pool_size = pool_size;
+
+	for_each_possible_cpu(cpu) {
+		struct klc_pool *pool = &per_cpu(klc_pools, cpu);
+		unsigned long flags;
+
+		spin_lock_irqsave(&pool->lock, flags);
+		stats->available += pool->nr_free;
+		stats->hits += pool->hits;
+		stats->misses += pool->misses;
+		spin_unlock_irqrestore(&pool->lock, flags);
+	}
+}
+/* ====================================================================== */
+
+static void
+klc_pools_destroy(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct klc_pool *pool = &per_cpu(klc_pools, cpu);
+
+		while (pool->nr_free != 0)
+			kmem_cache_free(klc_cache,
+				pool->objects[--pool->nr_free]);
+		kfree(pool->objects);
+		pool->objects = NULL;
+	}
+}
+
+int
+kedr_lc_pool_init(void)
+{
+	int cpu;
+
+	klc_cache = kmem_cache_create("kedr_lc_resource_info",
+		sizeof(struct kedr_lc_resource_info), 0, 0, NULL);
+	if (klc_cache == NULL) {
+		pr_err(KEDR_LC_MSG_PREFIX
+			"failed to create the cache for resource info\n");
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct klc_pool *pool = &per_cpu(klc_pools, cpu);
+
+		spin_lock_init(&pool->lock);
+		pool->nr_free = 0;
+		pool->hits = 0;
+		pool->misses = 0;
+
+		if (pool_size == 0)
+			continue;
+
+		pool->objects = kcalloc(pool_size, sizeof(*pool->objects),
+			GFP_KERNEL);
+		if (pool->objects == NULL)
+			goto fail;
+	}
+
+	if (pool_size != 0)
+		klc_pool_refill(NULL);
+	return 0;
+
+fail:
+	pr_err(KEDR_LC_MSG_PREFIX
+		"not enough memory for the pools of resource info\n");
+	klc_pools_destroy();
+	kmem_cache_destroy(klc_cache);
+	klc_cache = NULL;
+	return -ENOMEM;
+}
+
+void
+kedr_lc_pool_fini(void)
+{
+	cancel_work_sync(&klc_refill_work);
+	klc_pools_destroy();
+	kmem_cache_destroy(klc_cache);
+	klc_cache = NULL;
+}
+/* ====================================================================== */
@@ -0,0 +1,55 @@
+/* klc_pool.h - allocation of the resource information structures.
+ *
+ * The instances of struct kedr_lc_resource_info are allocated for each
+ * intercepted allocation, often in atomic context. To avoid the general
+ * purpose allocator there, they come from a dedicated slab cache and,
+ * first of all, from a small per-CPU pool of preallocated objects.
+ * The pool is refilled in process context when it runs low. */
+
+#ifndef KLC_POOL_H_1342_INCLUDED
+#define KLC_POOL_H_1342_INCLUDED
+
+struct kedr_lc_resource_info;
+
+/* Statistics of the pool, summed over all CPUs. */
+struct kedr_lc_pool_stats
+{
+	/* Maximum number of the preallocated objects per CPU. */
+	unsigned int pool_size;
+
+	/* Number of the preallocated objects currently available. */
+	unsigned long available;
+
+	/* Number of the allocations served from the pool ("hits") and
+	 * from the slab cache directly ("misses"). */
+	unsigned long hits;
+	unsigned long misses;
+};
+
+/* Creates the cache and fills the pools. Should be called from the
+ * module's init function before any other kedr_lc_pool_* functions.
+ *
+ * Returns 0 on success, -errno on failure. */
+int
+kedr_lc_pool_init(void);
+
+/* Releases the pools and destroys the cache. All the objects allocated
+ * with kedr_lc_pool_alloc() must have been freed by this time. */
+void
+kedr_lc_pool_fini(void);
+
+/* Returns an uninitialized object or NULL if there is not enough memory.
+ * Can be used in atomic context too. */
+struct kedr_lc_resource_info *
+kedr_lc_pool_alloc(void);
+
+/* Frees the object allocated with kedr_lc_pool_alloc().
+ * Can be used in atomic context too. */
+void
+kedr_lc_pool_free(struct kedr_lc_resource_info *info);
+
+/* Fills 'stats' with the current statistics of the pool. */
+void
+kedr_lc_pool_get_stats(struct kedr_lc_pool_stats *stats);
+
+#endif /* KLC_POOL_H_1342_INCLUDED */
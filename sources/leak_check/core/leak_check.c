@@ -22,11 +22,13 @@
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
 #include <linux/hash.h>
-#include <linux/workqueue.h>
+#include <linux/jhash.h>
+#include <linux/vmalloc.h>
 #include <linux/string.h>
 #include <linux/slab.h>
 #include <linux/sched.h>
 #include <linux/hardirq.h>
+#include <linux/rcupdate.h>
 
 #include <kedr/core/kedr.h>
 #include <kedr/leak_check/leak_check.h>
@@ -34,6 +36,7 @@
 
 #include "leak_check_impl.h"
 #include "klc_output.h"
+#include "klc_pool.h"
 
 #include "config.h"
 /* ====================================================================== */
@@ -68,16 +71,23 @@ module_param(bad_free_groups_stored, uint, S_IRUGO);
 /* Global leak check object. */
 static struct kedr_leak_check* lc_object;
 
-/* Rb-tree of stack entries.
+/* Hash table of stack entries, keyed by address.
  * 
  * It contains all stack entries which (may) require symbolic resolving.
  * Whenever someone request new stack entry for some address, the entry
- * is also inserted into the tree(unless tree already has entry with
+ * is also inserted into the table(unless table already has entry with
  * given address).
  * When a section of the module is going to unload from the memory,
  * all entries corresponded to addresses within this section are
- * resolved. */
-struct rb_root stack_entry_tree = RB_ROOT;
+ * resolved and removed from the table.
+ *
+ * The table is searched under rcu_read_lock() only, so the stack entry
+ * for the address already seen is obtained without locks. Insertions and
+ * removals are serialized with 'stack_entry_lock'. */
+#define STACK_ENTRY_HASH_BITS 12
+#define STACK_ENTRY_TABLE_SIZE (1 << STACK_ENTRY_HASH_BITS)
+
+static struct hlist_head stack_entry_table[STACK_ENTRY_TABLE_SIZE];
 /* ====================================================================== */
 
 /* A mutex to serialize the execution of the target load handler here. KEDR
@@ -88,8 +98,6 @@ struct rb_root stack_entry_tree = RB_ROOT;
  * locked. */
 static DEFINE_MUTEX(lc_mutex);
 
-/* Workqueue name for leak check object. */
-static const char *wq_name = "kedr_lc";
 /* ====================================================================== */
 
 /* Non-zero if we are in IRQ (harqirq or softirq) context, 0 otherwise.
@@ -108,17 +116,18 @@ kedr_in_interrupt(void)
 }
 /* ====================================================================== */
 
-/* This structure represents a request to handle allocation or 
- * deallocation event or a request to flush the current results. */
-struct klc_work {
-	struct work_struct work;
-	struct kedr_leak_check *lc;
-	struct kedr_lc_resource_info *ri;
-};
-
-/* A spinlock that protects stack entries and 'stack_entry_tree'
- * from concurrent access. */
+/* A spinlock that protects changes of 'stack_entry_table' and resolving
+ * of stack entries. */
 static DEFINE_SPINLOCK(stack_entry_lock);
+
+#ifdef CONFIG_STACK_UNWIND
+/* [NB] It appears that the implementation of save_stack_trace() is not 
+ * guaranteed to be thread-safe as of this writing if the kernel uses
+ * DWARF2 unwinding. So, serialize its usage by Leak Check in this case.
+ * Other unwinders use only the stack being unwound.
+ * This problem needs more investigation. */
+static DEFINE_SPINLOCK(stack_unwind_lock);
+#endif
 /* ====================================================================== */
 
 /* Symbolic value of stack entry, when it is failed to be allocated. */
@@ -129,11 +138,11 @@ static struct stack_entry stack_entry_undef =
 {
 	.addr = 0,
 
-	/* .node value needn't to be initialized, as it is not accessed
-	 * via stack entry object. */
+	/* .hlist and .rcu values needn't to be initialized, as the object
+	 * is never inserted into the table and never destroyed. */
 
 	/* Nobody owner this reference, so object cannot be destroyed via unref. */
-	.refs = 1, 
+	.refs = ATOMIC_INIT(1),
 
 	.symbolic = stack_entry_symbolic_undef
 };
@@ -159,13 +168,10 @@ stack_entry_resolve(struct stack_entry* entry)
 	}
 }
 
-/* Decrement reference count on stack entry object.
- * If it becomes 0, destroy obiect.
- * Should be called with 'stack_entry_lock' locked. */
 static void
-stack_entry_unref(struct stack_entry* entry)
+stack_entry_free_rcu(struct rcu_head* rcu)
 {
-	if(--entry->refs) return;
+	struct stack_entry* entry = container_of(rcu, typeof(*entry), rcu);
 
 	if(entry->symbolic != stack_entry_symbolic_undef)
 		kfree(entry->symbolic);
@@ -173,112 +179,145 @@ stack_entry_unref(struct stack_entry* entry)
 	kfree(entry);
 }
 
-/* Increment reference of the given stack entry.
- * Should be called with 'stack_entry_lock' locked. */
+/* Decrement reference count on stack entry object.
+ * If it becomes 0, destroy object after the readers of the table,
+ * which may still see it, finish.
+ * May be called without locks. */
+static void
+stack_entry_unref(struct stack_entry* entry)
+{
+	if(!atomic_dec_and_test(&entry->refs)) return;
+
+	call_rcu(&entry->rcu, stack_entry_free_rcu);
+}
+
+static struct hlist_head*
+stack_entry_bucket(unsigned long addr)
+{
+	return &stack_entry_table[hash_long(addr, STACK_ENTRY_HASH_BITS)];
+}
+
+/* Search stack entry for given address in the bucket and reference it.
+ * Return NULL if not found.
+ * Should be called under rcu_read_lock() or with 'stack_entry_lock'
+ * locked. */
 static struct stack_entry*
-stack_entry_ref(struct stack_entry* entry)
+stack_entry_lookup(struct hlist_head* head, unsigned long addr)
 {
-	entry->refs++;
+	struct stack_entry* entry;
 
-	return entry;
+	kedr_hlist_for_each_entry_rcu(entry, head, hlist)
+	{
+		/* Entry with 0 refs is being destroyed, it is already removed
+		 * from the table but the readers may still see it. */
+		if((entry->addr == addr) && atomic_inc_not_zero(&entry->refs))
+			return entry;
+	}
+
+	return NULL;
 }
 
 /* Create new or return existed stack entry object for given address.
  * Note: Always return non-NULL. 
- * Should be called with 'stack_entry_lock' locked. */
+ * May be called without locks. */
 static struct stack_entry*
 stack_entry_create(unsigned long addr)
 {
 	struct stack_entry* entry;
-	struct rb_node ** new = &stack_entry_tree.rb_node, *parent = NULL;
+	struct hlist_head* head = stack_entry_bucket(addr);
+	unsigned long flags;
 
-	/* Search existing stack entry.*/
-	while(*new)
-	{
-		entry = container_of(*new, typeof(*entry), node);
-		parent = *new;
-
-		if(entry->addr < addr)
-			new = &((*new)->rb_right);
-		else if(entry->addr > addr)
-			new = &((*new)->rb_left);
-		else
-			return stack_entry_ref(entry);
-	}
+	/* Fast path: the address is already known. */
+	rcu_read_lock();
+	entry = stack_entry_lookup(head, addr);
+	rcu_read_unlock();
+	if(entry) return entry;
+
+	spin_lock_irqsave(&stack_entry_lock, flags);
+
+	/* Entry may be created concurrently. */
+	entry = stack_entry_lookup(head, addr);
+	if(entry) goto out;
 
 	/* If not found, create new one. */
 	entry = kmalloc(sizeof(*entry), GFP_ATOMIC);
 	if(!entry)
 	{
-		stack_entry_undef.refs++;
-		return &stack_entry_undef;
+		atomic_inc(&stack_entry_undef.refs);
+		entry = &stack_entry_undef;
+		goto out;
 	}
 
 	entry->addr = addr;
-	entry->refs = 2; /* One 'ref' for the tree, other for the caller. */
+	/* One 'ref' for the table, other for the caller. */
+	atomic_set(&entry->refs, 2);
 	entry->symbolic = NULL;
 
-	/* And insert it into tree. */
-	rb_link_node(&entry->node, parent, new);
-	rb_insert_color(&entry->node, &stack_entry_tree);
+	/* And insert it into the table. */
+	hlist_add_head_rcu(&entry->hlist, head);
+
+out:
+	spin_unlock_irqrestore(&stack_entry_lock, flags);
 
 	return entry;
 }
 
+/* Remove stack entry from the table and drop the table's reference.
+ * Should be called with 'stack_entry_lock' locked. */
+static void
+stack_entry_remove(struct stack_entry* entry)
+{
+	hlist_del_rcu(&entry->hlist);
+	stack_entry_unref(entry);
+}
+
 /* Clear map of stack entries.
  * Should be called with 'stack_entry_lock' locked. */
 static void
 stack_entries_clear(void)
 {
 	struct stack_entry* entry;
-	struct rb_node *node;
+	struct hlist_node *tmp;
+	int i;
 
-	for(node =  stack_entry_tree.rb_node;
-		node;
-		node =  stack_entry_tree.rb_node)
+	for(i = 0; i < STACK_ENTRY_TABLE_SIZE; i++)
 	{
-		entry = container_of(node, typeof(*entry), node);
-		rb_erase(node, &stack_entry_tree);
-		stack_entry_unref(entry);
+		kedr_hlist_for_each_entry_safe(entry, tmp,
+			&stack_entry_table[i], hlist)
+		{
+			stack_entry_remove(entry);
+		}
 	}
 }
 
 /* Resolve and clear stack entries in the map within given range.
- * Should be called with 'stack_entry_lock' locked. */
+ * Should be called with 'stack_entry_lock' locked.
+ *
+ * [NB] The code within the range is not executed anymore, so new
+ * references to these entries are not expected. */
 static void
 stack_entries_resolve_and_clear(unsigned long start, unsigned long end)
 {
 	struct stack_entry* entry;
-	struct rb_node *node = stack_entry_tree.rb_node, *next = NULL;
-
-	/* Search first entry with 'addr' >= start.
-	 * After the loop it will be stored in 'next'.*/
-	while(node)
-	{
-		entry = container_of(node, typeof(*entry), node);
-
-		if(entry->addr >= start)
-			{ next = node; node = node->rb_left; }
-		else
-			node = node->rb_right;
-	}
+	struct hlist_node *tmp;
+	int i;
 
-	/* Do the work. */
-	for(node = next; node; node = next)
+	for(i = 0; i < STACK_ENTRY_TABLE_SIZE; i++)
 	{
-		entry = container_of(node, typeof(*entry), node);
-		if(entry->addr >= end) break;
+		kedr_hlist_for_each_entry_safe(entry, tmp,
+			&stack_entry_table[i], hlist)
+		{
+			if((entry->addr < start) || (entry->addr >= end))
+				continue;
 
-		next = rb_next(node);
+			/* Resolve entry only if it used elsewhere outside of table. */
+			if(atomic_read(&entry->refs) > 1)
+			{
+				stack_entry_resolve(entry);
+			}
 
-		/* Resolve entry only if it used elsewhere outside of tree. */
-		if(entry->refs > 1)
-		{
-			stack_entry_resolve(entry);
+			stack_entry_remove(entry);
 		}
-
-		rb_erase(node, &stack_entry_tree);
-		stack_entry_unref(entry);
 	}
 }
 
@@ -298,6 +337,173 @@ kedr_lc_resolve_stack_entries(struct stack_entry** entries,
 
 /* ====================================================================== */
 
+/* Hash table of call stacks ("stack depot").
+ *
+ * The key is the array of stack entries of the call stack. As stack
+ * entries are unique for each address in the table of stack entries,
+ * the events with the same call stack share the same kedr_lc_stack
+ * instance.
+ *
+ * As for the stack entries, the table is searched under rcu_read_lock()
+ * only. Insertions and removals are serialized with 'klc_stack_lock'. */
+#define KLC_STACK_HASH_BITS 12
+#define KLC_STACK_TABLE_SIZE (1 << KLC_STACK_HASH_BITS)
+
+static struct hlist_head klc_stack_table[KLC_STACK_TABLE_SIZE];
+
+static DEFINE_SPINLOCK(klc_stack_lock);
+
+/* Call stack, when it is failed to be allocated. */
+static struct kedr_lc_stack klc_stack_undef =
+{
+	/* Nobody owns this reference, so object cannot be destroyed. */
+	.refs = ATOMIC_INIT(1),
+
+	.num_entries = 0
+};
+
+static void
+klc_stack_free_rcu(struct rcu_head *rcu)
+{
+	kfree(container_of(rcu, struct kedr_lc_stack, rcu));
+}
+
+/* Search call stack with given entries in the bucket and reference it.
+ * Return NULL if not found.
+ * Should be called under rcu_read_lock() or with 'klc_stack_lock'
+ * locked. */
+static struct kedr_lc_stack *
+klc_stack_lookup(struct hlist_head *head, u32 hash,
+	struct stack_entry **entries, unsigned int num_entries)
+{
+	struct kedr_lc_stack *stack;
+
+	kedr_hlist_for_each_entry_rcu(stack, head, hlist) {
+		if (stack->hash != hash || stack->num_entries != num_entries)
+			continue;
+		if (memcmp(stack->entries, entries, 
+			num_entries * sizeof(*entries)) != 0)
+			continue;
+		/* Call stack with 0 refs is being removed from the table. */
+		if (atomic_inc_not_zero(&stack->refs))
+			return stack;
+	}
+	return NULL;
+}
+
+/* Returns the call stack with given entries, creating it if needed. 
+ * The references to the stack entries are passed to this function: they
+ * are either owned by the call stack now or dropped.
+ * Never returns NULL.
+ *
+ * This function can be used in atomic context too. */
+static struct kedr_lc_stack *
+klc_stack_get(struct stack_entry **entries, unsigned int num_entries)
+{
+	struct kedr_lc_stack *stack;
+	struct hlist_head *head;
+	unsigned long flags;
+	unsigned int i;
+	u32 hash;
+
+	hash = jhash(entries, num_entries * sizeof(*entries), num_entries);
+	head = &klc_stack_table[hash_32(hash, KLC_STACK_HASH_BITS)];
+
+	/* Fast path: the call stack is already known. */
+	rcu_read_lock();
+	stack = klc_stack_lookup(head, hash, entries, num_entries);
+	rcu_read_unlock();
+	if (stack != NULL)
+		goto out_unref;
+
+	spin_lock_irqsave(&klc_stack_lock, flags);
+
+	/* Call stack may be created concurrently. */
+	stack = klc_stack_lookup(head, hash, entries, num_entries);
+	if (stack != NULL) {
+		spin_unlock_irqrestore(&klc_stack_lock, flags);
+		goto out_unref;
+	}
+
+	stack = kmalloc(sizeof(*stack) + num_entries * sizeof(*entries),
+		GFP_ATOMIC);
+	if (stack == NULL) {
+		spin_unlock_irqrestore(&klc_stack_lock, flags);
+		atomic_inc(&klc_stack_undef.refs);
+		stack = &klc_stack_undef;
+		goto out_unref;
+	}
+
+	atomic_set(&stack->refs, 1);
+	stack->hash = hash;
+	stack->num_entries = num_entries;
+	memcpy(stack->entries, entries, num_entries * sizeof(*entries));
+
+	hlist_add_head_rcu(&stack->hlist, head);
+	spin_unlock_irqrestore(&klc_stack_lock, flags);
+	return stack;
+
+out_unref:
+	for (i = 0; i < num_entries; ++i)
+		stack_entry_unref(entries[i]);
+	return stack;
+}
+
+/* Drops a reference to the call stack and destroys it if it was the last
+ * one.
+ *
+ * This function can be used in atomic context too. */
+static void
+klc_stack_put(struct kedr_lc_stack *stack)
+{
+	unsigned long flags;
+	unsigned int i;
+
+	if (!atomic_dec_and_test(&stack->refs))
+		return;
+
+	spin_lock_irqsave(&klc_stack_lock, flags);
+	hlist_del_rcu(&stack->hlist);
+	spin_unlock_irqrestore(&klc_stack_lock, flags);
+
+	/* The readers of the table may still see the call stack but they
+	 * do not access the stack entries. */
+	for (i = 0; i < stack->num_entries; ++i)
+		stack_entry_unref(stack->entries[i]);
+
+	call_rcu(&stack->rcu, klc_stack_free_rcu);
+}
+/* ====================================================================== */
+
+/* Non-zero for the addresses that may belong to the user space, 
+ * 0 otherwise. If the address is valid and this function returns non-zero,
+ * it is an address in the user space. */
+static int
+is_user_space_address(unsigned long addr)
+{
+	return (addr < TASK_SIZE);
+}
+
+/* Save the call stack for the event into 'stack_addrs' array of
+ * KEDR_MAX_FRAMES elements. */
+static void
+klc_save_stack_trace(unsigned long *stack_addrs, unsigned int *num_entries,
+	const void *caller_address)
+{
+#ifdef CONFIG_STACK_UNWIND
+	unsigned long flags;
+
+	spin_lock_irqsave(&stack_unwind_lock, flags);
+#endif
+	kedr_save_stack_trace(stack_addrs,
+		stack_depth,
+		num_entries,
+		(unsigned long)caller_address);
+#ifdef CONFIG_STACK_UNWIND
+	spin_unlock_irqrestore(&stack_unwind_lock, flags);
+#endif
+}
+
 /* Creates and initializes kedr_lc_resource_info structure and returns
  * a pointer to it (or NULL if there is not enough memory).
  *
@@ -312,12 +518,14 @@ resource_info_create(const void *addr, size_t size,
 	const void *caller_address)
 {
 	struct kedr_lc_resource_info *info;
-	unsigned long flags;
 
-	info = kzalloc(sizeof(*info), GFP_ATOMIC);
+	info = kedr_lc_pool_alloc();
 	if (info != NULL) {
-		int i;
-		unsigned long stack_addrs[ARRAY_SIZE(info->stack_entries)];
+		unsigned int i, num_entries;
+		unsigned long stack_addrs[KEDR_MAX_FRAMES];
+		struct stack_entry *entries[KEDR_MAX_FRAMES];
+
+		memset(info, 0, sizeof(*info));
 		// TODO: It seems that 'current' is valid even in interrupts.
 		if (!kedr_in_interrupt()) {
 			struct task_struct *task = current;
@@ -344,94 +552,357 @@ resource_info_create(const void *addr, size_t size,
 		info->addr = addr;
 		info->size  = size;
 
-/* [NB] It appears that the implementation of save_stack_trace() is not 
- * guaranteed to be thread-safe as of this writing if the kernel uses DWARF2
- * unwinding. So, serialize its usage by Leak Check(using `stack_entry_lock`).
- * This problem needs more investigation. */
-
-		spin_lock_irqsave(&stack_entry_lock, flags);
-
-		kedr_save_stack_trace(stack_addrs,
-			stack_depth,
-			&info->num_entries,
-			(unsigned long)caller_address);
+		klc_save_stack_trace(stack_addrs, &num_entries,
+			caller_address);
 
-		for(i = 0; i < info->num_entries; i++)
+		for(i = 0; i < num_entries; i++)
 		{
-			info->stack_entries[i] = stack_entry_create(stack_addrs[i]);
+			/* The "outermost" call stack elements for a system
+			 * call may be different for different processes.
+			 * They are dropped, so such call stacks are shared
+			 * if they differ in these elements only. */
+			if (is_user_space_address(stack_addrs[i]))
+				break;
+
+			entries[i] = stack_entry_create(stack_addrs[i]);
 		}
-		spin_unlock_irqrestore(&stack_entry_lock, flags);
+		info->stack = klc_stack_get(entries, i);
 
 		INIT_HLIST_NODE(&info->hlist);
+		atomic_set(&info->refs, 1);
 	}
 	return info;
 }
 
-/* Destroys kedr_lc_resource_info instance pointed to by 'info'.
+/* Drops a reference to kedr_lc_resource_info instance pointed to by 
+ * 'info' and destroys the instance if it was the last one.
  * No-op if 'info' is NULL.
- * [NB] Before destroying the structure, make sure it is not on the work
- * queue and you have removed it from the table if it was there. */
+ * [NB] Before dropping the reference owned by the storage, make sure you
+ * have removed the structure from the table if it was there. */
 static void
 resource_info_destroy(struct kedr_lc_resource_info *info)
 {
-	int i;
-	unsigned long flags;
-
 	if(!info) return;
+	if(!atomic_dec_and_test(&info->refs)) return;
 
-	spin_lock_irqsave(&stack_entry_lock, flags);
-	for(i = 0; i < info->num_entries; i++)
-	{
-		stack_entry_unref(info->stack_entries[i]);
-	}
-	spin_unlock_irqrestore(&stack_entry_lock, flags);
+	klc_stack_put(info->stack);
 
-	kfree(info);
+	kedr_lc_pool_free(info);
 }
 /* ====================================================================== */
 
-/* klc_clear_* can be called only in the following contexts to avoid messing
- * up the alloc/dealloc tables:
- * - when noone can post work items to lc->wq or
- * - from a work function of lc->wq (because the wq is single-threaded and
- *   ordered). */
+/* Number of the buckets moved from the old table to the new one at a time
+ * while the table of a shard is being resized. */
+#define KLC_MIGRATE_BATCH 64
+
+static unsigned int
+klc_hash(const void *addr)
+{
+	return (unsigned int)hash_ptr((void *)addr, 32);
+}
+
+/* Returns the shard of the storage for the given hash. */
+static struct kedr_lc_shard *
+klc_shard(struct kedr_leak_check *lc, unsigned int hash)
+{
+	return &lc->shards[hash & (KEDR_LC_SHARDS - 1)];
+}
+
+/* Returns the bucket for the given hash in the table with 2^'bits'
+ * buckets. */
+static struct hlist_head *
+klc_bucket(struct hlist_head *table, unsigned int bits, unsigned int hash)
+{
+	return &table[(hash >> KEDR_LC_SHARD_BITS) & ((1U << bits) - 1)];
+}
+
+static struct hlist_head *
+klc_table_alloc(unsigned int bits)
+{
+	size_t size = sizeof(struct hlist_head) << bits;
+	struct hlist_head *table;
+	unsigned int i;
+	
+	if (size <= PAGE_SIZE)
+		table = kmalloc(size, GFP_KERNEL);
+	else
+		table = vmalloc(size);
+	if (table == NULL)
+		return NULL;
+	
+	for (i = 0; i < (1U << bits); ++i)
+		INIT_HLIST_HEAD(&table[i]);
+	return table;
+}
+
 static void
-klc_clear_allocs(struct kedr_leak_check *lc)
+klc_table_free(struct hlist_head *table, unsigned int bits)
+{
+	if ((sizeof(struct hlist_head) << bits) <= PAGE_SIZE)
+		kfree(table);
+	else
+		vfree(table);
+}
+
+/* Destroys all the elements of the table. */
+static void
+klc_table_clear(struct hlist_head *table, unsigned int bits)
 {
 	struct kedr_lc_resource_info *ri = NULL;
-	struct hlist_head *head = NULL;
+	struct hlist_node *tmp = NULL;
 	unsigned int i;
-
-	for (i = 0; i < KEDR_RI_TABLE_SIZE; ++i) {
-		head = &lc->allocs[i];
-		while (!hlist_empty(head)) {
-			ri = hlist_entry(head->first,
-				struct kedr_lc_resource_info, hlist);
+	
+	for (i = 0; i < (1U << bits); ++i) {
+		kedr_hlist_for_each_entry_safe(ri, tmp, &table[i], hlist) {
 			hlist_del(&ri->hlist);
 			resource_info_destroy(ri);
 		}
 	}
 }
 
+/* Returns the number of bits for the table of a shard with 'nr_allocs'
+ * allocations: at most one allocation per bucket on average. */
+static unsigned int
+klc_table_bits(unsigned long nr_allocs)
+{
+	unsigned int bits = KEDR_LC_TABLE_MIN_BITS;
+	
+	while (bits < KEDR_LC_TABLE_MAX_BITS && (1UL << bits) < nr_allocs)
+		++bits;
+	return bits;
+}
+
+/* Non-zero if the table of the shard should be resized, that is, if there
+ * are more than 2 or less than 1/8 allocations per bucket on average.
+ * Should be called with the shard locked. */
+static int
+klc_shard_needs_resize(struct kedr_lc_shard *shard)
+{
+	unsigned long nr_buckets = 1UL << shard->bits;
+	
+	if (shard->old_allocs != NULL)
+		return 0; /* being resized already */
+	
+	if (shard->total_leaks > 2 * nr_buckets)
+		return (shard->bits < KEDR_LC_TABLE_MAX_BITS);
+	if (shard->total_leaks < nr_buckets / 8)
+		return (shard->bits > KEDR_LC_TABLE_MIN_BITS);
+	return 0;
+}
+
+/* Adds 'node' at the end of the list. */
+static void
+klc_hlist_add_tail(struct hlist_node *node, struct hlist_head *head)
+{
+	struct hlist_node **pprev = &head->first;
+	
+	while (*pprev != NULL)
+		pprev = &(*pprev)->next;
+	
+	node->next = NULL;
+	node->pprev = pprev;
+	*pprev = node;
+}
+
+/* Moves the elements of the next KLC_MIGRATE_BATCH buckets of the old 
+ * table to the new one.
+ * The elements of the new table are newer than the ones of the old table
+ * and the elements with the same address are in the same bucket of the old
+ * table. So, adding the elements at the end of the new buckets keeps the
+ * order "last in - first found" for each address.
+ * Should be called with the shard locked. */
+static void
+klc_shard_migrate(struct kedr_lc_shard *shard)
+{
+	struct kedr_lc_resource_info *ri = NULL;
+	struct hlist_node *tmp = NULL;
+	unsigned int end = shard->migrated + KLC_MIGRATE_BATCH;
+	
+	if (end > (1U << shard->old_bits))
+		end = 1U << shard->old_bits;
+	
+	for (; shard->migrated < end; ++shard->migrated) {
+		kedr_hlist_for_each_entry_safe(ri, tmp, 
+			&shard->old_allocs[shard->migrated], hlist) {
+			hlist_del(&ri->hlist);
+			klc_hlist_add_tail(&ri->hlist, klc_bucket(shard->allocs,
+				shard->bits, klc_hash(ri->addr)));
+		}
+	}
+}
+
+/* Resizes the table of the shard if needed. The new table is used right
+ * away, the elements are moved there from the old table by small batches,
+ * so that the events for the shard are not delayed for long. */
+static void
+klc_shard_resize(struct kedr_leak_check *lc, struct kedr_lc_shard *shard)
+{
+	struct hlist_head *table;
+	unsigned int bits;
+	unsigned long flags;
+	int needs_resize;
+	
+	spin_lock_irqsave(&shard->lock, flags);
+	needs_resize = klc_shard_needs_resize(shard);
+	bits = klc_table_bits((unsigned long)shard->total_leaks);
+	spin_unlock_irqrestore(&shard->lock, flags);
+	
+	if (!needs_resize)
+		return;
+	
+	table = klc_table_alloc(bits);
+	if (table == NULL)
+		return; /* try again later */
+	
+	spin_lock_irqsave(&shard->lock, flags);
+	/* The shard may have been cleared meanwhile. */
+	if (shard->bits == bits) {
+		spin_unlock_irqrestore(&shard->lock, flags);
+		klc_table_free(table, bits);
+		return;
+	}
+	shard->old_allocs = shard->allocs;
+	shard->old_bits = shard->bits;
+	shard->migrated = 0;
+	shard->allocs = table;
+	shard->bits = bits;
+	spin_unlock_irqrestore(&shard->lock, flags);
+	
+	++lc->nr_resizes;
+	
+	for (;;) {
+		struct hlist_head *old;
+		unsigned int old_bits;
+		int done;
+		
+		spin_lock_irqsave(&shard->lock, flags);
+		old = shard->old_allocs;
+		if (old == NULL) {
+			/* The shard has been cleared and the old table has 
+			 * been freed there. */
+			spin_unlock_irqrestore(&shard->lock, flags);
+			return;
+		}
+		
+		klc_shard_migrate(shard);
+		
+		old_bits = shard->old_bits;
+		done = (shard->migrated == (1U << old_bits));
+		if (done)
+			shard->old_allocs = NULL;
+		spin_unlock_irqrestore(&shard->lock, flags);
+		
+		if (done) {
+			klc_table_free(old, old_bits);
+			return;
+		}
+		cond_resched();
+	}
+}
+
+static void
+klc_resize_work(struct work_struct *work)
+{
+	struct kedr_leak_check *lc = 
+		container_of(work, struct kedr_leak_check, resize_work);
+	unsigned int i;
+	
+	for (i = 0; i < KEDR_LC_SHARDS; ++i)
+		klc_shard_resize(lc, &lc->shards[i]);
+}
+
+void
+kedr_lc_get_table_stats(struct kedr_leak_check *lc,
+	struct kedr_lc_table_stats *stats)
+{
+	unsigned long flags;
+	unsigned int i;
+	
+	memset(stats, 0, sizeof(*stats));
+	
+	for (i = 0; i < KEDR_LC_SHARDS; ++i) {
+		struct kedr_lc_shard *shard = &lc->shards[i];
+		
+		spin_lock_irqsave(&shard->lock, flags);
+		stats->nr_allocs += (unsigned long)shard->total_leaks;
+		stats->nr_buckets += 1UL << shard->bits;
+		spin_unlock_irqrestore(&shard->lock, flags);
+	}
+	stats->nr_resizes = lc->nr_resizes;
+}
+/* ====================================================================== */
+
+/* klc_clear_* may be called while the events are being handled. */
+static void
+klc_clear_allocs(struct kedr_leak_check *lc)
+{
+	struct kedr_lc_shard *shard;
+	struct hlist_head *table, *old, *old_resized;
+	unsigned int old_bits, old_resized_bits;
+	unsigned long flags;
+	unsigned int i;
+
+	for (i = 0; i < KEDR_LC_SHARDS; ++i) {
+		shard = &lc->shards[i];
+		
+		/* The tables of the shard are replaced with an empty table 
+		 * under the lock and their contents are destroyed after the
+		 * lock is released. */
+		table = klc_table_alloc(KEDR_LC_TABLE_MIN_BITS);
+		
+		spin_lock_irqsave(&shard->lock, flags);
+		old_resized = shard->old_allocs;
+		old_resized_bits = shard->old_bits;
+		shard->old_allocs = NULL;
+		
+		if (table != NULL) {
+			old = shard->allocs;
+			old_bits = shard->bits;
+			shard->allocs = table;
+			shard->bits = KEDR_LC_TABLE_MIN_BITS;
+		}
+		else {
+			/* Not enough memory, clear the table in place. */
+			old = NULL;
+			old_bits = 0;
+			klc_table_clear(shard->allocs, shard->bits);
+		}
+		shard->total_allocs = 0;
+		shard->total_leaks = 0;
+		spin_unlock_irqrestore(&shard->lock, flags);
+
+		if (old != NULL) {
+			klc_table_clear(old, old_bits);
+			klc_table_free(old, old_bits);
+		}
+		if (old_resized != NULL) {
+			klc_table_clear(old_resized, old_resized_bits);
+			klc_table_free(old_resized, old_resized_bits);
+		}
+	}
+}
+
 static void
 klc_clear_deallocs(struct kedr_leak_check *lc)
 {
 	unsigned int i;
+	unsigned long flags;
 
+	spin_lock_irqsave(&lc->bad_free_lock, flags);
 	if (lc->total_bad_frees == 0) {
 		BUG_ON(lc->nr_bad_free_groups != 0);
-		return;
+		goto out;
 	}
 	BUG_ON(lc->nr_bad_free_groups == 0);
 
-	/* No need to protect the storage because this function is called
-	 * when no other code (replacement functions, etc.) can interfere.
-	 */
 	for (i = 0; i < lc->nr_bad_free_groups; ++i) {
 		resource_info_destroy(lc->bad_free_groups[i].ri);
 		lc->bad_free_groups[i].ri = NULL;
 	}
 	lc->nr_bad_free_groups = 0;
+	lc->total_bad_frees = 0;
+out:
+	spin_unlock_irqrestore(&lc->bad_free_lock, flags);
 }
 /* ====================================================================== */
 
@@ -458,9 +929,21 @@ lc_object_create(void)
 		goto fail_output;
 	}
 	
-	for (i = 0; i < KEDR_RI_TABLE_SIZE; ++i)
-		INIT_HLIST_HEAD(&lc->allocs[i]);
+	for (i = 0; i < KEDR_LC_SHARDS; ++i) {
+		struct kedr_lc_shard *shard = &lc->shards[i];
+		
+		spin_lock_init(&shard->lock);
+		shard->allocs = klc_table_alloc(KEDR_LC_TABLE_MIN_BITS);
+		if (shard->allocs == NULL) {
+			pr_warning(KEDR_LC_MSG_PREFIX
+			"Not enough memory to create the tables.\n");
+			goto fail_tables;
+		}
+		shard->bits = KEDR_LC_TABLE_MIN_BITS;
+	}
+	INIT_WORK(&lc->resize_work, klc_resize_work);
 
+	spin_lock_init(&lc->bad_free_lock);
 	lc->bad_free_groups = kzalloc(bad_free_groups_stored * 
 		sizeof(struct kedr_lc_bad_free_group), GFP_KERNEL);
 	if (lc->bad_free_groups == NULL) {
@@ -469,20 +952,17 @@ lc_object_create(void)
 		goto fail_bad_free_groups;
 	}
 	/* nr_bad_free_groups is now 0. */
-	lc->wq = create_singlethread_workqueue(wq_name);
-	if (lc->wq == NULL) {
-		pr_warning(KEDR_LC_MSG_PREFIX
-		"Failed to create the workqueue \"%s\"\n",
-			wq_name);
-		goto fail_wq;
-	}
 	
 	/* [NB] The totals are already zero due to kzalloc(). */
 	return lc;
 
-fail_wq:
-	kfree(lc->bad_free_groups);
 fail_bad_free_groups:
+fail_tables:
+	for (i = 0; i < KEDR_LC_SHARDS; ++i) {
+		if (lc->shards[i].allocs != NULL)
+			klc_table_free(lc->shards[i].allocs, 
+				KEDR_LC_TABLE_MIN_BITS);
+	}
 	kedr_lc_output_destroy(lc->output);
 fail_output:
 	kfree(lc);
@@ -493,23 +973,25 @@ fail_output:
 static void
 lc_object_destroy(struct kedr_leak_check *lc)
 {
-	unsigned int i;
+	unsigned int i, j;
 	
 	if (lc == NULL)
 		return;
 	
-	if (lc->wq != NULL) {
-		flush_workqueue(lc->wq); /* just in case  */
-		destroy_workqueue(lc->wq);
-	}
-
+	cancel_work_sync(&lc->resize_work);
+	
 	klc_clear_allocs(lc);
 	klc_clear_deallocs(lc);
 	
 	/* The table of resource leaks should be already empty.
 	 * Warn if it is not. */
-	for (i = 0; i < KEDR_RI_TABLE_SIZE; ++i)
-		WARN_ON_ONCE(!hlist_empty(&lc->allocs[i]));
+	for (i = 0; i < KEDR_LC_SHARDS; ++i) {
+		struct kedr_lc_shard *shard = &lc->shards[i];
+		
+		for (j = 0; j < (1U << shard->bits); ++j)
+			WARN_ON_ONCE(!hlist_empty(&shard->allocs[j]));
+		klc_table_free(shard->allocs, shard->bits);
+	}
 	
 	kfree(lc->bad_free_groups);
 	kedr_lc_output_destroy(lc->output);
@@ -526,55 +1008,38 @@ lc_object_reset(struct kedr_leak_check *lc)
 
 	klc_clear_allocs(lc);
 	klc_clear_deallocs(lc);
-	
-	lc->nr_bad_free_groups = 0;
-	lc->total_allocs = 0;
-	lc->total_leaks = 0;
-	lc->total_bad_frees = 0;
 }
 
 /* ====================================================================== */
 
-/* Non-zero for the addresses that may belong to the user space, 
- * 0 otherwise. If the address is valid and this function returns non-zero,
- * it is an address in the user space. */
-static int
-is_user_space_address(unsigned long addr)
-{
-	return (addr < TASK_SIZE);
-}
-
 /* Returns 0 if the call stacks in the given kedr_lc_resource_info 
  * structures are not equal, non-zero otherwise. */
 static int
 call_stacks_equal(const struct kedr_lc_resource_info *lhs, 
 	const struct kedr_lc_resource_info *rhs)
 {
-	unsigned int i;
-	if (lhs->num_entries != rhs->num_entries)
-		return 0;
-	
-	for (i = 0; i < lhs->num_entries; ++i) {
-		/* The "outermost" call stack elements for a system call
-		 * may be different for different processes. If the call
-		 * stacks differ in such elements only, we still consider
-		 * them equal. */
-		if (is_user_space_address(lhs->stack_entries[i]->addr) &&
-		    is_user_space_address(rhs->stack_entries[i]->addr))
-			break;
-		
-		if (lhs->stack_entries[i]->addr != rhs->stack_entries[i]->addr)
-			return 0;
-	}
-	return 1;
+	/* The events with the same call stack share it. */
+	return (lhs->stack == rhs->stack);
 }
 
 static void 
-ri_add(struct kedr_lc_resource_info *ri, struct hlist_head *ri_table)
+ri_add(struct kedr_lc_resource_info *ri, struct kedr_leak_check *lc)
 {
-	struct hlist_head *head;
-	head = &ri_table[hash_ptr((void *)(ri->addr), KEDR_RI_HASH_BITS)];
-	hlist_add_head(&ri->hlist, head);
+	unsigned int hash = klc_hash(ri->addr);
+	struct kedr_lc_shard *shard = klc_shard(lc, hash);
+	unsigned long flags;
+	int needs_resize;
+	
+	spin_lock_irqsave(&shard->lock, flags);
+	hlist_add_head(&ri->hlist, 
+		klc_bucket(shard->allocs, shard->bits, hash));
+	++shard->total_allocs;
+	++shard->total_leaks;
+	needs_resize = klc_shard_needs_resize(shard);
+	spin_unlock_irqrestore(&shard->lock, flags);
+	
+	if (needs_resize)
+		schedule_work(&lc->resize_work);
 }
 
 static void
@@ -582,72 +1047,48 @@ ri_add_bad_free(struct kedr_lc_resource_info *ri,
 	struct kedr_leak_check *lc)
 {
 	unsigned int i = 0;
+	unsigned long flags;
+	
+	spin_lock_irqsave(&lc->bad_free_lock, flags);
+	++lc->total_bad_frees;
+	
 	for (i = 0; i < lc->nr_bad_free_groups; ++i) {
 		if (call_stacks_equal(ri, lc->bad_free_groups[i].ri)) {
 			/* Similar events have already been stored. */
 			++lc->bad_free_groups[i].nr_items;
-			resource_info_destroy(ri);
-			return;
+			goto out_destroy;
 		}
 	}
 	
 	if (lc->nr_bad_free_groups == bad_free_groups_stored) {
 		/* No space for a new group. */
-		resource_info_destroy(ri);
-		return;
+		goto out_destroy;
 	}
 	
-	++lc->nr_bad_free_groups;
-	
 	lc->bad_free_groups[i].ri = ri;
 	lc->bad_free_groups[i].nr_items = 1;
+	++lc->nr_bad_free_groups;
+	
+	spin_unlock_irqrestore(&lc->bad_free_lock, flags);
+	return;
+
+out_destroy:
+	spin_unlock_irqrestore(&lc->bad_free_lock, flags);
+	resource_info_destroy(ri);
 }
 
-/* A helper function that looks for an item with 'addr' field equal
- * to 'addr' in the table. If found, the item is removed from the table and
- * a pointer to it is returned. If not found, NULL is returned. */
+/* Returns the newest element of the bucket for 'addr', NULL if not found.
+ * Should be called with the shard locked. */
 static struct kedr_lc_resource_info *
-ri_find_and_remove(const void *addr, struct hlist_head *ri_table)
+ri_find(struct hlist_head *head, const void *addr)
 {
-	struct hlist_head *head;
 	struct kedr_lc_resource_info *ri = NULL;
-	struct kedr_lc_resource_info *found = NULL;
-	struct hlist_node *tmp = NULL;
 	
-	head = &ri_table[hash_ptr((void *)addr, KEDR_RI_HASH_BITS)];
-	kedr_hlist_for_each_entry_safe(ri, tmp, head, hlist) {
-		if (ri->addr == addr) {
-			hlist_del(&ri->hlist);
-			found = ri;
-			break;
-		}
-	}
-	return found;
-}
-
-/* Finds the items in the given table (starting from the bucket #start_index
- * and going until its end) that have the same call stack as 'ri' and marks
- * them as such (sets their 'num_similar' fields to -1). Returns the number
- * of such items in 'ri->num_similar'. */
-static void
-ri_count_similar(struct kedr_lc_resource_info *ri,
-	struct hlist_head *ri_table, unsigned int start_index)
-{
-	unsigned int i;
-	struct kedr_lc_resource_info *info = NULL;
-	struct hlist_node *tmp = NULL;
-
-	ri->num_similar = 0;
-	
-	for (i = start_index; i < KEDR_RI_TABLE_SIZE; ++i) {
-		kedr_hlist_for_each_entry_safe(info, tmp, &ri_table[i], 
-			hlist) {
-			if (ri != info && call_stacks_equal(ri, info)) {
-				++ri->num_similar;
-				info->num_similar = (unsigned int)(-1);
-			}
-		}
+	kedr_hlist_for_each_entry(ri, head, hlist) {
+		if (ri->addr == addr)
+			return ri;
 	}
+	return NULL;
 }
 
 /* This function is usually called from deallocation handlers.
@@ -662,96 +1103,250 @@ ri_count_similar(struct kedr_lc_resource_info *ri,
 static int 
 find_and_remove_alloc(const void *addr, struct kedr_leak_check *lc)
 {
-	int ret = 0;
-	struct kedr_lc_resource_info *ri = NULL;
+	unsigned int hash;
+	struct kedr_lc_shard *shard;
+	struct kedr_lc_resource_info *found = NULL;
+	unsigned long flags;
+	int needs_resize = 0;
 	
 	WARN_ON(addr == NULL);
 	
-	ri = ri_find_and_remove(addr, &lc->allocs[0]);
-	if (ri) {
-		ret = 1;
-		resource_info_destroy(ri);
-		--lc->total_leaks;
+	hash = klc_hash(addr);
+	shard = klc_shard(lc, hash);
+	
+	spin_lock_irqsave(&shard->lock, flags);
+	/* The elements of the new table are newer, so it is searched 
+	 * first. */
+	found = ri_find(klc_bucket(shard->allocs, shard->bits, hash), addr);
+	if (found == NULL && shard->old_allocs != NULL) {
+		found = ri_find(klc_bucket(shard->old_allocs, shard->old_bits,
+			hash), addr);
 	}
-	return ret;
+	if (found != NULL) {
+		hlist_del(&found->hlist);
+		--shard->total_leaks;
+		needs_resize = klc_shard_needs_resize(shard);
+	}
+	spin_unlock_irqrestore(&shard->lock, flags);
+	
+	if (needs_resize)
+		schedule_work(&lc->resize_work);
+	
+	if (found == NULL)
+		return 0;
+	
+	resource_info_destroy(found);
+	return 1;
 }
 /* ====================================================================== */
 
-/* If klc_flush_* functions are called from the "target unload" handler 
- * or from a work item in lc->wq, no locks are needed to protect
- * the accesses to the tables of allocation and deallocation information.
- * This is because the wq is ordered and it is flushed in the "target
- * unload" handler before the functions are called. */
+/* The storage is not locked as a whole while the results are output, 
+ * because the output may sleep and the events may be handled at that
+ * time. Instead, the current contents of the storage are collected 
+ * into a snapshot. The structures in the snapshot are referenced, so
+ * they remain valid even if the resources are freed concurrently. */
+struct klc_snapshot
+{
+	struct kedr_lc_resource_info **items;
+	unsigned long nr_items;
+};
 
 static void
-klc_flush_allocs(struct kedr_leak_check *lc)
+klc_snapshot_release(struct klc_snapshot *snapshot)
+{
+	unsigned long i;
+	
+	for (i = 0; i < snapshot->nr_items; ++i)
+		resource_info_destroy(snapshot->items[i]);
+	
+	vfree(snapshot->items);
+	snapshot->items = NULL;
+	snapshot->nr_items = 0;
+}
+
+/* Adds the elements of the table to 'snapshot' which has space for 
+ * 'nr_max' elements. Returns -ENOSPC if there is not enough space.
+ * Should be called with the shard locked. */
+static int
+klc_snapshot_table(struct klc_snapshot *snapshot, unsigned long nr_max,
+	struct hlist_head *table, unsigned int bits)
 {
 	struct kedr_lc_resource_info *ri = NULL;
-	struct hlist_node *tmp = NULL;
-	struct hlist_head *head = NULL;
+	unsigned int j;
+	
+	for (j = 0; j < (1U << bits); ++j) {
+		kedr_hlist_for_each_entry(ri, &table[j], hlist) {
+			if (snapshot->nr_items == nr_max)
+				return -ENOSPC;
+			atomic_inc(&ri->refs);
+			snapshot->items[snapshot->nr_items++] = ri;
+		}
+	}
+	return 0;
+}
+
+/* Collects the allocations into 'snapshot'. Returns 0 on success,
+ * negative error code otherwise.
+ * 
+ * Allocations may be added while they are being collected, so if the 
+ * snapshot has no space for them, the function retries with more 
+ * space. */
+static int
+klc_snapshot_allocs(struct kedr_leak_check *lc, struct klc_snapshot *snapshot)
+{
+	struct kedr_lc_shard *shard;
+	unsigned long flags;
+	unsigned long nr_max = 0;
 	unsigned int i;
+	int ret;
+	
+	for (i = 0; i < KEDR_LC_SHARDS; ++i)
+		nr_max += (unsigned long)lc->shards[i].total_leaks;
+	
+retry:
+	nr_max = nr_max + nr_max / 8 + 16;
+	snapshot->nr_items = 0;
+	snapshot->items = vmalloc(nr_max * sizeof(*snapshot->items));
+	if (snapshot->items == NULL)
+		return -ENOMEM;
+	
+	for (i = 0; i < KEDR_LC_SHARDS; ++i) {
+		shard = &lc->shards[i];
+		
+		spin_lock_irqsave(&shard->lock, flags);
+		ret = klc_snapshot_table(snapshot, nr_max, 
+			shard->allocs, shard->bits);
+		if (ret == 0 && shard->old_allocs != NULL) {
+			ret = klc_snapshot_table(snapshot, nr_max, 
+				shard->old_allocs, shard->old_bits);
+		}
+		spin_unlock_irqrestore(&shard->lock, flags);
+		
+		if (ret != 0) {
+			klc_snapshot_release(snapshot);
+			nr_max *= 2;
+			goto retry;
+		}
+	}
+	
+	return 0;
+}
+
+static void
+klc_flush_allocs(struct kedr_leak_check *lc)
+{
+	struct klc_snapshot snapshot;
+	struct kedr_lc_resource_info *ri = NULL;
+	unsigned long i, j;
 	
-	if (syslog_output != 0 && lc->total_leaks != 0)
+	if (klc_snapshot_allocs(lc, &snapshot) != 0) {
+		pr_warning(KEDR_LC_MSG_PREFIX "klc_flush_allocs: "
+	"not enough memory to collect the information about leaks\n");
+		return;
+	}
+	
+	if (syslog_output != 0 && snapshot.nr_items != 0)
 		pr_warning(KEDR_LC_MSG_PREFIX 
 			"LeakCheck has detected possible memory leaks: \n");
 
-	for (i = 0; i < KEDR_RI_TABLE_SIZE; ++i) {
-		head = &lc->allocs[i];
-		kedr_hlist_for_each_entry_safe(ri, tmp, head, hlist) {
-			 ri->num_similar = 0;
-		}
-	} 
+	for (i = 0; i < snapshot.nr_items; ++i)
+		snapshot.items[i]->num_similar = 0;
 		
-	for (i = 0; i < KEDR_RI_TABLE_SIZE; ++i) {
-		head = &lc->allocs[i];
-		kedr_hlist_for_each_entry_safe(ri, tmp, head, hlist) {
-			if (ri->num_similar == (unsigned int)(-1))
-				/* This entry is similar to some entry
-				 * processed before. Nothing more to do. */
-				continue;
+	for (i = 0; i < snapshot.nr_items; ++i) {
+		ri = snapshot.items[i];
+		if (ri->num_similar == (unsigned int)(-1))
+			/* This entry is similar to some entry
+			 * processed before. Nothing more to do. */
+			continue;
 
 	/* We output only the most recent allocation with a given call stack
 	 * to reduce the needed size of the output buffer and to make the
 	 * report more readable. */
-			ri_count_similar(ri, &lc->allocs[0], i);
-			kedr_lc_print_alloc_info(lc->output, ri,
-						 (u64)ri->num_similar);
+		for (j = i + 1; j < snapshot.nr_items; ++j) {
+			if (call_stacks_equal(ri, snapshot.items[j])) {
+				++ri->num_similar;
+				snapshot.items[j]->num_similar = 
+					(unsigned int)(-1);
+			}
 		}
-	} 
+		kedr_lc_print_alloc_info(lc->output, ri,
+					 (u64)ri->num_similar);
+	}
+	
+	klc_snapshot_release(&snapshot);
 }
 
 static void
 klc_flush_deallocs(struct kedr_leak_check *lc)
 {
-	struct kedr_lc_resource_info *ri = NULL;
-	unsigned int i;
+	struct kedr_lc_bad_free_group *groups;
+	unsigned int i, nr_groups;
+	unsigned long flags;
+	u64 total_bad_frees;
 	u64 stored = 0;
 	
-	if (lc->total_bad_frees == 0) {
+	groups = kmalloc(bad_free_groups_stored * sizeof(*groups), GFP_KERNEL);
+	if (groups == NULL) {
+		pr_warning(KEDR_LC_MSG_PREFIX "klc_flush_deallocs: "
+	"not enough memory to collect the information about bad frees\n");
 		return;
 	}
+	
+	spin_lock_irqsave(&lc->bad_free_lock, flags);
+	nr_groups = lc->nr_bad_free_groups;
+	total_bad_frees = lc->total_bad_frees;
+	memcpy(groups, lc->bad_free_groups, nr_groups * sizeof(*groups));
+	for (i = 0; i < nr_groups; ++i)
+		atomic_inc(&groups[i].ri->refs);
+	spin_unlock_irqrestore(&lc->bad_free_lock, flags);
+	
+	if (total_bad_frees == 0)
+		goto out;
 		
 	if (syslog_output != 0) {
 		pr_warning(KEDR_LC_MSG_PREFIX 
 "LeakCheck has detected deallocations without matching allocations.\n");
 	}
 	
-	for (i = 0; i < lc->nr_bad_free_groups; ++i) {
-		u64 similar = (u64)(lc->bad_free_groups[i].nr_items - 1);
-		ri = lc->bad_free_groups[i].ri;
-		stored += lc->bad_free_groups[i].nr_items;
+	for (i = 0; i < nr_groups; ++i) {
+		u64 similar = (u64)(groups[i].nr_items - 1);
+		stored += groups[i].nr_items;
 		
-		kedr_lc_print_dealloc_info(lc->output, ri, similar);
+		kedr_lc_print_dealloc_info(lc->output, groups[i].ri, similar);
 	}
 	
-	kedr_lc_print_dealloc_note(lc->output, stored, lc->total_bad_frees);	
+	kedr_lc_print_dealloc_note(lc->output, stored, total_bad_frees);
+
+out:
+	for (i = 0; i < nr_groups; ++i)
+		resource_info_destroy(groups[i].ri);
+	kfree(groups);
 }
 
 static void
 klc_flush_stats(struct kedr_leak_check *lc)
 {
-	kedr_lc_print_totals(lc->output, lc->total_allocs, lc->total_leaks,
-		lc->total_bad_frees);
+	u64 total_allocs = 0;
+	u64 total_leaks = 0;
+	u64 total_bad_frees;
+	unsigned long flags;
+	unsigned int i;
+	
+	for (i = 0; i < KEDR_LC_SHARDS; ++i) {
+		struct kedr_lc_shard *shard = &lc->shards[i];
+		
+		spin_lock_irqsave(&shard->lock, flags);
+		total_allocs += shard->total_allocs;
+		total_leaks += shard->total_leaks;
+		spin_unlock_irqrestore(&shard->lock, flags);
+	}
+	
+	spin_lock_irqsave(&lc->bad_free_lock, flags);
+	total_bad_frees = lc->total_bad_frees;
+	spin_unlock_irqrestore(&lc->bad_free_lock, flags);
+	
+	kedr_lc_print_totals(lc->output, total_allocs, total_leaks,
+		total_bad_frees);
 	/* If needed, the counters will be reset by lc_object_reset(). */
 	
 	if (syslog_output != 0)
@@ -759,38 +1354,15 @@ klc_flush_stats(struct kedr_leak_check *lc)
 			"======== end of LeakCheck report ========\n");
 }
 
+/* Should be called with 'lc_mutex' locked. */
 static void
-work_func_flush(struct work_struct *work)
+klc_do_flush(struct kedr_leak_check *lc)
 {
-	struct klc_work *klc_work =
-	    container_of(work, struct klc_work, work);
-	struct kedr_leak_check *lc = klc_work->lc;
-
 	kedr_lc_output_clear(lc->output);
 
 	klc_flush_allocs(lc);
 	klc_flush_deallocs(lc);
 	klc_flush_stats(lc);
-
-	kfree(klc_work);
-}
-
-/* [NB] May be called in atomic context. */
-static void
-klc_do_flush(struct kedr_leak_check *lc)
-{
-	struct klc_work *klc_work;
-
-	klc_work = kzalloc(sizeof(*klc_work), GFP_ATOMIC);
-	if (klc_work == NULL) {
-		pr_warning(KEDR_LC_MSG_PREFIX "klc_do_flush: "
-	"not enough memory to create 'struct klc_work'\n");
-		return;
-	}
-
-	klc_work->lc = lc;
-	INIT_WORK(&klc_work->work, work_func_flush);
-	queue_work(lc->wq, &klc_work->work);
 }
 
 void
@@ -803,44 +1375,10 @@ kedr_lc_flush_results(struct kedr_leak_check *lc)
 	}
 
 	klc_do_flush(lc);
-
-	/* Make sure all pending requests have been processed before
-	 * going on. */
-	flush_workqueue(lc->wq);
 	mutex_unlock(&lc_mutex);
 }
 /* ====================================================================== */
 
-static void
-work_func_clear(struct work_struct *work)
-{
-	struct klc_work *klc_work =
-	    container_of(work, struct klc_work, work);
-	struct kedr_leak_check *lc = klc_work->lc;
-
-	lc_object_reset(lc);
-	kfree(klc_work);
-}
-
-/* [NB] May be called in atomic context. */
-static void
-klc_do_clear(struct kedr_leak_check *lc)
-{
-	struct klc_work *klc_work;
-
-	klc_work = kzalloc(sizeof(*klc_work), GFP_ATOMIC);
-	if (klc_work == NULL) {
-		pr_warning(KEDR_LC_MSG_PREFIX "klc_do_clear: "
-	"not enough memory to create 'struct klc_work'\n");
-		return;
-	}
-
-	klc_work->lc = lc;
-	INIT_WORK(&klc_work->work, work_func_clear);
-	queue_work(lc->wq, &klc_work->work);
-
-}
-
 void
 kedr_lc_clear(struct kedr_leak_check *lc)
 {
@@ -850,11 +1388,7 @@ kedr_lc_clear(struct kedr_leak_check *lc)
 		return;
 	}
 
-	klc_do_clear(lc);
-
-	/* Make sure all pending requests have been processed before
-	 * going on. */
-	flush_workqueue(lc->wq);
+	lc_object_reset(lc);
 	mutex_unlock(&lc_mutex);
 }
 /* ====================================================================== */
@@ -886,10 +1420,6 @@ on_session_end(void)
 
 	klc_do_flush(lc_object);
 
-	/* Make sure all pending requests have been processed before
-	 * going on. */
-	flush_workqueue(lc_object->wq);
-
 	/* Clear stack entries tree also.
 	 * New session may involve completely different modules and
 	 * addresses. */
@@ -930,83 +1460,20 @@ static struct kedr_payload payload = {
 };
 /* ====================================================================== */
 
-/* In work_func_*() functions, we do not need to use locks to protect the
- * storage of 'kedr_lc_resource_info' structures and the counters because
- * the work queue is ordered and does all this serialization already. */
-static void 
-work_func_alloc(struct work_struct *work)
-{
-	struct klc_work *klc_work = 
-		container_of(work, struct klc_work, work);
-	struct kedr_lc_resource_info *info = klc_work->ri;
-	struct kedr_leak_check *lc = klc_work->lc;
-	
-	BUG_ON(info == NULL);
-
-	ri_add(info, &lc->allocs[0]);
-	++lc->total_allocs;
-	++lc->total_leaks;
-
-	kfree(klc_work);
-}
-
-static void
-work_func_free(struct work_struct *work)
-{
-	struct klc_work *klc_work = 
-		container_of(work, struct klc_work, work);
-	struct kedr_lc_resource_info *info = klc_work->ri;
-	struct kedr_leak_check *lc = klc_work->lc;
-	
-	BUG_ON(info == NULL);
-	
-	if (!find_and_remove_alloc(info->addr, lc)) {
-		ri_add_bad_free(info, lc);
-		++lc->total_bad_frees;
-	}
-	else {
-		resource_info_destroy(info);
-	}
-		
-	kfree(klc_work);
-}
-
-/* The top half. */
-static void 
-klc_handle_event(struct kedr_leak_check *lc, const void *addr, size_t size, 
-	const void *caller_address,
-	void (*work_func)(struct work_struct *))
+void
+kedr_lc_handle_alloc(const void *addr, size_t size, 
+	const void *caller_address)
 {
-	struct klc_work *klc_work;
 	struct kedr_lc_resource_info *ri;
 	
 	ri = resource_info_create(addr, size, caller_address);
 	if (ri == NULL) {
-		pr_warning(KEDR_LC_MSG_PREFIX "klc_handle_event: "
+		pr_warning(KEDR_LC_MSG_PREFIX "kedr_lc_handle_alloc: "
 	"not enough memory to create 'struct kedr_lc_resource_info'\n");
 		return;
 	}
 	
-	klc_work = kzalloc(sizeof(*klc_work), GFP_ATOMIC);
-	if (klc_work == NULL) {
-		pr_warning(KEDR_LC_MSG_PREFIX "klc_handle_event: "
-	"not enough memory to create 'struct klc_work'\n");
-		resource_info_destroy(ri);
-		return;
-	}
-	
-	klc_work->lc = lc;
-	klc_work->ri = ri;
-	INIT_WORK(&klc_work->work, work_func);
-	queue_work(lc->wq, &klc_work->work);
-}
-/* ====================================================================== */
-
-void
-kedr_lc_handle_alloc(const void *addr, size_t size, 
-	const void *caller_address)
-{
-	klc_handle_event(lc_object, addr, size, caller_address, work_func_alloc);
+	ri_add(ri, lc_object);
 }
 EXPORT_SYMBOL(kedr_lc_handle_alloc);
 
@@ -1014,8 +1481,20 @@ void
 kedr_lc_handle_free(const void *addr,
 	const void *caller_address)
 {
-	klc_handle_event(lc_object, addr, (size_t)(-1), caller_address,
-		work_func_free);
+	struct kedr_lc_resource_info *ri;
+	
+	if (find_and_remove_alloc(addr, lc_object))
+		return;
+	
+	/* The information about the event is needed only for bad frees. */
+	ri = resource_info_create(addr, (size_t)(-1), caller_address);
+	if (ri == NULL) {
+		pr_warning(KEDR_LC_MSG_PREFIX "kedr_lc_handle_free: "
+	"not enough memory to create 'struct kedr_lc_resource_info'\n");
+		return;
+	}
+	
+	ri_add_bad_free(ri, lc_object);
 }
 EXPORT_SYMBOL(kedr_lc_handle_free);
 /* ====================================================================== */
@@ -1036,8 +1515,6 @@ detector_notifier_call(struct notifier_block *nb,
 		/* .init section of the module going to be unloaded. */
 		if(module_init_addr(mod))
 		{
-			flush_workqueue(lc_object->wq);
-
 			spin_lock_irqsave(&stack_entry_lock, flags);
 			stack_entries_resolve_and_clear(
 				(unsigned long)module_init_addr(mod),
@@ -1047,8 +1524,6 @@ detector_notifier_call(struct notifier_block *nb,
 	break;
 	case MODULE_STATE_GOING:
 		/* all sections of the module going to be unloaded. */
-		flush_workqueue(lc_object->wq);
-
 		spin_lock_irqsave(&stack_entry_lock, flags);
 
 		if(module_init_addr(mod))
@@ -1075,7 +1550,7 @@ static struct notifier_block detector_nb = {
 	.next = NULL,
 
 	/* Let KEDR core do it job first. So, if last target module will
-	 * be unloaded, stack_entries tree become empty when we try to
+	 * be unloaded, the table of stack entries becomes empty when we try to
 	 * resolve entries for that module. */
 	.priority = -2, 
 };
@@ -1088,7 +1563,10 @@ leak_check_cleanup_module(void)
 	kedr_payload_unregister(&payload);
 	unregister_module_notifier(&detector_nb);
 	lc_object_destroy(lc_object);
+	kedr_lc_pool_fini();
 	stack_entries_clear(); // Just for the case.
+	/* Wait for the stack entries to be freed. */
+	rcu_barrier();
 	kedr_lc_output_fini();
 }
 
@@ -1118,6 +1596,10 @@ leak_check_init_module(void)
 	if (ret != 0)
 		return ret;
 	
+	ret = kedr_lc_pool_init();
+	if (ret != 0)
+		goto fail_pool;
+	
 	lc_object = lc_object_create();
 	if (!lc_object)
 		goto fail_lc_object;
@@ -1137,6 +1619,8 @@ fail_payload:
 fail_notifier:
 	lc_object_destroy(lc_object);
 fail_lc_object:
+	kedr_lc_pool_fini();
+fail_pool:
 	kedr_lc_output_fini();
 	return ret;
 }
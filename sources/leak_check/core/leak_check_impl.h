@@ -6,8 +6,10 @@
 
 #include <linux/list.h>
 #include <linux/spinlock.h>
+#include <linux/cache.h>
 #include <linux/sched.h>
-#include <linux/rbtree.h>
+#include <linux/rcupdate.h>
+#include <linux/workqueue.h>
 #include <kedr/util/stack_trace.h>
 
 struct module;
@@ -28,20 +30,32 @@ struct kedr_lc_output;
  * The files in this directory contain information about the target module:
  * totals, information concerning resource leaks, etc. */
  
-/* kedr_lc_resource_info structures are stored in a hash table with 
- * KEDR_RI_TABLE_SIZE buckets. */
-#define KEDR_RI_HASH_BITS   10
-#define KEDR_RI_TABLE_SIZE  (1 << KEDR_RI_HASH_BITS)
+/* kedr_lc_resource_info structures are stored in a hash table split into
+ * KEDR_LC_SHARDS shards by the lower bits of the hash, each shard has its
+ * own lock. So the events for the different addresses are usually handled
+ * in parallel. */
+#define KEDR_LC_SHARD_BITS  6
+#define KEDR_LC_SHARDS      (1 << KEDR_LC_SHARD_BITS)
+
+/* Each shard has its own table, which is resized as the number of the
+ * allocations in the shard changes. The table of a shard has from 
+ * 2^KEDR_LC_TABLE_MIN_BITS to 2^KEDR_LC_TABLE_MAX_BITS buckets. */
+#define KEDR_LC_TABLE_MIN_BITS  4
+#define KEDR_LC_TABLE_MAX_BITS  16
 
 /* One stack entry, possibly resolved. */
 struct stack_entry
 {
 	unsigned long addr;
 	
-	/* Node of rb-tree, ordered by 'addr'. */
-	struct rb_node node;
+	/* Node of the hash table of stack entries, keyed by 'addr'. */
+	struct hlist_node hlist;
+	
+	/* The table is searched without locks, so the entry is freed only
+	 * after the RCU grace period. */
+	struct rcu_head rcu;
 	
-	int refs;
+	atomic_t refs;
 	
 	/* NULL, if entry hasn't been resolved yet.
 	 * Allocated symbolic description of the entry, if resolved.
@@ -52,6 +66,33 @@ struct stack_entry
 	char* symbolic;
 };
 
+/* A shard of the storage of the allocation events. */
+struct kedr_lc_shard
+{
+	/* Protects the buckets and the counters of the shard. The events
+	 * may be handled in atomic context, so the lock is taken with
+	 * interrupts disabled. */
+	spinlock_t lock;
+	
+	/* Buckets of the hash table of the shard, 2^'bits' of them.
+	 * Order of elements: last in - first found. */
+	struct hlist_head *allocs;
+	unsigned int bits;
+	
+	/* While the table is being resized, the elements are moved from
+	 * the old table to the new one ('allocs') a few buckets at a time.
+	 * The buckets of the old table below 'migrated' are empty already.
+	 * 'old_allocs' is NULL if the table is not being resized. */
+	struct hlist_head *old_allocs;
+	unsigned int old_bits;
+	unsigned int migrated;
+	
+	/* Number of the allocations in the shard and the number of them
+	 * not freed yet. */
+	u64 total_allocs;
+	u64 total_leaks;
+} ____cacheline_aligned_in_smp;
+
 struct kedr_leak_check
 {
 	/* The output subsystem for this LeakCheck object */
@@ -59,8 +100,25 @@ struct kedr_leak_check
 	
 	/* The storage of kedr_lc_resource_info structures corresponding
 	 * to the memory allocation events.
-	 * Order of elements: last in - first found. */
-	struct hlist_head allocs[KEDR_RI_TABLE_SIZE];
+	 *
+	 * LeakCheck API (kedr_lc_handle_*) updates the storage directly, 
+	 * in the context of the caller. The events for the same address
+	 * are handled in the same shard, so they are serialized by its lock.
+	 * The order of such events is the order in which the replacement
+	 * functions call LeakCheck API. */
+	struct kedr_lc_shard shards[KEDR_LC_SHARDS];
+	
+	/* Resizes the tables of the shards in process context. Scheduled
+	 * when the number of the allocations per bucket ("load factor") of
+	 * some shard goes out of range. */
+	struct work_struct resize_work;
+	
+	/* Number of the resizes of the tables. Changed only by
+	 * 'resize_work'. */
+	unsigned long nr_resizes;
+	
+	/* Protects the information about bad frees below. */
+	spinlock_t bad_free_lock;
 	
 	/* The storage of the information about the memory deallocation 
 	 * events for which no allocation event has been found 
@@ -70,37 +128,38 @@ struct kedr_leak_check
 	struct kedr_lc_bad_free_group *bad_free_groups;
 	unsigned int nr_bad_free_groups;
 	
-	/* A single-threaded (ordered) workqueue where the requests to 
-	 * handle allocations and deallocations are placed. It takes care of
-	 * serialization of access to the storage of kedr_lc_resource_info 
-	 * structures. The requests are guaranteed to be serviced strictly 
-	 * one-by-one, in FIFO order. 
-	 *
-	 * LeakCheck API (kedr_lc_handle_*) constitutes the "top half" of 
-	 * processing of the allocation/deallocation events. The workqueue 
-	 * provides the bottom half. The notions of "top" and "bottom" 
-	 * halves are similar to those used in interrupt handling.
-	 *
-	 * When the target has executed its cleanup function and is about to
-	 * unload, the workqueue should be flushed and our on_target_unload()
-	 * handler would therefore wait for all pending requests to be 
-	 * processed. After that, the storage can be accessed without 
-	 * locking as the workqueue is empty and no replacement function can
-	 * execute for the target module to add new requests to the 
-	 * workqueue. */
-	struct workqueue_struct *wq;
-	
-	/* Statistics: total number of the detected resource allocations,
-	 * possible leaks and unallocated frees. */
-	u64 total_allocs;
-	u64 total_leaks;
+	/* Statistics: total number of the unallocated frees. The totals for
+	 * the allocations are kept in the shards. */
 	u64 total_bad_frees;
 };
 
+/* A call stack. Each distinct call stack is stored once and shared by all
+ * the events with this call stack, so the events with the same call stack
+ * refer to the same instance of this structure. */
+struct kedr_lc_stack
+{
+	/* Node of the hash table of call stacks. */
+	struct hlist_node hlist;
+	
+	/* The table is searched without locks, so the call stack is freed
+	 * only after the RCU grace period. */
+	struct rcu_head rcu;
+	
+	/* The call stack is referenced by the events only, it is removed
+	 * from the table when the last reference is dropped. */
+	atomic_t refs;
+	
+	/* Hash of 'entries', the key in the table. */
+	u32 hash;
+	
+	unsigned int num_entries;
+	struct stack_entry* entries[];
+};
+
 /* This structure contains data about a resource:
  * the pointer to the resource ('addr') and a portion of the call stack for
  * the appropriate call to an allocation or deallocation function 
- * ('stack_entries' array containing 'num_entries' meaningful elements).
+ * ('stack').
  * 
  * The instances of this structure may be stored in a hash table with 
  * linked lists as buckets, hence 'hlist' field here. */
@@ -108,6 +167,10 @@ struct kedr_lc_resource_info
 {
 	struct hlist_node hlist;
 	
+	/* The structure is referenced by the storage and, temporarily, by
+	 * the code which outputs the results. */
+	atomic_t refs;
+	
 	/* The address of a resource in memory and the size of that
 	 *  resource. 'size' is (size_t)(-1) if the resource was freed 
 	 * rather than allocated. */
@@ -117,9 +180,9 @@ struct kedr_lc_resource_info
 	/* Number of events with the similar call stack. */
 	unsigned int num_similar;
 	
-	/* Call stack */
-	unsigned int num_entries;
-	struct stack_entry* stack_entries[KEDR_MAX_FRAMES];
+	/* Call stack, never NULL. The events with the same call stack
+	 * share it, so the call stacks may be compared by pointers. */
+	struct kedr_lc_stack *stack;
 	
 	/* Caller process info.
 	 * Note that if an event happened in an interrupt handler, task_pid
@@ -161,6 +224,24 @@ kedr_lc_flush_results(struct kedr_leak_check *lc);
 void
 kedr_lc_clear(struct kedr_leak_check *lc);
 
+/* Statistics of the storage of the allocation events. */
+struct kedr_lc_table_stats
+{
+	/* Number of the allocations not freed yet. */
+	unsigned long nr_allocs;
+	
+	/* Total number of the buckets in the tables of all shards. */
+	unsigned long nr_buckets;
+	
+	/* Number of the resizes of the tables so far. */
+	unsigned long nr_resizes;
+};
+
+/* Fills 'stats' with the current statistics of the storage. */
+void
+kedr_lc_get_table_stats(struct kedr_leak_check *lc,
+	struct kedr_lc_table_stats *stats);
+
 /* Resolve stack entries, if them hasn't been resolved before. */
 void
 kedr_lc_resolve_stack_entries(struct stack_entry** entries,
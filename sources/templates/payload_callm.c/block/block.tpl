@@ -21,6 +21,11 @@ kedr_trace_fc_pp_function_<$function.name$>(char* dest, size_t size,
 	return snprintf(dest, size, <$trace.formatString$>);
 <$endif$>}
 <$endif$>
+static struct kedr_trace_format kedr_trace_fc_format_<$function.name$> =
+{
+	.name = "<$function.name$>",
+	.pp = <$if trace.formatString$>&kedr_trace_fc_pp_function_<$function.name$><$else$>NULL<$endif$>,
+};
 
 // Interception function itself
 #define KEDR_<$if trace.happensBefore$>PRE<$else$>POST<$endif$>_<$function.name$>
@@ -33,10 +38,15 @@ kedr_<$if trace.happensBefore$>pre<$else$>post<$endif$>_<$function.name$>(<$argu
 <$endif$><$if concat(prologue)$><$prologue: join(\n)$>
 
 <$endif$><$if concat(trace.param.name)$>	<$entryAssign : join(\n\t\t)$>
-<$endif$>	kedr_trace_function_call("<$function.name$>",
-	call_info->return_address,
-	<$if trace.formatString$>&kedr_trace_fc_pp_function_<$function.name$><$else$>NULL<$endif$>,
-	<$if concat(trace.param.name)$>&__entry, sizeof(__entry)<$else$>NULL, 0<$endif$>);
-<$if concat(epilogue)$>
+<$endif$><$if concat(trace.param.name)$>	/* Condition is evaluated at compile time. */
+	if(sizeof(__entry) <= KEDR_TRACE_FIXED_PARAMS_SIZE)
+		kedr_trace_function_call_fixed(&kedr_trace_fc_format_<$function.name$>,
+			call_info->return_address, &__entry, sizeof(__entry));
+	else
+		kedr_trace_function_call_format(&kedr_trace_fc_format_<$function.name$>,
+			call_info->return_address, &__entry, sizeof(__entry));
+<$else$>	kedr_trace_function_call_fixed(&kedr_trace_fc_format_<$function.name$>,
+	call_info->return_address, NULL, 0);
+<$endif$><$if concat(epilogue)$>
 <$epilogue: join(\n)$>
 <$endif$>}
@@ -45,6 +45,11 @@ static struct kedr_pre_pair pre_pairs[] =
 };
 
 
+static struct kedr_trace_format* trace_formats[] =
+{
+<$traceFormat_comma: join()$>	NULL
+};
+
 static struct kedr_payload payload = {
 	.mod                    = THIS_MODULE,
 
@@ -60,7 +65,7 @@ static void __exit
 <$module.name$>_cleanup_module(void)
 {
 	kedr_payload_unregister(&payload);
-	kedr_trace_pp_unregister();
+	kedr_trace_formats_unregister(trace_formats);
 	
 	functions_support_unregister();
 }
@@ -73,9 +78,17 @@ static int __init
 	result = functions_support_register();
 	if(result) return result;
 	
+	result = kedr_trace_formats_register(trace_formats);
+	if(result)
+	{
+		functions_support_unregister();
+		return result;
+	}
+	
 	result = kedr_payload_register(&payload);
 	if(result)
 	{
+		kedr_trace_formats_unregister(trace_formats);
 		functions_support_unregister();
 		return result;
 	}
@@ -0,0 +1 @@
+	&kedr_trace_fc_format_<$function.name$>,
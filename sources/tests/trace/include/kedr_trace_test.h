@@ -17,6 +17,22 @@ static inline void kedr_trace_test_call_msg(void* caller_address, const char* pa
     kedr_trace_test_call_msg_len(caller_address, param, strlen(param));
 }
 
+/*
+ * Add message about 'test_format_function' call with given string
+ * parameter into trace.
+ * 
+ * Message is written with registered format.
+ */
+void kedr_trace_test_call_format_msg_len(void* caller_address, const char* param, size_t len);
+
+/*
+ * Add message about 'test_fixed_function' call with given integer
+ * parameter into trace.
+ * 
+ * Message is written via kedr_trace_function_call_fixed().
+ */
+void kedr_trace_test_call_fixed(void* caller_address, unsigned long value);
+
 
 
 #endif /* KEDR_TRACE_TEST_INCLUDED */
\ No newline at end of file
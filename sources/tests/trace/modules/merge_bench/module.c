@@ -0,0 +1,245 @@
+/*
+ * Microbenchmark for merging of per-cpu trace buffers.
+ *
+ * Module contains its own copy of trace_buffer implementation.
+ * When loaded, it fills trace buffer with messages on 1, 2, 4, ...
+ * online CPUs and measures, how fast messages are extracted from it
+ * in the global order.
+ *
+ * CPUs write messages at the same time, so their timestamps interleave
+ * as in a real trace.
+ *
+ * Results are available in the debugfs file
+ * 'kedr_trace_merge_bench/results', one line per CPU count:
+ *
+ * cpus=<n> messages=<n> time_ns=<n> messages_per_sec=<n>
+ */
+
+#include <linux/module.h>
+#include <linux/init.h>
+
+#include <linux/kernel.h> /*printk*/
+
+MODULE_AUTHOR("Tsyvarev");
+MODULE_LICENSE("GPL");
+
+#include <linux/debugfs.h> /*debugfs_**/
+#include <linux/seq_file.h>
+#include <linux/cpumask.h>
+#include <linux/workqueue.h> /*schedule_work_on*/
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/log2.h> /*ilog2*/
+#include <linux/slab.h>
+
+#include "trace_buffer.h"
+
+/* Number of messages written on every CPU. */
+static unsigned long messages_per_cpu = 10000;
+module_param(messages_per_cpu, ulong, S_IRUGO);
+
+/* Size of the per-cpu buffer, should contain all messages for CPU. */
+static unsigned long buffer_size = 1000000;
+module_param(buffer_size, ulong, S_IRUGO);
+
+struct merge_bench_result
+{
+	int cpus;
+	unsigned long messages;
+	u64 time_ns;
+};
+
+/* One result for every CPU count measured. */
+static struct merge_bench_result* results;
+static int n_results;
+
+static struct dentry* bench_dir;
+static struct dentry* results_file;
+
+/* Filling of the buffer on one CPU. */
+struct fill_work
+{
+	struct work_struct work;
+	struct trace_buffer* tb;
+};
+
+/* Number of CPUs which fill the buffer and which have started. */
+static int fill_cpus;
+static atomic_t fill_started;
+
+static void fill_cpu(struct work_struct* work)
+{
+	struct fill_work* fw = container_of(work, struct fill_work, work);
+	unsigned long i;
+
+	/* Wait until all CPUs are ready to write. */
+	atomic_inc(&fill_started);
+	while(atomic_read(&fill_started) < fill_cpus) cpu_relax();
+
+	for(i = 0; i < messages_per_cpu; i++)
+	{
+		trace_buffer_write_message(fw->tb, &i, sizeof(i));
+	}
+}
+
+static int consume_msg(const void* msg, size_t size, int cpu,
+	u64 ts, void* user_data)
+{
+	unsigned long* messages = user_data;
+
+	(*messages)++;
+
+	return 1;
+}
+
+/* Measure merging of messages from first 'cpus' online CPUs. */
+static int merge_bench_run(int cpus, struct merge_bench_result* result)
+{
+	int err;
+	int cpu;
+	int i;
+	int cpus_filled = 0;
+	ktime_t start, end;
+	struct fill_work* works;
+	struct trace_buffer* tb = trace_buffer_alloc(buffer_size, 0,
+		trace_buffer_clock_global, 0);
+
+	if(!tb) return -ENOMEM;
+
+	works = kmalloc(sizeof(*works) * cpus, GFP_KERNEL);
+	if(!works)
+	{
+		trace_buffer_destroy(tb);
+		return -ENOMEM;
+	}
+
+	fill_cpus = cpus;
+	atomic_set(&fill_started, 0);
+
+	for_each_online_cpu(cpu)
+	{
+		struct fill_work* fw;
+
+		if(cpus_filled == cpus) break;
+		fw = &works[cpus_filled];
+		INIT_WORK(&fw->work, &fill_cpu);
+		fw->tb = tb;
+		schedule_work_on(cpu, &fw->work);
+		cpus_filled++;
+	}
+
+	for(i = 0; i < cpus_filled; i++) flush_work(&works[i].work);
+	kfree(works);
+
+	result->cpus = cpus;
+	result->messages = 0;
+
+	start = ktime_get();
+	do
+	{
+		err = trace_buffer_read(tb, &consume_msg, &result->messages);
+	} while(err > 0);
+	end = ktime_get();
+
+	result->time_ns = ktime_to_ns(ktime_sub(end, start));
+
+	trace_buffer_destroy(tb);
+
+	return (err == -EAGAIN) ? 0 : err;
+}
+
+static int results_seq_show(struct seq_file* m, void* v)
+{
+	int i;
+
+	for(i = 0; i < n_results; i++)
+	{
+		struct merge_bench_result* result = &results[i];
+		u64 rate = result->time_ns
+			? div64_u64((u64)result->messages * NSEC_PER_SEC, result->time_ns)
+			: 0;
+
+		seq_printf(m, "cpus=%d messages=%lu time_ns=%llu messages_per_sec=%llu\n",
+			result->cpus, result->messages,
+			(unsigned long long)result->time_ns,
+			(unsigned long long)rate);
+	}
+
+	return 0;
+}
+
+static int results_open(struct inode* inode, struct file* filp)
+{
+	return single_open(filp, &results_seq_show, NULL);
+}
+
+static struct file_operations results_ops =
+{
+	.owner = THIS_MODULE,
+	.open = results_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init
+merge_bench_init(void)
+{
+	int err;
+	int cpus;
+	int cpus_max = num_online_cpus();
+
+	results = kmalloc(sizeof(*results) * (ilog2(cpus_max) + 2), GFP_KERNEL);
+	if(!results) return -ENOMEM;
+
+	n_results = 0;
+	for(cpus = 1; ; cpus *= 2)
+	{
+		if(cpus > cpus_max) cpus = cpus_max;
+
+		err = merge_bench_run(cpus, &results[n_results]);
+		if(err) goto fail;
+
+		pr_info("kedr_trace merge benchmark: %d CPUs, %lu messages in %llu ns.\n",
+			cpus, results[n_results].messages,
+			(unsigned long long)results[n_results].time_ns);
+		n_results++;
+
+		if(cpus == cpus_max) break;
+	}
+
+	bench_dir = debugfs_create_dir("kedr_trace_merge_bench", NULL);
+	if(!bench_dir)
+	{
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	results_file = debugfs_create_file("results", S_IRUGO, bench_dir,
+		NULL, &results_ops);
+	if(!results_file)
+	{
+		err = -ENOMEM;
+		goto fail_results_file;
+	}
+
+	return 0;
+
+fail_results_file:
+	debugfs_remove(bench_dir);
+fail:
+	kfree(results);
+	return err;
+}
+
+static void __exit
+merge_bench_exit(void)
+{
+	debugfs_remove(results_file);
+	debugfs_remove(bench_dir);
+	kfree(results);
+}
+
+module_init(merge_bench_init);
+module_exit(merge_bench_exit);
@@ -0,0 +1,373 @@
+/*
+ * Benchmark for overhead of tracing function calls.
+ *
+ * Every run starts one writer thread on each of the first <n> online
+ * CPUs. Writers call instrumented stub in a tight loop, and the stub
+ * records its call via kedr_trace_function_call(), as payloads do.
+ *
+ * Run is started by writing number of CPUs into the debugfs file
+ * 'kedr_trace_overhead_bench/run'. Size of the trace buffer is taken as
+ * is, so it should be set via 'kedr_tracing/buffer_size' before the run.
+ *
+ * Trace should be read by some reader during the run. After writers
+ * finish, the run waits until all messages are read, this time is
+ * included into the reader throughput.
+ *
+ * Results are available in the debugfs file
+ * 'kedr_trace_overhead_bench/results', one line per run:
+ *
+ * buffer_size=<n> cpus=<n> events=<n> time_ns=<n> ns_per_event=<n>
+ * events_per_sec=<n> lost=<n> drop_permille=<n> reader_ns=<n>
+ * reader_events_per_sec=<n>
+ *
+ * Here 'ns_per_event' is the cost of one call for the writer,
+ * 'events_per_sec' is the throughput of all writers together.
+ */
+
+#include <linux/module.h>
+#include <linux/init.h>
+
+#include <linux/kernel.h> /*printk*/
+
+MODULE_AUTHOR("Tsyvarev");
+MODULE_LICENSE("GPL");
+
+#include <linux/debugfs.h> /*debugfs_**/
+#include <linux/seq_file.h>
+#include <linux/cpumask.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+#include <kedr/trace/trace.h>
+
+/* Number of calls performed on every CPU in one run. */
+static unsigned long events_per_cpu = 100000;
+module_param(events_per_cpu, ulong, S_IRUGO);
+
+/* How long to wait for the reader after writers finish. */
+static unsigned int reader_timeout_ms = 10000;
+module_param(reader_timeout_ms, uint, S_IRUGO);
+
+/* Maximum number of runs whose results are kept. */
+#define OVERHEAD_BENCH_RESULTS_MAX 64
+
+struct overhead_bench_result
+{
+	unsigned long buffer_size;
+	int cpus;
+	unsigned long events;
+	u64 time_ns;
+	/* Sum of the time spent by all writers. */
+	u64 writers_time_ns;
+	unsigned long lost;
+	/* 0 if reader doesn't finish in time. */
+	u64 reader_ns;
+};
+
+static struct overhead_bench_result results[OVERHEAD_BENCH_RESULTS_MAX];
+static int n_results;
+/* Protects results and serializes runs. */
+static DEFINE_MUTEX(bench_m);
+
+struct overhead_bench_writer
+{
+	struct task_struct* task;
+	u64 time_ns;
+	struct completion done;
+};
+
+/* Writers wait for this flag, so all of them start at the same time. */
+static int writers_start;
+static DECLARE_WAIT_QUEUE_HEAD(writers_start_wq);
+
+/*
+ * Callback for the reader.
+ *
+ * If callback is still pending when the module is unloaded, unloading
+ * waits for it.
+ */
+static struct kedr_trace_callback_head reader_callback_head;
+static DECLARE_COMPLETION(reader_done);
+static bool reader_pending;
+
+static struct dentry* bench_dir;
+static struct dentry* run_file;
+static struct dentry* results_file;
+
+static int stub_params_pp(char* dest, size_t size, const void* data)
+{
+	return snprintf(dest, size, "arg: %lu", *(const unsigned long*)data);
+}
+
+/* Instrumented stub. */
+static noinline void overhead_bench_stub(unsigned long arg)
+{
+	kedr_trace_function_call("overhead_bench_stub",
+		__builtin_return_address(0), &stub_params_pp,
+		&arg, sizeof(arg));
+}
+
+static int writer_thread(void* data)
+{
+	struct overhead_bench_writer* writer = data;
+	unsigned long i;
+	ktime_t start;
+
+	wait_event(writers_start_wq, writers_start || kthread_should_stop());
+	/* Run is cancelled. */
+	if(!writers_start) return 0;
+
+	start = ktime_get();
+	for(i = 0; i < events_per_cpu; i++)
+	{
+		overhead_bench_stub(i);
+	}
+	writer->time_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	complete(&writer->done);
+
+	/* Wait for kthread_stop(). */
+	set_current_state(TASK_INTERRUPTIBLE);
+	while(!kthread_should_stop())
+	{
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+static void reader_callback(struct kedr_trace_callback_head* callback_head)
+{
+	complete(&reader_done);
+}
+
+/* Wait until all messages written up to this moment are read. */
+static bool wait_reader(void)
+{
+	if(reader_pending)
+	{
+		/* Callback from the previous run is still pending. */
+		if(!try_wait_for_completion(&reader_done)) return 0;
+		reader_pending = 0;
+	}
+
+	init_completion(&reader_done);
+	kedr_trace_call_after_read(&reader_callback, &reader_callback_head);
+
+	if(!wait_for_completion_timeout(&reader_done,
+		msecs_to_jiffies(reader_timeout_ms)))
+	{
+		reader_pending = 1;
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Measure tracing on the first 'cpus' online CPUs. */
+static int overhead_bench_run(int cpus, struct overhead_bench_result* result)
+{
+	int err = 0;
+	int cpu;
+	int i, n_writers = 0;
+	unsigned long lost_start;
+	ktime_t start, end;
+	struct overhead_bench_writer* writers;
+
+	writers = kcalloc(cpus, sizeof(*writers), GFP_KERNEL);
+	if(!writers) return -ENOMEM;
+
+	writers_start = 0;
+
+	for_each_online_cpu(cpu)
+	{
+		struct overhead_bench_writer* writer = &writers[n_writers];
+
+		if(n_writers == cpus) break;
+
+		init_completion(&writer->done);
+		writer->task = kthread_create(&writer_thread, writer,
+			"kedr_trace_bench/%d", cpu);
+		if(IS_ERR(writer->task))
+		{
+			err = PTR_ERR(writer->task);
+			goto out;
+		}
+		kthread_bind(writer->task, cpu);
+		wake_up_process(writer->task);
+		n_writers++;
+	}
+
+	result->buffer_size = kedr_trace_buffer_size();
+	result->cpus = n_writers;
+	result->events = events_per_cpu * n_writers;
+	lost_start = kedr_trace_lost_messages();
+
+	start = ktime_get();
+	writers_start = 1;
+	wake_up_all(&writers_start_wq);
+
+	result->writers_time_ns = 0;
+	for(i = 0; i < n_writers; i++)
+	{
+		wait_for_completion(&writers[i].done);
+		result->writers_time_ns += writers[i].time_ns;
+	}
+	end = ktime_get();
+	result->time_ns = ktime_to_ns(ktime_sub(end, start));
+
+	result->reader_ns = wait_reader()
+		? ktime_to_ns(ktime_sub(ktime_get(), start)) : 0;
+
+	result->lost = kedr_trace_lost_messages() - lost_start;
+
+out:
+	for(i = 0; i < n_writers; i++)
+	{
+		kthread_stop(writers[i].task);
+	}
+	kfree(writers);
+
+	return err;
+}
+
+static ssize_t run_write(struct file* filp, const char __user* buf,
+	size_t count, loff_t* f_pos)
+{
+	int err;
+	unsigned int cpus;
+
+	err = kstrtouint_from_user(buf, count, 0, &cpus);
+	if(err) return err;
+
+	if(!cpus) return -EINVAL;
+	if(cpus > num_online_cpus()) cpus = num_online_cpus();
+
+	err = mutex_lock_killable(&bench_m);
+	if(err) return err;
+
+	if(n_results == OVERHEAD_BENCH_RESULTS_MAX)
+	{
+		err = -ENOSPC;
+		goto out;
+	}
+
+	err = overhead_bench_run(cpus, &results[n_results]);
+	if(err) goto out;
+
+	pr_info("kedr_trace overhead benchmark: %d CPUs, %lu events in %llu ns.\n",
+		results[n_results].cpus, results[n_results].events,
+		(unsigned long long)results[n_results].time_ns);
+	n_results++;
+
+out:
+	mutex_unlock(&bench_m);
+
+	return err ? err : count;
+}
+
+static struct file_operations run_ops =
+{
+	.owner = THIS_MODULE,
+	.write = run_write,
+};
+
+/* Return 'value * scale / divisor', 0 if divisor is 0. */
+static u64 rate(u64 value, u64 scale, u64 divisor)
+{
+	return divisor ? div64_u64(value * scale, divisor) : 0;
+}
+
+static int results_seq_show(struct seq_file* m, void* v)
+{
+	int i;
+	int err = mutex_lock_killable(&bench_m);
+	if(err) return err;
+
+	for(i = 0; i < n_results; i++)
+	{
+		struct overhead_bench_result* result = &results[i];
+
+		seq_printf(m, "buffer_size=%lu cpus=%d events=%lu time_ns=%llu "
+			"ns_per_event=%llu events_per_sec=%llu lost=%lu "
+			"drop_permille=%llu reader_ns=%llu reader_events_per_sec=%llu\n",
+			result->buffer_size, result->cpus, result->events,
+			(unsigned long long)result->time_ns,
+			(unsigned long long)rate(result->writers_time_ns, 1,
+				result->events),
+			(unsigned long long)rate(result->events, NSEC_PER_SEC,
+				result->time_ns),
+			result->lost,
+			(unsigned long long)rate(result->lost, 1000, result->events),
+			(unsigned long long)result->reader_ns,
+			(unsigned long long)rate(result->events - result->lost,
+				NSEC_PER_SEC, result->reader_ns));
+	}
+
+	mutex_unlock(&bench_m);
+
+	return 0;
+}
+
+static int results_open(struct inode* inode, struct file* filp)
+{
+	return single_open(filp, &results_seq_show, NULL);
+}
+
+static struct file_operations results_ops =
+{
+	.owner = THIS_MODULE,
+	.open = results_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init
+overhead_bench_init(void)
+{
+	bench_dir = debugfs_create_dir("kedr_trace_overhead_bench", NULL);
+	if(!bench_dir) return -ENOMEM;
+
+	run_file = debugfs_create_file("run", S_IWUSR, bench_dir,
+		NULL, &run_ops);
+	if(!run_file) goto fail;
+
+	results_file = debugfs_create_file("results", S_IRUGO, bench_dir,
+		NULL, &results_ops);
+	if(!results_file) goto fail_results_file;
+
+	return 0;
+
+fail_results_file:
+	debugfs_remove(run_file);
+fail:
+	debugfs_remove(bench_dir);
+	return -ENOMEM;
+}
+
+static void __exit
+overhead_bench_exit(void)
+{
+	debugfs_remove(results_file);
+	debugfs_remove(run_file);
+	debugfs_remove(bench_dir);
+
+	/* Callback head and the callback itself belong to this module. */
+	if(reader_pending)
+	{
+		pr_info("kedr_trace overhead benchmark: waiting for the trace to be read.\n");
+		wait_for_completion(&reader_done);
+	}
+}
+
+module_init(overhead_bench_init);
+module_exit(overhead_bench_exit);
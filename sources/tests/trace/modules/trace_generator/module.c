@@ -12,6 +12,8 @@ MODULE_LICENSE("GPL");
 
 #include <kedr/trace/trace.h>
 
+#include <linux/slab.h>
+
 /* 'msg_string' contains some string. */
 struct msg_string_data
 {
@@ -101,15 +103,77 @@ void kedr_trace_test_call_msg_len(void* return_address, const char* param, size_
 }
 EXPORT_SYMBOL(kedr_trace_test_call_msg_len);
 
+static struct kedr_trace_format test_format =
+{
+	.name = "test_format_function",
+	.pp = &test_function_call_pp,
+};
+
+/*
+ * Parameters are passed by copy, as in the payloads generated for
+ * call monitoring, so they may be stored in compact form.
+ */
+void kedr_trace_test_call_format_msg_len(void* return_address, const char* param, size_t len)
+{
+	struct msg_string_data* ms_data;
+	size_t size = offsetof(typeof(*ms_data), str) + len;
+	
+	ms_data = kmalloc(size, GFP_KERNEL);
+	if(!ms_data) return;
+	
+	ms_data->len = len;
+	memcpy(ms_data->str, param, len);
+	kedr_trace_function_call_format(&test_format, return_address,
+		ms_data, size);
+	
+	kfree(ms_data);
+}
+EXPORT_SYMBOL(kedr_trace_test_call_format_msg_len);
+
+/* Parameters fit into fixed-size message. */
+struct fixed_data
+{
+	unsigned long value;
+};
+
+static int test_fixed_pp(char* dest, size_t size, const void* data)
+{
+	const struct fixed_data* f_data = data;
+	
+	return snprintf(dest, size, "fixed_%lu", f_data->value);
+}
+
+static struct kedr_trace_format test_fixed_format =
+{
+	.name = "test_fixed_function",
+	.pp = &test_fixed_pp,
+};
+
+void kedr_trace_test_call_fixed(void* return_address, unsigned long value)
+{
+	struct fixed_data f_data = { .value = value };
+	
+	kedr_trace_function_call_fixed(&test_fixed_format, return_address,
+		&f_data, sizeof(f_data));
+}
+EXPORT_SYMBOL(kedr_trace_test_call_fixed);
+
+static struct kedr_trace_format* test_formats[] =
+{
+	&test_format,
+	&test_fixed_format,
+	NULL
+};
 
 static int __init
 trace_generator_init(void)
 {
-	return 0;
+	return kedr_trace_formats_register(test_formats);
 }
 static void
 trace_generator_exit(void)
 {
+	kedr_trace_formats_unregister(test_formats);
 	kedr_trace_pp_unregister();
 }
 
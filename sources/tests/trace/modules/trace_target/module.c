@@ -3,7 +3,9 @@
  * Generate trace messages via reading/writing file in debugfs.
  * 
  * Writing to the file generates message, dependent from the
- * string written.
+ * string written. If string starts with "call_", "fcall_" or "xcall_",
+ * function call message is generated, with return address inside this
+ * module.
  * 
  * Reading from the file allows to generate pair of messages under one lock,
  * so this messages should come paired in the trace.
@@ -51,7 +53,8 @@ static ssize_t tt_write(struct file *filp,
     const char __user* buf, size_t count, loff_t *f_pos)
 {
 	size_t len = count;
-	char* str = kmalloc(len, GFP_KERNEL);
+	unsigned long value;
+	char* str = kmalloc(len + 1, GFP_KERNEL);
 	if(!str) return -ENOMEM;
 	
 	if(copy_from_user(str, buf, len))
@@ -61,8 +64,23 @@ static ssize_t tt_write(struct file *filp,
 	}
 	
 	if(len && str[len - 1] == '\n')	len--;
+	str[len] = '\0';
 	
-	kedr_trace_test_msg_len(str, len);
+	/*
+	 * Strings with "call_" prefix generate function call messages,
+	 * ones with "fcall_" prefix - function call messages with
+	 * registered format, ones with "xcall_<number>" - function call
+	 * messages with fixed size.
+	 */
+	if(len > 5 && !strncmp(str, "call_", 5))
+		kedr_trace_test_call_msg_len((void*)&tt_write, str, len);
+	else if(len > 6 && !strncmp(str, "fcall_", 6))
+		kedr_trace_test_call_format_msg_len((void*)&tt_write, str, len);
+	else if(len > 6 && !strncmp(str, "xcall_", 6)
+		&& !kstrtoul(str + 6, 10, &value))
+		kedr_trace_test_call_fixed((void*)&tt_write, value);
+	else
+		kedr_trace_test_msg_len(str, len);
 	
 	kfree(str);
 	
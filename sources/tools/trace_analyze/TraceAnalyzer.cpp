@@ -0,0 +1,616 @@
+// Implementation of the trace analyzer
+
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
+#include <thread>
+#include <utility>
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "TraceAnalyzer.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////
+// Number of chunks per thread. Several chunks per thread smooth out 
+// the difference in the parsing speed of the chunks.
+static const unsigned int chunksPerThread = 4;
+
+// Chunks smaller than this are not split further.
+static const size_t chunkSizeMin = 1024 * 1024;
+
+///////////////////////////////////////////////////////////////////////
+// Functions which are recognized by the analyzer. Names correspond to
+// the callm payloads for spinlocks, mutexes and memory management.
+enum EFunctionKind
+{
+    FK_OTHER = 0,
+    // Lock is acquired unconditionally.
+    FK_LOCK,
+    // Lock is acquired if the result is 0.
+    FK_LOCK_RESULT_ZERO,
+    // Lock is acquired if the result is 1.
+    FK_LOCK_RESULT_ONE,
+    FK_UNLOCK,
+    // Result is the address of the memory allocated.
+    FK_ALLOC,
+    // Memory is freed, its address is the argument with given index.
+    FK_FREE,
+    // Memory at the first argument is replaced with the result.
+    FK_REALLOC
+};
+
+struct CFunctionInfo
+{
+    const char* name;
+    EFunctionKind kind;
+    bool isMutex;
+    // Index of the argument with address, for FK_FREE.
+    unsigned int argIndex;
+};
+
+static const CFunctionInfo functionsInfo[] = {
+    {"_raw_spin_lock", FK_LOCK, false, 0},
+    {"_raw_spin_lock_irq", FK_LOCK, false, 0},
+    {"_raw_spin_lock_irqsave", FK_LOCK, false, 0},
+    {"_spin_lock", FK_LOCK, false, 0},
+    {"_spin_lock_irq", FK_LOCK, false, 0},
+    {"_spin_lock_irqsave", FK_LOCK, false, 0},
+    {"_raw_spin_unlock", FK_UNLOCK, false, 0},
+    {"_raw_spin_unlock_irq", FK_UNLOCK, false, 0},
+    {"_raw_spin_unlock_irqrestore", FK_UNLOCK, false, 0},
+    {"_spin_unlock", FK_UNLOCK, false, 0},
+    {"_spin_unlock_irq", FK_UNLOCK, false, 0},
+    {"_spin_unlock_irqrestore", FK_UNLOCK, false, 0},
+    
+    {"mutex_lock", FK_LOCK, true, 0},
+    {"mutex_lock_interruptible", FK_LOCK_RESULT_ZERO, true, 0},
+    {"mutex_lock_killable", FK_LOCK_RESULT_ZERO, true, 0},
+    {"mutex_trylock", FK_LOCK_RESULT_ONE, true, 0},
+    {"mutex_unlock", FK_UNLOCK, true, 0},
+    
+    {"__kmalloc", FK_ALLOC, false, 0},
+    {"__kmalloc_node", FK_ALLOC, false, 0},
+    {"kmalloc_order_trace", FK_ALLOC, false, 0},
+    {"kmem_cache_alloc", FK_ALLOC, false, 0},
+    {"kmem_cache_alloc_node", FK_ALLOC, false, 0},
+    {"kmem_cache_alloc_notrace", FK_ALLOC, false, 0},
+    {"kmem_cache_alloc_node_notrace", FK_ALLOC, false, 0},
+    {"kmem_cache_alloc_trace", FK_ALLOC, false, 0},
+    {"kmem_cache_alloc_node_trace", FK_ALLOC, false, 0},
+    // __krealloc() does not free the original memory.
+    {"__krealloc", FK_ALLOC, false, 0},
+    {"alloc_pages_exact", FK_ALLOC, false, 0},
+    {"alloc_pages_exact_nid", FK_ALLOC, false, 0},
+    {"alloc_pages_current", FK_ALLOC, false, 0},
+    {"__alloc_pages_nodemask", FK_ALLOC, false, 0},
+    {"__get_free_pages", FK_ALLOC, false, 0},
+    {"get_zeroed_page", FK_ALLOC, false, 0},
+    {"krealloc", FK_REALLOC, false, 0},
+    {"kfree", FK_FREE, false, 0},
+    {"kzfree", FK_FREE, false, 0},
+    {"kmem_cache_free", FK_FREE, false, 1},
+    {"free_pages_exact", FK_FREE, false, 0},
+    {"__free_pages", FK_FREE, false, 0},
+    {"free_pages", FK_FREE, false, 0},
+};
+
+typedef unordered_map<CStrRef, const CFunctionInfo*, CStrRefHash> 
+    FunctionInfoMap;
+
+static FunctionInfoMap 
+createFunctionInfoMap()
+{
+    FunctionInfoMap map;
+    for (size_t i = 0; i < sizeof(functionsInfo) / sizeof(functionsInfo[0]); 
+        ++i) {
+        const CFunctionInfo& info = functionsInfo[i];
+        map[CStrRef(info.name, strlen(info.name))] = &info;
+    }
+    return map;
+}
+
+static const FunctionInfoMap functionInfoMap = createFunctionInfoMap();
+
+///////////////////////////////////////////////////////////////////////
+void 
+CLockStats::addHold(unsigned long long hold, const CSiteKey& site)
+{
+    acquisitions++;
+    totalHold += hold;
+    if ((acquisitions == 1) || (hold > maxHold)) {
+        maxHold = hold;
+        maxHoldSite = site;
+    }
+}
+
+void 
+CLockStats::merge(const CLockStats& other)
+{
+    if (other.acquisitions == 0) {
+        return;
+    }
+    if ((acquisitions == 0) || (other.maxHold > maxHold)) {
+        maxHold = other.maxHold;
+        maxHoldSite = other.maxHoldSite;
+    }
+    isMutex = other.isMutex;
+    acquisitions += other.acquisitions;
+    totalHold += other.totalHold;
+}
+
+///////////////////////////////////////////////////////////////////////
+CTraceAnalyzer::CTraceAnalyzer(unsigned int nThreads_)
+    : nThreads(nThreads_), trace(NULL), traceSize(0)
+{
+    if (nThreads == 0) {
+        nThreads = thread::hardware_concurrency();
+    }
+    if (nThreads == 0) {
+        nThreads = 1;
+    }
+}
+
+CTraceAnalyzer::~CTraceAnalyzer()
+{
+    unmap();
+}
+
+void 
+CTraceAnalyzer::unmap()
+{
+    if (trace != NULL) {
+        munmap((void*)trace, traceSize);
+        trace = NULL;
+        traceSize = 0;
+    }
+}
+
+void 
+CTraceAnalyzer::analyze(const string& filePath)
+{
+    unmap();
+    
+    int fd = open(filePath.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw CReadError(string("cannot open file: ") + strerror(errno));
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        int err = errno;
+        close(fd);
+        throw CReadError(string("cannot stat file: ") + strerror(err));
+    }
+    
+    if (st.st_size > 0) {
+        void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            int err = errno;
+            close(fd);
+            throw CReadError(string("cannot map file: ") + strerror(err));
+        }
+        trace = (const char*)addr;
+        traceSize = st.st_size;
+        // The file is read sequentially by every thread.
+        madvise(addr, traceSize, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    
+    // Split the trace into chunks on line boundaries.
+    vector<const char*> bounds;
+    const char* end = trace + traceSize;
+    size_t nChunks = nThreads * chunksPerThread;
+    size_t chunkSize = max(traceSize / nChunks + 1, chunkSizeMin);
+    
+    bounds.push_back(trace);
+    while ((size_t)(end - bounds.back()) > chunkSize) {
+        const char* p = (const char*)memchr(bounds.back() + chunkSize, '\n',
+            end - bounds.back() - chunkSize);
+        if (p == NULL) {
+            break;
+        }
+        bounds.push_back(p + 1);
+    }
+    bounds.push_back(end);
+    nChunks = bounds.size() - 1;
+    
+    vector<CChunkSummary> summaries(nChunks);
+    atomic<size_t> nextChunk(0);
+    
+    auto worker = [&]() {
+        size_t i;
+        while ((i = nextChunk++) < nChunks) {
+            analyzeChunk(bounds[i], bounds[i + 1], summaries[i]);
+        }
+    };
+    
+    vector<thread> threads;
+    for (unsigned int i = 1; i < min<size_t>(nThreads, nChunks); ++i) {
+        threads.push_back(thread(worker));
+    }
+    worker();
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+    
+    // Events crossing chunk boundaries are paired in the order of chunks.
+    total = CChunkSummary();
+    locksHeld.clear();
+    for (size_t i = 0; i < nChunks; ++i) {
+        mergeChunk(summaries[i]);
+    }
+}
+
+void 
+CTraceAnalyzer::analyzeChunk(const char* begin, const char* end, 
+    CChunkSummary& summary)
+{
+    CTraceLine line;
+    
+    while (begin != end) {
+        const char* lineEnd = (const char*)memchr(begin, '\n', end - begin);
+        if (lineEnd == NULL) {
+            lineEnd = end;
+        }
+        
+        summary.lines++;
+        if (!parseTraceLine(begin, lineEnd, line)) {
+            summary.malformed++;
+        }
+        else if (!line.function.empty()) {
+            analyzeCall(line, summary);
+        }
+        
+        begin = (lineEnd == end) ? end : lineEnd + 1;
+    }
+}
+
+// Returns address from the argument with given index or from the result
+// (if 'index' is -1). Returns false if there is no such value or it is 
+// NULL.
+static bool 
+getAddress(const CTraceLine& line, int index, unsigned long long& addr)
+{
+    CStrRef s = line.result;
+    if ((index >= 0) && !getArgument(line.args, index, s)) {
+        return false;
+    }
+    return parseAddress(s, addr) && (addr != 0);
+}
+
+// Accounts allocation of the memory at 'addr'.
+static void 
+accountAlloc(CChunkSummary& summary, unsigned long long addr, 
+    const CSiteKey& site)
+{
+    summary.allocations++;
+    
+    unordered_map<unsigned long long, vector<CAllocEvent> >::iterator 
+        events = summary.freesFirst.find(addr);
+    if (events != summary.freesFirst.end()) {
+        events->second.push_back(CAllocEvent(true, site));
+        return;
+    }
+    summary.allocationsLive[addr].site = site;
+}
+
+// Accounts freeing of the memory at 'addr'.
+static void 
+accountFree(CChunkSummary& summary, unsigned long long addr)
+{
+    summary.frees++;
+    
+    unordered_map<unsigned long long, vector<CAllocEvent> >::iterator 
+        events = summary.freesFirst.find(addr);
+    if (events != summary.freesFirst.end()) {
+        events->second.push_back(CAllocEvent(false));
+        return;
+    }
+    if (summary.allocationsLive.erase(addr)) {
+        summary.allocationsFreed.insert(addr);
+        return;
+    }
+    if (summary.allocationsFreed.count(addr)) {
+        // Not allocated since it has been freed in the chunk.
+        summary.unmatchedFrees++;
+        return;
+    }
+    // Memory may be allocated in one of the previous chunks.
+    summary.freesFirst[addr].push_back(CAllocEvent(false));
+}
+
+void 
+CTraceAnalyzer::analyzeCall(const CTraceLine& line, CChunkSummary& summary)
+{
+    CSiteKey site(line.function, line.callSite);
+    
+    summary.calls++;
+    summary.functionCalls[line.function]++;
+    summary.siteCalls[site]++;
+    
+    FunctionInfoMap::const_iterator it = functionInfoMap.find(line.function);
+    if (it == functionInfoMap.end()) {
+        return;
+    }
+    const CFunctionInfo& info = *it->second;
+    
+    unsigned long long addr;
+    long long result;
+    
+    switch (info.kind) {
+    case FK_LOCK_RESULT_ZERO:
+    case FK_LOCK_RESULT_ONE:
+        if (!parseInteger(line.result, result) || 
+            (result != (info.kind == FK_LOCK_RESULT_ONE ? 1 : 0))) {
+            break;
+        }
+        // Fall through
+    case FK_LOCK:
+        if (getAddress(line, 0, addr)) {
+            CLockHeld& state = summary.locksState[addr];
+            state.held = true;
+            state.isMutex = info.isMutex;
+            state.timestamp = line.timestamp;
+            state.site = site;
+        }
+        break;
+    case FK_UNLOCK:
+        if (getAddress(line, 0, addr)) {
+            unordered_map<unsigned long long, CLockHeld>::iterator state = 
+                summary.locksState.find(addr);
+            if (state == summary.locksState.end()) {
+                // Lock may be acquired in one of the previous chunks.
+                summary.locksReleasedFirst[addr] = line.timestamp;
+                CLockHeld& newState = summary.locksState[addr];
+                newState.held = false;
+                newState.isMutex = info.isMutex;
+            }
+            else if (state->second.held) {
+                CLockStats& stats = summary.locks[addr];
+                stats.isMutex = info.isMutex;
+                stats.addHold(line.timestamp - state->second.timestamp,
+                    state->second.site);
+                state->second.held = false;
+            }
+            else {
+                summary.unmatchedReleases++;
+            }
+        }
+        break;
+    case FK_ALLOC:
+        if (getAddress(line, -1, addr)) {
+            accountAlloc(summary, addr, site);
+        }
+        break;
+    case FK_FREE:
+        if (getAddress(line, info.argIndex, addr)) {
+            accountFree(summary, addr);
+        }
+        break;
+    case FK_REALLOC:
+        if (getAddress(line, -1, addr)) {
+            unsigned long long oldAddr;
+            if (getAddress(line, 0, oldAddr)) {
+                accountFree(summary, oldAddr);
+            }
+            accountAlloc(summary, addr, site);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+template<typename Map>
+static void 
+mergeCounts(Map& to, const Map& from)
+{
+    for (typename Map::const_iterator it = from.begin(); it != from.end(); 
+        ++it) {
+        to[it->first] += it->second;
+    }
+}
+
+void 
+CTraceAnalyzer::mergeChunk(const CChunkSummary& summary)
+{
+    total.lines += summary.lines;
+    total.calls += summary.calls;
+    total.malformed += summary.malformed;
+    mergeCounts(total.functionCalls, summary.functionCalls);
+    mergeCounts(total.siteCalls, summary.siteCalls);
+    
+    // Locks
+    for (unordered_map<unsigned long long, unsigned long long>::const_iterator
+        it = summary.locksReleasedFirst.begin(); 
+        it != summary.locksReleasedFirst.end(); ++it) {
+        unordered_map<unsigned long long, CLockHeld>::iterator held = 
+            locksHeld.find(it->first);
+        if (held == locksHeld.end()) {
+            total.unmatchedReleases++;
+            continue;
+        }
+        CLockStats& stats = total.locks[it->first];
+        stats.isMutex = held->second.isMutex;
+        stats.addHold(it->second - held->second.timestamp, 
+            held->second.site);
+    }
+    for (unordered_map<unsigned long long, CLockStats>::const_iterator 
+        it = summary.locks.begin(); it != summary.locks.end(); ++it) {
+        total.locks[it->first].merge(it->second);
+    }
+    for (unordered_map<unsigned long long, CLockHeld>::const_iterator 
+        it = summary.locksState.begin(); it != summary.locksState.end(); 
+        ++it) {
+        if (it->second.held) {
+            locksHeld[it->first] = it->second;
+        }
+        else {
+            locksHeld.erase(it->first);
+        }
+    }
+    total.unmatchedReleases += summary.unmatchedReleases;
+    
+    // Allocations
+    total.allocations += summary.allocations;
+    total.frees += summary.frees;
+    total.unmatchedFrees += summary.unmatchedFrees;
+    for (unordered_map<unsigned long long, vector<CAllocEvent> >::
+        const_iterator it = summary.freesFirst.begin(); 
+        it != summary.freesFirst.end(); ++it) {
+        const vector<CAllocEvent>& events = it->second;
+        for (size_t i = 0; i < events.size(); ++i) {
+            if (events[i].isAlloc) {
+                total.allocationsLive[it->first].site = events[i].site;
+            }
+            else if (!total.allocationsLive.erase(it->first)) {
+                total.unmatchedFrees++;
+            }
+        }
+    }
+    // Allocations in the chunk replace the ones made before.
+    for (unordered_set<unsigned long long>::const_iterator 
+        it = summary.allocationsFreed.begin(); 
+        it != summary.allocationsFreed.end(); ++it) {
+        total.allocationsLive.erase(*it);
+    }
+    for (unordered_map<unsigned long long, CAllocation>::const_iterator 
+        it = summary.allocationsLive.begin(); 
+        it != summary.allocationsLive.end(); ++it) {
+        total.allocationsLive[it->first] = it->second;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////
+// Sorts entries of the map by decreasing value and returns at most
+// 'nTop' of them (all if 'nTop' is 0). Entries with equal values are 
+// sorted by key, so the result does not depend on the order of 'entries'.
+template<typename Key, typename Value, typename Compare>
+static vector<pair<Key, Value> > 
+sortedTop(const vector<pair<Key, Value> >& entries, unsigned int nTop, 
+    Compare compare)
+{
+    vector<pair<Key, Value> > result(entries);
+    size_t n = (nTop == 0) ? result.size() : min<size_t>(nTop, result.size());
+    partial_sort(result.begin(), result.begin() + n, result.end(), 
+        [&compare](const pair<Key, Value>& a, const pair<Key, Value>& b) {
+            if (compare(a, b)) {
+                return true;
+            }
+            return !compare(b, a) && (a.first < b.first);
+        });
+    result.resize(n);
+    return result;
+}
+
+template<typename Key>
+static bool 
+greaterCount(const pair<Key, unsigned long long>& a, 
+    const pair<Key, unsigned long long>& b)
+{
+    return a.second > b.second;
+}
+
+static bool 
+greaterHold(const pair<unsigned long long, CLockStats>& a, 
+    const pair<unsigned long long, CLockStats>& b)
+{
+    return a.second.totalHold > b.second.totalHold;
+}
+
+static ostream& 
+operator<<(ostream& out, const CStrRef& s)
+{
+    return out.write(s.data, s.size);
+}
+
+static void 
+printSite(ostream& out, const CSiteKey& site)
+{
+    out << site.function << " (" << site.site << ")";
+}
+
+void 
+CTraceAnalyzer::printReport(ostream& out, unsigned int nTop) const
+{
+    out << "Lines: " << total.lines << ", function calls: " << total.calls
+        << ", malformed lines: " << total.malformed << "\n";
+    
+    // Calls per function
+    vector<pair<CStrRef, unsigned long long> > functions(
+        total.functionCalls.begin(), total.functionCalls.end());
+    functions = sortedTop(functions, nTop, greaterCount<CStrRef>);
+    
+    out << "\nCalls per function:\n";
+    for (size_t i = 0; i < functions.size(); ++i) {
+        out << setw(14) << functions[i].second << "  " 
+            << functions[i].first << "\n";
+    }
+    
+    // Calls per call site
+    vector<pair<CSiteKey, unsigned long long> > sites(
+        total.siteCalls.begin(), total.siteCalls.end());
+    sites = sortedTop(sites, nTop, greaterCount<CSiteKey>);
+    
+    out << "\nCalls per call site:\n";
+    for (size_t i = 0; i < sites.size(); ++i) {
+        out << setw(14) << sites[i].second << "  ";
+        printSite(out, sites[i].first);
+        out << "\n";
+    }
+    
+    // Locks
+    vector<pair<unsigned long long, CLockStats> > locks(
+        total.locks.begin(), total.locks.end());
+    locks = sortedTop(locks, nTop, greaterHold);
+    
+    out << "\nLock hold times, in microseconds:\n";
+    out << setw(18) << "lock" << "  " << setw(8) << "kind" << "  " 
+        << setw(12) << "acquisitions" << "  " << setw(12) << "total" << "  "
+        << setw(10) << "max" << "  " << setw(10) << "avg" << "  "
+        << "longest hold at\n";
+    for (size_t i = 0; i < locks.size(); ++i) {
+        const CLockStats& stats = locks[i].second;
+        out << setw(18) << hex << locks[i].first << dec << "  " 
+            << setw(8) << (stats.isMutex ? "mutex" : "spinlock") << "  "
+            << setw(12) << stats.acquisitions << "  " 
+            << setw(12) << stats.totalHold << "  "
+            << setw(10) << stats.maxHold << "  " 
+            << setw(10) << stats.totalHold / stats.acquisitions << "  ";
+        printSite(out, stats.maxHoldSite);
+        out << "\n";
+    }
+    out << "Locks held at the end of the trace: " << locksHeld.size()
+        << ", unmatched releases: " << total.unmatchedReleases << "\n";
+    
+    // Allocations
+    unordered_map<CSiteKey, unsigned long long, CSiteKeyHash> liveSites;
+    for (unordered_map<unsigned long long, CAllocation>::const_iterator 
+        it = total.allocationsLive.begin(); 
+        it != total.allocationsLive.end(); ++it) {
+        liveSites[it->second.site]++;
+    }
+    vector<pair<CSiteKey, unsigned long long> > live(
+        liveSites.begin(), liveSites.end());
+    live = sortedTop(live, nTop, greaterCount<CSiteKey>);
+    
+    out << "\nAllocations: " << total.allocations 
+        << ", frees: " << total.frees 
+        << ", unmatched frees: " << total.unmatchedFrees
+        << ", not freed: " << total.allocationsLive.size() << "\n";
+    out << "\nNot freed allocations per call site:\n";
+    for (size_t i = 0; i < live.size(); ++i) {
+        out << setw(14) << live[i].second << "  ";
+        printSite(out, live[i].first);
+        out << "\n";
+    }
+}
@@ -0,0 +1,203 @@
+#ifndef TRACEANALYZER_H_1547_INCLUDED
+#define TRACEANALYZER_H_1547_INCLUDED
+
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "TraceParser.h"
+
+///////////////////////////////////////////////////////////////////////
+// Call site of the function: (function, location).
+struct CSiteKey
+{
+    CStrRef function;
+    CStrRef site;
+    
+    CSiteKey() {}
+    CSiteKey(const CStrRef& function_, const CStrRef& site_)
+        : function(function_), site(site_) {}
+    
+    bool 
+    operator==(const CSiteKey& other) const
+    {
+        return (function == other.function) && (site == other.site);
+    }
+    
+    bool 
+    operator<(const CSiteKey& other) const
+    {
+        if (function == other.function) {
+            return site < other.site;
+        }
+        return function < other.function;
+    }
+};
+
+struct CSiteKeyHash
+{
+    size_t 
+    operator()(const CSiteKey& key) const
+    {
+        CStrRefHash hash;
+        return hash(key.function) * 31 + hash(key.site);
+    }
+};
+
+// Statistics of the lock hold times, in microseconds.
+struct CLockStats
+{
+    bool isMutex;
+    unsigned long long acquisitions;
+    unsigned long long totalHold;
+    unsigned long long maxHold;
+    // Where the lock has been acquired for the longest time.
+    CSiteKey maxHoldSite;
+    
+    CLockStats() 
+        : isMutex(false), acquisitions(0), totalHold(0), maxHold(0) {}
+    
+    void 
+    addHold(unsigned long long hold, const CSiteKey& site);
+    
+    void 
+    merge(const CLockStats& other);
+};
+
+// State of the lock.
+struct CLockHeld
+{
+    bool held;
+    bool isMutex;
+    // When the lock has been acquired.
+    unsigned long long timestamp;
+    CSiteKey site;
+};
+
+// Live allocation.
+struct CAllocation
+{
+    CSiteKey site;
+};
+
+// Allocation or freeing of the memory at some address.
+struct CAllocEvent
+{
+    bool isAlloc;
+    // Call site of the allocation.
+    CSiteKey site;
+    
+    CAllocEvent(bool isAlloc_, const CSiteKey& site_ = CSiteKey())
+        : isAlloc(isAlloc_), site(site_) {}
+};
+
+///////////////////////////////////////////////////////////////////////
+// CChunkSummary - results of the analysis of a part of the trace.
+//
+// Events which cannot be paired within the chunk (a lock released or 
+// a memory freed before the first acquisition or allocation in the chunk)
+// are kept separately and paired when the chunks are merged in order.
+// For the memory, all the following allocations and frees of the same
+// address are kept too, so the merge replays them as a sequential pass
+// over the trace would.
+struct CChunkSummary
+{
+    unsigned long long lines;
+    unsigned long long calls;
+    unsigned long long malformed;
+    
+    std::unordered_map<CStrRef, unsigned long long, CStrRefHash> 
+        functionCalls;
+    std::unordered_map<CSiteKey, unsigned long long, CSiteKeyHash> 
+        siteCalls;
+    
+    // Statistics for hold intervals, both ends of which are found.
+    std::unordered_map<unsigned long long, CLockStats> locks;
+    // State of every lock touched in the chunk, at the end of the chunk.
+    std::unordered_map<unsigned long long, CLockHeld> locksState;
+    // Timestamp of the release of the lock which is not acquired before
+    // in the chunk.
+    std::unordered_map<unsigned long long, unsigned long long> 
+        locksReleasedFirst;
+    unsigned long long unmatchedReleases;
+    
+    unsigned long long allocations;
+    unsigned long long frees;
+    // Allocations which are not freed in the chunk.
+    std::unordered_map<unsigned long long, CAllocation> allocationsLive;
+    // Addresses allocated and then freed in the chunk.
+    std::unordered_set<unsigned long long> allocationsFreed;
+    // Allocations and frees, in order, of the addresses freed before
+    // they are allocated in the chunk.
+    std::unordered_map<unsigned long long, std::vector<CAllocEvent> > 
+        freesFirst;
+    unsigned long long unmatchedFrees;
+    
+    CChunkSummary()
+        : lines(0), calls(0), malformed(0), unmatchedReleases(0), 
+          allocations(0), frees(0), unmatchedFrees(0) {}
+};
+
+///////////////////////////////////////////////////////////////////////
+// CTraceAnalyzer - analyzes the text trace and prints the summary.
+class CTraceAnalyzer
+{
+public:
+    // This class represents the exceptions thrown if the trace cannot 
+    // be read.
+    class CReadError : public std::runtime_error 
+    {
+    public:
+        CReadError(const std::string& msg = "") 
+            : std::runtime_error(msg) {};
+    };
+    
+public:
+    // 'nThreads' is the number of threads used for parsing, 0 means 
+    // number of the CPUs.
+    CTraceAnalyzer(unsigned int nThreads);
+    ~CTraceAnalyzer();
+    
+    // Maps the trace file and analyzes it.
+    // Throws CTraceAnalyzer::CReadError if the file cannot be read.
+    void 
+    analyze(const std::string& filePath);
+    
+    // Outputs the summary. At most 'nTop' entries are printed in every 
+    // table, 0 means all entries.
+    void 
+    printReport(std::ostream& out, unsigned int nTop) const;
+    
+private:
+    unsigned int nThreads;
+    
+    // Mapped trace.
+    const char* trace;
+    size_t traceSize;
+    
+    // Results of the analysis, merged from all chunks.
+    CChunkSummary total;
+    // Holds which are not finished at the end of the trace.
+    std::unordered_map<unsigned long long, CLockHeld> locksHeld;
+    
+private: // implementation-related stuff
+    void 
+    unmap();
+    
+    // Analyzes the lines in [begin, end).
+    static void 
+    analyzeChunk(const char* begin, const char* end, CChunkSummary& summary);
+    
+    // Accounts the call of the function described by 'line'.
+    static void 
+    analyzeCall(const CTraceLine& line, CChunkSummary& summary);
+    
+    // Merges the summary of the next chunk into the total one.
+    void 
+    mergeChunk(const CChunkSummary& summary);
+};
+
+#endif // TRACEANALYZER_H_1547_INCLUDED
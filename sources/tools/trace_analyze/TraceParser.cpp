@@ -0,0 +1,234 @@
+// Implementation of the parser of the trace lines
+
+#include <algorithm>
+
+#include "TraceParser.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////
+// Strings
+static const char callPrefix[] = "called_";
+static const char argsPrefix[] = "arguments: (";
+static const char resultPrefix[] = ", result: ";
+static const char nullPointer[] = "(null)";
+
+#define PREFIX_LEN(prefix) (sizeof(prefix) - 1)
+
+///////////////////////////////////////////////////////////////////////
+bool 
+CStrRef::operator<(const CStrRef& other) const
+{
+    int result = memcmp(data, other.data, min(size, other.size));
+    return (result < 0) || ((result == 0) && (size < other.size));
+}
+
+// Checks whether [begin, end) starts with 'prefix' of length 'len'.
+static bool 
+startsWith(const char* begin, const char* end, const char* prefix, 
+    size_t len)
+{
+    return ((size_t)(end - begin) >= len) && !memcmp(begin, prefix, len);
+}
+
+// Parses timestamp "<sec>.<usec>:" into microseconds.
+static bool 
+parseTimestamp(const char* begin, const char* end, 
+    unsigned long long& timestamp)
+{
+    unsigned long long sec = 0;
+    unsigned long long usec = 0;
+    const char* p = begin;
+    
+    for (; (p != end) && (*p >= '0') && (*p <= '9'); ++p) {
+        sec = sec * 10 + (*p - '0');
+    }
+    if ((p == begin) || (p == end) || (*p != '.')) {
+        return false;
+    }
+    
+    const char* usecBegin = ++p;
+    for (; (p != end) && (*p >= '0') && (*p <= '9'); ++p) {
+        usec = usec * 10 + (*p - '0');
+    }
+    if ((p - usecBegin != 6) || (p == end) || (*p != ':')) {
+        return false;
+    }
+    
+    timestamp = sec * 1000000 + usec;
+    return true;
+}
+
+// Parses the message about function call. Other messages are ignored.
+static void 
+parseCallMessage(const char* begin, const char* end, CTraceLine& line)
+{
+    if (!startsWith(begin, end, callPrefix, PREFIX_LEN(callPrefix))) {
+        return;
+    }
+    
+    const char* function = begin + PREFIX_LEN(callPrefix);
+    const char* p = find(function, end, ':');
+    if ((p == end) || !startsWith(p, end, ": (", 3)) {
+        return;
+    }
+    CStrRef functionRef(function, p - function);
+    
+    // Call site
+    const char* site = p + 3;
+    p = find(site, end, ')');
+    if (p == end) {
+        return;
+    }
+    CStrRef siteRef(site, p - site);
+    if (startsWith(site, p, "[<", 2)) {
+        // Address is followed by the module-relative location.
+        const char* location = find(site, p, ' ');
+        if (location != p) {
+            siteRef = CStrRef(location + 1, p - location - 1);
+        }
+    }
+    
+    line.function = functionRef;
+    line.callSite = siteRef;
+    
+    // Arguments and result
+    p++;
+    if ((p != end) && (*p == ' ')) {
+        p++;
+    }
+    if (!startsWith(p, end, argsPrefix, PREFIX_LEN(argsPrefix))) {
+        return;
+    }
+    const char* args = p + PREFIX_LEN(argsPrefix);
+    
+    // Arguments may contain parentheses ("(null)"), so their end is
+    // determined by the result or by the end of the line.
+    const char* argsEnd = end;
+    const char* result = search(args, end, 
+        resultPrefix, resultPrefix + PREFIX_LEN(resultPrefix));
+    if (result != end) {
+        argsEnd = result;
+        line.result = CStrRef(result + PREFIX_LEN(resultPrefix), 
+            end - result - PREFIX_LEN(resultPrefix));
+    }
+    if ((argsEnd == args) || (argsEnd[-1] != ')')) {
+        return;
+    }
+    line.args = CStrRef(args, argsEnd - 1 - args);
+}
+
+bool 
+parseTraceLine(const char* begin, const char* end, CTraceLine& line)
+{
+    line.function = CStrRef();
+    line.callSite = CStrRef();
+    line.args = CStrRef();
+    line.result = CStrRef();
+    
+    // Skip command and pid.
+    const char* p = find(begin, end, '\t');
+    if (p == end) {
+        return false;
+    }
+    
+    // Skip cpu.
+    const char* cpu = p + 1;
+    p = find(cpu, end, '\t');
+    if ((p == end) || (p == cpu) || (*cpu != '[') || (p[-1] != ']')) {
+        return false;
+    }
+    
+    const char* ts = p + 1;
+    p = find(ts, end, '\t');
+    if ((p == end) || !parseTimestamp(ts, p, line.timestamp)) {
+        return false;
+    }
+    
+    parseCallMessage(p + 1, end, line);
+    return true;
+}
+
+bool 
+getArgument(const CStrRef& args, unsigned int index, CStrRef& arg)
+{
+    const char* p = args.data;
+    const char* end = args.data + args.size;
+    
+    for (; index > 0; --index) {
+        p = search(p, end, ", ", ", " + 2);
+        if (p == end) {
+            return false;
+        }
+        p += 2;
+    }
+    
+    const char* argEnd = search(p, end, ", ", ", " + 2);
+    arg = CStrRef(p, argEnd - p);
+    return !arg.empty();
+}
+
+bool 
+parseAddress(const CStrRef& s, unsigned long long& value)
+{
+    if (s == CStrRef(nullPointer, PREFIX_LEN(nullPointer))) {
+        value = 0;
+        return true;
+    }
+    
+    const char* p = s.data;
+    const char* end = s.data + s.size;
+    if (startsWith(p, end, "0x", 2)) {
+        p += 2;
+    }
+    if (p == end) {
+        return false;
+    }
+    
+    value = 0;
+    for (; p != end; ++p) {
+        unsigned int digit;
+        if ((*p >= '0') && (*p <= '9')) {
+            digit = *p - '0';
+        }
+        else if ((*p >= 'a') && (*p <= 'f')) {
+            digit = *p - 'a' + 10;
+        }
+        else if ((*p >= 'A') && (*p <= 'F')) {
+            digit = *p - 'A' + 10;
+        }
+        else {
+            return false;
+        }
+        value = (value << 4) | digit;
+    }
+    return true;
+}
+
+bool 
+parseInteger(const CStrRef& s, long long& value)
+{
+    const char* p = s.data;
+    const char* end = s.data + s.size;
+    bool negative = false;
+    
+    if ((p != end) && (*p == '-')) {
+        negative = true;
+        ++p;
+    }
+    if (p == end) {
+        return false;
+    }
+    
+    value = 0;
+    for (; p != end; ++p) {
+        if ((*p < '0') || (*p > '9')) {
+            return false;
+        }
+        value = value * 10 + (*p - '0');
+    }
+    if (negative) {
+        value = -value;
+    }
+    return true;
+}
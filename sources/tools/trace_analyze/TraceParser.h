@@ -0,0 +1,104 @@
+#ifndef TRACEPARSER_H_1532_INCLUDED
+#define TRACEPARSER_H_1532_INCLUDED
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+///////////////////////////////////////////////////////////////////////
+// CStrRef - reference to a part of the trace text.
+// 
+// The trace is mapped into memory for the whole time of analysis, so
+// the references are used as keys instead of copies of the strings.
+struct CStrRef
+{
+    const char* data;
+    size_t size;
+    
+    CStrRef() : data(NULL), size(0) {}
+    CStrRef(const char* data_, size_t size_) : data(data_), size(size_) {}
+    
+    bool 
+    empty() const
+    {
+        return size == 0;
+    }
+    
+    bool 
+    operator==(const CStrRef& other) const
+    {
+        return (size == other.size) && !memcmp(data, other.data, size);
+    }
+    
+    bool 
+    operator<(const CStrRef& other) const;
+    
+    std::string 
+    str() const
+    {
+        return std::string(data, size);
+    }
+};
+
+// Hash function for CStrRef (FNV-1a).
+struct CStrRefHash
+{
+    size_t 
+    operator()(const CStrRef& s) const
+    {
+        unsigned long long h = 14695981039346656037ULL;
+        for (size_t i = 0; i < s.size; ++i) {
+            h = (h ^ (unsigned char)s.data[i]) * 1099511628211ULL;
+        }
+        return (size_t)h;
+    }
+};
+
+///////////////////////////////////////////////////////////////////////
+// CTraceLine - one line of the trace, split into the fields.
+// 
+// The line has the following format:
+//      <command>-<pid>\t[<cpu>]\t<sec>.<usec>:\t<message>
+// 
+// For function call messages, <message> is
+//      called_<function>: (<call site>) arguments: (<args>)[, result: <result>]
+// where <call site> is either "[<address>] <module>.<section>+<offset>"
+// or "[address]" if the target module is unknown.
+struct CTraceLine
+{
+    // Timestamp, in microseconds.
+    unsigned long long timestamp;
+    
+    // Fields of the function call message. 'function' is empty for 
+    // other messages.
+    CStrRef function;
+    // Call site without the address, if the module is known.
+    CStrRef callSite;
+    // Arguments of the call, without the parentheses.
+    CStrRef args;
+    // Result of the call, empty if the function has no result.
+    CStrRef result;
+};
+
+// Parses the line [begin, end), without the end-of-line character.
+// Returns false if the line has incorrect format.
+bool 
+parseTraceLine(const char* begin, const char* end, CTraceLine& line);
+
+// Extracts the argument with the given index (0-based) from 'args'.
+// Returns false if there is no such argument.
+bool 
+getArgument(const CStrRef& args, unsigned int index, CStrRef& arg);
+
+// Parses a pointer or an address printed in hexadecimal, with or 
+// without "0x" prefix. "(null)" is parsed as 0.
+// Returns false if the value has incorrect format.
+bool 
+parseAddress(const CStrRef& s, unsigned long long& value);
+
+// Parses a signed decimal integer.
+// Returns false if the value has incorrect format.
+bool 
+parseInteger(const CStrRef& s, long long& value);
+
+#endif // TRACEPARSER_H_1532_INCLUDED
@@ -0,0 +1,124 @@
+/*
+ * Analyzer of the text KEDR trace.
+ *
+ * Maps the trace file (a copy of the 'trace' file of the KEDR trace), 
+ * parses it in parallel and prints:
+ *  - number of calls per function and per call site,
+ *  - hold times of the spinlocks and mutexes,
+ *  - balance of memory allocations and frees.
+ *
+ * Usage: kedr_trace_analyze [-j <threads>] [-n <top>] <file>
+ */
+
+#include <iostream>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include <unistd.h>
+
+#include "TraceAnalyzer.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////
+// Common data
+const string appName = "kedr_trace_analyze";
+
+// Number of entries printed in every table by default.
+static const unsigned int nTopDefault = 20;
+
+///////////////////////////////////////////////////////////////////////
+// Output information about the usage of the tool
+static void
+usage();
+
+// Parses a non-negative number. Returns false on error.
+static bool 
+parseNumber(const char* str, unsigned int& value);
+
+///////////////////////////////////////////////////////////////////////
+int 
+main(int argc, char* argv[])
+{
+    unsigned int nThreads = 0;
+    unsigned int nTop = nTopDefault;
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "j:n:h")) != -1) {
+        switch (opt) {
+        case 'j':
+            if (!parseNumber(optarg, nThreads)) {
+                cerr << "Incorrect number of threads: " << optarg << endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n':
+            if (!parseNumber(optarg, nTop)) {
+                cerr << "Incorrect number of entries: " << optarg << endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'h':
+            usage();
+            return EXIT_SUCCESS;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    
+    if (optind != argc - 1) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    string traceFile = argv[optind];
+    
+    try {
+        CTraceAnalyzer analyzer(nThreads);
+        analyzer.analyze(traceFile);
+        analyzer.printReport(cout, nTop);
+    }
+    catch (bad_alloc& e) {
+        cerr << "Error: not enough memory" << endl;
+        return EXIT_FAILURE;
+    }
+    catch (CTraceAnalyzer::CReadError& e) {
+        cerr << "Failed to read " << traceFile << ": " << e.what() << endl;
+        return EXIT_FAILURE;
+    }
+    catch (runtime_error& e) {
+        cerr << "Error: " << e.what() << endl;
+        return EXIT_FAILURE;
+    }
+    
+    cout.flush();
+    return EXIT_SUCCESS;
+}
+
+///////////////////////////////////////////////////////////////////////
+static void 
+usage()
+{
+    cout << "Usage: " << appName << " "
+         << "[-j <threads>] [-n <top>] <trace file>" << endl
+         << endl
+         << "  -j <threads>  number of threads used for parsing "
+         << "(default: number of CPUs)" << endl
+         << "  -n <top>      number of entries printed in every table, "
+         << "0 - all (default: " << nTopDefault << ")" << endl;
+    return;
+}
+
+static bool 
+parseNumber(const char* str, unsigned int& value)
+{
+    char* end;
+    unsigned long result = strtoul(str, &end, 10);
+    if ((*str == '\0') || (*end != '\0') || (str[0] == '-')) {
+        return false;
+    }
+    value = (unsigned int)result;
+    return true;
+}
@@ -0,0 +1,109 @@
+/*
+ * Decoder of the binary KEDR trace.
+ *
+ * Reads records from the 'trace_binary' file of the KEDR trace (or from
+ * its copy) and prints them in the format of the 'trace' file.
+ *
+ * Usage: kedr_trace_decode [file]
+ *
+ * If file is not given, records are read from the standard input.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include <kedr/trace/trace_binary.h>
+
+static int decode_trace(FILE* in, FILE* out)
+{
+	struct kedr_trace_binary_record header;
+	char* data = NULL;
+	size_t data_alloc_size = 0;
+	const size_t header_size = offsetof(struct kedr_trace_binary_record, data);
+	int result = 0;
+
+	while(1)
+	{
+		size_t data_size;
+		size_t size_read = fread(&header, 1, header_size, in);
+		unsigned long sec;
+		unsigned usec;
+
+		if(size_read == 0) break; /* EOF */
+		if(size_read != header_size)
+		{
+			fprintf(stderr, "Trace ends in the middle of the record.\n");
+			result = 1;
+			break;
+		}
+		if(header.size < header_size)
+		{
+			fprintf(stderr, "Incorrect size of the record: %u.\n",
+				(unsigned)header.size);
+			result = 1;
+			break;
+		}
+
+		data_size = kedr_trace_binary_record_data_size(&header);
+		if(data_size > data_alloc_size)
+		{
+			char* data_new = realloc(data, data_size);
+			if(!data_new)
+			{
+				fprintf(stderr, "Failed to allocate buffer for record.\n");
+				result = 1;
+				break;
+			}
+			data = data_new;
+			data_alloc_size = data_size;
+		}
+
+		if(fread(data, 1, data_size, in) != data_size)
+		{
+			fprintf(stderr, "Trace ends in the middle of the record.\n");
+			result = 1;
+			break;
+		}
+
+		sec = (unsigned long)(header.ts / 1000000000);
+		usec = (unsigned)((header.ts % 1000000000) / 1000);
+
+		fprintf(out, "%.*s-%d\t[%.03u]\t%lu.%.06u:\t%.*s\n",
+			(int)sizeof(header.command), header.command,
+			(int)header.pid, (unsigned)header.cpu, sec, usec,
+			(int)data_size, data);
+	}
+
+	free(data);
+	return result;
+}
+
+int main(int argc, char** argv)
+{
+	FILE* in = stdin;
+	int result;
+
+	if(argc > 2)
+	{
+		fprintf(stderr, "Usage: %s [file]\n", argv[0]);
+		return 1;
+	}
+
+	if(argc == 2)
+	{
+		in = fopen(argv[1], "rb");
+		if(!in)
+		{
+			fprintf(stderr, "Failed to open file '%s'.\n", argv[1]);
+			return 1;
+		}
+	}
+
+	result = decode_trace(in, stdout);
+
+	if(in != stdin) fclose(in);
+
+	return result;
+}
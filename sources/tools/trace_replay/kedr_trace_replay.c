@@ -0,0 +1,590 @@
+/*
+ * Replay harness for the trace buffer.
+ *
+ * The trace buffer (trace/trace_buffer.c) is built in userspace above
+ * the model of the kernel ring buffer. Per-CPU streams of events,
+ * recorded from a trace or generated randomly, are written into the
+ * buffer at full speed and read back through the merging logic.
+ *
+ * For every message read the harness checks that:
+ *  - messages from the same CPU are read in the order they were
+ *    written, without duplicates;
+ *  - timestamps of the messages do not decrease (when it is
+ *    guaranteed, see check_ts below);
+ *  - size and CPU of the message are the ones it was written with
+ *    (up to rounding of the size by the ring buffer).
+ * At the end, it checks that every message written is either read or
+ * counted as lost.
+ *
+ * Usage: kedr_trace_replay [options] [trace-file]
+ *
+ * See usage() for the options.
+ */
+
+#include <kernel_shim.h>
+
+#include "trace_buffer.h"
+
+#include <unistd.h>
+#include <time.h>
+#include <ctype.h>
+
+/* State of the kernel shim. */
+int shim_nr_cpus = 1;
+__thread int shim_cpu = 0;
+__thread bool shim_in_nmi = 0;
+__thread bool shim_in_irq = 0;
+void (*shim_synchronize_sched_hook)(void) = NULL;
+u64 shim_time_ns = 0;
+
+/* Event to be written into the buffer. */
+struct replay_event
+{
+	int cpu;
+	u64 ts;
+	unsigned int size;
+};
+
+/* Data of the message written. */
+struct replay_msg
+{
+	u32 cpu;
+	u32 size;
+	u64 seq;
+};
+
+struct replay_options
+{
+	unsigned long buffer_size;
+	bool overwrite;
+	bool lockless;
+	bool compact_ts;
+	/* Percent of messages committed after the next one on the CPU. */
+	unsigned int in_flight;
+	/* Number of messages written between reads. */
+	unsigned long read_interval;
+	/* Percent of reads preceded by buffer resize. */
+	unsigned int resize;
+	unsigned int seed;
+	/* Generator parameters. */
+	unsigned long n_generate;
+	int n_cpus;
+	bool verbose;
+};
+
+/* Global state of the replay. */
+static struct trace_buffer* tb;
+
+/* Per-CPU state. */
+struct replay_cpu
+{
+	/* Sequence number of the last message written. */
+	u64 seq_written;
+	/* Sequence number of the last message read. */
+	u64 seq_read;
+	/* Message reserved but not committed yet, if not NULL. */
+	void* in_flight_id;
+};
+
+static struct replay_cpu* cpus;
+
+static unsigned long n_written;
+static unsigned long n_dropped;
+static unsigned long n_read;
+static unsigned long n_errors;
+static unsigned long n_ts_inversions;
+
+static u64 ts_last_read;
+/* Whether timestamps of the messages read should not decrease. */
+static bool check_ts;
+
+static double write_time;
+static double read_time;
+
+static void usage(const char* program)
+{
+	printf("Usage: %s [options] [trace-file]\n"
+		"\n"
+		"Replay per-CPU event streams through the trace buffer.\n"
+		"\n"
+		"Events are read from 'trace-file' ('-' for stdin), which is\n"
+		"either a text trace of KEDR or has lines '<cpu> <ts-ns> <size>'.\n"
+		"\n"
+		"Options:\n"
+		"  -g N       generate N random events instead of reading a file\n"
+		"  -p CPUS    number of CPUs for the generated events (default 4)\n"
+		"  -s SEED    seed for the random generator (default 1)\n"
+		"  -b SIZE    size of the buffer per CPU in bytes (default 65536)\n"
+		"  -o         overwrite the oldest messages when the buffer is full\n"
+		"  -l         use lock-free clock\n"
+		"  -c         use compact timestamps\n"
+		"  -i PERCENT commit this percent of messages after the next one\n"
+		"             on the same CPU, as if interrupted (default 0)\n"
+		"  -r N       read the buffer after every N events (default 64)\n"
+		"  -R PERCENT resize the buffer before this percent of reads\n"
+		"  -v         print every message read\n"
+		"  -h         print this help\n",
+		program);
+}
+
+static double now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/*
+ * Parse line of the KEDR text trace:
+ *   <comm>-<pid>\t[<cpu>]\t<sec>.<usec>:\t<message>
+ * or line of the simple format:
+ *   <cpu> <ts-ns> <size>
+ *
+ * Return 0 on success, 1 if line should be skipped.
+ */
+static int parse_event(const char* line, struct replay_event* event)
+{
+	const char* p = strstr(line, "\t[");
+	char* end;
+
+	if(p)
+	{
+		unsigned long sec, usec;
+
+		event->cpu = strtol(p + 2, &end, 10);
+		if(strncmp(end, "]\t", 2)) return 1;
+		sec = strtoul(end + 2, &end, 10);
+		if(*end != '.') return 1;
+		usec = strtoul(end + 1, &end, 10);
+		if(*end != ':') return 1;
+
+		event->ts = (u64)sec * 1000000000ULL + (u64)usec * 1000ULL;
+		/* Message text approximates size of its binary data. */
+		event->size = strlen(end + 1);
+		return 0;
+	}
+
+	while(isspace((unsigned char)*line)) line++;
+	if(!isdigit((unsigned char)*line)) return 1;
+
+	if(sscanf(line, "%d %llu %u", &event->cpu,
+		(unsigned long long*)&event->ts, &event->size) != 3)
+		return 1;
+
+	return 0;
+}
+
+static struct replay_event* load_events(const char* filename,
+	unsigned long* n_events, int* n_cpus)
+{
+	FILE* f;
+	char line[4096];
+	struct replay_event* events = NULL;
+	unsigned long n = 0, n_allocated = 0;
+	int cpu_max = 0;
+
+	f = strcmp(filename, "-") ? fopen(filename, "r") : stdin;
+	if(!f)
+	{
+		fprintf(stderr, "Cannot open '%s': %s\n", filename, strerror(errno));
+		return NULL;
+	}
+
+	while(fgets(line, sizeof(line), f))
+	{
+		struct replay_event event;
+
+		if(parse_event(line, &event)) continue;
+		if((event.cpu < 0) || (event.cpu >= NR_CPUS))
+		{
+			fprintf(stderr, "Incorrect CPU %d in the line: %s", event.cpu, line);
+			continue;
+		}
+
+		if(n == n_allocated)
+		{
+			struct replay_event* events_new;
+
+			n_allocated = n_allocated ? n_allocated * 2 : 1024;
+			events_new = realloc(events, n_allocated * sizeof(*events));
+			if(!events_new)
+			{
+				fprintf(stderr, "Cannot allocate array of events.\n");
+				free(events);
+				events = NULL;
+				break;
+			}
+			events = events_new;
+		}
+
+		events[n++] = event;
+		if(event.cpu > cpu_max) cpu_max = event.cpu;
+	}
+
+	if(f != stdin) fclose(f);
+
+	if(events && !n)
+	{
+		fprintf(stderr, "No events are found in '%s'.\n", filename);
+		free(events);
+		return NULL;
+	}
+
+	*n_events = n;
+	*n_cpus = cpu_max + 1;
+	return events;
+}
+
+static struct replay_event* generate_events(unsigned long n_events,
+	int n_cpus)
+{
+	unsigned long i;
+	u64 ts = 1000000000ULL;
+	struct replay_event* events = malloc(n_events * sizeof(*events));
+
+	if(!events)
+	{
+		fprintf(stderr, "Cannot allocate array of events.\n");
+		return NULL;
+	}
+
+	for(i = 0; i < n_events; i++)
+	{
+		/*
+		 * Rare long pauses exceed the range of compact timestamp
+		 * deltas.
+		 */
+		if(rand() % 1000 == 0)
+			ts += (u64)(rand() % 4 + 1) * 1000000000ULL;
+		else
+			ts += rand() % 2000;
+
+		events[i].cpu = rand() % n_cpus;
+		events[i].ts = ts;
+		events[i].size = sizeof(struct replay_msg) + rand() % 112;
+	}
+
+	return events;
+}
+
+/* Commit message which is reserved but not committed on the CPU. */
+static void commit_in_flight(int cpu)
+{
+	int cpu_old = shim_cpu;
+
+	if(!cpus[cpu].in_flight_id) return;
+
+	shim_set_cpu(cpu);
+	trace_buffer_write_unlock(tb, cpus[cpu].in_flight_id);
+	cpus[cpu].in_flight_id = NULL;
+	shim_set_cpu(cpu_old);
+}
+
+/*
+ * Grace period in the kernel waits for all writers, so it commits
+ * messages in flight.
+ */
+static void commit_in_flight_all(void)
+{
+	int cpu;
+
+	for(cpu = 0; cpu < shim_nr_cpus; cpu++)
+		commit_in_flight(cpu);
+}
+
+static void write_event(const struct replay_event* event,
+	const struct replay_options* options)
+{
+	struct replay_cpu* replay_cpu = &cpus[event->cpu];
+	unsigned int size = event->size;
+	struct replay_msg* msg;
+	void* id;
+
+	if(size < sizeof(*msg)) size = sizeof(*msg);
+
+	shim_set_cpu(event->cpu);
+	/* Clock of the buffer makes timestamps strictly increasing. */
+	shim_set_time(event->ts);
+	/* Only interrupt may be written while other message is in flight. */
+	shim_in_irq = (replay_cpu->in_flight_id != NULL);
+
+	id = trace_buffer_write_lock(tb, size, (void**)&msg);
+	n_written++;
+	if(!id)
+	{
+		shim_in_irq = 0;
+		n_dropped++;
+		return;
+	}
+
+	msg->cpu = event->cpu;
+	msg->size = size;
+	msg->seq = ++replay_cpu->seq_written;
+	memset(msg + 1, 0, size - sizeof(*msg));
+
+	/*
+	 * Message in flight is committed after the message which
+	 * interrupts it.
+	 */
+	if(replay_cpu->in_flight_id)
+	{
+		trace_buffer_write_unlock(tb, id);
+		shim_in_irq = 0;
+		commit_in_flight(event->cpu);
+	}
+	else if((unsigned int)(rand() % 100) < options->in_flight)
+	{
+		replay_cpu->in_flight_id = id;
+	}
+	else
+	{
+		trace_buffer_write_unlock(tb, id);
+	}
+}
+
+static int process_msg(const void* data, size_t size, int cpu,
+	u64 ts, void* user_data)
+{
+	const struct replay_msg* msg = data;
+	const struct replay_options* options = user_data;
+
+	n_read++;
+
+	if(options->verbose)
+	{
+		printf("[%d] %llu: seq %llu, size %zu\n", cpu,
+			(unsigned long long)ts, (unsigned long long)msg->seq, size);
+	}
+
+	/* Size of the message read is rounded up by the ring buffer. */
+	if((size < sizeof(*msg)) || (msg->size > size)
+		|| (size - msg->size >= sizeof(u64)) || (msg->cpu != (u32)cpu))
+	{
+		fprintf(stderr, "Message of size %zu read from CPU %d is corrupted.\n",
+			size, cpu);
+		n_errors++;
+		return 1;
+	}
+
+	if(msg->seq <= cpus[cpu].seq_read)
+	{
+		fprintf(stderr, "Message %llu from CPU %d is read after message %llu.\n",
+			(unsigned long long)msg->seq, cpu,
+			(unsigned long long)cpus[cpu].seq_read);
+		n_errors++;
+	}
+	else
+	{
+		cpus[cpu].seq_read = msg->seq;
+	}
+
+	if(ts < ts_last_read)
+	{
+		n_ts_inversions++;
+		if(check_ts)
+		{
+			fprintf(stderr, "Message %llu from CPU %d has timestamp %llu "
+				"less than the previous one %llu.\n",
+				(unsigned long long)msg->seq, cpu,
+				(unsigned long long)ts, (unsigned long long)ts_last_read);
+			n_errors++;
+		}
+	}
+	else
+	{
+		ts_last_read = ts;
+	}
+
+	return 1;
+}
+
+static void read_messages(const struct replay_options* options)
+{
+	double start = now();
+
+	if(options->resize && ((unsigned int)(rand() % 100) < options->resize))
+	{
+		unsigned long size = PAGE_SIZE * (2 + rand() % 16);
+		if(trace_buffer_resize(tb, size))
+		{
+			fprintf(stderr, "Failed to resize buffer to %lu bytes.\n", size);
+			n_errors++;
+		}
+	}
+
+	while(trace_buffer_read_batch(tb, process_msg, (void*)options) > 0);
+
+	read_time += now() - start;
+}
+
+static void replay(const struct replay_event* events, unsigned long n_events,
+	const struct replay_options* options)
+{
+	unsigned long i;
+
+	for(i = 0; i < n_events; i++)
+	{
+		double start = now();
+
+		write_event(&events[i], options);
+
+		write_time += now() - start;
+
+		if((i + 1) % options->read_interval == 0)
+			read_messages(options);
+	}
+
+	commit_in_flight_all();
+	read_messages(options);
+}
+
+int main(int argc, char** argv)
+{
+	struct replay_options options = {
+		.buffer_size = 65536,
+		.read_interval = 64,
+		.seed = 1,
+		.n_cpus = 4,
+	};
+	struct replay_event* events;
+	unsigned long n_events;
+	unsigned long n_lost, n_recursion;
+	int opt;
+
+	while((opt = getopt(argc, argv, "g:p:s:b:olci:r:R:vh")) != -1)
+	{
+		switch(opt)
+		{
+		case 'g':
+			options.n_generate = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			options.n_cpus = atoi(optarg);
+			break;
+		case 's':
+			options.seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			options.buffer_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			options.overwrite = 1;
+			break;
+		case 'l':
+			options.lockless = 1;
+			break;
+		case 'c':
+			options.compact_ts = 1;
+			break;
+		case 'i':
+			options.in_flight = atoi(optarg);
+			break;
+		case 'r':
+			options.read_interval = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			options.resize = atoi(optarg);
+			break;
+		case 'v':
+			options.verbose = 1;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if(!options.read_interval || (options.n_cpus <= 0)
+		|| (options.n_cpus > NR_CPUS))
+	{
+		fprintf(stderr, "Incorrect options.\n");
+		return 2;
+	}
+
+	srand(options.seed);
+
+	if(options.n_generate)
+	{
+		if(optind != argc)
+		{
+			fprintf(stderr, "Trace file cannot be used with '-g'.\n");
+			return 2;
+		}
+		events = generate_events(options.n_generate, options.n_cpus);
+		n_events = options.n_generate;
+		shim_nr_cpus = options.n_cpus;
+	}
+	else
+	{
+		if(optind + 1 != argc)
+		{
+			usage(argv[0]);
+			return 2;
+		}
+		events = load_events(argv[optind], &n_events, &shim_nr_cpus);
+	}
+	if(!events) return 1;
+
+	/*
+	 * Timestamp of the message in flight is taken on commit, unless
+	 * compact timestamps are used.
+	 */
+	check_ts = options.compact_ts || !options.in_flight;
+
+	cpus = calloc(shim_nr_cpus, sizeof(*cpus));
+	tb = trace_buffer_alloc(options.buffer_size, options.overwrite,
+		options.lockless ? trace_buffer_clock_lockless : trace_buffer_clock_global,
+		options.compact_ts);
+	if(!cpus || !tb)
+	{
+		fprintf(stderr, "Cannot create trace buffer.\n");
+		return 1;
+	}
+
+	shim_synchronize_sched_hook = commit_in_flight_all;
+
+	replay(events, n_events, &options);
+
+	n_lost = trace_buffer_lost_messages(tb);
+	if(n_read + n_lost + n_dropped != n_written)
+	{
+		fprintf(stderr, "%lu messages are written, but %lu are read, "
+			"%lu are lost and %lu are dropped.\n",
+			n_written, n_read, n_lost, n_dropped);
+		n_errors++;
+	}
+
+	/* Writers never reenter themselves in the harness. */
+	n_recursion = trace_buffer_recursion_rejected(tb,
+			trace_buffer_context_normal)
+		+ trace_buffer_recursion_rejected(tb, trace_buffer_context_irq);
+	if(n_recursion)
+	{
+		fprintf(stderr, "%lu messages are rejected as recursive.\n",
+			n_recursion);
+		n_errors++;
+	}
+
+	printf("CPUs:           %d\n", shim_nr_cpus);
+	printf("Written:        %lu\n", n_written);
+	printf("Read:           %lu\n", n_read);
+	printf("Lost:           %lu\n", n_lost);
+	printf("Dropped:        %lu\n", n_dropped);
+	printf("Recursive:      %lu\n", n_recursion);
+	printf("TS inversions:  %lu%s\n", n_ts_inversions,
+		check_ts ? "" : " (allowed)");
+	printf("Write rate:     %.0f events/s\n",
+		write_time > 0 ? n_written / write_time : 0.0);
+	printf("Read rate:      %.0f events/s\n",
+		read_time > 0 ? n_read / read_time : 0.0);
+	printf("Errors:         %lu\n", n_errors);
+
+	trace_buffer_destroy(tb);
+	free(cpus);
+	free(events);
+
+	return n_errors ? 1 : 0;
+}
@@ -0,0 +1,421 @@
+/*
+ * Userspace model of the kernel ring buffer, see shim/linux/ring_buffer.h.
+ */
+
+#include <linux/ring_buffer.h>
+
+#define RB_EVENT_COMMITTED 1
+#define RB_EVENT_DISCARDED 2
+
+/* Data of events are aligned to 4 bytes, as in the kernel. */
+#define RB_ALIGNMENT 4
+/* Events themselves are aligned to 8 bytes. */
+#define RB_EVENT_ALIGNMENT 8
+
+#define round_up_to(x, a) (((x) + (a) - 1) / (a) * (a))
+
+#define rb_event_size(length) \
+	(offsetof(struct ring_buffer_event, data) + round_up_to(length, RB_EVENT_ALIGNMENT))
+
+struct rb_cpu;
+
+/*
+ * Page of the buffer. Its memory is aligned to the page size and
+ * starts with the header, which refers to this structure.
+ */
+struct rb_page
+{
+	char* mem;
+	struct rb_cpu* cpu_buffer;
+	size_t write_pos;
+	size_t read_pos;
+	/* Number of events reserved but not committed yet. */
+	unsigned long uncommitted;
+	struct rb_page* next;
+};
+
+struct rb_page_header
+{
+	struct rb_page* page;
+	u64 pad;
+};
+
+#define RB_PAGE_DATA_START sizeof(struct rb_page_header)
+
+struct rb_cpu
+{
+	pthread_mutex_t lock;
+	/* Pages in the ring, from the oldest one. */
+	struct rb_page* head;
+	struct rb_page* tail;
+	unsigned long n_pages;
+	/* Page the reader reads from. It is not in the ring. */
+	struct rb_page* reader_page;
+	unsigned long overruns;
+};
+
+struct ring_buffer
+{
+	bool overwrite;
+	/* Maximum number of pages in the ring of every CPU. */
+	unsigned long max_pages;
+	int n_cpus;
+	struct rb_cpu* cpus;
+};
+
+static unsigned long rb_size_to_pages(unsigned long size)
+{
+	unsigned long n_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	return n_pages < 2 ? 2 : n_pages;
+}
+
+static struct rb_page* rb_page_alloc(struct rb_cpu* cpu_buffer)
+{
+	struct rb_page* page = malloc(sizeof(*page));
+	if(!page) return NULL;
+	
+	if(posix_memalign((void**)&page->mem, PAGE_SIZE, PAGE_SIZE))
+	{
+		free(page);
+		return NULL;
+	}
+	((struct rb_page_header*)page->mem)->page = page;
+	
+	page->cpu_buffer = cpu_buffer;
+	page->write_pos = RB_PAGE_DATA_START;
+	page->read_pos = RB_PAGE_DATA_START;
+	page->uncommitted = 0;
+	page->next = NULL;
+	
+	return page;
+}
+
+static void rb_page_free(struct rb_page* page)
+{
+	free(page->mem);
+	free(page);
+}
+
+static struct rb_page* rb_event_page(struct ring_buffer_event* event)
+{
+	char* mem = (char*)((unsigned long)event & PAGE_MASK);
+	return ((struct rb_page_header*)mem)->page;
+}
+
+/* Count events which are not discarded and not read in the page. */
+static unsigned long rb_page_entries(struct rb_page* page)
+{
+	unsigned long entries = 0;
+	size_t pos;
+	
+	for(pos = page->read_pos; pos < page->write_pos;)
+	{
+		struct ring_buffer_event* event =
+			(struct ring_buffer_event*)(page->mem + pos);
+		if(!(event->flags & RB_EVENT_DISCARDED)) entries++;
+		pos += rb_event_size(event->length);
+	}
+	
+	return entries;
+}
+
+/*
+ * Remove the oldest page from the ring, counting its events as overruns.
+ * 
+ * Return NULL if the page has uncommitted events.
+ */
+static struct rb_page* rb_drop_head(struct rb_cpu* cpu_buffer)
+{
+	struct rb_page* page = cpu_buffer->head;
+	
+	if(!page || page->uncommitted) return NULL;
+	
+	cpu_buffer->overruns += rb_page_entries(page);
+	
+	cpu_buffer->head = page->next;
+	if(!cpu_buffer->head) cpu_buffer->tail = NULL;
+	cpu_buffer->n_pages--;
+	
+	page->next = NULL;
+	page->write_pos = RB_PAGE_DATA_START;
+	page->read_pos = RB_PAGE_DATA_START;
+	
+	return page;
+}
+
+static void rb_append(struct rb_cpu* cpu_buffer, struct rb_page* page)
+{
+	if(cpu_buffer->tail)
+		cpu_buffer->tail->next = page;
+	else
+		cpu_buffer->head = page;
+	cpu_buffer->tail = page;
+	cpu_buffer->n_pages++;
+}
+
+static void rb_cpu_clear(struct rb_cpu* cpu_buffer)
+{
+	while(cpu_buffer->head)
+	{
+		struct rb_page* page = cpu_buffer->head;
+		cpu_buffer->head = page->next;
+		rb_page_free(page);
+	}
+	cpu_buffer->tail = NULL;
+	cpu_buffer->n_pages = 0;
+	
+	if(cpu_buffer->reader_page)
+	{
+		rb_page_free(cpu_buffer->reader_page);
+		cpu_buffer->reader_page = NULL;
+	}
+	cpu_buffer->overruns = 0;
+}
+
+struct ring_buffer* ring_buffer_alloc(unsigned long size, unsigned flags)
+{
+	int cpu;
+	struct ring_buffer* buffer = malloc(sizeof(*buffer));
+	if(!buffer) return NULL;
+	
+	buffer->overwrite = (flags & RB_FL_OVERWRITE) != 0;
+	buffer->max_pages = rb_size_to_pages(size);
+	buffer->n_cpus = shim_nr_cpus;
+	buffer->cpus = calloc(buffer->n_cpus, sizeof(*buffer->cpus));
+	if(!buffer->cpus)
+	{
+		free(buffer);
+		return NULL;
+	}
+	
+	for(cpu = 0; cpu < buffer->n_cpus; cpu++)
+		pthread_mutex_init(&buffer->cpus[cpu].lock, NULL);
+	
+	return buffer;
+}
+
+void ring_buffer_free(struct ring_buffer* buffer)
+{
+	int cpu;
+	
+	for(cpu = 0; cpu < buffer->n_cpus; cpu++)
+	{
+		rb_cpu_clear(&buffer->cpus[cpu]);
+		pthread_mutex_destroy(&buffer->cpus[cpu].lock);
+	}
+	
+	free(buffer->cpus);
+	free(buffer);
+}
+
+struct ring_buffer_event* ring_buffer_lock_reserve(struct ring_buffer* buffer,
+	unsigned long length)
+{
+	struct rb_cpu* cpu_buffer = &buffer->cpus[shim_cpu];
+	struct ring_buffer_event* event = NULL;
+	size_t size = rb_event_size(length);
+	struct rb_page* page;
+	
+	if(size > PAGE_SIZE - RB_PAGE_DATA_START) return NULL;
+	
+	pthread_mutex_lock(&cpu_buffer->lock);
+	
+	page = cpu_buffer->tail;
+	if(!page || (page->write_pos + size > PAGE_SIZE))
+	{
+		if(cpu_buffer->n_pages < buffer->max_pages)
+			page = rb_page_alloc(cpu_buffer);
+		else if(buffer->overwrite)
+			page = rb_drop_head(cpu_buffer);
+		else
+			page = NULL;
+		
+		if(!page) goto out;
+		rb_append(cpu_buffer, page);
+	}
+	
+	event = (struct ring_buffer_event*)(page->mem + page->write_pos);
+	event->length = round_up_to(length, RB_ALIGNMENT);
+	event->flags = 0;
+	page->write_pos += size;
+	page->uncommitted++;
+	
+out:
+	pthread_mutex_unlock(&cpu_buffer->lock);
+	return event;
+}
+
+static void rb_commit(struct ring_buffer_event* event, u32 flags)
+{
+	struct rb_page* page = rb_event_page(event);
+	struct rb_cpu* cpu_buffer = page->cpu_buffer;
+	
+	pthread_mutex_lock(&cpu_buffer->lock);
+	event->flags |= flags;
+	page->uncommitted--;
+	pthread_mutex_unlock(&cpu_buffer->lock);
+}
+
+int ring_buffer_unlock_commit(struct ring_buffer* buffer,
+	struct ring_buffer_event* event)
+{
+	(void)buffer;
+	rb_commit(event, RB_EVENT_COMMITTED);
+	return 0;
+}
+
+void ring_buffer_discard_commit(struct ring_buffer* buffer,
+	struct ring_buffer_event* event)
+{
+	(void)buffer;
+	rb_commit(event, RB_EVENT_COMMITTED | RB_EVENT_DISCARDED);
+}
+
+/* Find the next event for the reader. Should be called under lock. */
+static struct ring_buffer_event* rb_peek(struct rb_cpu* cpu_buffer)
+{
+	while(1)
+	{
+		struct rb_page* page = cpu_buffer->reader_page;
+		
+		if(page)
+		{
+			while(page->read_pos < page->write_pos)
+			{
+				struct ring_buffer_event* event =
+					(struct ring_buffer_event*)(page->mem + page->read_pos);
+				
+				if(!(event->flags & RB_EVENT_COMMITTED)) return NULL;
+				if(!(event->flags & RB_EVENT_DISCARDED)) return event;
+				
+				page->read_pos += rb_event_size(event->length);
+			}
+			
+			/* Page is read, all its events are committed. */
+			rb_page_free(page);
+			cpu_buffer->reader_page = NULL;
+		}
+		
+		/* Swap the oldest page out of the ring. */
+		page = cpu_buffer->head;
+		if(!page) return NULL;
+		
+		cpu_buffer->head = page->next;
+		if(!cpu_buffer->head) cpu_buffer->tail = NULL;
+		cpu_buffer->n_pages--;
+		page->next = NULL;
+		
+		cpu_buffer->reader_page = page;
+	}
+}
+
+struct ring_buffer_event* ring_buffer_peek(struct ring_buffer* buffer,
+	int cpu, u64* ts)
+{
+	struct rb_cpu* cpu_buffer = &buffer->cpus[cpu];
+	struct ring_buffer_event* event;
+	
+	pthread_mutex_lock(&cpu_buffer->lock);
+	event = rb_peek(cpu_buffer);
+	pthread_mutex_unlock(&cpu_buffer->lock);
+	
+	if(ts) *ts = 0;
+	return event;
+}
+
+struct ring_buffer_event* ring_buffer_consume(struct ring_buffer* buffer,
+	int cpu, u64* ts)
+{
+	struct rb_cpu* cpu_buffer = &buffer->cpus[cpu];
+	struct ring_buffer_event* event;
+	
+	pthread_mutex_lock(&cpu_buffer->lock);
+	event = rb_peek(cpu_buffer);
+	if(event)
+		cpu_buffer->reader_page->read_pos += rb_event_size(event->length);
+	pthread_mutex_unlock(&cpu_buffer->lock);
+	
+	if(ts) *ts = 0;
+	return event;
+}
+
+void* ring_buffer_event_data(struct ring_buffer_event* event)
+{
+	return event->data;
+}
+
+unsigned ring_buffer_event_length(struct ring_buffer_event* event)
+{
+	return event->length;
+}
+
+int ring_buffer_empty(struct ring_buffer* buffer)
+{
+	int cpu;
+	
+	for(cpu = 0; cpu < buffer->n_cpus; cpu++)
+	{
+		if(ring_buffer_peek(buffer, cpu, NULL)) return 0;
+	}
+	
+	return 1;
+}
+
+unsigned long ring_buffer_overruns(struct ring_buffer* buffer)
+{
+	int cpu;
+	unsigned long overruns = 0;
+	
+	for(cpu = 0; cpu < buffer->n_cpus; cpu++)
+	{
+		struct rb_cpu* cpu_buffer = &buffer->cpus[cpu];
+		
+		pthread_mutex_lock(&cpu_buffer->lock);
+		overruns += cpu_buffer->overruns;
+		pthread_mutex_unlock(&cpu_buffer->lock);
+	}
+	
+	return overruns;
+}
+
+void ring_buffer_reset(struct ring_buffer* buffer)
+{
+	int cpu;
+	
+	for(cpu = 0; cpu < buffer->n_cpus; cpu++)
+	{
+		struct rb_cpu* cpu_buffer = &buffer->cpus[cpu];
+		
+		pthread_mutex_lock(&cpu_buffer->lock);
+		rb_cpu_clear(cpu_buffer);
+		pthread_mutex_unlock(&cpu_buffer->lock);
+	}
+}
+
+unsigned long ring_buffer_size(struct ring_buffer* buffer)
+{
+	return buffer->max_pages * PAGE_SIZE;
+}
+
+int ring_buffer_resize(struct ring_buffer* buffer, unsigned long size)
+{
+	int cpu;
+	
+	buffer->max_pages = rb_size_to_pages(size);
+	
+	for(cpu = 0; cpu < buffer->n_cpus; cpu++)
+	{
+		struct rb_cpu* cpu_buffer = &buffer->cpus[cpu];
+		
+		pthread_mutex_lock(&cpu_buffer->lock);
+		while(cpu_buffer->n_pages > buffer->max_pages)
+		{
+			struct rb_page* page = rb_drop_head(cpu_buffer);
+			if(!page) break;
+			rb_page_free(page);
+		}
+		pthread_mutex_unlock(&cpu_buffer->lock);
+	}
+	
+	return 0;
+}
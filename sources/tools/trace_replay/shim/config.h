@@ -0,0 +1 @@
+/* Userspace shim: no kernel configuration is needed for the trace buffer. */
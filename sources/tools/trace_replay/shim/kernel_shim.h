@@ -0,0 +1,237 @@
+#ifndef KERNEL_SHIM_H
+#define KERNEL_SHIM_H
+
+/*
+ * Userspace replacement for the kernel API used by trace_buffer.c.
+ *
+ * Only what the trace buffer needs is provided. CPUs are simulated:
+ * the current CPU is set by the replay harness via shim_set_cpu().
+ * Time is simulated too: ktime_get() returns the time set via
+ * shim_set_time().
+ *
+ * Locks are real (pthread) ones, so the code behaves correctly if the
+ * harness uses several threads, but nothing else simulates concurrency.
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* Types */
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t s64;
+
+/* Generic macros */
+#define __percpu
+#define __rcu
+#define __user
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#ifndef container_of
+#define container_of(ptr, type, member) \
+	((type*)((char*)(ptr) - offsetof(type, member)))
+#endif
+
+#define BUG_ON(cond) do { \
+	if(cond) { \
+		fprintf(stderr, "BUG at %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		abort(); \
+	} \
+} while(0)
+
+#define pr_err(...) fprintf(stderr, __VA_ARGS__)
+
+#define ERESTARTSYS 512
+
+/* Memory */
+#define GFP_KERNEL 0
+#define GFP_ATOMIC 0
+#define kmalloc(size, flags) malloc(size)
+#define kzalloc(size, flags) calloc(1, size)
+#define kfree(p) free(p)
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
+#define PAGE_MASK (~(PAGE_SIZE - 1))
+
+/* Simulated CPUs */
+#define NR_CPUS 64
+
+extern int shim_nr_cpus;
+extern __thread int shim_cpu;
+
+static inline void shim_set_cpu(int cpu)
+{
+	shim_cpu = cpu;
+}
+
+#define num_possible_cpus() (shim_nr_cpus)
+#define for_each_possible_cpu(cpu) \
+	for((cpu) = 0; (cpu) < shim_nr_cpus; (cpu)++)
+#define smp_processor_id() (shim_cpu)
+
+/* Per-cpu variables are arrays indexed by simulated CPU. */
+#define alloc_percpu(type) ((type*)calloc(shim_nr_cpus, sizeof(type)))
+#define free_percpu(p) free(p)
+#define per_cpu_ptr(p, cpu) (&(p)[cpu])
+#define this_cpu_ptr(p) (&(p)[shim_cpu])
+
+/* Execution contexts */
+extern __thread bool shim_in_nmi;
+extern __thread bool shim_in_irq;
+
+#define in_nmi() (shim_in_nmi)
+#define hardirq_count() (shim_in_irq)
+#define in_serving_softirq() (0)
+#define preempt_disable() do {} while(0)
+#define preempt_enable() do {} while(0)
+#define local_irq_save(flags) ((void)(flags = 0))
+#define local_irq_restore(flags) ((void)(flags))
+#define barrier() __asm__ __volatile__("" ::: "memory")
+#define smp_mb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/*
+ * Called by synchronize_sched(). The harness uses it to commit events
+ * which are reserved but not committed yet, as the grace period would
+ * wait for such writers in the kernel.
+ */
+extern void (*shim_synchronize_sched_hook)(void);
+
+static inline void synchronize_sched(void)
+{
+	if(shim_synchronize_sched_hook) shim_synchronize_sched_hook();
+}
+
+/* Simulated time */
+typedef s64 ktime_t;
+
+extern u64 shim_time_ns;
+
+static inline void shim_set_time(u64 ns)
+{
+	shim_time_ns = ns;
+}
+
+static inline ktime_t ktime_get(void)
+{
+	return (ktime_t)shim_time_ns;
+}
+
+#define ktime_to_ns(kt) ((s64)(kt))
+
+/* Atomics */
+typedef struct { int counter; } atomic_t;
+typedef struct { s64 counter; } atomic64_t;
+
+#define ATOMIC_INIT(i) { (i) }
+#define ATOMIC64_INIT(i) { (i) }
+
+#define atomic_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_SEQ_CST)
+#define atomic_set(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+#define atomic_inc(v) ((void)__atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST))
+#define atomic_dec(v) ((void)__atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST))
+
+#define atomic64_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_SEQ_CST)
+#define atomic64_set(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+
+static inline s64 atomic64_cmpxchg(atomic64_t* v, s64 old, s64 new_value)
+{
+	__atomic_compare_exchange_n(&v->counter, &old, new_value, 0,
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return old;
+}
+
+/* Locks */
+struct mutex
+{
+	pthread_mutex_t m;
+};
+
+#define mutex_init(lock) pthread_mutex_init(&(lock)->m, NULL)
+#define mutex_destroy(lock) pthread_mutex_destroy(&(lock)->m)
+#define mutex_lock(lock) pthread_mutex_lock(&(lock)->m)
+#define mutex_lock_killable(lock) pthread_mutex_lock(&(lock)->m)
+#define mutex_lock_interruptible(lock) pthread_mutex_lock(&(lock)->m)
+#define mutex_unlock(lock) pthread_mutex_unlock(&(lock)->m)
+
+typedef struct
+{
+	pthread_mutex_t m;
+} spinlock_t;
+
+#define DEFINE_SPINLOCK(name) spinlock_t name = { PTHREAD_MUTEX_INITIALIZER }
+#define spin_lock_init(lock) pthread_mutex_init(&(lock)->m, NULL)
+#define spin_lock(lock) pthread_mutex_lock(&(lock)->m)
+#define spin_unlock(lock) pthread_mutex_unlock(&(lock)->m)
+#define spin_lock_irqsave(lock, flags) \
+	((void)(flags = 0), pthread_mutex_lock(&(lock)->m))
+#define spin_unlock_irqrestore(lock, flags) \
+	((void)(flags), pthread_mutex_unlock(&(lock)->m))
+#define spin_trylock_irqsave(lock, flags) \
+	((void)(flags = 0), !pthread_mutex_trylock(&(lock)->m))
+
+/* Wait queues: readers never sleep in the harness. */
+typedef struct { int dummy; } wait_queue_head_t;
+
+#define init_waitqueue_head(q) ((void)(q))
+#define waitqueue_active(q) ((void)(q), 0)
+#define wake_up_all(q) ((void)(q))
+
+/* Lock-free lists */
+struct llist_node
+{
+	struct llist_node* next;
+};
+
+struct llist_head
+{
+	struct llist_node* first;
+};
+
+#define llist_entry(ptr, type, member) container_of(ptr, type, member)
+
+static inline void init_llist_head(struct llist_head* list)
+{
+	list->first = NULL;
+}
+
+static inline bool llist_add(struct llist_node* node, struct llist_head* head)
+{
+	struct llist_node* first = __atomic_load_n(&head->first, __ATOMIC_SEQ_CST);
+	
+	do
+	{
+		node->next = first;
+	} while(!__atomic_compare_exchange_n(&head->first, &first, node, 0,
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	
+	return first == NULL;
+}
+
+static inline struct llist_node* llist_del_all(struct llist_head* head)
+{
+	return __atomic_exchange_n(&head->first, NULL, __ATOMIC_SEQ_CST);
+}
+
+/* Unaligned access */
+#define get_unaligned(ptr) ({ \
+	__typeof__(*(ptr)) __v; \
+	memcpy(&__v, (ptr), sizeof(__v)); \
+	__v; \
+})
+
+#define put_unaligned(val, ptr) do { \
+	__typeof__(*(ptr)) __v = (val); \
+	memcpy((ptr), &__v, sizeof(__v)); \
+} while(0)
+
+#endif /* KERNEL_SHIM_H */
@@ -0,0 +1,58 @@
+#ifndef RING_BUFFER_SHIM_H
+#define RING_BUFFER_SHIM_H
+
+/*
+ * Userspace model of the kernel ring buffer.
+ *
+ * Properties the trace buffer relies on are kept:
+ *  - every CPU has its own list of pages, events are never split
+ *    between pages;
+ *  - reader cannot see an event before all previous events on the same
+ *    CPU are committed;
+ *  - event peeked by the reader is kept in the reader page, which is
+ *    never overwritten;
+ *  - in overwrite mode, writer drops the oldest page as a whole and
+ *    counts its events as overruns;
+ *  - after the reader takes the page the writer writes to, the writer
+ *    continues in a new page.
+ */
+
+#include <kernel_shim.h>
+
+#define RB_FL_OVERWRITE (1 << 0)
+
+struct ring_buffer;
+
+struct ring_buffer_event
+{
+	u32 length;
+	u32 flags;
+	/* Data is aligned as in the kernel, for 64-bit timestamps. */
+	u64 data[0];
+};
+
+struct ring_buffer* ring_buffer_alloc(unsigned long size, unsigned flags);
+void ring_buffer_free(struct ring_buffer* buffer);
+
+struct ring_buffer_event* ring_buffer_lock_reserve(struct ring_buffer* buffer,
+	unsigned long length);
+int ring_buffer_unlock_commit(struct ring_buffer* buffer,
+	struct ring_buffer_event* event);
+void ring_buffer_discard_commit(struct ring_buffer* buffer,
+	struct ring_buffer_event* event);
+
+struct ring_buffer_event* ring_buffer_peek(struct ring_buffer* buffer,
+	int cpu, u64* ts);
+struct ring_buffer_event* ring_buffer_consume(struct ring_buffer* buffer,
+	int cpu, u64* ts);
+
+void* ring_buffer_event_data(struct ring_buffer_event* event);
+unsigned ring_buffer_event_length(struct ring_buffer_event* event);
+
+int ring_buffer_empty(struct ring_buffer* buffer);
+unsigned long ring_buffer_overruns(struct ring_buffer* buffer);
+void ring_buffer_reset(struct ring_buffer* buffer);
+unsigned long ring_buffer_size(struct ring_buffer* buffer);
+int ring_buffer_resize(struct ring_buffer* buffer, unsigned long size);
+
+#endif /* RING_BUFFER_SHIM_H */
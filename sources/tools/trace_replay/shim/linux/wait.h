@@ -0,0 +1,2 @@
+/* Userspace shim, see kernel_shim.h. */
+#include <kernel_shim.h>
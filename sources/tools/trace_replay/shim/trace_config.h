@@ -0,0 +1,34 @@
+#ifndef TRACE_CONFIG_H_INCLUDED
+#define TRACE_CONFIG_H_INCLUDED
+
+/*
+ * Userspace variant of the trace_config.h: the model of the ring buffer
+ * has the signatures of the functions fixed.
+ */
+
+#include <linux/ring_buffer.h>
+
+static inline struct ring_buffer_event*
+ring_buffer_consume_compat(struct ring_buffer* rb, int cpu, u64* ts)
+{
+	return ring_buffer_consume(rb, cpu, ts);
+}
+static inline struct ring_buffer_event*
+ring_buffer_peek_compat(struct ring_buffer* rb, int cpu, u64* ts)
+{
+	return ring_buffer_peek(rb, cpu, ts);
+}
+
+static inline unsigned long
+ring_buffer_size_compat(struct ring_buffer* rb)
+{
+	return ring_buffer_size(rb);
+}
+
+static inline int
+ring_buffer_resize_compat(struct ring_buffer* rb, unsigned long size)
+{
+	return ring_buffer_resize(rb, size);
+}
+
+#endif /* TRACE_CONFIG_H_INCLUDED */
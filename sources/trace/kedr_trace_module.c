@@ -1,11 +1,21 @@
 #include <kedr/core/kedr.h>
+#include <kedr/trace/trace_binary.h>
 #include "trace_buffer.h"
+#include "trace_format.h"
+#include "trace_tee.h"
+#include "trace_filter.h"
+#include "trace_sampling.h"
+#include "trace_stats.h"
+#include "trace_sink.h"
+#include "trace_compact.h"
+#include "trace_channel.h"
 #include "wait_nestable.h"
 
 #include <linux/module.h>
 #include <linux/init.h>
 
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
 
 #include <linux/debugfs.h>
 
@@ -21,9 +31,26 @@
 
 #include <linux/version.h> /* KERNEL_VERSION macro */
 
+#include <linux/sort.h> /* sort() for index of targets */
+
+#include <linux/percpu.h>
+
+#include <linux/workqueue.h> /* delayed work for auto-grow of the buffer */
+
 #include "config.h"
 
 #define BUFFER_SIZE_DEFAULT 100000
+#define SHARED_WINDOW_SIZE_DEFAULT (1024 * 1024)
+#define SINK_SPILL_SIZE_DEFAULT (8 * 1024 * 1024)
+#define SINK_INTERVAL_MS_DEFAULT 100
+
+/* Capacity of the dictionaries for compact encoding of the messages. */
+#define CALL_SITES_DICT_SIZE 4096
+#define TASKS_DICT_SIZE 1024
+/* New generation of the dictionaries is started when one is 3/4 full. */
+#define DICT_ROTATE_THRESHOLD(size) ((size) / 4 * 3)
+/* Function call with larger parameters is never encoded compactly. */
+#define COMPACT_PARAMS_SIZE_MAX 256
 
 // Global trace_buffer object.
 static struct trace_buffer* tb_global;
@@ -46,7 +73,7 @@ static struct trace_buffer* tb_global;
  */
 struct trace_session
 {
-    int refs;
+    atomic_t refs;
     /* Element of 'trace_session_list', see below. */
     struct list_head list;
     /* Whether session is marked as ended.*/
@@ -69,6 +96,14 @@ struct trace_session
  * for new messages written.
  */
 static LIST_HEAD(trace_session_list);
+/*
+ * Protect 'trace_session_list'.
+ * 
+ * Ended session is removed from the list by 'after read' callback,
+ * which may be executed in any context and without 'trace_m' (e.g. by
+ * the readers of the shared file and of the sink).
+ */
+static DEFINE_SPINLOCK(trace_session_list_lock);
 
 /* Trace message as a plain text. */
 struct trace_message_extracted
@@ -118,7 +153,7 @@ static DECLARE_WAIT_QUEUE_HEAD(wq_session);
  * 
  * 'tme_last';
  * 'tme_last_current_pos';
- * 'trace_session_list';
+ * ending of the sessions;
  * methods on 'tb_global'.
  */
 static DEFINE_MUTEX(trace_m);
@@ -126,13 +161,13 @@ static DEFINE_MUTEX(trace_m);
 /**************** Implementation of the trace session *****************/
 static struct trace_session* trace_session_ref(struct trace_session* session)
 {
-    session->refs++;
+    atomic_inc(&session->refs);
     return session;
 }
 
 static void trace_session_unref(struct trace_session* session)
 {
-    if(--session->refs == 0)
+    if(atomic_dec_and_test(&session->refs))
     {
         kfree(session);
     }
@@ -144,7 +179,7 @@ static struct trace_session* trace_session_create(void)
     
     if(session)
     {
-        session->refs = 1;
+        atomic_set(&session->refs, 1);
         session->is_ended = 0;
     }
     
@@ -160,10 +195,17 @@ static void trace_session_set_end(struct trace_session* session)
 void trace_session_after_read_callback(struct kedr_trace_callback_head* callback_head)
 {
     struct trace_session* session = container_of(callback_head, typeof(*session), callback_head);
+    unsigned long flags;
+    
+    spin_lock_irqsave(&trace_session_list_lock, flags);
     list_del(&session->list);
+    spin_unlock_irqrestore(&trace_session_list_lock, flags);
+    
     trace_session_unref(session);
 }
 
+static void trace_dicts_rotate(void);
+
 /* Mark current trace session as ended. */
 static int kedr_trace_end_session(void)
 {
@@ -185,12 +227,14 @@ static int kedr_trace_end_session(void)
         return err;
     }
     
+    spin_lock_irq(&trace_session_list_lock);
     BUG_ON(list_empty(&trace_session_list));
     
     session = list_entry(trace_session_list.prev, typeof(*session), list);
     list_add_tail(&session_new->list, &trace_session_list);
     
     trace_session_set_end(session);
+    spin_unlock_irq(&trace_session_list_lock);
     /* 
      * This should be called under mutex locked, as callback may be
      * executed immediately.
@@ -200,6 +244,9 @@ static int kedr_trace_end_session(void)
 
     mutex_unlock(&trace_m);
     
+    /* Next session starts with empty dictionaries. */
+    trace_dicts_rotate();
+    
     wake_up_all(&wq_session);
     
     return 0;
@@ -259,21 +306,304 @@ static int tme_alloc(struct trace_message_extracted* tme, size_t size)
 unsigned long buffer_size = BUFFER_SIZE_DEFAULT;
 module_param(buffer_size, ulong, S_IRUGO);
 
+/*
+ * Auto-grow of the buffer.
+ * 
+ * If more than 'buffer_grow_threshold' messages are lost during a
+ * second, buffer is doubled, but not above 'buffer_size_max'.
+ * 
+ * Zero 'buffer_size_max' disables auto-grow.
+ */
+unsigned long buffer_size_max = 0;
+module_param(buffer_size_max, ulong, S_IRUGO);
+
+unsigned long buffer_grow_threshold = 1000;
+module_param(buffer_grow_threshold, ulong, S_IRUGO);
+
+static void buffer_grow_work_func(struct work_struct* work);
+static DECLARE_DELAYED_WORK(buffer_grow_work, &buffer_grow_work_func);
+
+/* Number of lost messages at the previous check. */
+static unsigned long buffer_grow_lost_prev;
+
+/*
+ * Size of the dedicated trace buffer of every target module.
+ * 
+ * If not zero, function calls made by the target are written into the
+ * buffer of that target and are read via 'targets/<name>/trace' file,
+ * so calls of different targets do not evict each other. Other messages,
+ * including markers about targets and sessions, remain in the global
+ * buffer.
+ * 
+ * Buffer of the target is kept after the target is unloaded and is
+ * reused when the target is loaded again.
+ */
+unsigned long target_buffer_size = 0;
+module_param(target_buffer_size, ulong, S_IRUGO);
+
+/*
+ * Clock used for timestamps of the messages:
+ * 
+ * "global" - timestamps are serialized using global spinlock,
+ * "lockless" - timestamps are serialized using lock-free atomic maximum.
+ */
+static char* clock_mode = "global";
+module_param(clock_mode, charp, S_IRUGO);
+
+/*
+ * Encoding of the messages in the trace buffer:
+ * 
+ * "plain" - every message is stored with full timestamp and full
+ *           information about the process,
+ * "compact" - timestamps are stored as deltas, and function call
+ *           messages with registered format refer to the dictionaries
+ *           of call sites and processes and have their parameters packed.
+ *
+ * Compact encoding allows the buffer of the same size to hold several
+ * times more function calls.
+ */
+static char* encoding = "plain";
+module_param(encoding, charp, S_IRUGO);
+
+static bool encoding_compact;
+
+/* Clock of the trace buffers, set according to 'clock_mode'. */
+static enum trace_buffer_clock_type trace_clock_type;
+
+/*
+ * Dictionaries for compact function call messages.
+ * 
+ * Created only for compact encoding.
+ */
+static struct trace_dict* call_sites_dict;
+static struct trace_dict* tasks_dict;
+
+/*
+ * Whether previous generation of the dictionaries is not cleared yet.
+ * 
+ * New generation cannot be started until that.
+ */
+static atomic_t dicts_rotation_pending = ATOMIC_INIT(0);
+
+/* Number of function calls written in plain form because of full dictionary. */
+static atomic_long_t dicts_fallbacks = ATOMIC_LONG_INIT(0);
+/* Number of generations started. Changed under 'dicts_rotation_pending'. */
+static unsigned long dicts_rotations;
+
+/*
+ * Check fill level of the dictionaries every second.
+ * 
+ * Writers may work in any context, so they cannot start new generation
+ * themselves.
+ */
+static void dicts_check_work_func(struct work_struct* work);
+static DECLARE_DELAYED_WORK(dicts_check_work, &dicts_check_work_func);
+
+/* Statistics of all messages written, per CPU. */
+static struct kedr_trace_stats* stats_global;
+/* Statistics of function call messages without registered format. */
+static struct kedr_trace_stats* stats_unregistered;
+
+/*
+ * Size of the window of text for 'trace_shared' file.
+ * 
+ * Readers of that file may fall behind each other at most by that size.
+ */
+unsigned long shared_window_size = SHARED_WINDOW_SIZE_DEFAULT;
+module_param(shared_window_size, ulong, S_IRUGO);
+
+/* Tee for readers of 'trace_shared' file. */
+static struct trace_tee* tee_global;
+
+/*
+ * Size of the spill area of the sink and interval between drains
+ * of the trace buffer by the sink's worker.
+ */
+unsigned long sink_spill_size = SINK_SPILL_SIZE_DEFAULT;
+module_param(sink_spill_size, ulong, S_IRUGO);
+
+unsigned int sink_interval_ms = SINK_INTERVAL_MS_DEFAULT;
+module_param(sink_interval_ms, uint, S_IRUGO);
+
+/* Sink controlled via 'sink' file. */
+static struct trace_sink* sink_global;
+
+/* Directory with traces of the targets. */
+static struct dentry* targets_dir;
+
+/* Dedicated trace of the target module. */
+struct target_trace
+{
+    struct list_head list;
+    char name[MODULE_NAME_LEN];
+    struct trace_channel* channel;
+};
+
+/* 
+ * Traces of the targets, which have been loaded at least once.
+ * 
+ * Elements are removed only when the module is unloaded.
+ */
+static LIST_HEAD(target_traces);
+static DEFINE_MUTEX(target_traces_m);
+
+static int trace_print_message(char* str, size_t size,
+    const void* msg, size_t msg_size, int cpu, u64 ts);
+
+/* 
+ * Return buffer of the target with given name, creating it if needed.
+ * 
+ * If dedicated buffers are disabled or cannot be created, return the
+ * global buffer.
+ */
+static struct trace_buffer* target_trace_get_buffer(const char* name)
+{
+    struct target_trace* tt;
+    struct trace_buffer* tb;
+    
+    if(!target_buffer_size) return tb_global;
+    
+    mutex_lock(&target_traces_m);
+    list_for_each_entry(tt, &target_traces, list)
+    {
+        if(!strcmp(tt->name, name)) goto out;
+    }
+    
+    tt = kmalloc(sizeof(*tt), GFP_KERNEL);
+    if(!tt) goto fail;
+    
+    snprintf(tt->name, sizeof(tt->name), "%s", name);
+    tt->channel = trace_channel_create(name, targets_dir,
+        target_buffer_size, trace_clock_type, encoding_compact,
+        shared_window_size, &trace_print_message);
+    if(!tt->channel)
+    {
+        kfree(tt);
+        goto fail;
+    }
+    
+    list_add_tail(&tt->list, &target_traces);
+out:
+    tb = trace_channel_buffer(tt->channel);
+    mutex_unlock(&target_traces_m);
+    
+    return tb;
+
+fail:
+    mutex_unlock(&target_traces_m);
+    pr_err("Failed to create trace buffer for target '%s', "
+        "global buffer is used instead.\n", name);
+    
+    return tb_global;
+}
+
+static void target_traces_destroy(void)
+{
+    struct target_trace* tt, *tt_tmp;
+    
+    list_for_each_entry_safe(tt, tt_tmp, &target_traces, list)
+    {
+        list_del(&tt->list);
+        trace_channel_destroy(tt->channel);
+        kfree(tt);
+    }
+}
+
 // Names of files
 static struct dentry* trace_file;
 static struct dentry* trace_session_file;
+static struct dentry* trace_binary_file;
+static struct dentry* trace_shared_file;
 static struct dentry* trace_dir;
 static struct dentry* reset_file;
 static struct dentry* buffer_size_file;
 static struct dentry* lost_messages_file;
+static struct dentry* filter_file;
+static struct dentry* sampling_file;
+static struct dentry* sink_file;
+static struct dentry* sink_spill_file;
+static struct dentry* stats_file;
+
+/* Types of the messages in the trace buffer. */
+enum trace_message_type
+{
+    /* Message with pretty print function ('struct pp_message_data'). */
+    trace_message_type_pp = 0,
+    /* Message with registered format. */
+    trace_message_type_format,
+    /* Function call message with registered format ('struct function_call_format_data'). */
+    trace_message_type_call_format,
+    /* Function call message in compact form ('struct function_call_compact_message'). */
+    trace_message_type_call_compact,
+    /* Function call message in fixed form ('struct function_call_fixed_message'). */
+    trace_message_type_call_fixed,
+};
 
 /*
  * Format of the message written into the trace buffer.
+ * 
+ * Every type of the message starts with 'type' field.
  */
 struct kedr_trace_message
 {
+    /* One of 'trace_message_type' values. */
+    u16 type;
+    /* Identificator of the registered format, if message has one. */
+    u16 format_id;
+    pid_t pid;
     char command[TASK_COMM_LEN];
+    char data[0];
+};
+
+/* Key in the dictionary of processes. */
+struct task_key
+{
     pid_t pid;
+    char command[TASK_COMM_LEN];
+};
+
+/*
+ * Function call message with registered format in compact form.
+ * 
+ * Format, return address and target are taken from the dictionary
+ * of call sites, process information from the dictionary of processes.
+ */
+struct function_call_compact_message
+{
+    /* trace_message_type_call_compact */
+    u16 type;
+    u16 call_site_id;
+    u16 task_id;
+    /* 
+     * Size of the parameters before packing. If parameters are not
+     * packed, COMPACT_PARAMS_RAW bit is set.
+     */
+    u16 params_size;
+    unsigned char params[0];
+};
+
+#define COMPACT_PARAMS_RAW 0x8000
+
+/*
+ * Function call message with registered format in fixed form.
+ * 
+ * As in compact form, call site and process are taken from the
+ * dictionaries. Parameters are stored as is in the space of the fixed
+ * size, so the message is written without any packing.
+ */
+struct function_call_fixed_message
+{
+    /* trace_message_type_call_fixed */
+    u16 type;
+    u16 call_site_id;
+    u16 task_id;
+    u16 params_size;
+    unsigned long params[KEDR_TRACE_FIXED_PARAMS_SIZE / sizeof(unsigned long)];
+};
+
+/* Data for message with pretty print function. */
+struct pp_message_data
+{
     kedr_trace_pp_function pp;
     char data[0];
 };
@@ -327,13 +657,153 @@ static void tme_last_clear(void)
     tme_last_current_pos = 0;
 }
 
+/*
+ * Rotation of the dictionaries.
+ * 
+ * Messages which refer to the previous generation may be in the global
+ * buffer and in the buffers of the targets. The generation is cleared
+ * when all these buffers are read.
+ */
+struct trace_dicts_rotation_head
+{
+    struct kedr_trace_callback_head callback_head;
+    struct trace_dicts_rotation* rotation;
+};
+
+struct trace_dicts_rotation
+{
+    /* Number of buffers which are not read yet. */
+    atomic_t refs;
+    struct trace_dicts_rotation_head heads[0];
+};
+
+static void trace_dicts_rotation_callback(struct kedr_trace_callback_head* ch)
+{
+    struct trace_dicts_rotation_head* head = container_of(ch,
+        typeof(*head), callback_head);
+    struct trace_dicts_rotation* rotation = head->rotation;
+    
+    if(!atomic_dec_and_test(&rotation->refs)) return;
+    
+    trace_dict_clear_old(call_sites_dict);
+    trace_dict_clear_old(tasks_dict);
+    kfree(rotation);
+    
+    /* Pairs with atomic_cmpxchg() in trace_dicts_rotate(). */
+    smp_mb();
+    atomic_set(&dicts_rotation_pending, 0);
+}
+
+/*
+ * Start new generation of the dictionaries, so they do not fill up
+ * with keys of the processes and targets which are no longer traced.
+ * 
+ * Does nothing if the previous generation is not cleared yet.
+ */
+static void trace_dicts_rotate(void)
+{
+    struct target_trace* tt;
+    struct trace_dicts_rotation* rotation;
+    int n_heads = 1;
+    int i = 0;
+    
+    if(!encoding_compact) return;
+    if(atomic_cmpxchg(&dicts_rotation_pending, 0, 1)) return;
+    
+    mutex_lock(&target_traces_m);
+    list_for_each_entry(tt, &target_traces, list) n_heads++;
+    
+    rotation = kmalloc(sizeof(*rotation)
+        + sizeof(rotation->heads[0]) * n_heads, GFP_KERNEL);
+    if(!rotation)
+    {
+        /* Dictionaries continue to be used as is. */
+        mutex_unlock(&target_traces_m);
+        atomic_set(&dicts_rotation_pending, 0);
+        return;
+    }
+    
+    trace_dict_rotate(call_sites_dict);
+    trace_dict_rotate(tasks_dict);
+    dicts_rotations++;
+    /* 
+     * Wait for writers which have interned keys of the previous
+     * generation, so their messages are committed before the
+     * callbacks below are registered.
+     */
+    synchronize_sched();
+    
+    atomic_set(&rotation->refs, n_heads);
+    for(i = 0; i < n_heads; i++) rotation->heads[i].rotation = rotation;
+    
+    i = 0;
+    list_for_each_entry(tt, &target_traces, list)
+    {
+        trace_buffer_call_after_read(trace_channel_buffer(tt->channel),
+            &trace_dicts_rotation_callback,
+            &rotation->heads[i++].callback_head);
+    }
+    kedr_trace_call_after_read(&trace_dicts_rotation_callback,
+        &rotation->heads[i].callback_head);
+    
+    mutex_unlock(&target_traces_m);
+}
+
+/* Start new generation of the dictionaries if some of them is almost full. */
+static void dicts_check_work_func(struct work_struct* work)
+{
+    if((trace_dict_size(call_sites_dict)
+            >= DICT_ROTATE_THRESHOLD(CALL_SITES_DICT_SIZE))
+        || (trace_dict_size(tasks_dict)
+            >= DICT_ROTATE_THRESHOLD(TASKS_DICT_SIZE)))
+    {
+        trace_dicts_rotate();
+    }
+    
+    schedule_delayed_work(&dicts_check_work, HZ);
+}
+
 /* Reset trace. */
 static void kedr_trace_reset(void)
 {
+    struct target_trace* tt;
+    
     mutex_lock(&trace_m);
     trace_buffer_reset(tb_global);
     tme_last_clear();
     mutex_unlock(&trace_m);
+    
+    mutex_lock(&target_traces_m);
+    list_for_each_entry(tt, &target_traces, list)
+    {
+        trace_buffer_reset(trace_channel_buffer(tt->channel));
+    }
+    mutex_unlock(&target_traces_m);
+    
+    /* Messages which refer to the dictionaries are dropped. */
+    trace_dicts_rotate();
+}
+
+/*
+ * Return number of writes in given context rejected because of
+ * recursion, in all trace buffers.
+ */
+static unsigned long kedr_trace_recursion_rejected(
+    enum trace_buffer_context context)
+{
+    struct target_trace* tt;
+    unsigned long rejected = trace_buffer_recursion_rejected(tb_global,
+        context);
+    
+    mutex_lock(&target_traces_m);
+    list_for_each_entry(tt, &target_traces, list)
+    {
+        rejected += trace_buffer_recursion_rejected(
+            trace_channel_buffer(tt->channel), context);
+    }
+    mutex_unlock(&target_traces_m);
+    
+    return rejected;
 }
 
 /*
@@ -407,6 +877,55 @@ static void kedr_trace_marker_session(bool is_started)
     }
 }
    
+/*
+ * Trace marker for event about change of sampling parameters.
+ * 
+ * Messages with given format between this marker and the next one for
+ * the same format are sampled according to parameters in the marker.
+ */
+struct sampling_marker_data
+{
+    u16 format_id;
+    unsigned int every;
+    unsigned int rate;
+    /* Messages skipped before this marker. */
+    unsigned long skipped;
+};
+
+static int
+kedr_trace_marker_sampling_pp_function(char* dest, size_t size,
+    const void* data)
+{
+    const struct sampling_marker_data* smd = data;
+    PRINT_BUFFER(pb, dest, size);
+    
+    str_into_buffer(&pb, "sampling: \"");
+    snprintf_into_buffer(&pb, trace_format_print_name, smd->format_id);
+    print_into_buffer(&pb, "\" every=%u rate=%u skipped=%lu",
+        smd->every, smd->rate, smd->skipped);
+    
+    return print_buffer_size_written(&pb);
+}
+
+/* Add message about sampling parameters of the format being changed. */
+static void kedr_trace_marker_sampling(u16 format_id,
+    unsigned int every, unsigned int rate, unsigned long skipped)
+{
+    struct sampling_marker_data* smd;
+    void* id = kedr_trace_lock(kedr_trace_marker_sampling_pp_function,
+        sizeof(*smd), (void**)&smd);
+    
+    if(id)
+    {
+        smd->format_id = format_id;
+        smd->every = every;
+        smd->rate = rate;
+        smd->skipped = skipped;
+        
+        kedr_trace_unlock_commit(id);
+    }
+}
+
 /**************** Implementation of the exported functions ************/
 
 /*
@@ -420,29 +939,91 @@ void kedr_trace_pp_unregister(void)
 EXPORT_SYMBOL(kedr_trace_pp_unregister);
 
 /*
- * Reserve space for message in the trace.
+ * Count message of given size in the statistics.
  * 
- * 'pp' is pretty print function which will be used for this data.
+ * 'stats' is statistics of the format or of the function, may be NULL.
+ */
+static inline void trace_stats_account(struct kedr_trace_stats* stats,
+    size_t size, bool reserved)
+{
+    trace_stats_add(stats_global, size, reserved);
+    if(stats) trace_stats_add(stats, size, reserved);
+}
+
+/*
+ * Reserve space for message of given type in the trace buffer 'tb'.
  * 
- * Return not NULL on success. Returning value should be passed to
- * the kedr_trace_unlock_commit() for complete trace operation.
+ * Message is counted in 'stats', if it is not NULL.
  */
-void* kedr_trace_lock(kedr_trace_pp_function pp,
-    size_t size, void** data)
+static void* trace_message_lock(struct trace_buffer* tb,
+    enum trace_message_type type, u16 format_id,
+    struct kedr_trace_stats* stats, size_t size, void** data)
 {
     struct kedr_trace_message* msg;
-    void* id = trace_buffer_write_lock(tb_global,
-        sizeof(struct kedr_trace_message) + size, (void**)&msg);
+    void* id;
+    
+    size += sizeof(struct kedr_trace_message);
+    id = trace_buffer_write_lock(tb, size, (void**)&msg);
+    trace_stats_account(stats, size, id != NULL);
     if(id == NULL) return NULL;
-    msg->pp = pp;
+    msg->type = type;
+    msg->format_id = format_id;
     msg->pid = task_tgid_vnr(current);
     strncpy(msg->command, current->comm, sizeof(msg->command));
 
     *data = msg->data;
     return id;
 }
+
+/* Reserve space for message with pretty print function. */
+static void* trace_pp_message_lock(struct trace_buffer* tb,
+    kedr_trace_pp_function pp, struct kedr_trace_stats* stats,
+    size_t size, void** data)
+{
+    struct pp_message_data* pmd;
+    void* id = trace_message_lock(tb, trace_message_type_pp,
+        TRACE_FORMAT_ID_INVALID, stats,
+        offsetof(typeof(*pmd), data) + size, (void**)&pmd);
+    if(id == NULL) return NULL;
+    pmd->pp = pp;
+
+    *data = pmd->data;
+    return id;
+}
+
+/*
+ * Reserve space for message in the trace.
+ * 
+ * 'pp' is pretty print function which will be used for this data.
+ * 
+ * Return not NULL on success. Returning value should be passed to
+ * the kedr_trace_unlock_commit() for complete trace operation.
+ */
+void* kedr_trace_lock(kedr_trace_pp_function pp,
+    size_t size, void** data)
+{
+    return trace_pp_message_lock(tb_global, pp, NULL, size, data);
+}
 EXPORT_SYMBOL(kedr_trace_lock);
 
+/*
+ * Reserve space for message with registered format in the trace.
+ */
+void* kedr_trace_format_lock(struct kedr_trace_format* format,
+    size_t size, void** data)
+{
+    void* id = NULL;
+    
+    preempt_disable();
+    if(trace_sampling_pass(format->sampling))
+        id = trace_message_lock(tb_global, trace_message_type_format,
+            format->id, format->stats, size, data);
+    preempt_enable();
+    
+    return id;
+}
+EXPORT_SYMBOL(kedr_trace_format_lock);
+
 /*
  * Complete trace operation, started with kedr_trace_lock().
  */
@@ -478,43 +1059,132 @@ void kedr_trace_call_after_read(kedr_trace_callback_func func,
 }
 EXPORT_SYMBOL(kedr_trace_call_after_read);
 
-/* 
- * Information about target module.
- * 
- * Used for pretty print trace message.
- */
-struct target_info
+unsigned long kedr_trace_lost_messages(void)
 {
-	struct list_head list;
+    unsigned long lost;
+    
+    mutex_lock(&trace_m);
+    lost = trace_buffer_lost_messages(tb_global);
+    mutex_unlock(&trace_m);
+    
+    return lost;
+}
+EXPORT_SYMBOL(kedr_trace_lost_messages);
 
-	void* core_addr;
-	void* init_addr;
+unsigned long kedr_trace_buffer_size(void)
+{
+    unsigned long size;
+    
+    mutex_lock(&trace_m);
+    size = trace_buffer_size(tb_global);
+    mutex_unlock(&trace_m);
+    
+    return size;
+}
+EXPORT_SYMBOL(kedr_trace_buffer_size);
+
+/* 
+ * Information about target module.
+ * 
+ * Used for pretty print trace message.
+ */
+struct target_info
+{
+	struct list_head list;
+
+	void* core_addr;
+	void* init_addr;
 	unsigned int core_size;
 	unsigned int init_size;
 
 	char name[MODULE_NAME_LEN];
 	struct module* m;
     
+    /* 
+     * Buffer for function calls made by the target: dedicated buffer
+     * of the target or the global one.
+     */
+    struct trace_buffer* tb;
+    
+    /* 
+     * Messages which refer to the target may be in the global buffer
+     * and in the buffer of the target. Structure is freed when both
+     * buffers are read.
+     */
+    atomic_t refs;
     struct kedr_trace_callback_head callback_head;
+    struct kedr_trace_callback_head tb_callback_head;
 };
 
+static void target_info_unref(struct target_info* ti)
+{
+    if(atomic_dec_and_test(&ti->refs)) kfree(ti);
+}
+
 void free_target_info_callback(struct kedr_trace_callback_head* ch)
 {
     struct target_info* ti = container_of(ch, typeof(*ti), callback_head);
     
-    kfree(ti);
+    target_info_unref(ti);
+}
+
+static void free_target_info_tb_callback(struct kedr_trace_callback_head* ch)
+{
+    struct target_info* ti = container_of(ch, typeof(*ti), tb_callback_head);
+    
+    target_info_unref(ti);
+}
+
+/* 
+ * Return buffer for function call made from the target 'ti'.
+ * 
+ * 'ti' may be NULL if call is made from outside of the targets.
+ */
+static inline struct trace_buffer* target_trace_buffer(struct target_info* ti)
+{
+    return ti ? ti->tb : tb_global;
 }
 
 /*
  * List of informations about currently loaded targets.
  *
+ * Writes are performed only at target_load/target_unload events,
+ * which are already sync wrt themselves. Readers use 'targets_index'.
+ */
+static LIST_HEAD(targets_list);
+
+/* Address range of the section of the target. */
+struct target_range
+{
+    unsigned long start;
+    unsigned long end;
+    struct target_info* ti;
+};
+
+/* Sections of the targets, sorted by start address. */
+struct target_index
+{
+    int n_ranges;
+    struct target_range ranges[0];
+};
+
+/*
+ * Index of the targets for search target by address.
+ *
+ * Rebuilt on every change in 'targets_list'.
  * Read and write are sync using RCU(preemt type) plus
  * kedr_trace_call_after_read mechanism.
+ */
+static struct target_index __rcu* targets_index;
+
+/*
+ * Position of the range in the 'targets_index', found by the last
+ * search on given CPU.
  *
- * Writes are performed only at target_load/target_unload events,
- * which are already sync wrt themselves.
+ * Calls from the same place are usually traced in series, so this
+ * position is checked before the binary search.
  */
-static LIST_HEAD(targets_list);
+static DEFINE_PER_CPU(int, targets_index_last_pos);
 
 /* Data for function call message. */
 struct function_call_data
@@ -533,6 +1203,29 @@ struct function_call_data
     char params[0];
 };
 
+/* Key in the dictionary of call sites. */
+struct call_site_key
+{
+    void* return_address;
+    struct target_info* ti;
+    u16 format_id;
+};
+
+/* Data for function call message with registered format. */
+struct function_call_format_data
+{
+    void* return_address;
+    
+    /* 
+     * Information about target module which calls given function.
+     * 
+     * May be NULL.
+     */
+    struct target_info* ti;
+    
+    char params[0];
+};
+
 static bool within(void* addr, void* section_start,
     unsigned int section_size)
 {
@@ -540,30 +1233,150 @@ static bool within(void* addr, void* section_start,
         && ((unsigned long)addr < ((unsigned long)section_start + section_size));
 }
 
-static int function_call_pp_function(char* dest, size_t size,
-    const void* data)
+/* 
+ * Find information about target module which contains given address.
+ * 
+ * Return NULL if address is not inside any target.
+ * 
+ * Should be called with preemption disabled.
+ */
+static struct target_info* target_info_find(void* addr)
 {
-    const struct function_call_data* fcd = data;
-    PRINT_BUFFER(pb, dest, size);
+    unsigned long a = (unsigned long)addr;
+    int pos, low, high;
+    const struct target_range* range;
+    struct target_index* index = rcu_dereference_sched(targets_index);
     
-    print_into_buffer(&pb, "called_%s: ", fcd->function_name);
-    if(fcd->ti)
+    if(!index) return NULL;
+    
+    /*
+     * Position may be set for the previous index. Such position is
+     * just a hint, which is verified.
+     */
+    pos = __this_cpu_read(targets_index_last_pos);
+    if(pos < index->n_ranges)
+    {
+        range = &index->ranges[pos];
+        if((a >= range->start) && (a < range->end)) return range->ti;
+    }
+    
+    low = 0;
+    high = index->n_ranges;
+    while(low < high)
+    {
+        pos = low + (high - low) / 2;
+        range = &index->ranges[pos];
+        
+        if(a < range->start)
+            high = pos;
+        else if(a >= range->end)
+            low = pos + 1;
+        else
+        {
+            __this_cpu_write(targets_index_last_pos, pos);
+            return range->ti;
+        }
+    }
+    
+    return NULL;
+}
+
+static int target_range_cmp(const void* a, const void* b)
+{
+    const struct target_range* range_a = a;
+    const struct target_range* range_b = b;
+    
+    if(range_a->start < range_b->start) return -1;
+    return range_a->start > range_b->start;
+}
+
+static void target_index_add(struct target_index* index,
+    void* section_start, unsigned int section_size, struct target_info* ti)
+{
+    struct target_range* range;
+    
+    if(!section_size) return;
+    
+    range = &index->ranges[index->n_ranges++];
+    range->start = (unsigned long)section_start;
+    range->end = range->start + section_size;
+    range->ti = ti;
+}
+
+/*
+ * Build index for the current 'targets_list' and publish it.
+ * 
+ * Return previous index, which should be freed after all current
+ * readers finish.
+ * 
+ * If new index cannot be allocated, NULL index is published, so
+ * messages are written without information about targets.
+ */
+static struct target_index* target_index_rebuild(void)
+{
+    int n_ranges = 0;
+    struct target_info* ti;
+    struct target_index* index;
+    struct target_index* index_old = rcu_dereference_protected(targets_index, 1);
+    
+    list_for_each_entry(ti, &targets_list, list)
+    {
+        n_ranges += 2;
+    }
+    
+    index = kmalloc(sizeof(*index) + n_ranges * sizeof(index->ranges[0]),
+        GFP_KERNEL);
+    if(index)
+    {
+        index->n_ranges = 0;
+        list_for_each_entry(ti, &targets_list, list)
+        {
+            target_index_add(index, ti->core_addr, ti->core_size, ti);
+            target_index_add(index, ti->init_addr, ti->init_size, ti);
+        }
+        
+        sort(index->ranges, index->n_ranges, sizeof(index->ranges[0]),
+            &target_range_cmp, NULL);
+    }
+    else
+    {
+        pr_err("Failed to allocate index of targets.\n");
+    }
+    
+    rcu_assign_pointer(targets_index, index);
+    
+    return index_old;
+}
+
+/* Print return address of the function call. */
+static void print_call_address(struct print_buffer* pb,
+    void* return_address, struct target_info* ti)
+{
+    if(ti)
     {
         unsigned int rel_addr;
-        struct target_info* ti = fcd->ti;
-        bool is_core = within(fcd->return_address,
+        bool is_core = within(return_address,
             ti->core_addr, ti->core_size);
-        rel_addr = (unsigned int)((unsigned long)fcd->return_address
+        rel_addr = (unsigned int)((unsigned long)return_address
             - (is_core ? (unsigned long)ti->core_addr : (unsigned long)ti->init_addr));
         
-        print_into_buffer(&pb, "([<%p>] %s.%s+0x%x)", fcd->return_address,
+        print_into_buffer(pb, "([<%p>] %s.%s+0x%x)", return_address,
             ti->name, is_core? "core": "init", rel_addr);
     }
     else
     {
-        print_into_buffer(&pb, "([%p])", fcd->return_address);
+        print_into_buffer(pb, "([%p])", return_address);
     }
+}
+
+static int function_call_pp_function(char* dest, size_t size,
+    const void* data)
+{
+    const struct function_call_data* fcd = data;
+    PRINT_BUFFER(pb, dest, size);
     
+    print_into_buffer(&pb, "called_%s: ", fcd->function_name);
+    print_call_address(&pb, fcd->return_address, fcd->ti);
     
     if(fcd->params_pp)
     {
@@ -574,26 +1387,97 @@ static int function_call_pp_function(char* dest, size_t size,
     return print_buffer_size_written(&pb);
 }
 
-void* kedr_trace_function_call_lock(const char* function_name,
-	void* return_address, kedr_trace_pp_function params_pp,
-    size_t params_size, void** params)
+static int function_call_format_print(char* dest, size_t size,
+    u16 format_id, void* return_address, struct target_info* ti,
+    const void* params)
+{
+    PRINT_BUFFER(pb, dest, size);
+    
+    str_into_buffer(&pb, "called_");
+    snprintf_into_buffer(&pb, trace_format_print_name, format_id);
+    str_into_buffer(&pb, ": ");
+    print_call_address(&pb, return_address, ti);
+    
+    snprintf_into_buffer(&pb, trace_format_print, format_id, " ", params);
+    
+    return print_buffer_size_written(&pb);
+}
+
+static int function_call_format_pp_function(char* dest, size_t size,
+    u16 format_id, const void* data)
+{
+    const struct function_call_format_data* fcfd = data;
+    
+    return function_call_format_print(dest, size, format_id,
+        fcfd->return_address, fcfd->ti, fcfd->params);
+}
+
+static int function_call_compact_pp_function(char* dest, size_t size,
+    const struct function_call_compact_message* msg, size_t msg_size)
+{
+    /* Parameters are restored into aligned buffer. */
+    unsigned long params[COMPACT_PARAMS_SIZE_MAX / sizeof(unsigned long)];
+    size_t params_size = msg->params_size & ~COMPACT_PARAMS_RAW;
+    size_t packed_size = msg_size - offsetof(typeof(*msg), params);
+    const struct call_site_key* key = trace_dict_key(call_sites_dict,
+        msg->call_site_id);
+    
+    if(msg->params_size & COMPACT_PARAMS_RAW)
+    {
+        if(packed_size < params_size) goto corrupted;
+        memcpy(params, msg->params, params_size);
+    }
+    else if(!trace_unpack_words(params, params_size, msg->params, packed_size))
+    {
+        goto corrupted;
+    }
+    
+    return function_call_format_print(dest, size, key->format_id,
+        key->return_address, key->ti, params);
+
+corrupted:
+    return snprintf(dest, size, "<corrupted message>");
+}
+
+static int function_call_fixed_pp_function(char* dest, size_t size,
+    const struct function_call_fixed_message* msg)
+{
+    const struct call_site_key* key = trace_dict_key(call_sites_dict,
+        msg->call_site_id);
+    
+    return function_call_format_print(dest, size, key->format_id,
+        key->return_address, key->ti, msg->params);
+}
+
+/*
+ * Find target for the function call and check the call against filter.
+ * 
+ * Return false if call is filtered out.
+ * 
+ * Should be called with preemption disabled. In that case target
+ * information is valid until message is commited.
+ */
+static bool function_call_filter(const char* function_name,
+    void* return_address, struct target_info** ti)
+{
+    *ti = target_info_find(return_address);
+    
+    return trace_filter_pass(function_name, return_address,
+        *ti ? (*ti)->name : NULL);
+}
+
+/* Reserve space for function call message in the trace buffer 'tb'. */
+static void* function_call_message_lock(struct trace_buffer* tb,
+    const char* function_name, void* return_address, struct target_info* ti,
+    kedr_trace_pp_function params_pp, size_t params_size, void** params)
 {
     struct function_call_data* fcd;
     size_t size = offsetof(typeof(*fcd), params) + params_size;
-    void* id = kedr_trace_lock(&function_call_pp_function, size, (void**)&fcd);
+    void* id = trace_pp_message_lock(tb, &function_call_pp_function,
+        stats_unregistered, size, (void**)&fcd);
     
     if(id)
     {
-        struct target_info* ti;
-        list_for_each_entry_rcu(ti, &targets_list, list)
-        {
-            if(within(return_address, ti->core_addr, ti->core_size)
-                || within(return_address, ti->init_addr, ti->init_size))
-                break;
-        }
-        
-        if(&ti->list == &targets_list) ti = NULL;
-        
         fcd->function_name = function_name;
         fcd->return_address = return_address;
         fcd->ti = ti;
@@ -604,27 +1488,301 @@ void* kedr_trace_function_call_lock(const char* function_name,
     
     return id;
 }
+
+/* 
+ * Messages reserved via *_lock() functions are committed with
+ * kedr_trace_unlock_commit(), which knows nothing about buffers of the
+ * targets. So such messages are always written into the global buffer.
+ */
+void* kedr_trace_function_call_lock(const char* function_name,
+	void* return_address, kedr_trace_pp_function params_pp,
+    size_t params_size, void** params)
+{
+    struct target_info* ti;
+    void* id = NULL;
+    
+    /* Filtered calls do not reserve space in the buffer. */
+    preempt_disable();
+    if(function_call_filter(function_name, return_address, &ti))
+        id = function_call_message_lock(tb_global, function_name,
+            return_address, ti, params_pp, params_size, params);
+    preempt_enable();
+    
+    return id;
+}
 EXPORT_SYMBOL(kedr_trace_function_call_lock);
 
+/* Reserve space for function call message with registered format. */
+static void* function_call_format_message_lock(struct trace_buffer* tb,
+    struct kedr_trace_format* format,
+    void* return_address, struct target_info* ti,
+    size_t params_size, void** params)
+{
+    struct function_call_format_data* fcfd;
+    size_t size = offsetof(typeof(*fcfd), params) + params_size;
+    void* id = trace_message_lock(tb, trace_message_type_call_format,
+        format->id, format->stats, size, (void**)&fcfd);
+    
+    if(id)
+    {
+        fcfd->return_address = return_address;
+        fcfd->ti = ti;
+
+        *params = fcfd->params;
+    }
+    
+    return id;
+}
+
+/*
+ * Intern call site and current process into the dictionaries.
+ * 
+ * Return false if some dictionary is full.
+ * 
+ * Should be called with preemption disabled.
+ */
+static bool function_call_compact_ids(struct kedr_trace_format* format,
+    void* return_address, struct target_info* ti,
+    u16* call_site_id, u16* task_id)
+{
+    struct call_site_key call_site;
+    struct task_key task;
+    
+    /* Padding of the key is compared too. */
+    memset(&call_site, 0, sizeof(call_site));
+    call_site.return_address = return_address;
+    call_site.ti = ti;
+    call_site.format_id = format->id;
+    *call_site_id = trace_dict_intern(call_sites_dict, &call_site);
+    if(*call_site_id == TRACE_DICT_ID_INVALID) goto full;
+    
+    task.pid = task_tgid_vnr(current);
+    strncpy(task.command, current->comm, sizeof(task.command));
+    *task_id = trace_dict_intern(tasks_dict, &task);
+    if(*task_id == TRACE_DICT_ID_INVALID) goto full;
+    
+    return 1;
+
+full:
+    atomic_long_inc(&dicts_fallbacks);
+    return 0;
+}
+
+/*
+ * Write function call message with registered format in compact form.
+ * 
+ * Return false if message cannot be encoded compactly. In that case
+ * it should be written in plain form.
+ * 
+ * Should be called with preemption disabled.
+ */
+static bool function_call_compact_write(struct trace_buffer* tb,
+    struct kedr_trace_format* format,
+    void* return_address, struct target_info* ti,
+    const void* params, size_t params_size)
+{
+    struct function_call_compact_message* msg;
+    u16 call_site_id, task_id, params_size_field;
+    size_t packed_size, size;
+    void* id;
+    
+    if(params_size > COMPACT_PARAMS_SIZE_MAX) return 0;
+    
+    if(!function_call_compact_ids(format, return_address, ti,
+        &call_site_id, &task_id))
+        return 0;
+    
+    packed_size = trace_pack_words(NULL, params, params_size);
+    if(packed_size < params_size)
+    {
+        params_size_field = params_size;
+    }
+    else
+    {
+        packed_size = params_size;
+        params_size_field = params_size | COMPACT_PARAMS_RAW;
+    }
+    
+    size = offsetof(typeof(*msg), params) + packed_size;
+    id = trace_buffer_write_lock(tb, size, (void**)&msg);
+    trace_stats_account(format->stats, size, id != NULL);
+    /* Message is dropped, as it would be in plain form. */
+    if(!id) return 1;
+    
+    msg->type = trace_message_type_call_compact;
+    msg->call_site_id = call_site_id;
+    msg->task_id = task_id;
+    msg->params_size = params_size_field;
+    
+    if(params_size_field & COMPACT_PARAMS_RAW)
+        memcpy(msg->params, params, params_size);
+    else
+        trace_pack_words(msg->params, params, params_size);
+    
+    trace_buffer_write_unlock(tb, id);
+    
+    return 1;
+}
+
+/*
+ * Write function call message with registered format in fixed form.
+ * 
+ * Return false if message cannot be written in that form. In that case
+ * it should be written in other form.
+ * 
+ * Should be called with preemption disabled.
+ */
+static bool function_call_fixed_write(struct trace_buffer* tb,
+    struct kedr_trace_format* format,
+    void* return_address, struct target_info* ti,
+    const void* params, size_t params_size)
+{
+    struct function_call_fixed_message* msg;
+    u16 call_site_id, task_id;
+    void* id;
+    
+    if(params_size > KEDR_TRACE_FIXED_PARAMS_SIZE) return 0;
+    
+    if(!function_call_compact_ids(format, return_address, ti,
+        &call_site_id, &task_id))
+        return 0;
+    
+    id = trace_buffer_write_lock(tb, sizeof(*msg), (void**)&msg);
+    trace_stats_account(format->stats, sizeof(*msg), id != NULL);
+    /* Message is dropped, as it would be in plain form. */
+    if(!id) return 1;
+    
+    msg->type = trace_message_type_call_fixed;
+    msg->call_site_id = call_site_id;
+    msg->task_id = task_id;
+    msg->params_size = params_size;
+    if(params_size) memcpy(msg->params, params, params_size);
+    
+    trace_buffer_write_unlock(tb, id);
+    
+    return 1;
+}
+
+/*
+ * Write function call message with registered format in plain form.
+ * 
+ * Should be called with preemption disabled.
+ */
+static void function_call_format_write(struct trace_buffer* tb,
+    struct kedr_trace_format* format,
+    void* return_address, struct target_info* ti,
+    const void* params, size_t params_size)
+{
+    void* vparams;
+    void* id;
+    
+    id = function_call_format_message_lock(tb, format,
+        return_address, ti, params_size, &vparams);
+    if(id)
+    {
+        if(params_size) memcpy(vparams, params, params_size);
+
+        trace_buffer_write_unlock(tb, id);
+    }
+}
+
+void* kedr_trace_function_call_format_lock(struct kedr_trace_format* format,
+	void* return_address, size_t params_size, void** params)
+{
+    struct target_info* ti;
+    void* id = NULL;
+    
+    preempt_disable();
+    if(function_call_filter(format->name, return_address, &ti)
+        && trace_sampling_pass(format->sampling))
+        id = function_call_format_message_lock(tb_global, format,
+            return_address, ti, params_size, params);
+    preempt_enable();
+    
+    return id;
+}
+EXPORT_SYMBOL(kedr_trace_function_call_format_lock);
+
 void kedr_trace_function_call(const char* function_name,
 	void* return_address, kedr_trace_pp_function params_pp,
 	const void* params, size_t params_size)
 {
     void* vparams;
-    void* id = kedr_trace_function_call_lock(function_name, return_address,
-        params_pp, params_size, &vparams);
+    struct target_info* ti;
+    struct trace_buffer* tb;
+    void* id;
+    
+    preempt_disable();
+    if(!function_call_filter(function_name, return_address, &ti))
+        goto out;
     
+    tb = target_trace_buffer(ti);
+    id = function_call_message_lock(tb, function_name, return_address, ti,
+        params_pp, params_size, &vparams);
     if(id)
     {
         if(params_size) memcpy(vparams, params, params_size);
 
-        kedr_trace_unlock_commit(id);
+        trace_buffer_write_unlock(tb, id);
     }
+out:
+    preempt_enable();
 }
 EXPORT_SYMBOL(kedr_trace_function_call);
 
+void kedr_trace_function_call_format(struct kedr_trace_format* format,
+	void* return_address, const void* params, size_t params_size)
+{
+    struct target_info* ti;
+    struct trace_buffer* tb;
+    
+    preempt_disable();
+    if(!function_call_filter(format->name, return_address, &ti)
+        || !trace_sampling_pass(format->sampling))
+        goto out;
+    
+    tb = target_trace_buffer(ti);
+    
+    /* Parameters are known in advance, so they may be packed. */
+    if(encoding_compact && function_call_compact_write(tb, format,
+        return_address, ti, params, params_size))
+        goto out;
+    
+    function_call_format_write(tb, format, return_address, ti,
+        params, params_size);
+out:
+    preempt_enable();
+}
+EXPORT_SYMBOL(kedr_trace_function_call_format);
+
+void kedr_trace_function_call_fixed(struct kedr_trace_format* format,
+	void* return_address, const void* params, size_t params_size)
+{
+    struct target_info* ti;
+    struct trace_buffer* tb;
+    
+    preempt_disable();
+    if(!function_call_filter(format->name, return_address, &ti)
+        || !trace_sampling_pass(format->sampling))
+        goto out;
+    
+    tb = target_trace_buffer(ti);
+    
+    /* Neither packing nor size computation is needed. */
+    if(encoding_compact && function_call_fixed_write(tb, format,
+        return_address, ti, params, params_size))
+        goto out;
+    
+    function_call_format_write(tb, format, return_address, ti,
+        params, params_size);
+out:
+    preempt_enable();
+}
+EXPORT_SYMBOL(kedr_trace_function_call_fixed);
+
 static void on_target_loaded(struct module* target_module)
 {
+    struct target_index* index_old;
     struct target_info* ti = kmalloc(sizeof(*ti), GFP_KERNEL);
     
     if(!ti)
@@ -640,14 +1798,21 @@ static void on_target_loaded(struct module* target_module)
     
     memcpy(ti->name, module_name(target_module), sizeof(ti->name));
     ti->m = target_module;
+    ti->tb = target_trace_get_buffer(ti->name);
+    atomic_set(&ti->refs, 1);
     
-    list_add_rcu(&ti->list, &targets_list);
+    list_add(&ti->list, &targets_list);
+    
+    index_old = target_index_rebuild();
+    synchronize_sched();
+    kfree(index_old);
     
     kedr_trace_marker_target(ti->name, 1);
 }
 
 static void on_target_unloaded(struct module* target_module)
 {
+    struct target_index* index_old;
     struct target_info* ti;
     list_for_each_entry(ti, &targets_list, list)
     {
@@ -658,7 +1823,8 @@ static void on_target_unloaded(struct module* target_module)
     
     kedr_trace_marker_target(ti->name, 0);
     
-    list_del_rcu(&ti->list);
+    list_del(&ti->list);
+    index_old = target_index_rebuild();
     
     /* 
      * Syncronize all currently writing messages for safety.
@@ -667,7 +1833,14 @@ static void on_target_unloaded(struct module* target_module)
      * already commited.
      */
     synchronize_sched();
+    kfree(index_old);
     
+    if(ti->tb != tb_global)
+    {
+        atomic_inc(&ti->refs);
+        trace_buffer_call_after_read(ti->tb, &free_target_info_tb_callback,
+            &ti->tb_callback_head);
+    }
     kedr_trace_call_after_read(&free_target_info_callback,
         &ti->callback_head);
 }
@@ -688,18 +1861,81 @@ static void on_session_end(void)
     }
 }
 
-static struct kedr_payload payload =
-{
-    .mod = THIS_MODULE,
-
-    .on_session_start = &on_session_start,
-    .on_session_end = &on_session_end,
-    .on_target_loaded = &on_target_loaded,
-    .on_target_about_to_unload = &on_target_unloaded
-};
-
-
-/**********************************************************************/
+static struct kedr_payload payload =
+{
+    .mod = THIS_MODULE,
+
+    .on_session_start = &on_session_start,
+    .on_session_end = &on_session_end,
+    .on_target_loaded = &on_target_loaded,
+    .on_target_about_to_unload = &on_target_unloaded
+};
+
+
+/**********************************************************************/
+/* Extract information about the process which wrote the message. */
+static void trace_message_task(const struct kedr_trace_message* msg,
+    pid_t* pid, const char** command)
+{
+    if(msg->type == trace_message_type_call_compact)
+    {
+        const struct function_call_compact_message* fccm =
+            (const struct function_call_compact_message*)msg;
+        const struct task_key* task = trace_dict_key(tasks_dict,
+            fccm->task_id);
+        
+        *pid = task->pid;
+        *command = task->command;
+    }
+    else if(msg->type == trace_message_type_call_fixed)
+    {
+        const struct function_call_fixed_message* fcfm =
+            (const struct function_call_fixed_message*)msg;
+        const struct task_key* task = trace_dict_key(tasks_dict,
+            fcfm->task_id);
+        
+        *pid = task->pid;
+        *command = task->command;
+    }
+    else
+    {
+        *pid = msg->pid;
+        *command = msg->command;
+    }
+}
+
+/*
+ * Print message-specific data of the message.
+ * 
+ * Behaves as snprintf().
+ */
+static int trace_message_pp(char* dest, size_t size,
+    const struct kedr_trace_message* msg, size_t msg_size)
+{
+    const struct pp_message_data* pmd;
+    
+    switch(msg->type)
+    {
+    case trace_message_type_pp:
+        pmd = (const struct pp_message_data*)msg->data;
+        return pmd->pp(dest, size, pmd->data);
+    case trace_message_type_format:
+        return trace_format_print(dest, size, msg->format_id, "", msg->data);
+    case trace_message_type_call_format:
+        return function_call_format_pp_function(dest, size,
+            msg->format_id, msg->data);
+    case trace_message_type_call_compact:
+        return function_call_compact_pp_function(dest, size,
+            (const struct function_call_compact_message*)msg, msg_size);
+    case trace_message_type_call_fixed:
+        return function_call_fixed_pp_function(dest, size,
+            (const struct function_call_fixed_message*)msg);
+    default:
+        return snprintf(dest, size, "<unknown message type %u>",
+            (unsigned)msg->type);
+    }
+}
+
 /*
  * Interpretator of the trace content as a string.
  */
@@ -712,15 +1948,19 @@ static int trace_print_message(char* str, size_t size,
         (const struct kedr_trace_message*)msg;
     // ts is time in nanoseconds since system starts
     u32 sec, ms;
+    pid_t pid;
+    const char* command;
    
     sec = div_u64_rem(ts, 1000000000, &ms);
     ms /= 1000;
 
+    trace_message_task(msg_real, &pid, &command);
+
     print_into_buffer(&pb, "%s-%d\t[%.03d]\t%lu.%.06u:\t",
-        msg_real->command, msg_real->pid,
+        command, pid,
         cpu, (unsigned long)sec, (unsigned)ms);
     
-    snprintf_into_buffer(&pb, msg_real->pp, msg_real->data);
+    snprintf_into_buffer(&pb, trace_message_pp, msg_real, msg_size);
     
     str_into_buffer(&pb, "\n");
 
@@ -756,6 +1996,7 @@ int trace_process_msg(const void* msg,
      * Look for session for message extracted.
      * Normally, it is the first element in the list.
      */
+    spin_lock_irq(&trace_session_list_lock);
     list_for_each_entry(session, &trace_session_list, list)
     {
         if(!session->is_ended || (session->ts_end >= ts)) break;
@@ -764,10 +2005,58 @@ int trace_process_msg(const void* msg,
     BUG_ON(&session->list == &trace_session_list);
     
     tme_last.message_session = trace_session_ref(session);
+    spin_unlock_irq(&trace_session_list_lock);
 
     return 1; /* Message is assumed to be consumed. */
 }
 
+/*
+ * Type of the function which accepts chunks of the trace.
+ * 
+ * Return number of bytes consumed from the chunk or negative error code.
+ */
+typedef int (*trace_read_fn)(const char* chunk,
+    int chunk_size, struct trace_session* message_session, void* user_data);
+
+/*
+ * Pass unread part of the last extracted message to 'read_fn'.
+ * 
+ * Return what 'read_fn' returns, or 0 if message belongs to the session
+ * other than one pointed by 'read_session_p'.
+ * 
+ * Should be executed under 'trace_m' locked.
+ */
+static int trace_last_deliver(trace_read_fn read_fn,
+    struct trace_session** read_session_p,
+    void* user_data)
+{
+    int err;
+    
+    if(read_session_p
+        && *read_session_p
+        && *read_session_p != tme_last.message_session)
+    {
+        /* Message from another session, interpreted as EOF.*/
+        return 0;
+    }
+    
+    err = read_fn(tme_last.text + tme_last_current_pos,
+        tme_last.text_size - tme_last_current_pos, tme_last.message_session,
+        user_data);
+    if(err > 0)
+    {
+        tme_last_current_pos += err;
+        
+        if(tme_last_current_pos == tme_last.text_size)
+        {
+            /* Plain message is fully consumed. Clear it. */
+            tme_last_clear();
+        }
+    }
+    
+    return err;
+}
+
 /* 
  * Read next chunk of the trace.
  * 
@@ -784,8 +2073,7 @@ int trace_process_msg(const void* msg,
  * 
  * NOTE: read_session_p is dereferenced under mutex locked.
  */
-static int trace_read(int (*read_fn)(const char* chunk,
-    int chunk_size, struct trace_session* message_session, void* user_data),
+static int trace_read(trace_read_fn read_fn,
     struct trace_session** read_session_p,
     void* user_data)
 {
@@ -812,28 +2100,101 @@ static int trace_read(int (*read_fn)(const char* chunk,
         } 
     }
     
-    if(read_session_p
-        && *read_session_p
-        && *read_session_p != tme_last.message_session)
+    err = trace_last_deliver(read_fn, read_session_p, user_data);
+
+out:
+    mutex_unlock(&trace_m);
+    
+    return err;
+}
+
+struct trace_read_batch_data
+{
+    trace_read_fn read_fn;
+    struct trace_session** read_session_p;
+    void* user_data;
+    
+    /* Total number of bytes consumed by 'read_fn'. */
+    int bytes_read;
+    /* Result of the last delivering of the message. */
+    int err;
+};
+
+static void trace_batch_deliver(struct trace_read_batch_data* data)
+{
+    data->err = trace_last_deliver(data->read_fn, data->read_session_p,
+        data->user_data);
+    if(data->err > 0) data->bytes_read += data->err;
+}
+
+/* 
+ * Interpretator function for trace buffer in batch mode.
+ * 
+ * Extract message and deliver it to the reader. Stop extraction when
+ * the last message is not fully delivered (reader has no space or
+ * message belongs to another session).
+ */
+static int trace_process_msg_batch(const void* msg,
+    size_t msg_size, int cpu, u64 ts, void* user_data)
+{
+    int err;
+    
+    if(tme_last.text_size) return 0;
+    
+    err = trace_process_msg(msg, msg_size, cpu, ts, NULL);
+    if(err <= 0) return err;
+    
+    trace_batch_deliver(user_data);
+    
+    return 1;
+}
+
+/*
+ * Read as many chunks of the trace as 'read_fn' accepts.
+ * 
+ * Unlike trace_read(), all messages are extracted under single
+ * lock of the trace.
+ * 
+ * Return number of bytes consumed by 'read_fn', if it is positive.
+ * Otherwise return the same value as trace_read() would return.
+ */
+static int trace_read_batch(trace_read_fn read_fn,
+    struct trace_session** read_session_p,
+    void* user_data)
+{
+    int err;
+    struct trace_read_batch_data data =
     {
-        /* Message from another session, interpreted as EOF.*/
-        err = 0;
-        goto out;
-    }
+        .read_fn = read_fn,
+        .read_session_p = read_session_p,
+        .user_data = user_data,
+        .bytes_read = 0,
+        .err = 0
+    };
     
-    err = read_fn(tme_last.text + tme_last_current_pos,
-        tme_last.text_size - tme_last_current_pos, tme_last.message_session,
-        user_data);
-    if(err > 0)
+    if(mutex_lock_interruptible(&trace_m))
+        return -ERESTARTSYS;
+    
+    /* Rest of the message extracted before. */
+    if(tme_last.text_size) trace_batch_deliver(&data);
+    
+    if(!tme_last.text_size)
     {
-        tme_last_current_pos += err;
-        
-        if(tme_last_current_pos == tme_last.text_size)
+        err = trace_buffer_read_batch(tb_global, &trace_process_msg_batch, &data);
+        if(err < 0 && !data.bytes_read)
         {
-            /* Plain message is fully consumed. Clear it. */
-            tme_last_clear();
+            if(err == -EAGAIN
+                && read_session_p
+                && *read_session_p
+                && (*read_session_p)->is_ended)
+            {
+                err = 0;  //If read session is ended, trace emptiness means EOF.
+            }
+            goto out;
         }
     }
+    
+    err = data.bytes_read ? data.bytes_read : data.err;
 
 out:
     mutex_unlock(&trace_m);
@@ -877,7 +2238,7 @@ static ssize_t trace_file_op_read(struct file* filp, char __user* buf,
     read_data.count = count;
     read_data.bytes_read = 0;
     
-    err = trace_read(read_fn_normal, NULL, &read_data);
+    err = trace_read_batch(read_fn_normal, NULL, &read_data);
     if(err == -EAGAIN && !(filp->f_flags & O_NONBLOCK))
     {
         bool woken_flag = 0;
@@ -889,7 +2250,7 @@ static ssize_t trace_file_op_read(struct file* filp, char __user* buf,
         {
             add_wait_queue_nestable(wq_buffer, &w_buffer);
 
-            err = trace_read(read_fn_normal, NULL, &read_data);
+            err = trace_read_batch(read_fn_normal, NULL, &read_data);
             
             if(err != -EAGAIN) break;
             err = wait_flagged_interruptible(&woken_flag);
@@ -900,12 +2261,6 @@ static ssize_t trace_file_op_read(struct file* filp, char __user* buf,
     }
     if(err < 0) return err;
     
-    while(read_data.bytes_read < read_data.count)
-    {
-        err = trace_read(read_fn_normal, NULL, &read_data);
-        if(err < 0) break;
-    }
-    
     return read_data.bytes_read;
 }
 
@@ -987,7 +2342,7 @@ static ssize_t trace_file_session_op_read(struct file* filp, char __user* buf,
     read_data.normal_data.bytes_read = 0;
     read_data.session_p = read_session_p;
     
-    err = trace_read(read_fn_session, read_session_p, &read_data);
+    err = trace_read_batch(read_fn_session, read_session_p, &read_data);
     if(err == -EAGAIN && !(filp->f_flags & O_NONBLOCK))
     {
         bool woken_flag = 0;
@@ -1000,7 +2355,7 @@ static ssize_t trace_file_session_op_read(struct file* filp, char __user* buf,
         {
             add_wait_queue_nestable(wq_buffer, &w_buffer);
             add_wait_queue_nestable(&wq_session, &w_session);
-            err = trace_read(read_fn_session, read_session_p, &read_data);
+            err = trace_read_batch(read_fn_session, read_session_p, &read_data);
             
             if(err != -EAGAIN) break;
             err = wait_flagged_interruptible(&woken_flag);
@@ -1012,25 +2367,217 @@ static ssize_t trace_file_session_op_read(struct file* filp, char __user* buf,
     }
     if(err <= 0) return err;
     
-    while(read_data.normal_data.bytes_read < read_data.normal_data.count)
+    return read_data.normal_data.bytes_read;
+}
+
+static unsigned int trace_file_session_op_poll(struct file *filp, poll_table *wait)
+{
+    int err;
+    
+    struct trace_session** read_session_p = (struct trace_session**)&filp->private_data;
+    wait_queue_head_t* wq_buffer = trace_buffer_get_wait_queue(tb_global);
+    poll_wait(filp, wq_buffer, wait);
+    poll_wait(filp, &wq_session, wait);
+    
+    err = trace_read(&poll_fn, read_session_p, NULL);
+    
+    switch(err)
     {
-        err = trace_read(read_fn_session, read_session_p, &read_data);
-        if(err <= 0) break;
+    case 0:
+        return POLLIN | POLLRDNORM;
+    case -EAGAIN:
+        return 0;
+    default:
+        return (unsigned)err;
     }
+}
+
+static int trace_file_session_op_open(struct inode* inode, struct file* filp)
+{
+    // Currently, this is perfomed by VFS automatically, but nevertheless.
+    filp->private_data = NULL;
     
-    return read_data.normal_data.bytes_read;
+    return nonseekable_open(inode, filp);
+}
+
+static int trace_file_session_op_release(struct inode* inode, struct file* filp)
+{
+    struct trace_session* read_session = filp->private_data;
+    if(read_session) trace_session_unref(read_session);
+    
+    return 0;
+}
+
+static struct file_operations trace_file_session_ops =
+{
+    .owner = THIS_MODULE,
+    .open = &trace_file_session_op_open,
+    .read = &trace_file_session_op_read,
+    .poll = &trace_file_session_op_poll,
+    .release = &trace_file_session_op_release,
+};
+/******************** trace_binary file operations ********************/
+/*
+ * Buffer for the binary record being copied to the user.
+ * 
+ * Protected by 'trace_m'.
+ */
+static char* binary_record;
+static size_t binary_record_alloc_size;
+
+struct read_fn_binary_data
+{
+    char __user* buf;
+    size_t count;
+    size_t bytes_read;
+};
+
+/* 
+ * Interpretator function for trace buffer, which copies message to the
+ * user as a binary record.
+ * 
+ * If record cannot fit into the rest of the user buffer, message is
+ * not consumed and 0 is returned.
+ */
+static int trace_process_msg_binary(const void* msg,
+    size_t msg_size, int cpu, u64 ts, void* user_data)
+{
+    struct read_fn_binary_data* read_data = user_data;
+    const struct kedr_trace_message* msg_real = msg;
+    struct kedr_trace_binary_record* record;
+    size_t data_size, record_size;
+    pid_t pid;
+    const char* command;
+    
+    data_size = trace_message_pp(NULL, 0, msg_real, msg_size);
+    record_size = offsetof(struct kedr_trace_binary_record, data) + data_size;
+    
+    if(record_size > read_data->count - read_data->bytes_read)
+    {
+        /* User buffer cannot hold even single record. */
+        if(read_data->bytes_read == 0) return -EINVAL;
+        return 0;
+    }
+    
+    /* '+1' is for '\0' byte, which pretty print function appends. */
+    if(binary_record_alloc_size < record_size + 1)
+    {
+        char* binary_record_new = kmalloc(record_size + 1, GFP_KERNEL);
+        if(!binary_record_new) return -ENOMEM;
+        
+        kfree(binary_record);
+        binary_record = binary_record_new;
+        binary_record_alloc_size = record_size + 1;
+    }
+    
+    record = (struct kedr_trace_binary_record*)binary_record;
+    record->size = record_size;
+    record->cpu = cpu;
+    record->ts = ts;
+    trace_message_task(msg_real, &pid, &command);
+    record->pid = pid;
+    memcpy(record->command, command, sizeof(record->command));
+    
+    trace_message_pp(record->data, data_size + 1, msg_real, msg_size);
+    
+    if(copy_to_user(read_data->buf + read_data->bytes_read, record,
+        record_size)) return -EFAULT;
+    
+    read_data->bytes_read += record_size;
+    
+    return 1; /* Message is consumed. */
+}
+
+/* 
+ * Read as many binary records as fit into the user buffer.
+ * 
+ * Return positive number of bytes read or negative error code.
+ * If trace is empty, -EAGAIN is returned.
+ */
+static int trace_read_binary(struct read_fn_binary_data* read_data)
+{
+    int err;
+    
+    if(mutex_lock_interruptible(&trace_m))
+        return -ERESTARTSYS;
+    
+    if(tme_last.text_size)
+    {
+        /* 
+         * Message is partially read via text interface. Binary
+         * interface cannot represent it.
+         */
+        err = -EBUSY;
+        goto out;
+    }
+    
+    do
+    {
+        err = trace_buffer_read(tb_global, &trace_process_msg_binary,
+            read_data);
+    } while((err > 0) && (read_data->bytes_read < read_data->count));
+    
+    if(read_data->bytes_read) err = read_data->bytes_read;
+out:
+    mutex_unlock(&trace_m);
+    
+    return err;
+}
+
+static ssize_t trace_file_binary_op_read(struct file* filp, char __user* buf,
+    size_t count, loff_t* f_pos)
+{
+    int err;
+    struct read_fn_binary_data read_data;
+    
+    if(!count) return 0;
+    
+    read_data.buf = buf;
+    read_data.count = count;
+    read_data.bytes_read = 0;
+    
+    err = trace_read_binary(&read_data);
+    if(err == -EAGAIN && !(filp->f_flags & O_NONBLOCK))
+    {
+        bool woken_flag = 0;
+        DEFINE_WAIT_NESTED(w_buffer, woken_flag);
+        
+        wait_queue_head_t* wq_buffer = trace_buffer_get_wait_queue(tb_global);
+        
+        while(1)
+        {
+            add_wait_queue_nestable(wq_buffer, &w_buffer);
+
+            err = trace_read_binary(&read_data);
+            
+            if(err != -EAGAIN) break;
+            err = wait_flagged_interruptible(&woken_flag);
+            if(err) break;
+        }
+        
+        remove_wait_queue_nestable(wq_buffer, &w_buffer);
+    }
+    
+    return err;
+}
+
+static int poll_fn_binary(const void* msg,
+    size_t msg_size, int cpu, u64 ts, void* user_data)
+{
+    return 0; /* Do not consume message. */
 }
 
-static unsigned int trace_file_session_op_poll(struct file *filp, poll_table *wait)
+static unsigned int trace_file_binary_op_poll(struct file *filp, poll_table *wait)
 {
     int err;
     
-    struct trace_session** read_session_p = (struct trace_session**)&filp->private_data;
     wait_queue_head_t* wq_buffer = trace_buffer_get_wait_queue(tb_global);
     poll_wait(filp, wq_buffer, wait);
-    poll_wait(filp, &wq_session, wait);
     
-    err = trace_read(&poll_fn, read_session_p, NULL);
+    if(mutex_lock_interruptible(&trace_m))
+        return POLLERR;
+    err = trace_buffer_read(tb_global, &poll_fn_binary, NULL);
+    mutex_unlock(&trace_m);
     
     switch(err)
     {
@@ -1039,33 +2586,67 @@ static unsigned int trace_file_session_op_poll(struct file *filp, poll_table *wa
     case -EAGAIN:
         return 0;
     default:
-        return (unsigned)err;
+        return POLLERR;
     }
 }
 
-static int trace_file_session_op_open(struct inode* inode, struct file* filp)
+static struct file_operations trace_file_binary_ops =
 {
-    // Currently, this is perfomed by VFS automatically, but nevertheless.
-    filp->private_data = NULL;
+    .owner = THIS_MODULE,
+    .open = &trace_file_op_open,
+    .read = &trace_file_binary_op_read,
+    .poll = &trace_file_binary_op_poll
+};
+/******************** trace_shared file operations ********************/
+/*
+ * Every opened 'trace_shared' file is a reader of the tee, so it receives
+ * all messages extracted after the file has been opened.
+ * 
+ * Messages extracted via other trace files are not seen by the
+ * readers of that file.
+ */
+static ssize_t trace_file_shared_op_read(struct file* filp, char __user* buf,
+    size_t count, loff_t* f_pos)
+{
+    struct trace_tee_reader* reader = filp->private_data;
+    
+    return trace_tee_read(reader, buf, count,
+        !(filp->f_flags & O_NONBLOCK));
+}
+
+static unsigned int trace_file_shared_op_poll(struct file *filp, poll_table *wait)
+{
+    struct trace_tee_reader* reader = filp->private_data;
+    
+    return trace_tee_poll(reader, filp, wait);
+}
+
+static int trace_file_shared_op_open(struct inode* inode, struct file* filp)
+{
+    struct trace_tee_reader* reader = trace_tee_reader_create(tee_global);
+    if(!reader) return -ENOMEM;
+    
+    filp->private_data = reader;
     
     return nonseekable_open(inode, filp);
 }
 
-static int trace_file_session_op_release(struct inode* inode, struct file* filp)
+static int trace_file_shared_op_release(struct inode* inode, struct file* filp)
 {
-    struct trace_session* read_session = filp->private_data;
-    if(read_session) trace_session_unref(read_session);
+    struct trace_tee_reader* reader = filp->private_data;
+    
+    trace_tee_reader_destroy(reader);
     
     return 0;
 }
 
-static struct file_operations trace_file_session_ops =
+static struct file_operations trace_file_shared_ops =
 {
     .owner = THIS_MODULE,
-    .open = &trace_file_session_op_open,
-    .read = &trace_file_session_op_read,
-    .poll = &trace_file_session_op_poll,
-    .release = &trace_file_session_op_release,
+    .open = &trace_file_shared_op_open,
+    .release = &trace_file_shared_op_release,
+    .read = &trace_file_shared_op_read,
+    .poll = &trace_file_shared_op_poll
 };
 ////////////////////////////////////
 
@@ -1141,16 +2722,45 @@ buffer_size_file_write(struct file *filp,
     
     err = mutex_lock_interruptible(&trace_m);
     if(err) return err;
+    /* 
+     * Messages in the buffer and the last message extracted are kept,
+     * unless resize resets the buffer.
+     */
     err = trace_buffer_resize(tb_global, size);
-    if(err) goto out;
-    
-    tme_last_clear();
-out:
+    if(!err && !trace_buffer_resize_keeps_messages()) tme_last_clear();
     mutex_unlock(&trace_m);
     
     return err ? err : count;
 }
 
+/* Check rate of lost messages and grow the buffer if needed. */
+static void buffer_grow_work_func(struct work_struct* work)
+{
+    unsigned long lost, size, size_new;
+    
+    mutex_lock(&trace_m);
+    
+    lost = trace_buffer_lost_messages(tb_global);
+    /* Counter is cleared on reset. */
+    if(lost < buffer_grow_lost_prev) buffer_grow_lost_prev = 0;
+    
+    size = trace_buffer_size(tb_global);
+    if((lost - buffer_grow_lost_prev > buffer_grow_threshold)
+        && (size < buffer_size_max))
+    {
+        size_new = min(size * 2, buffer_size_max);
+        if(!trace_buffer_resize(tb_global, size_new))
+            pr_info("KEDR trace buffer is grown to %lu bytes per CPU "
+                "as %lu messages are lost.\n",
+                size_new, lost - buffer_grow_lost_prev);
+    }
+    buffer_grow_lost_prev = lost;
+    
+    mutex_unlock(&trace_m);
+    
+    schedule_delayed_work(&buffer_grow_work, HZ);
+}
+
 static struct file_operations buffer_size_file_ops = 
 {
     .owner = THIS_MODULE,
@@ -1188,6 +2798,299 @@ static struct file_operations lost_messages_file_ops =
     .release = &single_release,
 };
 
+// Filter file operations implementation
+static int filter_seq_show(struct seq_file* m, void* v)
+{
+    return trace_filter_show(m);
+}
+
+static int
+filter_file_open(struct inode *inode, struct file *filp)
+{
+    return single_open(filp, &filter_seq_show, NULL);
+}
+
+/* Writing to the file replaces the whole filter. */
+static ssize_t
+filter_file_write(struct file *filp,
+    const char __user *buf, size_t count, loff_t * f_pos)
+{
+    int err;
+    char* str = kmalloc(count + 1, GFP_KERNEL);
+    if(str == NULL) return -ENOMEM;
+
+    if(copy_from_user(str, buf, count))
+    {
+        kfree(str);
+        return -EFAULT;
+    }
+    str[count] = '\0';
+
+    err = trace_filter_set(str);
+
+    kfree(str);
+    
+    return err ? err : count;
+}
+
+static struct file_operations filter_file_ops = 
+{
+    .owner = THIS_MODULE,
+    .open = &filter_file_open,
+    .read = &seq_read,
+    .write = &filter_file_write,
+    .release = &single_release
+};
+
+// Sampling file operations implementation
+static int sampling_seq_show(struct seq_file* m, void* v)
+{
+    trace_format_sampling_show(m);
+    
+    return 0;
+}
+
+static int
+sampling_file_open(struct inode *inode, struct file *filp)
+{
+    return single_open(filp, &sampling_seq_show, NULL);
+}
+
+/*
+ * Parse sampling parameters for the function.
+ * 
+ * Format is '<function> [every=<N>] [rate=<R>]' or '<function> off'.
+ * Parameters which are not given are disabled.
+ */
+static int sampling_parse(char* str, const char** name,
+    unsigned int* every, unsigned int* rate)
+{
+    char* token;
+    
+    *every = 0;
+    *rate = 0;
+    *name = NULL;
+    
+    while((token = strsep(&str, " \t\n")) != NULL)
+    {
+        if(!*token) continue;
+        
+        if(!*name)
+            *name = token;
+        else if(!strncmp(token, "every=", 6))
+        {
+            if(kstrtouint(token + 6, 0, every)) return -EINVAL;
+        }
+        else if(!strncmp(token, "rate=", 5))
+        {
+            if(kstrtouint(token + 5, 0, rate)) return -EINVAL;
+        }
+        else if(strcmp(token, "off"))
+            return -EINVAL;
+    }
+    
+    return *name ? 0 : -EINVAL;
+}
+
+static ssize_t
+sampling_file_write(struct file *filp,
+    const char __user *buf, size_t count, loff_t * f_pos)
+{
+    int err;
+    const char* name;
+    unsigned int every, rate;
+    u16 format_id;
+    unsigned long skipped;
+    char* str = kmalloc(count + 1, GFP_KERNEL);
+    if(str == NULL) return -ENOMEM;
+
+    if(copy_from_user(str, buf, count))
+    {
+        kfree(str);
+        return -EFAULT;
+    }
+    str[count] = '\0';
+
+    err = sampling_parse(str, &name, &every, &rate);
+    if(err) goto out;
+    
+    err = trace_format_sampling_set(name, every, rate, &format_id, &skipped);
+    if(err) goto out;
+    
+    kedr_trace_marker_sampling(format_id, every, rate, skipped);
+out:
+    kfree(str);
+    
+    return err ? err : count;
+}
+
+static struct file_operations sampling_file_ops = 
+{
+    .owner = THIS_MODULE,
+    .open = &sampling_file_open,
+    .read = &seq_read,
+    .write = &sampling_file_write,
+    .release = &single_release
+};
+
+// Sink file operations implementation
+static int sink_seq_show(struct seq_file* m, void* v)
+{
+    return trace_sink_show(sink_global, m);
+}
+
+static int
+sink_file_open(struct inode *inode, struct file *filp)
+{
+    return single_open(filp, &sink_seq_show, NULL);
+}
+
+/*
+ * Control the sink.
+ * 
+ * Accepted commands are 'file <path>', 'memory' and 'off'.
+ */
+static ssize_t
+sink_file_write(struct file *filp,
+    const char __user *buf, size_t count, loff_t * f_pos)
+{
+    int err;
+    char* cmd;
+    char* arg;
+    char* str = kmalloc(count + 1, GFP_KERNEL);
+    if(str == NULL) return -ENOMEM;
+
+    if(copy_from_user(str, buf, count))
+    {
+        kfree(str);
+        return -EFAULT;
+    }
+    str[count] = '\0';
+
+    cmd = strim(str);
+    arg = strpbrk(cmd, " \t");
+    if(arg)
+    {
+        *arg++ = '\0';
+        arg = skip_spaces(arg);
+    }
+
+    if(!strcmp(cmd, "file") && arg && *arg)
+        err = trace_sink_start_file(sink_global, arg);
+    else if(!strcmp(cmd, "memory") && !arg)
+        err = trace_sink_start_memory(sink_global);
+    else if(!strcmp(cmd, "off") && !arg)
+    {
+        trace_sink_stop(sink_global);
+        err = 0;
+    }
+    else
+        err = -EINVAL;
+
+    kfree(str);
+    
+    return err ? err : count;
+}
+
+static struct file_operations sink_file_ops = 
+{
+    .owner = THIS_MODULE,
+    .open = &sink_file_open,
+    .read = &seq_read,
+    .write = &sink_file_write,
+    .release = &single_release
+};
+
+// Sink spill file operations implementation
+static ssize_t
+sink_spill_file_read(struct file *filp, char __user *buf, size_t count,
+    loff_t *f_pos)
+{
+    return trace_sink_read_spill(sink_global, buf, count);
+}
+
+static struct file_operations sink_spill_file_ops = 
+{
+    .owner = THIS_MODULE,
+    .read = &sink_spill_file_read,
+};
+
+// Stats file operations implementation
+static const char* context_names[trace_buffer_context_max] =
+{
+    [trace_buffer_context_normal] = "normal",
+    [trace_buffer_context_softirq] = "softirq",
+    [trace_buffer_context_irq] = "irq",
+    [trace_buffer_context_nmi] = "nmi",
+};
+
+static int stats_seq_show(struct seq_file* m, void* v)
+{
+    int cpu;
+    int context;
+    char name[16];
+    struct trace_stats_counters counters;
+    
+    trace_stats_print_header(m, "cpu");
+    for_each_online_cpu(cpu)
+    {
+        trace_stats_get_cpu(stats_global, cpu, &counters);
+        snprintf(name, sizeof(name), "%d", cpu);
+        trace_stats_print(m, name, &counters);
+    }
+    trace_stats_get(stats_global, &counters);
+    trace_stats_print(m, "total", &counters);
+    
+    seq_putc(m, '\n');
+    
+    trace_stats_print_header(m, "function");
+    trace_format_stats_show(m);
+    trace_stats_get(stats_unregistered, &counters);
+    if(counters.events || counters.failures)
+        trace_stats_print(m, "<unregistered>", &counters);
+    
+    seq_putc(m, '\n');
+    
+    /* Failures above which are caused by recursion. */
+    seq_printf(m, "%-24s %12s\n", "context", "recursive");
+    for(context = 0; context < trace_buffer_context_max; context++)
+    {
+        seq_printf(m, "%-24s %12lu\n", context_names[context],
+            kedr_trace_recursion_rejected(context));
+    }
+    
+    if(encoding_compact)
+    {
+        seq_putc(m, '\n');
+        /* Keys of the current generation. */
+        seq_printf(m, "%-24s %12s %12s\n", "dictionary", "keys", "capacity");
+        seq_printf(m, "%-24s %12u %12u\n", "call sites",
+            trace_dict_size(call_sites_dict), CALL_SITES_DICT_SIZE);
+        seq_printf(m, "%-24s %12u %12u\n", "tasks",
+            trace_dict_size(tasks_dict), TASKS_DICT_SIZE);
+        seq_printf(m, "%-24s %12lu\n", "generations",
+            dicts_rotations + 1);
+        seq_printf(m, "%-24s %12lu\n", "plain fallbacks",
+            atomic_long_read(&dicts_fallbacks));
+    }
+    
+    return 0;
+}
+
+static int
+stats_file_open(struct inode *inode, struct file *filp)
+{
+    return single_open(filp, &stats_seq_show, NULL);
+}
+
+static struct file_operations stats_file_ops = 
+{
+    .owner = THIS_MODULE,
+    .open = &stats_file_open,
+    .read = &seq_read,
+    .release = &single_release,
+};
+
 
 void print_into_buffer(struct print_buffer* pb, const char* format, ...)
 {
@@ -1221,6 +3124,28 @@ kedr_trace_module_init(void)
 {
     int err = -ENOMEM;
     struct trace_session* first_session;
+    enum trace_buffer_clock_type clock_type;
+
+    if(!strcmp(clock_mode, "global"))
+        clock_type = trace_buffer_clock_global;
+    else if(!strcmp(clock_mode, "lockless"))
+        clock_type = trace_buffer_clock_lockless;
+    else
+    {
+        pr_err("Unknown clock mode '%s' for KEDR trace.\n", clock_mode);
+        return -EINVAL;
+    }
+    trace_clock_type = clock_type;
+
+    if(!strcmp(encoding, "plain"))
+        encoding_compact = 0;
+    else if(!strcmp(encoding, "compact"))
+        encoding_compact = 1;
+    else
+    {
+        pr_err("Unknown encoding '%s' for KEDR trace.\n", encoding);
+        return -EINVAL;
+    }
 
     tme_init(&tme_last);
     
@@ -1228,9 +3153,35 @@ kedr_trace_module_init(void)
     if(!first_session) goto fail_trace_session;
     list_add(&first_session->list, &trace_session_list);
 
-    tb_global = trace_buffer_alloc(buffer_size, 1);
+    tb_global = trace_buffer_alloc(buffer_size, 1, clock_type,
+        encoding_compact);
     if(!tb_global) goto fail_trace_buffer;
     
+    if(encoding_compact)
+    {
+        call_sites_dict = trace_dict_create(CALL_SITES_DICT_SIZE,
+            sizeof(struct call_site_key));
+        if(!call_sites_dict) goto fail_call_sites_dict;
+        
+        tasks_dict = trace_dict_create(TASKS_DICT_SIZE,
+            sizeof(struct task_key));
+        if(!tasks_dict) goto fail_tasks_dict;
+    }
+    
+    stats_global = trace_stats_create();
+    if(!stats_global) goto fail_stats_global;
+    
+    stats_unregistered = trace_stats_create();
+    if(!stats_unregistered) goto fail_stats_unregistered;
+    
+    tee_global = trace_tee_create(tb_global, shared_window_size,
+        &trace_print_message);
+    if(!tee_global) goto fail_trace_tee;
+    
+    sink_global = trace_sink_create(tb_global, sink_spill_size,
+        sink_interval_ms, &trace_print_message);
+    if(!sink_global) goto fail_trace_sink;
+    
     trace_dir = debugfs_create_dir("kedr_tracing", NULL);
     if(!trace_dir) goto fail_trace_dir;
     
@@ -1244,6 +3195,16 @@ kedr_trace_module_init(void)
         
     if(!trace_session_file) goto fail_trace_session_file;
 
+    trace_binary_file = debugfs_create_file("trace_binary", S_IRUSR, trace_dir,
+        NULL, &trace_file_binary_ops);
+        
+    if(!trace_binary_file) goto fail_trace_binary_file;
+
+    trace_shared_file = debugfs_create_file("trace_shared", S_IRUSR, trace_dir,
+        NULL, &trace_file_shared_ops);
+        
+    if(!trace_shared_file) goto fail_trace_shared_file;
+
     reset_file = debugfs_create_file("reset",
         S_IWUSR | S_IWGRP,
         trace_dir,
@@ -1268,25 +3229,112 @@ kedr_trace_module_init(void)
     
     if(!lost_messages_file) goto fail_lost_messages_file;
 
+    filter_file = debugfs_create_file("filter",
+        S_IRUGO | S_IWUSR,
+        trace_dir,
+        NULL,
+        &filter_file_ops);
+    
+    if(!filter_file) goto fail_filter_file;
+
+    sampling_file = debugfs_create_file("sampling",
+        S_IRUGO | S_IWUSR,
+        trace_dir,
+        NULL,
+        &sampling_file_ops);
+    
+    if(!sampling_file) goto fail_sampling_file;
+
+    sink_file = debugfs_create_file("sink",
+        S_IRUGO | S_IWUSR,
+        trace_dir,
+        NULL,
+        &sink_file_ops);
+    
+    if(!sink_file) goto fail_sink_file;
+
+    sink_spill_file = debugfs_create_file("sink_spill",
+        S_IRUSR,
+        trace_dir,
+        NULL,
+        &sink_spill_file_ops);
+    
+    if(!sink_spill_file) goto fail_sink_spill_file;
+
+    stats_file = debugfs_create_file("stats",
+        S_IRUGO,
+        trace_dir,
+        NULL,
+        &stats_file_ops);
+    
+    if(!stats_file) goto fail_stats_file;
+
+    if(target_buffer_size)
+    {
+        targets_dir = debugfs_create_dir("targets", trace_dir);
+        if(!targets_dir) goto fail_targets_dir;
+    }
+
     err = kedr_payload_register(&payload);
     if(err) goto fail_payload;
 
+    if(buffer_size_max)
+    {
+        /* Growing buffer shouldn't drop messages already in it. */
+        if(trace_buffer_resize_keeps_messages())
+            schedule_delayed_work(&buffer_grow_work, HZ);
+        else
+            pr_info("KEDR trace buffer cannot be resized without "
+                "reset on this kernel, 'buffer_size_max' is ignored.\n");
+    }
+    if(encoding_compact)
+        schedule_delayed_work(&dicts_check_work, HZ);
+
     return 0;
 
 fail_payload:
+    debugfs_remove(targets_dir);
+fail_targets_dir:
+    debugfs_remove(stats_file);
+fail_stats_file:
+    debugfs_remove(sink_spill_file);
+fail_sink_spill_file:
+    debugfs_remove(sink_file);
+fail_sink_file:
+    debugfs_remove(sampling_file);
+fail_sampling_file:
+    debugfs_remove(filter_file);
+fail_filter_file:
     debugfs_remove(lost_messages_file);
 fail_lost_messages_file:
     debugfs_remove(buffer_size_file);
 fail_buffer_size_file:
     debugfs_remove(reset_file);
 fail_reset_file:
+    debugfs_remove(trace_shared_file);
+fail_trace_shared_file:
+    debugfs_remove(trace_binary_file);
+fail_trace_binary_file:
     debugfs_remove(trace_session_file);
 fail_trace_session_file:
     debugfs_remove(trace_file);
 fail_trace_file:
     debugfs_remove(trace_dir);
 fail_trace_dir:
+    trace_sink_destroy(sink_global);
+fail_trace_sink:
+    trace_tee_destroy(tee_global);
+fail_trace_tee:
+    trace_stats_destroy(stats_unregistered);
+fail_stats_unregistered:
+    trace_stats_destroy(stats_global);
+fail_stats_global:
+    if(tasks_dict) trace_dict_destroy(tasks_dict);
+fail_tasks_dict:
+    if(call_sites_dict) trace_dict_destroy(call_sites_dict);
+fail_call_sites_dict:
     trace_buffer_destroy(tb_global);
+    trace_format_destroy();
 fail_trace_buffer:
     list_del(&first_session->list);
     trace_session_unref(first_session);
@@ -1302,13 +3350,40 @@ kedr_trace_module_exit(void)
     struct trace_session* first_session;
     
     kedr_payload_unregister(&payload);
+    cancel_delayed_work_sync(&buffer_grow_work);
+    cancel_delayed_work_sync(&dicts_check_work);
+    /* 
+     * Targets are unloaded, so their information is freed when both
+     * their buffers and the global one are destroyed.
+     */
+    target_traces_destroy();
+    debugfs_remove(targets_dir);
+    debugfs_remove(stats_file);
+    debugfs_remove(sink_spill_file);
+    debugfs_remove(sink_file);
+    debugfs_remove(sampling_file);
+    debugfs_remove(filter_file);
     debugfs_remove(lost_messages_file);
     debugfs_remove(buffer_size_file);
     debugfs_remove(reset_file);
+    debugfs_remove(trace_shared_file);
+    debugfs_remove(trace_binary_file);
     debugfs_remove(trace_session_file);
     debugfs_remove(trace_file);
     debugfs_remove(trace_dir);
+    trace_sink_destroy(sink_global);
+    trace_tee_destroy(tee_global);
     trace_buffer_destroy(tb_global);
+    /* Messages which refer to the dictionaries are freed with the buffer. */
+    if(tasks_dict) trace_dict_destroy(tasks_dict);
+    if(call_sites_dict) trace_dict_destroy(call_sites_dict);
+    trace_stats_destroy(stats_unregistered);
+    trace_stats_destroy(stats_global);
+    /* Should be after all 'after read' callbacks are executed. */
+    trace_format_destroy();
+    kfree(binary_record);
+    trace_filter_destroy();
+    kfree(rcu_dereference_protected(targets_index, 1));
 
     first_session = list_first_entry(&trace_session_list,
         typeof(*first_session), list);
@@ -10,8 +10,13 @@
 #include <linux/slab.h> /* kmalloc and others*/
 #include <linux/wait.h> /*wait queue definitions*/
 #include <linux/sched.h> /* TASK_NORMAL, TASK_INTERRUPTIBLE*/
-#include <linux/hardirq.h> /* in_nmi() */
+#include <linux/hardirq.h> /* in_nmi(), hardirq_count(), in_serving_softirq() */
 #include <linux/hrtimer.h> /* high resolution timer for clock*/
+#include <linux/atomic.h> /* atomic64_t for lock-free clock */
+#include <linux/percpu.h> /* per-cpu state of compact timestamps */
+#include <linux/irqflags.h> /* local_irq_save() */
+#include <linux/llist.h> /* lock-free lists of callbacks */
+#include <asm/unaligned.h> /* get_unaligned(), put_unaligned() */
 
 #include "config.h"
 
@@ -40,7 +45,29 @@
 /*
  * We want timestamps to be strongly monotonic.
  */
-static u64 last_ts = 0;
+
+/*
+ * Make 'ts' greater than the last timestamp issued and store it as
+ * the last one. The last timestamp is advanced with cmpxchg as an
+ * atomic maximum, so it is never read torn and never goes back,
+ * even if the caller doesn't hold any lock.
+ */
+static u64 advance_ts(atomic64_t* last_issued, u64 ts)
+{
+	u64 last = atomic64_read(last_issued);
+
+	while(1)
+	{
+		u64 ts_new = ((s64)(ts - last) <= 0) ? last + 1 : ts;
+		u64 last_real = atomic64_cmpxchg(last_issued, last, ts_new);
+
+		if(last_real == last) return ts_new;
+		/* Another CPU has issued timestamp concurrently, retry. */
+		last = last_real;
+	}
+}
+
+static atomic64_t last_ts = ATOMIC64_INIT(0);
 static DEFINE_SPINLOCK(last_ts_lock);
 
 static u64 correct_ts(u64 ts)
@@ -48,17 +75,22 @@ static u64 correct_ts(u64 ts)
 	unsigned long flags;
 
 	/*
-	 * If in an NMI context then dont risk lockups and return the
-	 * input timestamp:
+	 * In an NMI context the lock may be held by the interrupted code,
+	 * so dont risk lockups and don't wait for it. If the lock is busy,
+	 * timestamp is issued without the lock: the atomic maximum keeps
+	 * it ordered with the ones issued under the lock.
 	 */
+	if (in_nmi())
+	{
+		if (!spin_trylock_irqsave(&last_ts_lock, flags))
+			return advance_ts(&last_ts, ts);
+	}
+	else
+	{
+		spin_lock_irqsave(&last_ts_lock, flags);
+	}
 
-	if (in_nmi()) return ts;
-	
-	spin_lock_irqsave(&last_ts_lock, flags);
-
-	if ((s64)(ts - last_ts) <= 0)
-		ts = last_ts + 1;
-	last_ts = ts;
+	ts = advance_ts(&last_ts, ts);
 
 	spin_unlock_irqrestore(&last_ts_lock, flags);
 
@@ -72,6 +104,31 @@ kedr_clock(void)
 	return correct_ts(ktime_to_ns(ktime_get()));
 }
 
+/*
+ * Lock-free variant of the strongly monotonic timestamps.
+ *
+ * Instead of serializing all CPUs on 'last_ts_lock' (with interrupts
+ * disabled), the last timestamp issued is only advanced with advance_ts().
+ * Every timestamp is still strictly greater than any timestamp issued
+ * before it, so strictly ordered actions on different CPUs get strictly
+ * ordered timestamps.
+ *
+ * Because no lock is taken, this variant is also safe in NMI context,
+ * so timestamps of NMI messages are corrected too.
+ */
+static atomic64_t last_ts_lockless = ATOMIC64_INIT(0);
+
+static u64 correct_ts_lockless(u64 ts)
+{
+	return advance_ts(&last_ts_lockless, ts);
+}
+
+static u64
+kedr_clock_lockless(void)
+{
+	return correct_ts_lockless(ktime_to_ns(ktime_get()));
+}
+
 /* 
  * Format of ring buffer trace data.
  * 
@@ -89,13 +146,67 @@ struct trace_data
 #define msg_to_event_size(msg_size) ((msg_size) + offsetof(struct trace_data, msg))
 #define event_to_msg_size(event_size) ((event_size) - offsetof(struct trace_data, msg))
 
+/*
+ * Format of ring buffer trace data with compact timestamps.
+ * 
+ * Data begins with 32-bit header. Two lower bits of the header are
+ * the kind of the timestamp:
+ * 
+ *   delta - upper bits of the header are the difference with the
+ *           timestamp of the previous delta or sync event on the same
+ *           CPU. The message follows the header.
+ *   sync  - 64-bit timestamp follows the header, then the message.
+ *           Next delta events are counted from it.
+ *   abs   - same as sync, but delta events are not counted from it.
+ *           Used for messages written from NMI.
+ * 
+ * Delta event is written only when the previous event, which delta is
+ * counted from, is stored in the same page of the ring buffer. Pages
+ * are lost as a whole, so delta event is never read without its
+ * predecessor. The first event in the page is always sync.
+ */
+#define TS_KIND_DELTA 0
+#define TS_KIND_SYNC 1
+#define TS_KIND_ABS 2
+#define TS_KIND_MASK 3
+
+#define TS_DELTA_SHIFT 2
+#define TS_DELTA_MAX ((u64)(~(u32)0 >> TS_DELTA_SHIFT))
+
+#define TS_HEADER_SIZE_DELTA sizeof(u32)
+#define TS_HEADER_SIZE_FULL (sizeof(u32) + sizeof(u64))
+
+#define ts_header_size(header) \
+	((((header) & TS_KIND_MASK) == TS_KIND_DELTA) \
+		? TS_HEADER_SIZE_DELTA : TS_HEADER_SIZE_FULL)
+
+#define event_page(event) ((unsigned long)ring_buffer_event_data(event) & PAGE_MASK)
+
+/* Per-cpu state of the writer of compact timestamps. */
+struct ts_writer
+{
+	/* Timestamp of the last delta or sync event. */
+	u64 ts_prev;
+	/* Page where that event is stored. */
+	unsigned long page;
+	/* Value of 'ts_sync_gen' of the buffer when that event is written. */
+	unsigned int sync_gen;
+};
+
+/* Per-cpu state of the recursion protection. */
+struct trace_recursion
+{
+	/* Bit for every context which writer is active on the CPU. */
+	unsigned int bits;
+	/* Number of rejected writes for every context. */
+	unsigned long rejected[trace_buffer_context_max];
+};
+
 /*
  * Last message extracted from per-cpu buffer.
  */
 struct last_message
 {
-	/* List of per-cpu last messages ordered by timestamp. */
-	struct list_head list;
 	/* 
 	 * Event extracted or NULL if buffer found to be empty.
 	 * */
@@ -108,19 +219,15 @@ struct last_message
 	 * which cannot be more than any possible timestamp of the future message.
 	 */
 	u64 ts;
-};
-
-void last_message_set(struct last_message* lm,
-	struct ring_buffer_event* event)
-{
-	struct trace_data* td;
-	
-	BUG_ON(lm->event);
 	
-	td = ring_buffer_event_data(event);
-	lm->ts = td->ts;
-	lm->event = event;
-}
+	/*
+	 * For compact timestamps: timestamp of the last delta or sync
+	 * event read and page where that event is stored. If 'ts_base_page'
+	 * is 0, the timestamp is unknown.
+	 */
+	u64 ts_base;
+	unsigned long ts_base_page;
+};
 
 /*
  * Struct, represented buffer which support two main operations:
@@ -136,12 +243,19 @@ struct trace_buffer
 
 	//Array of 'last_message' content for corresponding CPUs.
 	struct last_message* last_messages;
-	//List organization of 'last_messages', ordered by .ts in ascended order.
-	struct list_head last_messages_ordered;
+	/*
+	 * Binary min-heap of pointers to 'last_messages', keyed by .ts.
+	 * 
+	 * The oldest message is always at the top. Only timestamp of the
+	 * top message is changed, and it is only increased, so heap
+	 * is restored by sifting the top down: O(log(NR_CPUS)) per message.
+	 */
+	struct last_message** last_messages_heap;
+	int n_last_messages;
 	
 	/* 
 	 * Prevent concurrent access to 'last_message' array
-	 * and 'last_messages_ordered' list.
+	 * and 'last_messages_heap'.
 	 */
 	struct mutex m;
 	
@@ -150,19 +264,114 @@ struct trace_buffer
 
 	u64 (*clock)(void);
 	
+	/* Whether timestamps are stored in compact form. */
+	bool compact_ts;
+	/* Per-cpu state of the writers. Used only for compact timestamps. */
+	struct ts_writer __percpu* ts_writers;
+	/* Incremented when buffer is reset, so writers start from sync events. */
+	atomic_t ts_sync_gen;
+	/* 
+	 * Number of delta events dropped because their timestamp cannot
+	 * be restored. Protected by the mutex.
+	 */
+	unsigned long ts_lost;
+	
+	/* Per-cpu state of the recursion protection. */
+	struct trace_recursion __percpu* recursion;
+	
 	/*
-     *  Pointer to the first callback(for call it when needed)
-     * and to the last callback for add new ones.
-     */
-    struct kedr_trace_callback_head* callback_first;
-    struct kedr_trace_callback_head** callback_last_p;
+	 * Callbacks are added lock-free into per-cpu lists, and are
+	 * collected into 'callbacks_pending' list, sorted by timestamp,
+	 * when they are going to be executed.
+	 */
+	struct llist_head __percpu* callbacks_new;
+	/* Pointer to the first and to the last pending callbacks. */
+	struct llist_node* callbacks_pending;
+	struct llist_node* callbacks_pending_last;
+	/* Number of callbacks added but not executed yet. */
+	atomic_t callbacks_count;
+	/* 
+	 * Callbacks with timestamp less than this are ready for execution.
+	 * 
+	 * Advanced by the reader under mutex and by the writer of the
+	 * callback, which finds the buffer empty. Callbacks themselves are
+	 * executed after the mutex is released.
+	 */
+	atomic64_t callbacks_ready_ts;
+	/*
+	 * Set when somebody fails to take 'cb_lock' for execution of the
+	 * callbacks. The holder of the lock repeats the execution after it
+	 * releases the lock.
+	 */
+	atomic_t callbacks_kick;
 
 	/*
-	 * Protect callbacks list and their execution.
+	 * Protect pending callbacks list and execution of callbacks.
 	 */
 	spinlock_t cb_lock;
 };
 
+/*
+ * Set event as the last message extracted from per-cpu buffer.
+ * 
+ * Return false if timestamp of the event cannot be restored. Such
+ * event is not set.
+ */
+static bool last_message_set(struct trace_buffer* tb,
+	struct last_message* lm, struct ring_buffer_event* event)
+{
+	struct trace_data* td;
+	u32 header;
+	
+	BUG_ON(lm->event);
+	
+	if(!tb->compact_ts)
+	{
+		td = ring_buffer_event_data(event);
+		lm->ts = td->ts;
+		lm->event = event;
+		return 1;
+	}
+	
+	header = *(u32*)ring_buffer_event_data(event);
+	switch(header & TS_KIND_MASK)
+	{
+	case TS_KIND_DELTA:
+		if(lm->ts_base_page != event_page(event)) return 0;
+		lm->ts_base += header >> TS_DELTA_SHIFT;
+		lm->ts = lm->ts_base;
+		break;
+	case TS_KIND_SYNC:
+		lm->ts_base = get_unaligned((u64*)((u32*)ring_buffer_event_data(event) + 1));
+		lm->ts_base_page = event_page(event);
+		lm->ts = lm->ts_base;
+		break;
+	default:
+		lm->ts = get_unaligned((u64*)((u32*)ring_buffer_event_data(event) + 1));
+	}
+	
+	lm->event = event;
+	return 1;
+}
+
+/* Return pointer to the message stored in the event and its size. */
+static void* event_to_msg(struct trace_buffer* tb,
+	struct ring_buffer_event* event, size_t* size)
+{
+	size_t header_size;
+	char* data = ring_buffer_event_data(event);
+	
+	if(!tb->compact_ts)
+	{
+		*size = event_to_msg_size(ring_buffer_event_length(event));
+		return ((struct trace_data*)data)->msg;
+	}
+	
+	header_size = ts_header_size(*(u32*)data);
+	*size = ring_buffer_event_length(event) - header_size;
+	return data + header_size;
+}
+
 void trace_buffer_clear_last_message(struct trace_buffer* tb, int cpu)
 {
 	if(tb->last_messages[cpu].event)
@@ -172,46 +381,180 @@ void trace_buffer_clear_last_message(struct trace_buffer* tb, int cpu)
 	}
 }
 
+/*
+ * Restore heap property after timestamp of the top message is increased.
+ * 
+ * Return true if the top message has been moved down, that is some other
+ * message is older than it.
+ */
+static bool trace_buffer_sift_oldest(struct trace_buffer* tb)
+{
+	struct last_message** heap = tb->last_messages_heap;
+	struct last_message* lm = heap[0];
+	int n = tb->n_last_messages;
+	int i = 0;
+	
+	while(1)
+	{
+		int child = 2 * i + 1;
+		if(child >= n) break;
+		
+		if((child + 1 < n) && (heap[child + 1]->ts < heap[child]->ts))
+			child++;
+		/* On equal timestamps the moved message is left above. */
+		if(heap[child]->ts >= lm->ts) break;
+		
+		heap[i] = heap[child];
+		i = child;
+	}
+	
+	heap[i] = lm;
+	
+	return i != 0;
+}
+
+#define callback_of(n) llist_entry(n, struct kedr_trace_callback_head, node)
+
 /* 
- * Execute all callbacks with timestamp less than given one.
+ * Insert callback into the pending list according to its timestamp.
+ * 
+ * Callbacks are usually added in order of timestamps, so this is
+ * usually appending to the end.
  * 
  * Should be executed under cb_lock.
  */
-static inline void
-execute_callbacks_before_ts(struct trace_buffer* tb, u64 ts)
+static void callbacks_pending_insert(struct trace_buffer* tb,
+	struct llist_node* node)
 {
-	while(tb->callback_first)
+	struct llist_node** p;
+	u64 ts = callback_of(node)->ts;
+	
+	if(!tb->callbacks_pending
+		|| (callback_of(tb->callbacks_pending_last)->ts <= ts))
 	{
-		struct kedr_trace_callback_head* callback = tb->callback_first;
-		if(callback->ts >= ts) break;
+		node->next = NULL;
+		if(tb->callbacks_pending)
+			tb->callbacks_pending_last->next = node;
+		else
+			tb->callbacks_pending = node;
+		tb->callbacks_pending_last = node;
+		return;
+	}
+	
+	/* Node is inserted before the last one, so the last isn't changed. */
+	for(p = &tb->callbacks_pending; callback_of(*p)->ts <= ts; p = &(*p)->next);
+	
+	node->next = *p;
+	*p = node;
+}
 
-		tb->callback_first = callback->next;
-		if(!tb->callback_first)
+/* 
+ * Move callbacks from per-cpu lists into the pending list.
+ * 
+ * Should be executed under cb_lock.
+ */
+static void callbacks_collect(struct trace_buffer* tb)
+{
+	int cpu;
+	
+	for_each_possible_cpu(cpu)
+	{
+		struct llist_node* node = llist_del_all(per_cpu_ptr(tb->callbacks_new, cpu));
+		struct llist_node* reversed = NULL;
+		
+		/* List is extracted from the newest callback, reverse it. */
+		while(node)
 		{
-			tb->callback_last_p = &tb->callback_first;
+			struct llist_node* next = node->next;
+			node->next = reversed;
+			reversed = node;
+			node = next;
+		}
+		
+		while(reversed)
+		{
+			struct llist_node* next = reversed->next;
+			callbacks_pending_insert(tb, reversed);
+			reversed = next;
 		}
-		callback->func(callback);
 	}
 }
 
 /* 
- * Execute all callbacks.
+ * Execute ready callbacks, or all callbacks if 'all' is true.
  * 
- * Should be executed under cb_lock or without concurrency.
+ * If 'try' is true and callbacks are being executed by someone else,
+ * return immediately. The one who executes them repeats the execution
+ * after that, so callbacks which have become ready are not left until
+ * the next read.
+ * 
+ * Readers call it after the mutex is released, so writers waiting for
+ * the callbacks are not delayed by reading of the messages.
  */
-static inline void
-execute_callbacks_all(struct trace_buffer* tb)
+static void
+trace_buffer_run_callbacks(struct trace_buffer* tb, bool all, bool try)
 {
-	while(tb->callback_first)
+	unsigned long flags;
+	u64 ready_ts;
+	
+	/* Fast path for the reader: nothing to execute. */
+	if(!atomic_read(&tb->callbacks_count)) return;
+	
+	do
 	{
-		struct kedr_trace_callback_head* callback = tb->callback_first;
-
-		tb->callback_first = callback->next;
-		if(!tb->callback_first)
+		/* Writers may drain callbacks from interrupt context. */
+		if(try)
 		{
-			tb->callback_last_p = &tb->callback_first;
+			/* Pairs with smp_mb() after the lock is released below. */
+			atomic_set(&tb->callbacks_kick, 1);
+			smp_mb();
+			if(!spin_trylock_irqsave(&tb->cb_lock, flags)) return;
 		}
-		callback->func(callback);
+		else
+		{
+			spin_lock_irqsave(&tb->cb_lock, flags);
+		}
+		atomic_set(&tb->callbacks_kick, 0);
+		
+		callbacks_collect(tb);
+		ready_ts = atomic64_read(&tb->callbacks_ready_ts);
+		
+		while(tb->callbacks_pending)
+		{
+			struct kedr_trace_callback_head* callback =
+				callback_of(tb->callbacks_pending);
+			if(!all && (callback->ts >= ready_ts)) break;
+			
+			tb->callbacks_pending = tb->callbacks_pending->next;
+			atomic_dec(&tb->callbacks_count);
+			/* 
+			 * Callback may add new callback, which is executed
+			 * at the next iteration, if it is ready.
+			 */
+			callback->func(callback);
+		}
+		
+		spin_unlock_irqrestore(&tb->cb_lock, flags);
+		smp_mb();
+	} while(atomic_read(&tb->callbacks_kick));
+}
+
+/* 
+ * Mark callbacks with timestamp less than given one as ready.
+ * 
+ * May be executed concurrently, the mark never goes back.
+ */
+static inline void
+trace_buffer_callbacks_ready(struct trace_buffer* tb, u64 ts)
+{
+	u64 ready_ts = atomic64_read(&tb->callbacks_ready_ts);
+	
+	while(ts > ready_ts)
+	{
+		u64 ready_ts_real = atomic64_cmpxchg(&tb->callbacks_ready_ts,
+			ready_ts, ts);
+		if(ready_ts_real == ready_ts) break;
+		ready_ts = ready_ts_real;
 	}
 }
 
@@ -224,18 +567,18 @@ execute_callbacks_all(struct trace_buffer* tb)
 
 static void trace_buffer_clear_internal(struct trace_buffer* tb)
 {
-	unsigned long flags;
 	int cpu;
 	//Clear last messages
 	for_each_possible_cpu(cpu)
 	{
 		trace_buffer_clear_last_message(tb, cpu);
+		tb->last_messages[cpu].ts_base_page = 0;
 	}
 
 	ring_buffer_reset(tb->buffer);
-	spin_lock_irqsave(&tb->cb_lock, flags);
-	execute_callbacks_all(tb);
-	spin_unlock_irqrestore(&tb->cb_lock, flags);
+	atomic_inc(&tb->ts_sync_gen);
+	tb->ts_lost = 0;
+	trace_buffer_run_callbacks(tb, 1, 0);
 }
 
 /*
@@ -246,8 +589,11 @@ static void trace_buffer_clear_internal(struct trace_buffer* tb)
  *  when size is overflowed while writing message:
  *   if 'mode_overwrite' is 0, then newest message will be dropped.
  *   otherwise the oldest message will be dropped.
+ * 'clock_type' determine clock used for timestamps of messages.
+ * 'compact_ts' determine whether timestamps are stored in compact form.
  */
-struct trace_buffer* trace_buffer_alloc(size_t size, bool mode_overwrite)
+struct trace_buffer* trace_buffer_alloc(size_t size, bool mode_overwrite,
+	enum trace_buffer_clock_type clock_type, bool compact_ts)
 {
 	int cpu;
 	u64 ts;
@@ -268,7 +614,14 @@ struct trace_buffer* trace_buffer_alloc(size_t size, bool mode_overwrite)
 	}
 	
 	//setup clock
-	tb->clock = kedr_clock;
+	switch(clock_type)
+	{
+	case trace_buffer_clock_lockless:
+		tb->clock = kedr_clock_lockless;
+		break;
+	default:
+		tb->clock = kedr_clock;
+	}
 	ts = tb->clock();
 
 	tb->last_messages = kmalloc(num_possible_cpus() * sizeof(struct last_message), GFP_KERNEL);
@@ -280,14 +633,79 @@ struct trace_buffer* trace_buffer_alloc(size_t size, bool mode_overwrite)
 		return NULL;
 	}
 
-	INIT_LIST_HEAD(&tb->last_messages_ordered);
+	tb->last_messages_heap = kmalloc(num_possible_cpus() * sizeof(struct last_message*), GFP_KERNEL);
+	if(tb->last_messages_heap == NULL)
+	{
+		pr_err("%s: Cannot allocate heap of last messages.", __func__);
+		kfree(tb->last_messages);
+		ring_buffer_free(tb->buffer);
+		kfree(tb);
+		return NULL;
+	}
+
+	tb->compact_ts = compact_ts;
+	tb->ts_writers = NULL;
+	if(compact_ts)
+	{
+		/* Zeroed state never matches 'ts_sync_gen', so writers start from sync. */
+		tb->ts_writers = alloc_percpu(struct ts_writer);
+		if(tb->ts_writers == NULL)
+		{
+			pr_err("%s: Cannot allocate state of timestamp writers.", __func__);
+			kfree(tb->last_messages_heap);
+			kfree(tb->last_messages);
+			ring_buffer_free(tb->buffer);
+			kfree(tb);
+			return NULL;
+		}
+	}
+	atomic_set(&tb->ts_sync_gen, 1);
+	tb->ts_lost = 0;
+
+	tb->recursion = alloc_percpu(struct trace_recursion);
+	if(tb->recursion == NULL)
+	{
+		pr_err("%s: Cannot allocate state of recursion protection.", __func__);
+		free_percpu(tb->ts_writers);
+		kfree(tb->last_messages_heap);
+		kfree(tb->last_messages);
+		ring_buffer_free(tb->buffer);
+		kfree(tb);
+		return NULL;
+	}
+	for_each_possible_cpu(cpu)
+	{
+		memset(per_cpu_ptr(tb->recursion, cpu), 0,
+			sizeof(struct trace_recursion));
+	}
+
+	tb->callbacks_new = alloc_percpu(struct llist_head);
+	if(tb->callbacks_new == NULL)
+	{
+		pr_err("%s: Cannot allocate lists of callbacks.", __func__);
+		free_percpu(tb->recursion);
+		free_percpu(tb->ts_writers);
+		kfree(tb->last_messages_heap);
+		kfree(tb->last_messages);
+		ring_buffer_free(tb->buffer);
+		kfree(tb);
+		return NULL;
+	}
+	for_each_possible_cpu(cpu)
+	{
+		init_llist_head(per_cpu_ptr(tb->callbacks_new, cpu));
+	}
+
+	/* All timestamps are equal, so any order is a heap. */
+	tb->n_last_messages = 0;
 	for_each_possible_cpu(cpu)
 	{
 		struct last_message* lm = &tb->last_messages[cpu];
 
 		lm->event = NULL;
 		lm->ts = ts;
-		list_add_tail(&lm->list, &tb->last_messages_ordered);
+		lm->ts_base_page = 0;
+		tb->last_messages_heap[tb->n_last_messages++] = lm;
 	}
 
 	mutex_init(&tb->m);
@@ -295,8 +713,11 @@ struct trace_buffer* trace_buffer_alloc(size_t size, bool mode_overwrite)
 
 	init_waitqueue_head(&tb->rq);
 
-	tb->callback_first = NULL;
-	tb->callback_last_p = &tb->callback_first;
+	tb->callbacks_pending = NULL;
+	tb->callbacks_pending_last = NULL;
+	atomic_set(&tb->callbacks_count, 0);
+	atomic64_set(&tb->callbacks_ready_ts, 0);
+	atomic_set(&tb->callbacks_kick, 0);
 	
 	return tb;
 }
@@ -305,11 +726,15 @@ struct trace_buffer* trace_buffer_alloc(size_t size, bool mode_overwrite)
  */
 void trace_buffer_destroy(struct trace_buffer* tb)
 {
-	execute_callbacks_all(tb);
+	trace_buffer_run_callbacks(tb, 1, 0);
 	
 	mutex_destroy(&tb->m);
 
 	ring_buffer_free(tb->buffer);
+	free_percpu(tb->callbacks_new);
+	free_percpu(tb->recursion);
+	free_percpu(tb->ts_writers);
+	kfree(tb->last_messages_heap);
 	kfree(tb->last_messages);
 	kfree(tb);
 }
@@ -326,18 +751,161 @@ void trace_buffer_destroy(struct trace_buffer* tb)
  * 
  * May be called in the atomic context.
  */
-void* trace_buffer_write_lock(struct trace_buffer* tb,
+static void* trace_buffer_write_lock_compact(struct trace_buffer* tb,
+	size_t size, void** msg)
+{
+	unsigned long flags;
+	struct ring_buffer_event* event;
+	struct ts_writer* writer;
+	unsigned int sync_gen;
+	u32* header;
+	u64 ts;
+	
+	if(in_nmi())
+	{
+		/* 
+		 * NMI may interrupt other writer in the middle, so the state
+		 * of the writer cannot be used. Timestamp is set on commit.
+		 */
+		event = ring_buffer_lock_reserve(tb->buffer,
+			TS_HEADER_SIZE_FULL + size);
+		if(event == NULL) return NULL;
+		header = ring_buffer_event_data(event);
+		*header = TS_KIND_ABS;
+		*msg = (char*)header + TS_HEADER_SIZE_FULL;
+		return event;
+	}
+	
+	/* 
+	 * Timestamp is taken at reservation. With interrupts disabled,
+	 * order of events in the per-cpu buffer is the order of their
+	 * timestamps, and reader may restore timestamps from deltas.
+	 */
+	local_irq_save(flags);
+	writer = this_cpu_ptr(tb->ts_writers);
+	sync_gen = atomic_read(&tb->ts_sync_gen);
+	ts = tb->clock();
+	
+	if((writer->sync_gen == sync_gen) && (ts - writer->ts_prev <= TS_DELTA_MAX))
+	{
+		event = ring_buffer_lock_reserve(tb->buffer,
+			TS_HEADER_SIZE_DELTA + size);
+		if(event == NULL) goto out;
+		
+		if(event_page(event) == writer->page)
+		{
+			header = ring_buffer_event_data(event);
+			*header = ((u32)(ts - writer->ts_prev) << TS_DELTA_SHIFT)
+				| TS_KIND_DELTA;
+			*msg = (char*)header + TS_HEADER_SIZE_DELTA;
+			goto set_prev;
+		}
+		/* Event is the first in the page, it should be sync. */
+		ring_buffer_discard_commit(tb->buffer, event);
+	}
+	
+	event = ring_buffer_lock_reserve(tb->buffer, TS_HEADER_SIZE_FULL + size);
+	if(event == NULL) goto out;
+	
+	header = ring_buffer_event_data(event);
+	*header = TS_KIND_SYNC;
+	put_unaligned(ts, (u64*)(header + 1));
+	*msg = (char*)header + TS_HEADER_SIZE_FULL;
+	writer->sync_gen = sync_gen;
+
+set_prev:
+	writer->ts_prev = ts;
+	writer->page = event_page(event);
+out:
+	local_irq_restore(flags);
+	return event;
+}
+
+static void* trace_buffer_write_lock_plain(struct trace_buffer* tb,
 	size_t size, void** msg)
 {
 	struct trace_data* msg_real;
-	struct ring_buffer_event* event =
-		ring_buffer_lock_reserve(tb->buffer, msg_to_event_size(size));
+	struct ring_buffer_event* event;
+	
+	event = ring_buffer_lock_reserve(tb->buffer, msg_to_event_size(size));
 	if(event == NULL) return NULL;
 	msg_real = ring_buffer_event_data(event);
 	*msg = (void*)msg_real->msg;
 	return event;
 }
 
+/* Return context of the current writer. */
+static enum trace_buffer_context trace_context_current(void)
+{
+	if(in_nmi()) return trace_buffer_context_nmi;
+	if(hardirq_count()) return trace_buffer_context_irq;
+	if(in_serving_softirq()) return trace_buffer_context_softirq;
+	return trace_buffer_context_normal;
+}
+
+/*
+ * Mark writer of given context as active on the current CPU.
+ * 
+ * Return false if such writer is already active, that is this is
+ * a recursion.
+ * 
+ * Should be called with preemption disabled.
+ * 
+ * Writer of more nested context may interrupt read-modify-write
+ * of the bits, but it restores them before return.
+ */
+static bool trace_recursion_enter(struct trace_buffer* tb,
+	enum trace_buffer_context context)
+{
+	struct trace_recursion* recursion = this_cpu_ptr(tb->recursion);
+	
+	if(recursion->bits & (1 << context))
+	{
+		recursion->rejected[context]++;
+		return 0;
+	}
+	recursion->bits |= 1 << context;
+	barrier();
+	return 1;
+}
+
+static void trace_recursion_exit(struct trace_buffer* tb,
+	enum trace_buffer_context context)
+{
+	struct trace_recursion* recursion = this_cpu_ptr(tb->recursion);
+	
+	barrier();
+	recursion->bits &= ~(1 << context);
+}
+
+void* trace_buffer_write_lock(struct trace_buffer* tb,
+	size_t size, void** msg)
+{
+	void* id;
+	enum trace_buffer_context context = trace_context_current();
+	
+	/* 
+	 * Reserved event keeps preemption disabled until commit,
+	 * so writer stays on the CPU.
+	 */
+	preempt_disable();
+	if(!trace_recursion_enter(tb, context))
+	{
+		preempt_enable();
+		return NULL;
+	}
+	
+	if(tb->compact_ts)
+		id = trace_buffer_write_lock_compact(tb, size, msg);
+	else
+		id = trace_buffer_write_lock_plain(tb, size, msg);
+	
+	if(id == NULL) trace_recursion_exit(tb, context);
+	preempt_enable();
+	
+	return id;
+}
+
 /*
  * Commit message written after previous call
  * trace_buffer_write_lock().
@@ -348,8 +916,19 @@ void trace_buffer_write_unlock(struct trace_buffer* tb,
 	void* id)
 {
 	struct ring_buffer_event* event = (struct ring_buffer_event*)id;
-	struct trace_data *msg_real = ring_buffer_event_data(event);
-	msg_real->ts = tb->clock();
+	
+	if(!tb->compact_ts)
+	{
+		struct trace_data *msg_real = ring_buffer_event_data(event);
+		msg_real->ts = tb->clock();
+	}
+	else
+	{
+		u32* header = ring_buffer_event_data(event);
+		if((*header & TS_KIND_MASK) == TS_KIND_ABS)
+			put_unaligned(tb->clock(), (u64*)(header + 1));
+	}
+	trace_recursion_exit(tb, trace_context_current());
 	ring_buffer_unlock_commit(tb->buffer, event);
 	/* It is sufficient to check waitqueue emptiness without lock */
 	if(waitqueue_active(&tb->rq))
@@ -391,7 +970,6 @@ void trace_buffer_write_message(struct trace_buffer* tb,
 
 static int trace_buffer_update_internal(struct trace_buffer* tb)
 {
-	unsigned long flags;
 	/* Timestamp for empty per-cpu buffers. */
 	u64 ts_empty = 0;
 	/* Whether ts_empty is set. */
@@ -404,12 +982,10 @@ static int trace_buffer_update_internal(struct trace_buffer* tb)
 	while(1)
 	{
 		struct ring_buffer_event* event;
-		struct last_message* lm;
 		int cpu;
 		
 		
-		oldest_message = list_first_entry(&tb->last_messages_ordered,
-			struct last_message, list);
+		oldest_message = tb->last_messages_heap[0];
 		
 		if(oldest_message->event) break; // Oldest message is already set.
 		
@@ -424,24 +1000,20 @@ static int trace_buffer_update_internal(struct trace_buffer* tb)
 		
 		event = ring_buffer_peek_compat(tb->buffer, cpu, NULL);
 		
+		if(event && !last_message_set(tb, oldest_message, event))
+		{
+			/* Timestamp is unknown, so message cannot be ordered. */
+			ring_buffer_consume_compat(tb->buffer, cpu, NULL);
+			tb->ts_lost++;
+			continue;
+		}
+		
 		if(event)
 		{
-			last_message_set(oldest_message, event);
-			
 			non_empty_buffer_found = 1;
 			
 			// Reorder given last message, if needed
-			lm = oldest_message;
-			list_for_each_entry_continue(lm, &tb->last_messages_ordered, list)
-			{
-				if(lm->ts >= oldest_message->ts) break;
-			}
-			
-			if(oldest_message->list.next != &lm->list)
-			{
-				// Reorder
-				list_move_tail(&oldest_message->list, &lm->list);
-			}
+			trace_buffer_sift_oldest(tb);
 			
 			/* 
 			 * Per-cpu buffer has message extracted, so it won't be
@@ -479,17 +1051,8 @@ static int trace_buffer_update_internal(struct trace_buffer* tb)
 		oldest_message->ts = ts_empty;
 				
 		// Reorder given last message, if needed
-		lm = oldest_message;
-		list_for_each_entry_continue(lm, &tb->last_messages_ordered, list)
+		if(trace_buffer_sift_oldest(tb))
 		{
-			if(lm->ts >= oldest_message->ts) break;
-		}
-		
-		if(oldest_message->list.next != &lm->list)
-		{
-			// Reorder
-			list_move_tail(&oldest_message->list, &lm->list);
-			
 			/*
 			 * Every per-cpu buffer which is found to be empty has
 			 * 'ts_empty' timestamp.
@@ -511,9 +1074,7 @@ static int trace_buffer_update_internal(struct trace_buffer* tb)
 		if(!non_empty_buffer_found)
 		{
 			/* Every per-cpu buffer is checked and found to be empty. */
-			spin_lock_irqsave(&tb->cb_lock, flags);
-			execute_callbacks_before_ts(tb, ts_empty);
-			spin_unlock_irqrestore(&tb->cb_lock, flags);
+			trace_buffer_callbacks_ready(tb, ts_empty);
 			return -EAGAIN;
 		}
 			
@@ -530,41 +1091,41 @@ static int trace_buffer_update_internal(struct trace_buffer* tb)
 		synchronize_sched();
 	}
    
-	spin_lock_irqsave(&tb->cb_lock, flags);
-	execute_callbacks_before_ts(tb, oldest_message->ts);
-	spin_unlock_irqrestore(&tb->cb_lock, flags);
+	trace_buffer_callbacks_ready(tb, oldest_message->ts);
 
 	return 0;
 }
 
-int
-trace_buffer_read(struct trace_buffer* tb,
+/*
+ * Pass the oldest message to 'process_msg'.
+ * 
+ * Should be executed under mutex locked.
+ */
+static int
+trace_buffer_read_internal(struct trace_buffer* tb,
 	int (*process_msg)(const void* msg, size_t size, int cpu,
 		u64 ts, void* user_data),
 	void* user_data)
 {
-	int err = 0;
+	int err;
 
 	int cpu;
-	struct trace_data* td;
+	void* msg;
+	size_t size;
 	struct last_message* oldest_message;
 
-	if(mutex_lock_killable(&tb->m))
-		return -ERESTARTSYS;
-
-
 	err = trace_buffer_update_internal(tb);
-	if(err) goto out;
+	if(err) return err;
 
-	oldest_message = list_first_entry(&tb->last_messages_ordered, struct last_message, list);
+	oldest_message = tb->last_messages_heap[0];
 	
 	BUG_ON(!oldest_message->event);
 	
 	cpu = oldest_message - tb->last_messages;
-	td = ring_buffer_event_data(oldest_message->event);
+	msg = event_to_msg(tb, oldest_message->event, &size);
 	
-	err = process_msg(td->msg,
-		event_to_msg_size(ring_buffer_event_length(oldest_message->event)),
+	err = process_msg(msg,
+		size,
 		cpu,
 		oldest_message->ts,
 		user_data);
@@ -574,11 +1135,51 @@ trace_buffer_read(struct trace_buffer* tb,
 		trace_buffer_clear_last_message(tb, cpu);
 	}
 	
-out:
+	return err;
+}
+
+int
+trace_buffer_read(struct trace_buffer* tb,
+	int (*process_msg)(const void* msg, size_t size, int cpu,
+		u64 ts, void* user_data),
+	void* user_data)
+{
+	int err;
+
+	if(mutex_lock_killable(&tb->m))
+		return -ERESTARTSYS;
+
+	err = trace_buffer_read_internal(tb, process_msg, user_data);
+
 	mutex_unlock(&tb->m);
+	
+	trace_buffer_run_callbacks(tb, 0, 0);
 	return err;
 }
 
+int
+trace_buffer_read_batch(struct trace_buffer* tb,
+	int (*process_msg)(const void* msg, size_t size, int cpu,
+		u64 ts, void* user_data),
+	void* user_data)
+{
+	int err;
+	int n_consumed = 0;
+
+	if(mutex_lock_killable(&tb->m))
+		return -ERESTARTSYS;
+
+	while((err = trace_buffer_read_internal(tb, process_msg, user_data)) > 0)
+	{
+		n_consumed++;
+	}
+
+	mutex_unlock(&tb->m);
+	
+	trace_buffer_run_callbacks(tb, 0, 0);
+	return n_consumed ? n_consumed : err;
+}
+
 
 wait_queue_head_t*
 trace_buffer_get_wait_queue(struct trace_buffer* tb)
@@ -592,7 +1193,7 @@ trace_buffer_get_wait_queue(struct trace_buffer* tb)
 unsigned long
 trace_buffer_lost_messages(struct trace_buffer* tb)
 {
-	return ring_buffer_overruns(tb->buffer);
+	return ring_buffer_overruns(tb->buffer) + tb->ts_lost;
 }
 
 /*
@@ -624,10 +1225,14 @@ trace_buffer_size(struct trace_buffer* tb)
 /*
  * Change size of the buffer.
  *
- * Current messages in the buffer may be silently lost.
- * (in the current implementation, the buffer is forcibly reset).
+ * Ring buffer adds or removes pages while writers continue to write.
+ * Messages extracted from per-cpu buffers are kept in the reader pages,
+ * which are never removed, so 'last_messages' remain valid.
  *
- * Return new size on success, negative error code otherwise.
+ * Older ring buffer without per-cpu resize (RING_BUFFER_RESIZE_BUF_SIZE)
+ * resets all per-cpu buffers, so 'last_messages' are cleared too.
+ *
+ * Return 0 on success, negative error code otherwise.
  */
 
 int trace_buffer_resize(struct trace_buffer* tb,
@@ -640,42 +1245,74 @@ int trace_buffer_resize(struct trace_buffer* tb,
 	}
 	
 	result = ring_buffer_resize_compat(tb->buffer, size);
+	/* Some kernels return new size on success. */
+	if(result > 0) result = 0;
 	
-	if(!result)
-	{
-		trace_buffer_clear_internal(tb);
-	}
+#ifdef RING_BUFFER_RESIZE_BUF_SIZE
+	if(!result) trace_buffer_clear_internal(tb);
+#else
+	/* Writers start new pages with full timestamps. */
+	if(!result) atomic_inc(&tb->ts_sync_gen);
+#endif
 	
 	mutex_unlock(&tb->m);
 	return result;
 }
 
+bool
+trace_buffer_resize_keeps_messages(void)
+{
+#ifdef RING_BUFFER_RESIZE_BUF_SIZE
+	return 0;
+#else
+	return 1;
+#endif
+}
+
 void trace_buffer_call_after_read(struct trace_buffer* tb,
     kedr_trace_callback_func func,
     struct kedr_trace_callback_head* callback_head)
 {
-	unsigned long flags;
-	spin_lock_irqsave(&tb->cb_lock, flags);
-	
 	callback_head->func = func;
-	callback_head->ts = tb->clock();
 	
-	callback_head->next = NULL;
-	*tb->callback_last_p = callback_head;
-	tb->callback_last_p = &callback_head->next;
+	/* Counted before it may be seen by the collector. */
+	atomic_inc(&tb->callbacks_count);
+	
+	preempt_disable();
+	callback_head->ts = tb->clock();
+	llist_add(&callback_head->node, this_cpu_ptr(tb->callbacks_new));
+	preempt_enable();
 
 	/* 
 	 * Fast check whether buffer is currently empty.
+	 * 
+	 * If so, all messages written before the callback are read.
+	 * If callbacks are being executed (possibly, this one is called
+	 * from a callback), they are executed again after that.
 	 */
 	if(ring_buffer_empty(tb->buffer))
 	{
-		execute_callbacks_all(tb);
+		trace_buffer_callbacks_ready(tb, callback_head->ts + 1);
+		trace_buffer_run_callbacks(tb, 0, 1);
 	}
-
-	spin_unlock_irqrestore(&tb->cb_lock, flags);
 }
 
 u64 trace_buffer_clock(struct trace_buffer* tb)
 {
 	return tb->clock();
 }
+
+unsigned long
+trace_buffer_recursion_rejected(struct trace_buffer* tb,
+	enum trace_buffer_context context)
+{
+	int cpu;
+	unsigned long rejected = 0;
+	
+	for_each_possible_cpu(cpu)
+	{
+		rejected += per_cpu_ptr(tb->recursion, cpu)->rejected[context];
+	}
+	
+	return rejected;
+}
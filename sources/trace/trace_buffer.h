@@ -16,6 +16,39 @@
 
 struct trace_buffer;
 
+/*
+ * Clock used for timestamp messages in the buffer.
+ *
+ * Both clocks produce strongly monotonic timestamps, so messages about
+ * strictly ordered actions on different CPUs are ordered correctly.
+ */
+enum trace_buffer_clock_type
+{
+	/* Timestamps are serialized with global spinlock. */
+	trace_buffer_clock_global = 0,
+	/* Timestamps are serialized with lock-free atomic maximum. */
+	trace_buffer_clock_lockless,
+};
+
+/*
+ * Context of the writer, from the least nested to the most nested.
+ * 
+ * Writer may be interrupted by the writer of more nested context on
+ * the same CPU. But writer cannot be interrupted by the writer of the
+ * same context, so such writer is a recursion (e.g., the code between
+ * reservation and commit is traced too). As in ftrace, recursive
+ * writes are rejected.
+ */
+enum trace_buffer_context
+{
+	trace_buffer_context_normal = 0,
+	trace_buffer_context_softirq,
+	trace_buffer_context_irq,
+	trace_buffer_context_nmi,
+	
+	trace_buffer_context_max
+};
+
 /*
  * Allocate buffer.
  * 
@@ -24,9 +57,15 @@ struct trace_buffer;
  *  when size is overflowed while writing message:
  *   if 'mode_overwrite' is 0, then newest message will be dropped.
  *   otherwise the oldest message will be dropped.
+ * 'clock_type' determine clock used for timestamps of messages.
+ * 'compact_ts' determine whether timestamps are stored in compact form:
+ *  as 30-bit differences with the previous message on the same CPU
+ *  instead of full 64-bit values. Timestamp of such message is taken
+ *  when space for it is reserved, not when it is committed.
  */
 struct trace_buffer*
-trace_buffer_alloc(size_t size, bool mode_overwrite);
+trace_buffer_alloc(size_t size, bool mode_overwrite,
+    enum trace_buffer_clock_type clock_type, bool compact_ts);
 /*
  * Destroy buffer, free all resources which it used.
  */
@@ -84,6 +123,27 @@ trace_buffer_read(struct trace_buffer* tb,
         u64 ts, void* user_data),
     void* user_data);
 
+/*
+ * Read messages from the buffer while 'process_msg' consumes them.
+ * 
+ * Same as calling trace_buffer_read() repeatedly, but the buffer is
+ * locked only once.
+ * 
+ * Return number of messages consumed. If no message is consumed,
+ * return value as trace_buffer_read() does.
+ * 
+ * Callbacks which become ready are executed here, with only the locks
+ * of the caller held. Caller need not hold locks of the owners of the
+ * callbacks, so callbacks should take them themselves.
+ * 
+ * Shouldn't be called in atomic context.
+ */
+int
+trace_buffer_read_batch(struct trace_buffer* tb,
+    int (*process_msg)(const void* msg, size_t size, int cpu,
+        u64 ts, void* user_data),
+    void* user_data);
+
 /*
  * Return waitqueue for wait, when buffer become non-empty.
  * 
@@ -127,15 +187,26 @@ trace_buffer_size(struct trace_buffer* tb);
 /*
  * Change size of the buffer.
  *
- * Current messages in the buffer may be silently lost.
- * (in current implementation buffer is forcibly reseted).
+ * Buffer may be resized while messages are written and read. Messages
+ * in the buffer are kept, except the oldest ones when the buffer
+ * shrinks: these are counted as lost.
+ *
+ * On kernels, where ring buffer cannot be resized online (see
+ * trace_buffer_resize_keeps_messages()), the buffer is reset instead.
  *
- * Return new size on success, negative error code otherwise.
+ * Return 0 on success, negative error code otherwise.
  */
 
 int
 trace_buffer_resize(struct trace_buffer* tb, unsigned long size);
 
+/*
+ * Return true if trace_buffer_resize() keeps messages in the buffer,
+ * false if it resets the buffer.
+ */
+bool
+trace_buffer_resize_keeps_messages(void);
+
 
 /* 
  * Call 'func' after all messages, written into buffer until this moment,
@@ -147,4 +218,12 @@ void trace_buffer_call_after_read(struct trace_buffer* tb,
 
 u64 trace_buffer_clock(struct trace_buffer* tb);
 
+/*
+ * Return number of writes in given context, which are rejected
+ * because of recursion.
+ */
+unsigned long
+trace_buffer_recursion_rejected(struct trace_buffer* tb,
+    enum trace_buffer_context context);
+
 #endif /* MY_TRACE_BUFFER_H */
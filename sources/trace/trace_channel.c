@@ -0,0 +1,203 @@
+/*
+ * Implementation of the trace channel.
+ */
+#include "trace_channel.h"
+
+#include <linux/module.h>
+#include <linux/slab.h> /* kmalloc and others */
+#include <linux/fs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+
+struct trace_channel
+{
+    struct trace_buffer* tb;
+    /* Readers of the 'trace' file. */
+    struct trace_tee* tee;
+
+    struct dentry* dir;
+    struct dentry* trace_file;
+    struct dentry* buffer_size_file;
+    struct dentry* lost_messages_file;
+};
+
+/* Trace file operations implementation */
+static ssize_t channel_trace_file_read(struct file* filp, char __user* buf,
+    size_t count, loff_t* f_pos)
+{
+    struct trace_tee_reader* reader = filp->private_data;
+
+    return trace_tee_read(reader, buf, count,
+        !(filp->f_flags & O_NONBLOCK));
+}
+
+static unsigned int channel_trace_file_poll(struct file* filp,
+    poll_table* wait)
+{
+    struct trace_tee_reader* reader = filp->private_data;
+
+    return trace_tee_poll(reader, filp, wait);
+}
+
+static int channel_trace_file_open(struct inode* inode, struct file* filp)
+{
+    struct trace_channel* channel = inode->i_private;
+    struct trace_tee_reader* reader = trace_tee_reader_create(channel->tee);
+    if(!reader) return -ENOMEM;
+
+    filp->private_data = reader;
+
+    return nonseekable_open(inode, filp);
+}
+
+static int channel_trace_file_release(struct inode* inode, struct file* filp)
+{
+    struct trace_tee_reader* reader = filp->private_data;
+
+    trace_tee_reader_destroy(reader);
+
+    return 0;
+}
+
+static struct file_operations channel_trace_file_ops =
+{
+    .owner = THIS_MODULE,
+    .open = &channel_trace_file_open,
+    .release = &channel_trace_file_release,
+    .read = &channel_trace_file_read,
+    .poll = &channel_trace_file_poll
+};
+
+/* Buffer size file operations implementation */
+static int channel_buffer_size_seq_show(struct seq_file* m, void* v)
+{
+    struct trace_channel* channel = m->private;
+
+    seq_printf(m, "%lu\n", trace_buffer_size(channel->tb));
+
+    return 0;
+}
+
+static int channel_buffer_size_file_open(struct inode* inode,
+    struct file* filp)
+{
+    return single_open(filp, &channel_buffer_size_seq_show, inode->i_private);
+}
+
+static ssize_t channel_buffer_size_file_write(struct file* filp,
+    const char __user* buf, size_t count, loff_t* f_pos)
+{
+    struct trace_channel* channel =
+        ((struct seq_file*)filp->private_data)->private;
+    unsigned long size;
+    int err;
+
+    err = kstrtoul_from_user(buf, count, 0, &size);
+    if(err) return err;
+
+    err = trace_buffer_resize(channel->tb, size);
+
+    return err ? err : count;
+}
+
+static struct file_operations channel_buffer_size_file_ops =
+{
+    .owner = THIS_MODULE,
+    .open = &channel_buffer_size_file_open,
+    .read = &seq_read,
+    .write = &channel_buffer_size_file_write,
+    .release = &single_release
+};
+
+/* Lost messages file operations implementation */
+static int channel_lost_messages_seq_show(struct seq_file* m, void* v)
+{
+    struct trace_channel* channel = m->private;
+
+    seq_printf(m, "%lu\n", trace_buffer_lost_messages(channel->tb));
+
+    return 0;
+}
+
+static int channel_lost_messages_file_open(struct inode* inode,
+    struct file* filp)
+{
+    return single_open(filp, &channel_lost_messages_seq_show,
+        inode->i_private);
+}
+
+static struct file_operations channel_lost_messages_file_ops =
+{
+    .owner = THIS_MODULE,
+    .open = &channel_lost_messages_file_open,
+    .read = &seq_read,
+    .release = &single_release
+};
+
+struct trace_channel* trace_channel_create(const char* name,
+    struct dentry* parent, size_t size,
+    enum trace_buffer_clock_type clock_type, bool compact_ts,
+    size_t window_size, trace_tee_print_func print_msg)
+{
+    struct trace_channel* channel = kmalloc(sizeof(*channel), GFP_KERNEL);
+    if(!channel)
+    {
+        pr_err("%s: Cannot allocate trace_channel structure.", __func__);
+        return NULL;
+    }
+
+    channel->tb = trace_buffer_alloc(size, 1, clock_type, compact_ts);
+    if(!channel->tb) goto fail_buffer;
+
+    channel->tee = trace_tee_create(channel->tb, window_size, print_msg);
+    if(!channel->tee) goto fail_tee;
+
+    channel->dir = debugfs_create_dir(name, parent);
+    if(!channel->dir) goto fail_dir;
+
+    channel->trace_file = debugfs_create_file("trace", S_IRUSR,
+        channel->dir, channel, &channel_trace_file_ops);
+    if(!channel->trace_file) goto fail_trace_file;
+
+    channel->buffer_size_file = debugfs_create_file("buffer_size",
+        S_IRUGO | S_IWUSR, channel->dir, channel,
+        &channel_buffer_size_file_ops);
+    if(!channel->buffer_size_file) goto fail_buffer_size_file;
+
+    channel->lost_messages_file = debugfs_create_file("lost_messages",
+        S_IRUGO, channel->dir, channel, &channel_lost_messages_file_ops);
+    if(!channel->lost_messages_file) goto fail_lost_messages_file;
+
+    return channel;
+
+fail_lost_messages_file:
+    debugfs_remove(channel->buffer_size_file);
+fail_buffer_size_file:
+    debugfs_remove(channel->trace_file);
+fail_trace_file:
+    debugfs_remove(channel->dir);
+fail_dir:
+    pr_err("%s: Cannot create files for trace channel '%s'.", __func__, name);
+    trace_tee_destroy(channel->tee);
+fail_tee:
+    trace_buffer_destroy(channel->tb);
+fail_buffer:
+    kfree(channel);
+    return NULL;
+}
+
+void trace_channel_destroy(struct trace_channel* channel)
+{
+    debugfs_remove(channel->lost_messages_file);
+    debugfs_remove(channel->buffer_size_file);
+    debugfs_remove(channel->trace_file);
+    debugfs_remove(channel->dir);
+    trace_tee_destroy(channel->tee);
+    trace_buffer_destroy(channel->tb);
+    kfree(channel);
+}
+
+struct trace_buffer* trace_channel_buffer(struct trace_channel* channel)
+{
+    return channel->tb;
+}
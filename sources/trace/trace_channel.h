@@ -0,0 +1,47 @@
+#ifndef TRACE_CHANNEL_H
+#define TRACE_CHANNEL_H
+
+/*
+ * Trace channel: dedicated trace buffer with its own directory of files.
+ *
+ * Messages written into the channel do not share space with messages of
+ * other channels, so they are not evicted by them, and readers of the
+ * channel never see foreign messages.
+ *
+ * Directory of the channel contains:
+ *
+ * 'trace' - text of the messages. Every reader of the file receives all
+ *           messages extracted after the file has been opened, as
+ *           readers of 'trace_shared' do.
+ * 'buffer_size' - size of the buffer of the channel, may be changed.
+ * 'lost_messages' - number of messages lost due to the buffer overflow.
+ */
+
+#include "trace_buffer.h"
+#include "trace_tee.h"
+
+#include <linux/debugfs.h>
+
+struct trace_channel;
+
+/*
+ * Create channel with directory 'name' under 'parent'.
+ *
+ * Parameters of the buffer are the same as for trace_buffer_alloc(),
+ * the oldest messages are overwritten when the buffer is full.
+ * Text of the messages is delivered to the readers via window of
+ * 'window_size' bytes.
+ *
+ * Return NULL on error.
+ */
+struct trace_channel* trace_channel_create(const char* name,
+    struct dentry* parent, size_t size,
+    enum trace_buffer_clock_type clock_type, bool compact_ts,
+    size_t window_size, trace_tee_print_func print_msg);
+
+void trace_channel_destroy(struct trace_channel* channel);
+
+/* Return buffer for write messages into the channel. */
+struct trace_buffer* trace_channel_buffer(struct trace_channel* channel);
+
+#endif /* TRACE_CHANNEL_H */
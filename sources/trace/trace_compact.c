@@ -0,0 +1,275 @@
+/*
+ * Implementation of the helpers for compact encoding of trace messages.
+ */
+
+#include "trace_compact.h"
+
+#include <linux/kernel.h>
+#include <linux/slab.h> /* kmalloc and others */
+#include <linux/vmalloc.h>
+#include <linux/atomic.h>
+#include <linux/jhash.h>
+#include <linux/log2.h> /* is_power_of_2 */
+#include <linux/percpu.h>
+#include <asm/unaligned.h> /* get_unaligned(), put_unaligned() */
+
+/* States of the dictionary entry. */
+#define TRACE_DICT_ENTRY_EMPTY 0
+#define TRACE_DICT_ENTRY_FILLING 1
+#define TRACE_DICT_ENTRY_READY 2
+
+/* Maximum number of entries checked while key is searched. */
+#define TRACE_DICT_PROBES 16
+
+struct trace_dict
+{
+    /* Number of entries in one generation. */
+    unsigned int n_entries;
+    size_t key_size;
+
+    /*
+     * Entries of both generations. Identificator of the key is the
+     * index of its entry, so generation 'g' has identificators
+     * [g * n_entries, (g + 1) * n_entries).
+     */
+    atomic_t* states;
+    char* keys;
+
+    /* Current generation, 0 or 1. */
+    atomic_t generation;
+
+    /* Number of entries in READY state, per generation. */
+    atomic_t sizes[2];
+
+    /*
+     * Identificator returned by the last search on given CPU.
+     *
+     * The same key is often interned several times in a row, and such
+     * key is checked without hashing. Keys of the ready entries never
+     * change, so the identificator is just a hint, which is verified
+     * (together with its generation).
+     */
+    u16 __percpu* last_ids;
+};
+
+#define trace_dict_entry_key(dict, i) ((dict)->keys + (size_t)(i) * (dict)->key_size)
+
+struct trace_dict* trace_dict_create(unsigned int n_entries, size_t key_size)
+{
+    unsigned int i;
+    struct trace_dict* dict;
+
+    BUG_ON(!is_power_of_2(n_entries));
+    BUG_ON(n_entries * 2 >= TRACE_DICT_ID_INVALID);
+
+    dict = kmalloc(sizeof(*dict), GFP_KERNEL);
+    if(!dict)
+    {
+        pr_err("%s: Cannot allocate dictionary structure.", __func__);
+        return NULL;
+    }
+
+    dict->n_entries = n_entries;
+    dict->key_size = key_size;
+    atomic_set(&dict->generation, 0);
+    atomic_set(&dict->sizes[0], 0);
+    atomic_set(&dict->sizes[1], 0);
+
+    dict->states = vmalloc(sizeof(*dict->states) * n_entries * 2);
+    dict->keys = vmalloc(key_size * n_entries * 2);
+    if(!dict->states || !dict->keys)
+    {
+        pr_err("%s: Cannot allocate dictionary for %u entries.",
+            __func__, n_entries);
+        vfree(dict->states);
+        vfree(dict->keys);
+        kfree(dict);
+        return NULL;
+    }
+
+    dict->last_ids = alloc_percpu(u16);
+    if(!dict->last_ids)
+    {
+        pr_err("%s: Cannot allocate per-cpu hints for dictionary.", __func__);
+        vfree(dict->states);
+        vfree(dict->keys);
+        kfree(dict);
+        return NULL;
+    }
+
+    for(i = 0; i < n_entries * 2; i++)
+        atomic_set(&dict->states[i], TRACE_DICT_ENTRY_EMPTY);
+
+    return dict;
+}
+
+void trace_dict_destroy(struct trace_dict* dict)
+{
+    free_percpu(dict->last_ids);
+    vfree(dict->keys);
+    vfree(dict->states);
+    kfree(dict);
+}
+
+/* Check whether entry is ready and contains given key. */
+static inline bool trace_dict_entry_match(struct trace_dict* dict,
+    unsigned int i, const void* key)
+{
+    if(atomic_read(&dict->states[i]) != TRACE_DICT_ENTRY_READY) return 0;
+    /* Pairs with smp_wmb() in trace_dict_intern(). */
+    smp_rmb();
+    return !memcmp(trace_dict_entry_key(dict, i), key, dict->key_size);
+}
+
+u16 trace_dict_intern(struct trace_dict* dict, const void* key)
+{
+    int probe;
+    int generation = atomic_read(&dict->generation);
+    unsigned int base = generation * dict->n_entries;
+    unsigned int i = this_cpu_read(*dict->last_ids);
+
+    if((i - base < dict->n_entries) && trace_dict_entry_match(dict, i, key))
+        return i;
+
+    i = base + (jhash(key, dict->key_size, 0) & (dict->n_entries - 1));
+
+    for(probe = 0; probe < TRACE_DICT_PROBES; probe++,
+        i = base + ((i + 1) & (dict->n_entries - 1)))
+    {
+        atomic_t* state = &dict->states[i];
+        switch(atomic_read(state))
+        {
+        case TRACE_DICT_ENTRY_READY:
+            /* Pairs with smp_wmb() below. */
+            smp_rmb();
+            if(!memcmp(trace_dict_entry_key(dict, i), key, dict->key_size))
+            {
+                this_cpu_write(*dict->last_ids, i);
+                return i;
+            }
+            break;
+        case TRACE_DICT_ENTRY_EMPTY:
+            if(atomic_cmpxchg(state, TRACE_DICT_ENTRY_EMPTY,
+                TRACE_DICT_ENTRY_FILLING) != TRACE_DICT_ENTRY_EMPTY)
+            {
+                /*
+                 * Entry is taken concurrently, possibly for the same
+                 * key. Duplicated keys are harmless, so continue.
+                 */
+                break;
+            }
+            memcpy(trace_dict_entry_key(dict, i), key, dict->key_size);
+            smp_wmb();
+            atomic_set(state, TRACE_DICT_ENTRY_READY);
+            atomic_inc(&dict->sizes[generation]);
+            this_cpu_write(*dict->last_ids, i);
+            return i;
+        default:
+            /* Entry is being filled, key cannot be compared. */
+            break;
+        }
+    }
+
+    return TRACE_DICT_ID_INVALID;
+}
+
+const void* trace_dict_key(struct trace_dict* dict, u16 id)
+{
+    BUG_ON(id >= dict->n_entries * 2);
+
+    return trace_dict_entry_key(dict, id);
+}
+
+unsigned int trace_dict_size(struct trace_dict* dict)
+{
+    return atomic_read(&dict->sizes[atomic_read(&dict->generation)]);
+}
+
+void trace_dict_rotate(struct trace_dict* dict)
+{
+    /* Entries of other generation should be seen cleared before. */
+    smp_mb();
+    atomic_set(&dict->generation, !atomic_read(&dict->generation));
+}
+
+void trace_dict_clear_old(struct trace_dict* dict)
+{
+    unsigned int i;
+    int old = !atomic_read(&dict->generation);
+    unsigned int base = old * dict->n_entries;
+
+    for(i = base; i < base + dict->n_entries; i++)
+        atomic_set(&dict->states[i], TRACE_DICT_ENTRY_EMPTY);
+    atomic_set(&dict->sizes[old], 0);
+}
+
+/* Zigzag encoding maps signed values with small magnitude to small ones. */
+static inline unsigned long zigzag_encode(unsigned long v)
+{
+    return (v << 1) ^ (unsigned long)((long)v >> (BITS_PER_LONG - 1));
+}
+
+static inline unsigned long zigzag_decode(unsigned long v)
+{
+    return (v >> 1) ^ (unsigned long)(-(long)(v & 1));
+}
+
+size_t trace_pack_words(void* dest, const void* data, size_t size)
+{
+    unsigned char* d = dest;
+    const unsigned char* s = data;
+    size_t packed_size = 0;
+    size_t n_words = size / sizeof(unsigned long);
+    size_t i;
+
+    for(i = 0; i < n_words; i++, s += sizeof(unsigned long))
+    {
+        unsigned long v = zigzag_encode(get_unaligned((const unsigned long*)s));
+
+        do
+        {
+            unsigned char byte = v & 0x7f;
+            v >>= 7;
+            if(v) byte |= 0x80;
+            if(d) d[packed_size] = byte;
+            packed_size++;
+        } while(v);
+    }
+
+    if(d) memcpy(d + packed_size, s, size % sizeof(unsigned long));
+
+    return packed_size + size % sizeof(unsigned long);
+}
+
+size_t trace_unpack_words(void* dest, size_t size,
+    const void* packed, size_t packed_size)
+{
+    unsigned char* d = dest;
+    const unsigned char* p = packed;
+    size_t pos = 0;
+    size_t n_words = size / sizeof(unsigned long);
+    size_t rest = size % sizeof(unsigned long);
+    size_t i;
+
+    for(i = 0; i < n_words; i++, d += sizeof(unsigned long))
+    {
+        unsigned long v = 0;
+        int shift = 0;
+        unsigned char byte;
+
+        do
+        {
+            if((pos == packed_size) || (shift >= BITS_PER_LONG)) return 0;
+            byte = p[pos++];
+            v |= (unsigned long)(byte & 0x7f) << shift;
+            shift += 7;
+        } while(byte & 0x80);
+
+        put_unaligned(zigzag_decode(v), (unsigned long*)d);
+    }
+
+    if(packed_size - pos < rest) return 0;
+    memcpy(d, p + pos, rest);
+
+    return pos + rest;
+}
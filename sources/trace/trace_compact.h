@@ -0,0 +1,109 @@
+#ifndef TRACE_COMPACT_H
+#define TRACE_COMPACT_H
+
+/*
+ * Helpers for compact encoding of the trace messages.
+ *
+ * Dictionary maps keys of fixed size into small identificators, so
+ * repeated values (e.g., call site or process information) are stored
+ * in the messages as identificators.
+ *
+ * Keys are added lock-free and may be added in any context, including
+ * NMI. When dictionary has no space for a new key, caller should store
+ * the value itself.
+ *
+ * Dictionary has two generations of keys. New keys are added into the
+ * current generation only. trace_dict_rotate() makes other generation
+ * current, and keys of the previous one are removed with
+ * trace_dict_clear_old() when no message refers to them. Identificator
+ * remains valid until its generation is cleared.
+ *
+ * The key interned last on the current CPU is checked before hashing, so
+ * repeated keys are cheap.
+ */
+
+#include <linux/types.h>
+
+struct trace_dict;
+
+/* Identificator which is never assigned to a key. */
+#define TRACE_DICT_ID_INVALID 0xffff
+
+/*
+ * Create dictionary for at most 'n_entries' keys of size 'key_size'.
+ *
+ * 'n_entries' should be power of 2 and less than half of
+ * TRACE_DICT_ID_INVALID.
+ *
+ * Return NULL on error.
+ */
+struct trace_dict* trace_dict_create(unsigned int n_entries, size_t key_size);
+
+void trace_dict_destroy(struct trace_dict* dict);
+
+/*
+ * Return identificator of the key, adding key into the dictionary
+ * if needed.
+ *
+ * Padding bytes of the key should be zeroed, as keys are compared
+ * bytewise.
+ *
+ * Return TRACE_DICT_ID_INVALID if there is no space for the key.
+ */
+u16 trace_dict_intern(struct trace_dict* dict, const void* key);
+
+/*
+ * Return key with given identificator.
+ *
+ * Identificator should be returned by trace_dict_intern() before.
+ */
+const void* trace_dict_key(struct trace_dict* dict, u16 id);
+
+/* Return number of keys in the current generation of the dictionary. */
+unsigned int trace_dict_size(struct trace_dict* dict);
+
+/*
+ * Make other generation current, so new keys are added there.
+ *
+ * Other generation should be empty, that is, trace_dict_clear_old()
+ * should be called after the previous rotation.
+ *
+ * Keys of the previous generation may still be returned to the writers
+ * which have started to intern them before the rotation.
+ */
+void trace_dict_rotate(struct trace_dict* dict);
+
+/*
+ * Remove all keys of the previous generation.
+ *
+ * Should be called only when nobody interns keys into that generation
+ * and no message refers to its identificators.
+ *
+ * May be called in atomic context.
+ */
+void trace_dict_clear_old(struct trace_dict* dict);
+
+/*
+ * Pack 'size' bytes of 'data' as a sequence of words, each stored as
+ * zigzag varint, followed by the rest bytes as is.
+ *
+ * Small and small negative values, which are common in parameters of
+ * the calls, occupy one or two bytes instead of a whole word.
+ *
+ * If 'dest' is NULL, only calculate size of the packed data.
+ *
+ * Return size of the packed data.
+ */
+size_t trace_pack_words(void* dest, const void* data, size_t size);
+
+/*
+ * Unpack data packed with trace_pack_words() into 'dest' of 'size'
+ * bytes.
+ *
+ * Return size of the packed data consumed or 0 if packed data of
+ * 'packed_size' is incorrect.
+ */
+size_t trace_unpack_words(void* dest, size_t size,
+    const void* packed, size_t packed_size);
+
+#endif /* TRACE_COMPACT_H */
@@ -0,0 +1,260 @@
+/*
+ * Implementation of the filter for function call messages.
+ */
+
+#include "trace_filter.h"
+
+#include <linux/kernel.h>
+#include <linux/slab.h> /* kmalloc and others */
+#include <linux/string.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+
+struct trace_filter_range
+{
+    unsigned long start;
+    unsigned long end;
+};
+
+/*
+ * Filter is never modified after creation.
+ *
+ * Strings in the filter point into 'text'.
+ */
+struct trace_filter
+{
+    const char** functions;
+    int n_functions;
+
+    const char** targets;
+    int n_targets;
+
+    struct trace_filter_range* ranges;
+    int n_ranges;
+
+    char* text;
+};
+
+/*
+ * Current filter, NULL if filter is empty.
+ *
+ * Readers are protected by RCU-sched, writers by 'filter_m'.
+ */
+static struct trace_filter __rcu* filter_current;
+static DEFINE_MUTEX(filter_m);
+
+#define FILTER_SEPARATORS " \t\n"
+
+static void trace_filter_free(struct trace_filter* filter)
+{
+    kfree(filter->functions);
+    kfree(filter->targets);
+    kfree(filter->ranges);
+    kfree(filter->text);
+    kfree(filter);
+}
+
+/* Parse rule and add it to the filter. */
+static int trace_filter_add_rule(struct trace_filter* filter, char* rule)
+{
+    char* value = strchr(rule, ':');
+    if(!value) goto invalid;
+
+    *value++ = '\0';
+
+    if(!strcmp(rule, "function"))
+    {
+        filter->functions[filter->n_functions++] = value;
+    }
+    else if(!strcmp(rule, "target"))
+    {
+        filter->targets[filter->n_targets++] = value;
+    }
+    else if(!strcmp(rule, "address"))
+    {
+        struct trace_filter_range* range = &filter->ranges[filter->n_ranges];
+        char* end = strchr(value, '-');
+        if(!end) goto invalid;
+
+        *end++ = '\0';
+        if(kstrtoul(value, 0, &range->start)) goto invalid;
+        if(kstrtoul(end, 0, &range->end)) goto invalid;
+        if(range->start >= range->end) goto invalid;
+
+        filter->n_ranges++;
+    }
+    else
+    {
+        goto invalid;
+    }
+
+    return 0;
+
+invalid:
+    pr_err("Invalid trace filter rule '%s'.\n", rule);
+    return -EINVAL;
+}
+
+/* Create filter from the rules. Return NULL if there are no rules. */
+static struct trace_filter* trace_filter_create(const char* rules, int* err)
+{
+    struct trace_filter* filter;
+    int n_rules = 0;
+    char* text;
+    char* rule;
+
+    text = kstrdup(rules, GFP_KERNEL);
+    if(!text)
+    {
+        *err = -ENOMEM;
+        return NULL;
+    }
+
+    /* Every rule is at most one element in every array. */
+    for(rule = text; *rule; n_rules++)
+    {
+        rule = skip_spaces(rule);
+        if(!*rule) break;
+        rule += strcspn(rule, FILTER_SEPARATORS);
+    }
+
+    *err = 0;
+    if(!n_rules)
+    {
+        kfree(text);
+        return NULL;
+    }
+
+    *err = -ENOMEM;
+    filter = kzalloc(sizeof(*filter), GFP_KERNEL);
+    if(!filter)
+    {
+        kfree(text);
+        return NULL;
+    }
+
+    filter->text = text;
+    filter->functions = kmalloc(sizeof(*filter->functions) * n_rules, GFP_KERNEL);
+    filter->targets = kmalloc(sizeof(*filter->targets) * n_rules, GFP_KERNEL);
+    filter->ranges = kmalloc(sizeof(*filter->ranges) * n_rules, GFP_KERNEL);
+    if(!filter->functions || !filter->targets || !filter->ranges)
+        goto fail;
+
+    while((rule = strsep(&text, FILTER_SEPARATORS)) != NULL)
+    {
+        if(!*rule) continue;
+
+        *err = trace_filter_add_rule(filter, rule);
+        if(*err) goto fail;
+    }
+
+    *err = 0;
+    return filter;
+
+fail:
+    trace_filter_free(filter);
+    return NULL;
+}
+
+int trace_filter_set(const char* rules)
+{
+    int err;
+    struct trace_filter* filter_old;
+    struct trace_filter* filter = trace_filter_create(rules, &err);
+
+    if(err) return err;
+
+    mutex_lock(&filter_m);
+    filter_old = rcu_dereference_protected(filter_current,
+        lockdep_is_held(&filter_m));
+    rcu_assign_pointer(filter_current, filter);
+    mutex_unlock(&filter_m);
+
+    if(filter_old)
+    {
+        synchronize_sched();
+        trace_filter_free(filter_old);
+    }
+
+    return 0;
+}
+
+int trace_filter_show(struct seq_file* m)
+{
+    int i;
+    struct trace_filter* filter;
+
+    if(mutex_lock_interruptible(&filter_m))
+        return -ERESTARTSYS;
+
+    filter = rcu_dereference_protected(filter_current,
+        lockdep_is_held(&filter_m));
+    if(filter)
+    {
+        for(i = 0; i < filter->n_functions; i++)
+            seq_printf(m, "function:%s\n", filter->functions[i]);
+        for(i = 0; i < filter->n_targets; i++)
+            seq_printf(m, "target:%s\n", filter->targets[i]);
+        for(i = 0; i < filter->n_ranges; i++)
+            seq_printf(m, "address:0x%lx-0x%lx\n",
+                filter->ranges[i].start, filter->ranges[i].end);
+    }
+
+    mutex_unlock(&filter_m);
+
+    return 0;
+}
+
+bool trace_filter_pass(const char* function_name, void* return_address,
+    const char* target_name)
+{
+    int i;
+    struct trace_filter* filter = rcu_dereference_sched(filter_current);
+
+    if(!filter) return true;
+
+    if(filter->n_functions)
+    {
+        for(i = 0; i < filter->n_functions; i++)
+        {
+            if(!strcmp(filter->functions[i], function_name)) break;
+        }
+        if(i == filter->n_functions) return false;
+    }
+
+    if(filter->n_targets)
+    {
+        if(!target_name) return false;
+
+        for(i = 0; i < filter->n_targets; i++)
+        {
+            if(!strcmp(filter->targets[i], target_name)) break;
+        }
+        if(i == filter->n_targets) return false;
+    }
+
+    if(filter->n_ranges)
+    {
+        unsigned long addr = (unsigned long)return_address;
+
+        for(i = 0; i < filter->n_ranges; i++)
+        {
+            if((addr >= filter->ranges[i].start)
+                && (addr < filter->ranges[i].end)) break;
+        }
+        if(i == filter->n_ranges) return false;
+    }
+
+    return true;
+}
+
+void trace_filter_destroy(void)
+{
+    struct trace_filter* filter = rcu_dereference_protected(filter_current, 1);
+
+    if(filter)
+    {
+        RCU_INIT_POINTER(filter_current, NULL);
+        trace_filter_free(filter);
+    }
+}
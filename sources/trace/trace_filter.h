@@ -0,0 +1,46 @@
+#ifndef TRACE_FILTER_H
+#define TRACE_FILTER_H
+
+/*
+ * Filter for function call messages.
+ *
+ * Filter is checked before space for the message is reserved in the
+ * trace buffer, so rejected calls do not consume the buffer.
+ *
+ * Filter consists of rules, separated by whitespaces:
+ *
+ *   function:<name>       - name of the called function,
+ *   target:<name>         - name of the target module which calls function,
+ *   address:<start>-<end> - range [start, end) of the return address.
+ *
+ * Call passes the filter if it matches at least one rule of every kind
+ * present in the filter. Empty filter passes all calls.
+ */
+
+#include <linux/types.h>
+#include <linux/seq_file.h>
+
+/*
+ * Replace current filter with the one described by 'rules'.
+ *
+ * Return 0 on success, negative error code otherwise.
+ */
+int trace_filter_set(const char* rules);
+
+/* Print current filter, one rule per line. */
+int trace_filter_show(struct seq_file* m);
+
+/*
+ * Check whether function call passes the filter.
+ *
+ * 'target_name' is NULL if return address is not inside any target.
+ *
+ * Should be called with preemption disabled.
+ */
+bool trace_filter_pass(const char* function_name, void* return_address,
+    const char* target_name);
+
+/* Free current filter. */
+void trace_filter_destroy(void);
+
+#endif /* TRACE_FILTER_H */
@@ -0,0 +1,333 @@
+/*
+ * Implementation of the registry of the formats for trace messages.
+ */
+
+#include <kedr/trace/trace.h>
+#include "trace_format.h"
+#include "trace_sampling.h"
+#include "trace_stats.h"
+
+#include <linux/module.h>
+#include <linux/idr.h>
+#include <linux/slab.h> /* kmalloc and others */
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+
+/* Maximum value of the format identificator. */
+#define TRACE_FORMAT_ID_MAX 0xffff
+
+/* 
+ * Registered format.
+ * 
+ * Lifetime of the entry is longer than one of the format: it is freed only
+ * after all messages, written with given format, are read.
+ */
+struct trace_format_entry
+{
+    /* 
+     * Registered format.
+     * 
+     * Set to NULL when format is unregistered.
+     * 
+     * Protected by RCU.
+     */
+    const struct kedr_trace_format __rcu* format;
+    
+    /* Whether format has pretty print function. */
+    bool has_pp;
+    
+    /* Id of the format, the key in 'formats_idr'. */
+    u16 id;
+    
+    /* Copy of the format's name, which is available after unregistration. */
+    char* name;
+    
+    /* Sampling state, which is referred by the format. */
+    struct kedr_trace_sampling* sampling;
+    
+    /* Statistics of the messages, which is referred by the format. */
+    struct kedr_trace_stats* stats;
+    
+    struct kedr_trace_callback_head callback_head;
+    struct rcu_head rcu;
+};
+
+/* 
+ * Mapping identificator -> 'struct trace_format_entry'.
+ * 
+ * Lookup is protected by RCU, modifications are protected by 'formats_lock'.
+ */
+static DEFINE_IDR(formats_idr);
+static DEFINE_SPINLOCK(formats_lock);
+
+void trace_format_destroy(void)
+{
+    /* All entries are freed via callbacks. */
+    rcu_barrier();
+    idr_destroy(&formats_idr);
+}
+
+static void trace_format_entry_free_rcu(struct rcu_head* rcu)
+{
+    struct trace_format_entry* entry = container_of(rcu, typeof(*entry), rcu);
+    
+    trace_stats_destroy(entry->stats);
+    trace_sampling_destroy(entry->sampling);
+    kfree(entry->name);
+    kfree(entry);
+}
+
+/* Executed when all messages with given format are read. */
+static void trace_format_entry_free_callback(struct kedr_trace_callback_head* ch)
+{
+    unsigned long flags;
+    struct trace_format_entry* entry = container_of(ch, typeof(*entry), callback_head);
+    
+    spin_lock_irqsave(&formats_lock, flags);
+    idr_remove(&formats_idr, entry->id);
+    spin_unlock_irqrestore(&formats_lock, flags);
+    
+    call_rcu(&entry->rcu, &trace_format_entry_free_rcu);
+}
+
+int kedr_trace_format_register(struct kedr_trace_format* format)
+{
+    unsigned long flags;
+    int id;
+    struct trace_format_entry* entry = kmalloc(sizeof(*entry), GFP_KERNEL);
+    
+    if(!entry) return -ENOMEM;
+    
+    entry->name = kstrdup(format->name ? format->name : "", GFP_KERNEL);
+    if(!entry->name)
+    {
+        kfree(entry);
+        return -ENOMEM;
+    }
+    
+    entry->sampling = trace_sampling_create();
+    if(!entry->sampling)
+    {
+        kfree(entry->name);
+        kfree(entry);
+        return -ENOMEM;
+    }
+    
+    entry->stats = trace_stats_create();
+    if(!entry->stats)
+    {
+        trace_sampling_destroy(entry->sampling);
+        kfree(entry->name);
+        kfree(entry);
+        return -ENOMEM;
+    }
+    
+    RCU_INIT_POINTER(entry->format, format);
+    entry->has_pp = format->pp != NULL;
+    
+    idr_preload(GFP_KERNEL);
+    spin_lock_irqsave(&formats_lock, flags);
+    id = idr_alloc(&formats_idr, entry, TRACE_FORMAT_ID_INVALID + 1,
+        TRACE_FORMAT_ID_MAX + 1, GFP_NOWAIT);
+    spin_unlock_irqrestore(&formats_lock, flags);
+    idr_preload_end();
+    
+    if(id < 0)
+    {
+        pr_err("Failed to assign identificator for trace format '%s'.\n",
+            entry->name);
+        trace_stats_destroy(entry->stats);
+        trace_sampling_destroy(entry->sampling);
+        kfree(entry->name);
+        kfree(entry);
+        return id;
+    }
+    
+    entry->id = id;
+    format->id = id;
+    format->sampling = entry->sampling;
+    format->stats = entry->stats;
+    
+    return 0;
+}
+EXPORT_SYMBOL(kedr_trace_format_register);
+
+void kedr_trace_format_unregister(struct kedr_trace_format* format)
+{
+    struct trace_format_entry* entry;
+    
+    rcu_read_lock();
+    entry = idr_find(&formats_idr, format->id);
+    rcu_read_unlock();
+    
+    BUG_ON(!entry || rcu_access_pointer(entry->format) != format);
+    
+    rcu_assign_pointer(entry->format, NULL);
+    /* Wait until all current users of the format finish. */
+    synchronize_rcu();
+    
+    format->id = TRACE_FORMAT_ID_INVALID;
+    format->sampling = NULL;
+    format->stats = NULL;
+    
+    kedr_trace_call_after_read(&trace_format_entry_free_callback,
+        &entry->callback_head);
+}
+EXPORT_SYMBOL(kedr_trace_format_unregister);
+
+int kedr_trace_formats_register(struct kedr_trace_format** formats)
+{
+    int err;
+    struct kedr_trace_format** format;
+    
+    for(format = formats; *format; format++)
+    {
+        err = kedr_trace_format_register(*format);
+        if(err) goto fail;
+    }
+    
+    return 0;
+
+fail:
+    while(format != formats)
+    {
+        format--;
+        kedr_trace_format_unregister(*format);
+    }
+    
+    return err;
+}
+EXPORT_SYMBOL(kedr_trace_formats_register);
+
+void kedr_trace_formats_unregister(struct kedr_trace_format** formats)
+{
+    struct kedr_trace_format** format;
+    
+    for(format = formats; *format; format++)
+    {
+        kedr_trace_format_unregister(*format);
+    }
+}
+EXPORT_SYMBOL(kedr_trace_formats_unregister);
+
+int trace_format_sampling_set(const char* name,
+    unsigned int every, unsigned int rate,
+    u16* id, unsigned long* skipped)
+{
+    int err = -ENOENT;
+    int entry_id;
+    unsigned long flags;
+    struct trace_format_entry* entry;
+    
+    /* Entries cannot be freed while they are in the idr. */
+    spin_lock_irqsave(&formats_lock, flags);
+    idr_for_each_entry(&formats_idr, entry, entry_id)
+    {
+        if(!rcu_access_pointer(entry->format)) continue;
+        if(strcmp(entry->name, name)) continue;
+        
+        trace_sampling_set(entry->sampling, every, rate);
+        *id = entry->id;
+        *skipped = trace_sampling_skipped(entry->sampling);
+        err = 0;
+        break;
+    }
+    spin_unlock_irqrestore(&formats_lock, flags);
+    
+    return err;
+}
+
+void trace_format_sampling_show(struct seq_file* m)
+{
+    int entry_id;
+    unsigned long flags;
+    struct trace_format_entry* entry;
+    
+    spin_lock_irqsave(&formats_lock, flags);
+    idr_for_each_entry(&formats_idr, entry, entry_id)
+    {
+        unsigned int every, rate;
+        unsigned long skipped = trace_sampling_skipped(entry->sampling);
+        
+        trace_sampling_get(entry->sampling, &every, &rate);
+        if(!every && !rate && !skipped) continue;
+        
+        seq_printf(m, "%s every=%u rate=%u skipped=%lu\n",
+            entry->name, every, rate, skipped);
+    }
+    spin_unlock_irqrestore(&formats_lock, flags);
+}
+
+void trace_format_stats_show(struct seq_file* m)
+{
+    int entry_id;
+    unsigned long flags;
+    struct trace_format_entry* entry;
+    
+    spin_lock_irqsave(&formats_lock, flags);
+    idr_for_each_entry(&formats_idr, entry, entry_id)
+    {
+        struct trace_stats_counters counters;
+        
+        trace_stats_get(entry->stats, &counters);
+        if(!counters.events && !counters.failures) continue;
+        
+        trace_stats_print(m, entry->name, &counters);
+    }
+    spin_unlock_irqrestore(&formats_lock, flags);
+}
+
+int trace_format_print_name(char* dest, size_t size, u16 id)
+{
+    int result;
+    struct trace_format_entry* entry;
+    
+    rcu_read_lock();
+    entry = idr_find(&formats_idr, id);
+    if(entry)
+        result = snprintf(dest, size, "%s", entry->name);
+    else
+        result = snprintf(dest, size, "<unknown format %u>", (unsigned)id);
+    rcu_read_unlock();
+    
+    return result;
+}
+
+int trace_format_print(char* dest, size_t size, u16 id,
+    const char* prefix, const void* data)
+{
+    int result;
+    int prefix_len;
+    struct trace_format_entry* entry;
+    const struct kedr_trace_format* format;
+    
+    rcu_read_lock();
+    entry = idr_find(&formats_idr, id);
+    if(!entry || !entry->has_pp)
+    {
+        result = 0;
+        goto out;
+    }
+    
+    prefix_len = snprintf(dest, size, "%s", prefix);
+    if(size > (size_t)prefix_len)
+    {
+        dest += prefix_len;
+        size -= prefix_len;
+    }
+    else
+    {
+        dest += size;
+        size = 0;
+    }
+    
+    format = rcu_dereference(entry->format);
+    if(format)
+        result = prefix_len + format->pp(dest, size, data);
+    else
+        result = prefix_len + snprintf(dest, size, "<format is unregistered>");
+out:
+    rcu_read_unlock();
+    
+    return result;
+}
@@ -0,0 +1,78 @@
+#ifndef TRACE_FORMAT_H
+#define TRACE_FORMAT_H
+
+/*
+ * Registry of the formats for trace messages.
+ *
+ * Format registered via kedr_trace_format_register() is assigned
+ * compact identificator, which is stored in the messages instead of
+ * pointers to the pretty print function and to the name of the format.
+ *
+ * The messages are formatted only when they are read, using identificator
+ * for find the format.
+ *
+ * After kedr_trace_format_unregister(), the identificator is not reused
+ * until all messages written before are read.
+ */
+
+#include <linux/types.h>
+#include <linux/seq_file.h>
+
+/* Identificator which is never assigned to a registered format. */
+#define TRACE_FORMAT_ID_INVALID 0
+
+/*
+ * Destroy format registry.
+ *
+ * Should be called after all callbacks, scheduled with
+ * kedr_trace_call_after_read(), are executed.
+ */
+void trace_format_destroy(void);
+
+/*
+ * Set sampling parameters for registered format with given name.
+ * 
+ * On success, return 0 and set 'id' to the identificator of the format
+ * and 'skipped' to the number of messages skipped before.
+ * If there is no such format, return -ENOENT.
+ */
+int trace_format_sampling_set(const char* name,
+    unsigned int every, unsigned int rate,
+    u16* id, unsigned long* skipped);
+
+/*
+ * Print sampling state of the formats, for which sampling is enabled or
+ * some messages have been skipped.
+ */
+void trace_format_sampling_show(struct seq_file* m);
+
+/*
+ * Print statistics of the messages for every format, for which some
+ * messages have been written or failed to be written.
+ *
+ * Formats which are unregistered are printed until all their messages
+ * are read.
+ */
+void trace_format_stats_show(struct seq_file* m);
+
+/*
+ * Print the name of the format with given identificator.
+ *
+ * Behaves as snprintf().
+ */
+int trace_format_print_name(char* dest, size_t size, u16 id);
+
+/*
+ * Print 'data' using pretty print function of the format with given
+ * identificator. Printed data is preceded with 'prefix'.
+ *
+ * If format has no pretty print function, nothing is printed.
+ * If format has been unregistered, a note about that is printed instead
+ * of data.
+ *
+ * Behaves as snprintf().
+ */
+int trace_format_print(char* dest, size_t size, u16 id,
+    const char* prefix, const void* data);
+
+#endif /* TRACE_FORMAT_H */
@@ -0,0 +1,116 @@
+/*
+ * Implementation of the sampling of the trace messages.
+ */
+
+#include "trace_sampling.h"
+
+#include <linux/slab.h> /* kmalloc and others */
+#include <linux/percpu.h>
+#include <linux/time.h> /* NSEC_PER_SEC */
+#include <linux/trace_clock.h> /* trace_clock_local() */
+
+struct trace_sampling_cpu
+{
+    /* Messages counted for 1-in-N sampling. */
+    unsigned long counter;
+    /* Messages skipped. */
+    unsigned long skipped;
+    /* Start of the current one-second window for rate sampling. */
+    u64 window_start;
+    /* Messages recorded in the current window. */
+    unsigned int window_events;
+};
+
+struct kedr_trace_sampling
+{
+    /* Parameters are read without lock. */
+    unsigned int every;
+    unsigned int rate;
+
+    struct trace_sampling_cpu __percpu* cpu;
+};
+
+struct kedr_trace_sampling* trace_sampling_create(void)
+{
+    struct kedr_trace_sampling* sampling = kmalloc(sizeof(*sampling), GFP_KERNEL);
+    if(!sampling) return NULL;
+
+    /* Allocated memory is zeroed. */
+    sampling->cpu = alloc_percpu(struct trace_sampling_cpu);
+    if(!sampling->cpu)
+    {
+        kfree(sampling);
+        return NULL;
+    }
+
+    sampling->every = 0;
+    sampling->rate = 0;
+
+    return sampling;
+}
+
+void trace_sampling_destroy(struct kedr_trace_sampling* sampling)
+{
+    free_percpu(sampling->cpu);
+    kfree(sampling);
+}
+
+void trace_sampling_set(struct kedr_trace_sampling* sampling,
+    unsigned int every, unsigned int rate)
+{
+    sampling->every = every > 1 ? every : 0;
+    sampling->rate = rate;
+}
+
+void trace_sampling_get(struct kedr_trace_sampling* sampling,
+    unsigned int* every, unsigned int* rate)
+{
+    *every = sampling->every;
+    *rate = sampling->rate;
+}
+
+bool trace_sampling_pass(struct kedr_trace_sampling* sampling)
+{
+    struct trace_sampling_cpu* sc;
+    unsigned int every = sampling->every;
+    unsigned int rate = sampling->rate;
+
+    /* Fast path: sampling is disabled. */
+    if(!every && !rate) return true;
+
+    sc = this_cpu_ptr(sampling->cpu);
+
+    if(every && (sc->counter++ % every)) goto skip;
+
+    if(rate)
+    {
+        u64 now = trace_clock_local();
+        if(now - sc->window_start >= NSEC_PER_SEC)
+        {
+            sc->window_start = now;
+            sc->window_events = 0;
+        }
+
+        if(sc->window_events >= rate) goto skip;
+        sc->window_events++;
+    }
+
+    return true;
+
+skip:
+    sc->skipped++;
+    return false;
+}
+
+unsigned long trace_sampling_skipped(struct kedr_trace_sampling* sampling)
+{
+    int cpu;
+    unsigned long skipped = 0;
+
+    for_each_possible_cpu(cpu)
+    {
+        skipped += per_cpu_ptr(sampling->cpu, cpu)->skipped;
+    }
+
+    return skipped;
+}
@@ -0,0 +1,45 @@
+#ifndef TRACE_SAMPLING_H
+#define TRACE_SAMPLING_H
+
+/*
+ * Sampling of the trace messages with registered format.
+ *
+ * Two kinds of sampling may be combined:
+ *
+ *   1-in-N - only every N-th message is recorded,
+ *   rate   - at most given number of messages per second is recorded
+ *            on every CPU.
+ *
+ * Counters are per-cpu and are not synchronized with interrupts on the
+ * same CPU, so number of skipped messages is approximate.
+ */
+
+#include <kedr/trace/trace.h>
+
+#include <linux/types.h>
+
+struct kedr_trace_sampling* trace_sampling_create(void);
+void trace_sampling_destroy(struct kedr_trace_sampling* sampling);
+
+/*
+ * Set sampling parameters.
+ *
+ * 'every' of 0 or 1 and 'rate' of 0 disable corresponded kind of sampling.
+ */
+void trace_sampling_set(struct kedr_trace_sampling* sampling,
+    unsigned int every, unsigned int rate);
+
+void trace_sampling_get(struct kedr_trace_sampling* sampling,
+    unsigned int* every, unsigned int* rate);
+
+/*
+ * Check whether message should be recorded and count it.
+ *
+ * Should be called with preemption disabled.
+ */
+bool trace_sampling_pass(struct kedr_trace_sampling* sampling);
+
+/* Return number of messages skipped due to sampling. */
+unsigned long trace_sampling_skipped(struct kedr_trace_sampling* sampling);
+
+#endif /* TRACE_SAMPLING_H */
@@ -0,0 +1,458 @@
+/*
+ * Implementation of the trace sink.
+ */
+
+#include "trace_sink.h"
+
+#include <linux/slab.h> /* kmalloc and others */
+#include <linux/vmalloc.h> /* vmalloc for the spill area */
+#include <linux/mutex.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/jiffies.h>
+#include <linux/fs.h>
+#include <linux/err.h>
+#include <linux/uaccess.h>
+#include <linux/version.h> /* KERNEL_VERSION macro */
+
+enum trace_sink_mode
+{
+    trace_sink_mode_off = 0,
+    trace_sink_mode_memory,
+    trace_sink_mode_file,
+};
+
+struct trace_sink
+{
+    struct trace_buffer* tb;
+    trace_sink_print_func print_msg;
+
+    size_t spill_size;
+    unsigned long interval;
+
+    /* Protect all fields below. */
+    struct mutex m;
+
+    enum trace_sink_mode mode;
+    struct task_struct* worker;
+
+    /* File and its path for file mode. */
+    struct file* file;
+    char* path;
+    loff_t file_pos;
+    /* When content of the spill area has been written last time. */
+    unsigned long last_flush;
+
+    /*
+     * Spill area, used as a ring.
+     *
+     * Byte at position 'pos' is stored at 'spill[pos % spill_size]'.
+     */
+    char* spill;
+    unsigned long spill_head;
+    unsigned long spill_tail;
+    /* Set when message doesn't fit into the spill area. */
+    bool spill_full;
+
+    /* Buffer for the message formatted. */
+    char* msg_text;
+    size_t msg_alloc_size;
+
+    /* Statistics since the sink is started. */
+    size_t spill_high_water;
+    unsigned long messages_drained;
+    unsigned long long bytes_drained;
+    unsigned long long bytes_written;
+    unsigned long writes;
+    int write_error;
+};
+
+#define trace_sink_spill_used(sink) ((size_t)((sink)->spill_head - (sink)->spill_tail))
+
+static const char* trace_sink_mode_name(enum trace_sink_mode mode)
+{
+    switch(mode)
+    {
+    case trace_sink_mode_memory:
+        return "memory";
+    case trace_sink_mode_file:
+        return "file";
+    default:
+        return "off";
+    }
+}
+
+static ssize_t kernel_write_compat(struct file* file, const char* buf,
+    size_t count, loff_t* pos)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+    return kernel_write(file, buf, count, pos);
+#else
+    ssize_t result = kernel_write(file, buf, count, *pos);
+    if(result > 0) *pos += result;
+    return result;
+#endif
+}
+
+struct trace_sink* trace_sink_create(struct trace_buffer* tb,
+    size_t spill_size, unsigned int interval_ms,
+    trace_sink_print_func print_msg)
+{
+    struct trace_sink* sink = kzalloc(sizeof(*sink), GFP_KERNEL);
+    if(!sink)
+    {
+        pr_err("%s: Cannot allocate trace_sink structure.", __func__);
+        return NULL;
+    }
+
+    sink->tb = tb;
+    sink->print_msg = print_msg;
+    sink->spill_size = spill_size;
+    sink->interval = msecs_to_jiffies(interval_ms);
+    if(!sink->interval) sink->interval = 1;
+
+    mutex_init(&sink->m);
+    sink->mode = trace_sink_mode_off;
+
+    return sink;
+}
+
+void trace_sink_destroy(struct trace_sink* sink)
+{
+    trace_sink_stop(sink);
+
+    mutex_destroy(&sink->m);
+    kfree(sink->msg_text);
+    vfree(sink->spill);
+    kfree(sink);
+}
+
+/*
+ * Interpretator function for trace buffer, which appends message into
+ * the spill area.
+ *
+ * If there is no space for the message, it is not consumed.
+ *
+ * Executed under sink's mutex.
+ */
+static int trace_sink_process_msg(const void* msg,
+    size_t msg_size, int cpu, u64 ts, void* user_data)
+{
+    struct trace_sink* sink = user_data;
+    size_t text_size, offset, first_size, used;
+
+    /* It should be at most 2 iterations. */
+    while(1)
+    {
+        text_size = sink->print_msg(sink->msg_text, sink->msg_alloc_size,
+            msg, msg_size, cpu, ts);
+        if(text_size < sink->msg_alloc_size) break;
+
+        /* Text buffer is too small for the message. */
+        kfree(sink->msg_text);
+        sink->msg_alloc_size = 0;
+        sink->msg_text = kmalloc(text_size + 1, GFP_KERNEL);
+        if(!sink->msg_text) return -ENOMEM;
+        sink->msg_alloc_size = text_size + 1;
+    }
+
+    /* Message which cannot fit into the whole area is truncated. */
+    if(text_size > sink->spill_size) text_size = sink->spill_size;
+
+    if(text_size > sink->spill_size - trace_sink_spill_used(sink))
+    {
+        sink->spill_full = 1;
+        return 0;
+    }
+
+    offset = sink->spill_head % sink->spill_size;
+    first_size = min(text_size, sink->spill_size - offset);
+
+    memcpy(sink->spill + offset, sink->msg_text, first_size);
+    memcpy(sink->spill, sink->msg_text + first_size, text_size - first_size);
+
+    sink->spill_head += text_size;
+
+    used = trace_sink_spill_used(sink);
+    if(used > sink->spill_high_water) sink->spill_high_water = used;
+
+    sink->messages_drained++;
+    sink->bytes_drained += text_size;
+
+    return 1;
+}
+
+/*
+ * Write content of the spill area into the file.
+ *
+ * Return 0 on success, negative error code otherwise.
+ */
+static int trace_sink_flush(struct trace_sink* sink)
+{
+    while(sink->spill_tail != sink->spill_head)
+    {
+        ssize_t written;
+        size_t offset = sink->spill_tail % sink->spill_size;
+        size_t len = min(trace_sink_spill_used(sink), sink->spill_size - offset);
+
+        written = kernel_write_compat(sink->file, sink->spill + offset,
+            len, &sink->file_pos);
+        if(written <= 0)
+        {
+            sink->write_error = written ? (int)written : -EIO;
+            return sink->write_error;
+        }
+
+        sink->spill_tail += written;
+        sink->bytes_written += written;
+        sink->writes++;
+    }
+
+    sink->last_flush = jiffies;
+
+    return 0;
+}
+
+/*
+ * Move messages from the trace buffer into the spill area. In file mode,
+ * write the spill area into the file when it is at least half-full or
+ * when it has not been written for a second.
+ *
+ * Executed under sink's mutex.
+ */
+static void trace_sink_drain(struct trace_sink* sink, bool force_flush)
+{
+    bool is_file = sink->mode == trace_sink_mode_file;
+
+    do
+    {
+        sink->spill_full = 0;
+        /* Ready 'after read' callbacks are executed under sink's mutex only. */
+        trace_buffer_read_batch(sink->tb, &trace_sink_process_msg, sink);
+
+        if(is_file && (sink->spill_full
+            || trace_sink_spill_used(sink) >= sink->spill_size / 2))
+        {
+            if(trace_sink_flush(sink)) return;
+        }
+        /* In memory mode the area is freed only by the reader. */
+    } while(is_file && sink->spill_full);
+
+    if(is_file && trace_sink_spill_used(sink)
+        && (force_flush || time_after(jiffies, sink->last_flush + HZ)))
+    {
+        trace_sink_flush(sink);
+    }
+}
+
+static int trace_sink_worker(void* data)
+{
+    struct trace_sink* sink = data;
+
+    while(!kthread_should_stop())
+    {
+        mutex_lock(&sink->m);
+        trace_sink_drain(sink, 0);
+        mutex_unlock(&sink->m);
+
+        schedule_timeout_interruptible(sink->interval);
+    }
+
+    return 0;
+}
+
+/* Start the sink in given mode. Executed under sink's mutex. */
+static int trace_sink_start(struct trace_sink* sink, enum trace_sink_mode mode)
+{
+    struct task_struct* worker;
+
+    if(sink->mode != trace_sink_mode_off) return -EBUSY;
+
+    if(!sink->spill)
+    {
+        sink->spill = vmalloc(sink->spill_size);
+        if(!sink->spill)
+        {
+            pr_err("%s: Cannot allocate spill area of %zu bytes.",
+                __func__, sink->spill_size);
+            return -ENOMEM;
+        }
+    }
+
+    sink->spill_head = 0;
+    sink->spill_tail = 0;
+    sink->spill_high_water = 0;
+    sink->messages_drained = 0;
+    sink->bytes_drained = 0;
+    sink->bytes_written = 0;
+    sink->writes = 0;
+    sink->write_error = 0;
+    sink->last_flush = jiffies;
+
+    worker = kthread_run(&trace_sink_worker, sink, "kedr_trace_sink");
+    if(IS_ERR(worker)) return PTR_ERR(worker);
+
+    sink->worker = worker;
+    sink->mode = mode;
+
+    return 0;
+}
+
+int trace_sink_start_memory(struct trace_sink* sink)
+{
+    int err;
+
+    if(mutex_lock_interruptible(&sink->m))
+        return -ERESTARTSYS;
+
+    err = trace_sink_start(sink, trace_sink_mode_memory);
+
+    mutex_unlock(&sink->m);
+
+    return err;
+}
+
+int trace_sink_start_file(struct trace_sink* sink, const char* path)
+{
+    int err;
+    struct file* file;
+    char* path_copy;
+
+    path_copy = kstrdup(path, GFP_KERNEL);
+    if(!path_copy) return -ENOMEM;
+
+    file = filp_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+    if(IS_ERR(file))
+    {
+        kfree(path_copy);
+        return PTR_ERR(file);
+    }
+
+    if(mutex_lock_interruptible(&sink->m))
+    {
+        err = -ERESTARTSYS;
+        goto fail;
+    }
+
+    /* Worker may access file as soon as it is started. */
+    if(sink->mode == trace_sink_mode_off)
+    {
+        sink->file = file;
+        sink->file_pos = 0;
+    }
+
+    err = trace_sink_start(sink, trace_sink_mode_file);
+    if(err)
+    {
+        if(sink->mode == trace_sink_mode_off) sink->file = NULL;
+        mutex_unlock(&sink->m);
+        goto fail;
+    }
+
+    kfree(sink->path);
+    sink->path = path_copy;
+
+    mutex_unlock(&sink->m);
+
+    return 0;
+
+fail:
+    filp_close(file, NULL);
+    kfree(path_copy);
+    return err;
+}
+
+void trace_sink_stop(struct trace_sink* sink)
+{
+    struct task_struct* worker;
+
+    mutex_lock(&sink->m);
+    worker = sink->worker;
+    sink->worker = NULL;
+    mutex_unlock(&sink->m);
+
+    if(!worker) return;
+
+    /* Worker takes the mutex, so it should be stopped without it. */
+    kthread_stop(worker);
+
+    mutex_lock(&sink->m);
+
+    trace_sink_drain(sink, 1);
+
+    if(sink->file)
+    {
+        filp_close(sink->file, NULL);
+        sink->file = NULL;
+    }
+
+    sink->mode = trace_sink_mode_off;
+
+    mutex_unlock(&sink->m);
+}
+
+ssize_t trace_sink_read_spill(struct trace_sink* sink,
+    char __user* buf, size_t count)
+{
+    ssize_t result;
+    size_t offset, first_size;
+
+    if(mutex_lock_interruptible(&sink->m))
+        return -ERESTARTSYS;
+
+    if(sink->mode == trace_sink_mode_file)
+    {
+        result = -EBUSY;
+        goto out;
+    }
+
+    if(count > trace_sink_spill_used(sink))
+        count = trace_sink_spill_used(sink);
+
+    if(!count)
+    {
+        result = 0;
+        goto out;
+    }
+
+    offset = sink->spill_tail % sink->spill_size;
+    first_size = min(count, sink->spill_size - offset);
+
+    if(copy_to_user(buf, sink->spill + offset, first_size)
+        || copy_to_user(buf + first_size, sink->spill, count - first_size))
+    {
+        result = -EFAULT;
+        goto out;
+    }
+
+    sink->spill_tail += count;
+    result = count;
+
+out:
+    mutex_unlock(&sink->m);
+
+    return result;
+}
+
+int trace_sink_show(struct trace_sink* sink, struct seq_file* m)
+{
+    if(mutex_lock_interruptible(&sink->m))
+        return -ERESTARTSYS;
+
+    seq_printf(m, "mode: %s\n", trace_sink_mode_name(sink->mode));
+    if(sink->mode == trace_sink_mode_file)
+        seq_printf(m, "file: %s\n", sink->path);
+    seq_printf(m, "spill_size: %zu\n", sink->spill_size);
+    seq_printf(m, "spill_used: %zu\n",
+        sink->spill ? trace_sink_spill_used(sink) : 0);
+    seq_printf(m, "spill_high_water: %zu\n", sink->spill_high_water);
+    seq_printf(m, "messages_drained: %lu\n", sink->messages_drained);
+    seq_printf(m, "bytes_drained: %llu\n", sink->bytes_drained);
+    seq_printf(m, "bytes_written: %llu\n", sink->bytes_written);
+    seq_printf(m, "writes: %lu\n", sink->writes);
+    seq_printf(m, "write_error: %d\n", sink->write_error);
+
+    mutex_unlock(&sink->m);
+
+    return 0;
+}
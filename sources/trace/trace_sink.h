@@ -0,0 +1,87 @@
+#ifndef TRACE_SINK_H
+#define TRACE_SINK_H
+
+/*
+ * Trace sink: kernel worker which drains the trace buffer without
+ * userspace reader.
+ *
+ * Messages are extracted in the global order, formatted and stored into
+ * the preallocated spill area. Depending on the mode, content of the
+ * spill area is:
+ *
+ *   memory - kept until it is read via trace_sink_read_spill(),
+ *   file   - written into the file in large sequential chunks.
+ *
+ * Sink consumes messages from the trace buffer, so it should not be
+ * used together with other readers of the trace.
+ */
+
+#include "trace_buffer.h"
+
+#include <linux/seq_file.h>
+
+struct trace_sink;
+
+/*
+ * Interpretator of the message as a text.
+ *
+ * This function should behave as snprintf().
+ */
+typedef int (*trace_sink_print_func)(char* str, size_t size,
+    const void* msg, size_t msg_size, int cpu, u64 ts);
+
+/*
+ * Create sink for given trace buffer.
+ *
+ * 'spill_size' is size of the spill area, which is allocated when
+ * sink is started. Worker drains the buffer every 'interval_ms'
+ * milliseconds.
+ *
+ * Sink is created stopped.
+ *
+ * Return NULL on error.
+ */
+struct trace_sink* trace_sink_create(struct trace_buffer* tb,
+    size_t spill_size, unsigned int interval_ms,
+    trace_sink_print_func print_msg);
+
+/* Stop sink if needed and destroy it. */
+void trace_sink_destroy(struct trace_sink* sink);
+
+/*
+ * Start sink which stores trace in the spill area.
+ *
+ * Return 0 on success, negative error code otherwise.
+ */
+int trace_sink_start_memory(struct trace_sink* sink);
+
+/*
+ * Start sink which writes trace into file with given path.
+ *
+ * File is created or truncated.
+ *
+ * Return 0 on success, negative error code otherwise.
+ */
+int trace_sink_start_file(struct trace_sink* sink, const char* path);
+
+/*
+ * Stop the sink.
+ *
+ * Messages which are in the trace buffer at the moment are drained
+ * before the sink is stopped. In file mode, file is closed.
+ */
+void trace_sink_stop(struct trace_sink* sink);
+
+/*
+ * Read content of the spill area in memory mode.
+ *
+ * Return number of bytes read or negative error code.
+ * 0 is returned if the spill area is empty.
+ */
+ssize_t trace_sink_read_spill(struct trace_sink* sink,
+    char __user* buf, size_t count);
+
+/* Print state and statistics of the sink. */
+int trace_sink_show(struct trace_sink* sink, struct seq_file* m);
+
+#endif /* TRACE_SINK_H */
@@ -0,0 +1,96 @@
+/*
+ * Implementation of the statistics of the trace messages.
+ */
+
+#include "trace_stats.h"
+
+#include <linux/slab.h> /* kmalloc and others */
+#include <linux/percpu.h>
+#include <linux/math64.h> /* div64_u64() */
+
+struct kedr_trace_stats
+{
+    struct trace_stats_counters __percpu* cpu;
+};
+
+struct kedr_trace_stats* trace_stats_create(void)
+{
+    struct kedr_trace_stats* stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+    if(!stats) return NULL;
+
+    /* Allocated memory is zeroed. */
+    stats->cpu = alloc_percpu(struct trace_stats_counters);
+    if(!stats->cpu)
+    {
+        kfree(stats);
+        return NULL;
+    }
+
+    return stats;
+}
+
+void trace_stats_destroy(struct kedr_trace_stats* stats)
+{
+    free_percpu(stats->cpu);
+    kfree(stats);
+}
+
+void trace_stats_add(struct kedr_trace_stats* stats, size_t size,
+    bool reserved)
+{
+    if(reserved)
+    {
+        this_cpu_inc(stats->cpu->events);
+        this_cpu_add(stats->cpu->bytes, size);
+    }
+    else
+    {
+        this_cpu_inc(stats->cpu->failures);
+    }
+}
+
+void trace_stats_get_cpu(struct kedr_trace_stats* stats, int cpu,
+    struct trace_stats_counters* counters)
+{
+    const struct trace_stats_counters* c = per_cpu_ptr(stats->cpu, cpu);
+
+    counters->events = c->events;
+    counters->bytes = c->bytes;
+    counters->failures = c->failures;
+}
+
+void trace_stats_get(struct kedr_trace_stats* stats,
+    struct trace_stats_counters* counters)
+{
+    int cpu;
+
+    counters->events = 0;
+    counters->bytes = 0;
+    counters->failures = 0;
+
+    for_each_possible_cpu(cpu)
+    {
+        const struct trace_stats_counters* c = per_cpu_ptr(stats->cpu, cpu);
+
+        counters->events += c->events;
+        counters->bytes += c->bytes;
+        counters->failures += c->failures;
+    }
+}
+
+void trace_stats_print_header(struct seq_file* m, const char* title)
+{
+    seq_printf(m, "%-24s %12s %14s %10s %8s\n",
+        title, "events", "bytes", "failures", "avg_size");
+}
+
+void trace_stats_print(struct seq_file* m, const char* name,
+    const struct trace_stats_counters* counters)
+{
+    u64 avg_size = counters->events ?
+        div64_u64(counters->bytes, counters->events) : 0;
+
+    seq_printf(m, "%-24s %12lu %14llu %10lu %8llu\n",
+        name, counters->events, (unsigned long long)counters->bytes,
+        counters->failures, (unsigned long long)avg_size);
+}
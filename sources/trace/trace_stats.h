@@ -0,0 +1,60 @@
+#ifndef TRACE_STATS_H
+#define TRACE_STATS_H
+
+/*
+ * Statistics of the messages written into the trace.
+ *
+ * For every CPU, the following is counted:
+ *
+ *   events   - messages for which space has been reserved,
+ *   bytes    - size of the space reserved for these messages,
+ *   failures - messages which cannot be reserved (e.g., buffer is full
+ *              in non-overwrite mode or message is too big).
+ *
+ * Counters are updated with this_cpu operations, so they may be updated
+ * in any context without locks.
+ */
+
+#include <kedr/trace/trace.h>
+
+#include <linux/types.h>
+#include <linux/seq_file.h>
+
+struct trace_stats_counters
+{
+    unsigned long events;
+    u64 bytes;
+    unsigned long failures;
+};
+
+struct kedr_trace_stats* trace_stats_create(void);
+void trace_stats_destroy(struct kedr_trace_stats* stats);
+
+/*
+ * Count message of given size. 'reserved' is false if space for the
+ * message cannot be reserved.
+ */
+void trace_stats_add(struct kedr_trace_stats* stats, size_t size,
+    bool reserved);
+
+/* Fill 'counters' with statistics for given CPU. */
+void trace_stats_get_cpu(struct kedr_trace_stats* stats, int cpu,
+    struct trace_stats_counters* counters);
+
+/* Fill 'counters' with statistics summed over all CPUs. */
+void trace_stats_get(struct kedr_trace_stats* stats,
+    struct trace_stats_counters* counters);
+
+/*
+ * Print counters as a line of the statistics table.
+ *
+ * Line starts with 'name', followed by the counters and by the average
+ * size of the message.
+ */
+void trace_stats_print(struct seq_file* m, const char* name,
+    const struct trace_stats_counters* counters);
+
+/* Print header of the statistics table with given title of the first column. */
+void trace_stats_print_header(struct seq_file* m, const char* title);
+
+#endif /* TRACE_STATS_H */
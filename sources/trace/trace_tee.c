@@ -0,0 +1,357 @@
+/*
+ * Implementation of the trace 'tee'.
+ */
+#include "trace_tee.h"
+#include "wait_nestable.h"
+
+#include <linux/slab.h> /* kmalloc and others */
+#include <linux/vmalloc.h> /* vmalloc for the window */
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/list.h>
+#include <linux/atomic.h>
+#include <linux/uaccess.h>
+
+struct trace_tee
+{
+    struct trace_buffer* tb;
+    trace_tee_print_func print_msg;
+
+    /*
+     * Window of text, used as a ring of 'size' bytes.
+     *
+     * Byte at position 'pos' in the text stream is stored at
+     * 'window[pos % size]'.
+     */
+    char* window;
+    size_t size;
+
+    /*
+     * Position after the last byte written into the window.
+     *
+     * Modified under 'fill_m', readers access it without lock.
+     */
+    atomic_long_t head;
+
+    /* List of readers. */
+    struct list_head readers;
+
+    /*
+     * Protect filling of the window and list of readers.
+     *
+     * Fields below are used only when filling.
+     */
+    struct mutex fill_m;
+
+    /* Buffer for the message formatted. */
+    char* msg_text;
+    size_t msg_alloc_size;
+
+    /* Free space in the window, which may be filled now. */
+    size_t fill_space;
+    /* Number of bytes added into the window in the current filling. */
+    size_t fill_added;
+
+    /* Woken when text is added into the window or some reader advances. */
+    wait_queue_head_t wq;
+};
+
+struct trace_tee_reader
+{
+    struct trace_tee* tee;
+    /* Element of the tee's readers list. */
+    struct list_head list;
+    /*
+     * Position of the first unread byte.
+     *
+     * Modified only by the reader itself, under 'm'.
+     */
+    atomic_long_t pos;
+    /* Serialize concurrent reads by the same reader. */
+    struct mutex m;
+};
+
+struct trace_tee* trace_tee_create(struct trace_buffer* tb,
+    size_t size, trace_tee_print_func print_msg)
+{
+    struct trace_tee* tee = kmalloc(sizeof(*tee), GFP_KERNEL);
+    if(!tee)
+    {
+        pr_err("%s: Cannot allocate trace_tee structure.", __func__);
+        return NULL;
+    }
+
+    tee->window = vmalloc(size);
+    if(!tee->window)
+    {
+        pr_err("%s: Cannot allocate window for trace_tee.", __func__);
+        kfree(tee);
+        return NULL;
+    }
+
+    tee->tb = tb;
+    tee->print_msg = print_msg;
+    tee->size = size;
+    atomic_long_set(&tee->head, 0);
+    INIT_LIST_HEAD(&tee->readers);
+    mutex_init(&tee->fill_m);
+    tee->msg_text = NULL;
+    tee->msg_alloc_size = 0;
+    init_waitqueue_head(&tee->wq);
+
+    return tee;
+}
+
+void trace_tee_destroy(struct trace_tee* tee)
+{
+    BUG_ON(!list_empty(&tee->readers));
+
+    mutex_destroy(&tee->fill_m);
+    kfree(tee->msg_text);
+    vfree(tee->window);
+    kfree(tee);
+}
+
+struct trace_tee_reader* trace_tee_reader_create(struct trace_tee* tee)
+{
+    struct trace_tee_reader* reader = kmalloc(sizeof(*reader), GFP_KERNEL);
+    if(!reader) return NULL;
+
+    reader->tee = tee;
+    mutex_init(&reader->m);
+
+    mutex_lock(&tee->fill_m);
+    atomic_long_set(&reader->pos, atomic_long_read(&tee->head));
+    list_add_tail(&reader->list, &tee->readers);
+    mutex_unlock(&tee->fill_m);
+
+    return reader;
+}
+
+void trace_tee_reader_destroy(struct trace_tee_reader* reader)
+{
+    struct trace_tee* tee = reader->tee;
+
+    mutex_lock(&tee->fill_m);
+    list_del(&reader->list);
+    mutex_unlock(&tee->fill_m);
+
+    /* Space, which is held by the reader, may be reused now. */
+    wake_up_all(&tee->wq);
+
+    mutex_destroy(&reader->m);
+    kfree(reader);
+}
+
+/*
+ * Interpretator function for trace buffer, which appends message into
+ * the window.
+ *
+ * If there is no space for the message, it is not consumed and 0 is
+ * returned.
+ *
+ * Executed under 'fill_m'.
+ */
+static int trace_tee_process_msg(const void* msg,
+    size_t msg_size, int cpu, u64 ts, void* user_data)
+{
+    struct trace_tee* tee = user_data;
+    size_t text_size, offset, first_size;
+    unsigned long head;
+
+    /* It should be at most 2 iterations. */
+    while(1)
+    {
+        text_size = tee->print_msg(tee->msg_text, tee->msg_alloc_size,
+            msg, msg_size, cpu, ts);
+        if(text_size < tee->msg_alloc_size) break;
+
+        /* Text buffer is too small for the message. */
+        kfree(tee->msg_text);
+        tee->msg_alloc_size = 0;
+        tee->msg_text = kmalloc(text_size + 1, GFP_KERNEL);
+        if(!tee->msg_text) return -ENOMEM;
+        tee->msg_alloc_size = text_size + 1;
+    }
+
+    /* Message which cannot fit into the whole window is truncated. */
+    if(text_size > tee->size) text_size = tee->size;
+
+    /* Wait until readers free the space. */
+    if(text_size > tee->fill_space) return 0;
+
+    head = atomic_long_read(&tee->head);
+    offset = head % tee->size;
+    first_size = min(text_size, tee->size - offset);
+
+    memcpy(tee->window + offset, tee->msg_text, first_size);
+    memcpy(tee->window, tee->msg_text + first_size, text_size - first_size);
+
+    /* Text should be visible to the readers before new head. */
+    smp_wmb();
+    atomic_long_set(&tee->head, head + text_size);
+
+    tee->fill_space -= text_size;
+    tee->fill_added += text_size;
+
+    return 1;
+}
+
+/*
+ * Move as many messages as possible from the trace buffer into the window.
+ *
+ * Return 0 if some text is added, -EAGAIN if nothing can be added now
+ * (trace buffer is empty or the window is full), other negative error
+ * code on error.
+ */
+static int trace_tee_fill(struct trace_tee* tee)
+{
+    int err;
+    unsigned long head, tail;
+    struct trace_tee_reader* reader;
+
+    if(mutex_lock_interruptible(&tee->fill_m))
+        return -ERESTARTSYS;
+
+    /*
+     * Text before the slowest reader may be overwritten.
+     *
+     * Readers may concurrently advance their positions, so free space
+     * may be only underestimated here.
+     */
+    head = atomic_long_read(&tee->head);
+    tail = head;
+    list_for_each_entry(reader, &tee->readers, list)
+    {
+        unsigned long pos = atomic_long_read(&reader->pos);
+        if(head - pos > head - tail) tail = pos;
+    }
+    /* Do not reuse space until readers finish copying from it. */
+    smp_mb();
+
+    tee->fill_space = tee->size - (head - tail);
+    tee->fill_added = 0;
+
+    err = trace_buffer_read_batch(tee->tb, &trace_tee_process_msg, tee);
+
+    if(tee->fill_added)
+        err = 0;
+    else if(err == 0)
+        err = -EAGAIN; /* Window is full. */
+
+    mutex_unlock(&tee->fill_m);
+
+    if(!err && waitqueue_active(&tee->wq))
+        wake_up_all(&tee->wq);
+
+    return err;
+}
+
+/*
+ * Read available text for the reader, fill the window if needed.
+ *
+ * Executed under reader's mutex.
+ */
+static ssize_t trace_tee_read_once(struct trace_tee_reader* reader,
+    char __user* buf, size_t count)
+{
+    struct trace_tee* tee = reader->tee;
+    unsigned long pos = atomic_long_read(&reader->pos);
+    unsigned long head = atomic_long_read(&tee->head);
+    size_t offset, first_size;
+
+    if(head == pos)
+    {
+        int err = trace_tee_fill(tee);
+        if(err) return err;
+
+        head = atomic_long_read(&tee->head);
+    }
+    /* Read text only after the head. */
+    smp_rmb();
+
+    if(count > head - pos) count = head - pos;
+
+    offset = pos % tee->size;
+    first_size = min(count, tee->size - offset);
+
+    if(copy_to_user(buf, tee->window + offset, first_size))
+        return -EFAULT;
+    if(copy_to_user(buf + first_size, tee->window, count - first_size))
+        return -EFAULT;
+
+    /* Text should be copied before its space is reused. */
+    smp_mb();
+    atomic_long_set(&reader->pos, pos + count);
+
+    if(waitqueue_active(&tee->wq))
+        wake_up_all(&tee->wq);
+
+    return count;
+}
+
+ssize_t trace_tee_read(struct trace_tee_reader* reader,
+    char __user* buf, size_t count, bool can_block)
+{
+    ssize_t err;
+    struct trace_tee* tee = reader->tee;
+
+    if(!count) return 0;
+
+    if(mutex_lock_interruptible(&reader->m))
+        return -ERESTARTSYS;
+
+    err = trace_tee_read_once(reader, buf, count);
+    if(err == -EAGAIN && can_block)
+    {
+        bool woken_flag = 0;
+        DEFINE_WAIT_NESTED(w_buffer, woken_flag);
+        DEFINE_WAIT_NESTED(w_tee, woken_flag);
+
+        wait_queue_head_t* wq_buffer = trace_buffer_get_wait_queue(tee->tb);
+
+        while(1)
+        {
+            add_wait_queue_nestable(wq_buffer, &w_buffer);
+            add_wait_queue_nestable(&tee->wq, &w_tee);
+
+            err = trace_tee_read_once(reader, buf, count);
+
+            if(err != -EAGAIN) break;
+            err = wait_flagged_interruptible(&woken_flag);
+            if(err) break;
+        }
+
+        remove_wait_queue_nestable(wq_buffer, &w_buffer);
+        remove_wait_queue_nestable(&tee->wq, &w_tee);
+    }
+
+    mutex_unlock(&reader->m);
+
+    return err;
+}
+
+unsigned int trace_tee_poll(struct trace_tee_reader* reader,
+    struct file* filp, poll_table* wait)
+{
+    int err;
+    struct trace_tee* tee = reader->tee;
+
+    poll_wait(filp, trace_buffer_get_wait_queue(tee->tb), wait);
+    poll_wait(filp, &tee->wq, wait);
+
+    if(atomic_long_read(&tee->head) != atomic_long_read(&reader->pos))
+        return POLLIN | POLLRDNORM;
+
+    err = trace_tee_fill(tee);
+
+    switch(err)
+    {
+    case 0:
+        return POLLIN | POLLRDNORM;
+    case -EAGAIN:
+        return 0;
+    default:
+        return POLLERR;
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef TRACE_TEE_H
+#define TRACE_TEE_H
+
+/*
+ * Trace 'tee': delivers the content of the trace buffer to several
+ * readers, so every reader receives all messages.
+ *
+ * Messages are extracted from the trace buffer and formatted only once,
+ * into the shared window of text. Every reader has its own cursor in
+ * that window and copies text from it without taking any lock.
+ *
+ * The window is refilled by the reader which has read everything in it.
+ * Only text, which is read by all readers, is freed from the window. So
+ * the slowest reader determines the speed of extraction of messages from
+ * the trace buffer.
+ */
+
+#include "trace_buffer.h"
+
+#include <linux/fs.h>
+#include <linux/poll.h>
+
+struct trace_tee;
+struct trace_tee_reader;
+
+/*
+ * Interpretator of the message as a text.
+ *
+ * This function should behave as snprintf().
+ */
+typedef int (*trace_tee_print_func)(char* str, size_t size,
+    const void* msg, size_t msg_size, int cpu, u64 ts);
+
+/*
+ * Create tee for given trace buffer with window of 'size' bytes.
+ *
+ * Return NULL on error.
+ */
+struct trace_tee* trace_tee_create(struct trace_buffer* tb,
+    size_t size, trace_tee_print_func print_msg);
+
+/*
+ * Destroy tee.
+ *
+ * All readers should be destroyed before.
+ */
+void trace_tee_destroy(struct trace_tee* tee);
+
+/*
+ * Create new reader for the tee.
+ *
+ * Reader receives messages extracted after this moment.
+ *
+ * Return NULL on error.
+ */
+struct trace_tee_reader* trace_tee_reader_create(struct trace_tee* tee);
+
+void trace_tee_reader_destroy(struct trace_tee_reader* reader);
+
+/*
+ * Read up to 'count' bytes of text for the reader.
+ *
+ * Return number of bytes read or negative error code.
+ * If no text is available and 'can_block' is false, return -EAGAIN.
+ */
+ssize_t trace_tee_read(struct trace_tee_reader* reader,
+    char __user* buf, size_t count, bool can_block);
+
+/* Poll for the text for the reader. */
+unsigned int trace_tee_poll(struct trace_tee_reader* reader,
+    struct file* filp, poll_table* wait);
+
+#endif /* TRACE_TEE_H */